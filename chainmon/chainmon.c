@@ -0,0 +1,452 @@
+/*
+ * ChainMon: a daemon that polls a BMU and its string of CMUs, and keeps their readings in a ring
+ * Linux only.
+ *
+ * Written 17/Oct/2026
+ *
+ * Every interval it sends each of the commands v o Is t p f to all devices, as packets with CRC12s, and
+ * collects the answers, which _prettyPrint sends as "\012:v 3312" plus a CRC12 and a CR. Answers whose
+ * CRC12 is wrong are counted and thrown away, as are answers cut too short to hold one (counted apart),
+ * and lines that aren't answers (such as our own packets coming back around the chain).
+ * The readings are kept as integers, in the units the devices send them, in 12 bytes per device per poll.
+ * The ring is allocated at start-up, so the memory used is fixed at about depth * (4 + 12 * devices) bytes
+ * however long it runs: 4.4 MB by default, which is a day of polls of 128 devices.
+ *
+ * Usage: chainmon [-i <seconds>] [-d <depth>] [-n <devices>] [-w <file>] [-l <file>] [-D] <comm port>
+ *	-i	Seconds from the start of one poll to the start of the next (default 30)
+ *	-d	Number of polls kept (default 2880)
+ *	-n	Most devices it will keep readings for (default 128)
+ *	-w	File to write the whole ring to, as CSV, on SIGUSR1 and on exit
+ *	-l	File to write the latest poll to, as CSV, after every poll
+ *	-D	Run in the background, logging to syslog
+ * Files are written to a temporary name then renamed, so a reader never sees half of one.
+ * Checksums must be on in the devices (the 'k' command), as they are after a reset.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "../sendprog/crc12.h"
+
+#define FIRST_US		2000000		/* Wait this long for the first answer to a command, */
+#define QUIET_US		300000		/* then until nothing arrives for this long */
+#define MAX_LINE		64
+
+/*
+ * One device's readings from one poll. Each is the number the device sent, so nothing is lost in
+ * conversion; the have bits say which arrived.
+ */
+typedef struct {
+	uint16_t v;					/* 'v' cell voltage, mV */
+	uint16_t o;					/* 'o' filtered open-circuit cell voltage, 1/16 mV */
+	int16_t is;					/* 'Is' bolt- drop in mV (CMU) or shunt current in 1/5 A (BMU); 9999 = invalid */
+	int16_t f;					/* 'f' state of charge, tenths of a percent (BMU only) */
+	int8_t t;					/* 't' temperature, degrees C */
+	uint8_t p;					/* 'p' status: local for a CMU, global for a BMU */
+	uint8_t have;				/* HAVE_V etc. */
+	uint8_t spare;
+} sample;
+
+enum { HAVE_V = 1, HAVE_O = 2, HAVE_IS = 4, HAVE_F = 8, HAVE_T = 16, HAVE_P = 32 };
+
+static const struct {
+	const char* cmd;
+	int have;
+} commands[] = {
+	{"v", HAVE_V}, {"o", HAVE_O}, {"Is", HAVE_IS}, {"t", HAVE_T}, {"p", HAVE_P}, {"f", HAVE_F}
+};
+#define N_COMMANDS	(int)(sizeof commands / sizeof commands[0])
+
+/* The ring: depth polls, each a time and a sample per device slot */
+static unsigned int depth = 2880, maxDevs = 128;
+static uint32_t* pollTime;			/* Seconds since 1970 */
+static sample* samples;				/* depth rows of maxDevs */
+static sample* overwritten;			/* The oldest row, while a poll that may be cut short replaces it */
+static unsigned long nPolls;		/* Polls started; the current one is row (nPolls-1) % depth */
+static unsigned short slotOf[256];	/* Slot+1 for each device ID, or 0 if it hasn't answered yet. Up to
+									   256, so not a char. */
+static unsigned char idOf[256];
+static unsigned int nDevs;
+
+/* Counts since start-up */
+static unsigned long answers, crcErrors, shortLines, misses, noSlot;
+
+static const char* portName;
+static int fd = -1;
+static int background;
+static volatile sig_atomic_t dumpWanted, stopWanted;
+
+void logMsg(int level, const char* fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	if (background)
+		vsyslog(level, fmt, ap);
+	else {
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+	}
+	va_end(ap);
+}
+
+long long nowUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int openPort(void) {
+	struct termios config;
+	fd = open(portName, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0)
+		return 0;
+	if (!isatty(fd) || tcgetattr(fd, &config) < 0) {
+		close(fd);
+		fd = -1;
+		return 0;
+	}
+	cfmakeraw(&config);					/* 8 bits, no parity, no processing */
+	config.c_cflag &= ~CSTOPB;
+	config.c_cflag |= CLOCAL | CREAD;
+	config.c_cc[VMIN] = 1;
+	config.c_cc[VTIME] = 0;
+	cfsetispeed(&config, B9600);
+	cfsetospeed(&config, B9600);
+	if (tcsetattr(fd, TCSAFLUSH, &config) < 0) {
+		close(fd);
+		fd = -1;
+		return 0;
+	}
+	return 1;
+}
+
+void closePort(void) {
+	if (fd >= 0)
+		close(fd);
+	fd = -1;
+}
+
+/* Send a command to every device, as a packet with a CRC12 */
+int sendPacket(const char* text) {
+	unsigned char buf[MAX_LINE];
+	int n = strlen(text), done = 0, r;
+	memcpy(buf, text, n);
+	printableCrc(crc12(buf, n), buf + n);
+	buf[n + 2] = '\r';
+	n += 3;
+	while (done < n) {
+		r = write(fd, buf + done, n - done);
+		if (r > 0)
+			done += r;
+		else if (r < 0 && errno != EAGAIN && errno != EINTR)
+			return 0;
+		else {
+			struct pollfd pfd = {fd, POLLOUT, 0};
+			poll(&pfd, 1, 1000);
+		}
+	}
+	return 1;
+}
+
+/* Read a byte, waiting until the time until. Returns 1 for a byte, 0 for a timeout, -1 for an error. */
+int readByte(unsigned char* p, long long until) {
+	for (;;) {
+		struct pollfd pfd = {fd, POLLIN, 0};
+		long long now;
+		int r = read(fd, p, 1);
+		if (r == 1)
+			return 1;
+		if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+			return -1;					/* A USB adapter unplugged, say */
+		now = nowUs();
+		if (now >= until || stopWanted)
+			return 0;
+		poll(&pfd, 1, (int)((until - now + 999) / 1000));
+	}
+}
+
+sample* slotSample(unsigned int slot) {
+	return samples + (size_t)((nPolls - 1) % depth) * maxDevs + slot;
+}
+
+/* Parse an answer line (without its CR) to the command cmd, and keep its reading */
+void handleLine(const unsigned char* line, int n, const char* cmd, int have) {
+	unsigned char ck[2];
+	int id, cmdLen = strlen(cmd), i, neg = 0, base = 10;
+	long value = 0;
+	sample* s;
+	if (n < 1 || line[0] != '\\')
+		return;							/* Not an answer */
+	if (n < 4 + 1 + cmdLen + 1 + 1 + 2) {
+		++shortLines;					/* Too short to hold a reading and a CRC12; cut off */
+		return;
+	}
+	printableCrc(crc12(line, n - 2), ck);
+	if (ck[0] != line[n-2] || ck[1] != line[n-1]) {
+		++crcErrors;
+		return;
+	}
+	n -= 2;
+	/* "\iii:cmd value" */
+	if (line[4] != ':' || memcmp(line + 5, cmd, cmdLen) != 0 || line[5 + cmdLen] != ' ')
+		return;							/* An answer to something else */
+	for (id=0, i=1; i < 4; ++i) {
+		if (line[i] < '0' || line[i] > '9')
+			return;
+		id = id * 10 + line[i] - '0';
+	}
+	i = 6 + cmdLen;
+	if (i < n && line[i] == '-') {
+		neg = 1;
+		++i;
+	} else if (i < n && line[i] == '$') {
+		base = 16;
+		++i;
+	}
+	if (i >= n)
+		return;
+	for (; i < n; ++i) {
+		int d = line[i] >= '0' && line[i] <= '9' ? line[i] - '0' :
+			base == 16 && line[i] >= 'A' && line[i] <= 'F' ? line[i] - 'A' + 10 : -1;
+		if (d < 0)
+			return;
+		value = value * base + d;
+	}
+	if (neg)
+		value = -value;
+	if (id > 255)
+		return;
+
+	if (slotOf[id] == 0) {
+		if (nDevs == maxDevs) {
+			++noSlot;
+			return;
+		}
+		idOf[nDevs] = id;
+		slotOf[id] = ++nDevs;
+		logMsg(LOG_INFO, "Device %d answered", id);
+	}
+	s = slotSample(slotOf[id] - 1);
+	switch (have) {
+	case HAVE_V: s->v = value; break;
+	case HAVE_O: s->o = value; break;
+	case HAVE_IS: s->is = value; break;
+	case HAVE_F: s->f = value; break;
+	case HAVE_T: s->t = value; break;
+	case HAVE_P: s->p = value; break;
+	}
+	s->have |= have;
+	++answers;
+}
+
+/* Send one command to all devices and collect their answers. Returns 0 if the port failed. */
+int query(const char* cmd, int have) {
+	unsigned char line[MAX_LINE], b;
+	int n = 0, r, answering = 0;
+	long long until;
+	tcflush(fd, TCIFLUSH);
+	if (!sendPacket(cmd))
+		return 0;
+	until = nowUs() + FIRST_US;
+	while ((r = readByte(&b, until)) == 1) {
+		if (n == 0 && b == '\\')
+			answering = 1;				/* Not just our own packet coming back */
+		if (answering)
+			until = nowUs() + QUIET_US;
+		if (b == '\r') {
+			handleLine(line, n, cmd, have);
+			n = 0;
+		} else if (b != '\n' && n < MAX_LINE)
+			line[n++] = b;
+	}
+	return r == 0;
+}
+
+/* Poll every device into the next row of the ring. Returns 0 if a signal to stop cut it short, in which
+   case the poll isn't counted and the ring is as it was before it; else 1. */
+int pollChain(void) {
+	unsigned int row, i;
+	uint32_t oldTime;
+	int c;
+	++nPolls;
+	row = (nPolls - 1) % depth;
+	oldTime = pollTime[row];
+	memcpy(overwritten, samples + (size_t)row * maxDevs, maxDevs * sizeof(sample));
+	pollTime[row] = (uint32_t)time(NULL);
+	memset(samples + (size_t)row * maxDevs, 0, maxDevs * sizeof(sample));
+	if (fd < 0 && !openPort()) {
+		if (nPolls == 1 || errno != ENOENT)
+			logMsg(LOG_ERR, "Could not open %s: %s", portName, strerror(errno));
+		return 1;
+	}
+	for (c=0; c < N_COMMANDS && !stopWanted; ++c)
+		if (!query(commands[c].cmd, commands[c].have)) {
+			logMsg(LOG_ERR, "Lost %s; will try to reopen it", portName);
+			closePort();
+			return 1;
+		}
+	if (stopWanted) {
+		memcpy(samples + (size_t)row * maxDevs, overwritten, maxDevs * sizeof(sample));
+		pollTime[row] = oldTime;
+		--nPolls;
+		return 0;
+	}
+	for (i=0; i < nDevs; ++i)
+		if (slotSample(i)->have == 0)
+			++misses;
+	return 1;
+}
+
+/* Write one row of the ring as CSV lines */
+void writeRow(FILE* f, unsigned int row) {
+	char when[32];
+	time_t t = pollTime[row];
+	unsigned int i;
+	strftime(when, sizeof when, "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+	for (i=0; i < nDevs; ++i) {
+		const sample* s = samples + (size_t)row * maxDevs + i;
+		if (s->have == 0)
+			continue;
+		fprintf(f, "%s,%u,", when, idOf[i]);
+		if (s->have & HAVE_V) fprintf(f, "%u", s->v);
+		fputc(',', f);
+		if (s->have & HAVE_O) fprintf(f, "%.4f", s->o / 16.0);
+		fputc(',', f);
+		if (s->have & HAVE_IS) fprintf(f, "%d", s->is);
+		fputc(',', f);
+		if (s->have & HAVE_F) fprintf(f, "%.1f", s->f / 10.0);
+		fputc(',', f);
+		if (s->have & HAVE_T) fprintf(f, "%d", s->t);
+		fputc(',', f);
+		if (s->have & HAVE_P) fprintf(f, "$%02X", s->p);
+		fputc('\n', f);
+	}
+}
+
+/* Write rows from first to the latest, oldest first, to name, by way of a temporary file */
+void writeRows(const char* name, unsigned long first) {
+	char tmp[4096];
+	FILE* f;
+	snprintf(tmp, sizeof tmp, "%s.tmp", name);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		logMsg(LOG_ERR, "Could not write %s: %s", tmp, strerror(errno));
+		return;
+	}
+	fprintf(f, "time,id,v_mV,o_mV,Is,f_pct,t_C,p\n");
+	for (; first < nPolls; ++first)
+		writeRow(f, first % depth);
+	if (fclose(f) != 0 || rename(tmp, name) != 0)
+		logMsg(LOG_ERR, "Could not write %s: %s", name, strerror(errno));
+}
+
+void onSignal(int sig) {
+	if (sig == SIGUSR1)
+		dumpWanted = 1;
+	else
+		stopWanted = 1;
+}
+
+void usage(void) {
+	fprintf(stderr, "Usage: chainmon [-i <seconds>] [-d <depth>] [-n <devices>] [-w <file>] [-l <file>] [-D] "
+		"<comm port>\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	const char* ringName = NULL;
+	const char* latestName = NULL;
+	unsigned int interval = 30;
+	struct sigaction sa;
+	int i;
+
+	for (i=1; i < argc && argv[i][0] == '-'; ++i) {
+		if (strcmp(argv[i], "-D") == 0)
+			background = 1;
+		else if (i + 1 < argc && strcmp(argv[i], "-i") == 0)
+			interval = atoi(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-d") == 0)
+			depth = atoi(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+			maxDevs = atoi(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-w") == 0)
+			ringName = argv[++i];
+		else if (i + 1 < argc && strcmp(argv[i], "-l") == 0)
+			latestName = argv[++i];
+		else
+			usage();
+	}
+	if (i != argc - 1)
+		usage();
+	portName = argv[i];
+	if (interval < 1 || depth < 1 || maxDevs < 1 || maxDevs > 256) {
+		fprintf(stderr, "The interval and depth must be at least 1, and devices 1 to 256\n");
+		exit(1);
+	}
+
+	pollTime = calloc(depth, sizeof *pollTime);
+	samples = calloc((size_t)depth * maxDevs, sizeof *samples);
+	overwritten = calloc(maxDevs, sizeof *overwritten);
+	if (pollTime == NULL || samples == NULL || overwritten == NULL) {
+		fprintf(stderr, "Not enough memory for %u polls of %u devices\n", depth, maxDevs);
+		exit(1);
+	}
+	if (!openPort()) {
+		fprintf(stderr, "Could not open %s as a serial port\n", portName);
+		exit(1);
+	}
+
+	if (background) {
+		openlog("chainmon", LOG_PID, LOG_DAEMON);
+		if (daemon(1, 0) < 0) {
+			perror("daemon");
+			exit(1);
+		}
+	}
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = onSignal;			/* No SA_RESTART: a signal cuts a wait short */
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	logMsg(LOG_INFO, "Polling %s every %u s; keeping %u polls of up to %u devices (%lu kB)", portName,
+		interval, depth, maxDevs, ((unsigned long)depth * (sizeof(uint32_t) + maxDevs * sizeof(sample)) + 1023) / 1024);
+
+	while (!stopWanted) {
+		long long next = nowUs() + interval * 1000000LL;
+		if (!pollChain())
+			break;						/* Stopped part way: nothing new to write */
+		if (latestName && nPolls)
+			writeRows(latestName, nPolls - 1);
+		while (!stopWanted) {
+			long long now = nowUs();
+			if (dumpWanted) {
+				dumpWanted = 0;
+				if (ringName)
+					writeRows(ringName, nPolls > depth ? nPolls - depth : 0);
+				logMsg(LOG_INFO, "%lu polls of %u devices: %lu answers, %lu bad CRC12s, %lu cut short, "
+					"%lu missed, %lu with no slot", nPolls, nDevs, answers, crcErrors, shortLines, misses,
+					noSlot);
+			}
+			if (now >= next)
+				break;
+			usleep(next - now > 1000000 ? 1000000 : next - now);
+		}
+	}
+
+	if (ringName)
+		writeRows(ringName, nPolls > depth ? nPolls - depth : 0);
+	logMsg(LOG_INFO, "Stopped after %lu polls: %lu answers, %lu bad CRC12s, %lu cut short, %lu missed",
+		nPolls, answers, crcErrors, shortLines, misses);
+	closePort();
+	return 0;
+}
@@ -0,0 +1,1243 @@
+/*
+ * ChainSim: a string of simulated CMUs (optionally with a BMU at its head) behind a pseudo-terminal, so
+ * that host software such as sendprog can be run, timed and regression-tested without any hardware.
+ * Linux only.
+ *
+ * Written 17/Oct/2026
+ *
+ * Each device is modelled at the byte level, in step with real time:
+ * - A byte takes 10 bit times on the wire (the host's own framing on the first hop), and a device echoes
+ *   each byte to the next one as its main loop gets to it, so every hop adds a byte time plus the
+ *   device's processing time. The main program's receive and transmit queues hold RxSz and TxSz (32)
+ *   bytes; BSL2 and the block loader poll the UART, so only one received byte can wait while they're busy.
+ *   A byte that arrives with nowhere to go is lost, as it would be.
+ * - DoPassword's recogniser: $05 $04 $03 $01 erases the main flash (30 segments, 16 ms each) and starts a
+ *   BSL2 download, which programs each byte (about 100 us) and checks the XOR of them all at the end.
+ *   $05 $04 $03 $02 and, on a device not selected with 'x', $05 $04 $03 $01 start a fake download.
+ *   $05 $04 $03 $03 starts the block loader (common/BlockLoader.s43): a segment's CRC12 takes 14 ms, an
+ *   erase 16 ms, each byte of plain data 110 us (reading the next one waits for it to be programmed),
+ *   each matched byte of compressed data 100 us, the end frame's CRC12 400 ms; devices that verify it
+ *   start the new program at the host's next byte; baud-rate frames change the CMUs' rate, and a BMU
+ *   spoils them.
+ * - Packets with CRC12s (common/Crc12.s43), ESC, and the commands s S x X v V t o f p q m Rl Is Pc, answered
+ *   in _prettyPrint's format; Modbus/ASCII reads of v V t o f p and the block of readings; and with -R,
+ *   the same reads of the BMU as Modbus RTU frames. The readings are made up, but the same on
+ *   every run.
+ * - Response slots (see common/CmdCharInterpreter.s43): a device holds a command packet, unless its ID is 1
+ *   or the packet is for one device (12sv), until the answers of the devices ahead of it have passed, then
+ *   appends its own.
+ * Errors are injected with a seeded generator, so a run with the same host software is repeatable.
+ *
+ * Usage: chainsim [-n <CMUs>] [-m] [-R] [-a] [-e <error rate>] [-r <seed>] [-i <image>] [-l <link>] [-v] [-- <command>]
+ *	-n	Number of CMUs, IDs 1 to n (default 8)
+ *	-m	Put a BMU (ID 255) at the head of the chain. It forwards the CMUs' bytes back to the host, but in
+ *		the block loader only while it hunts for a frame (WRT stops its ReadByte doing that otherwise),
+ *		and it misses any byte from the host that starts while it is sending one.
+ *	-R	The BMU takes Modbus RTU frames on its SCU port, as monolith built with MODBUS_RTU does
+ *	-a	Devices answer a command as soon as they have read it, as firmware built without RESP_SLOTS
+ *		does, instead of after the answers of the devices ahead of them
+ *	-e	Probability of a flipped bit in each byte on each hop (default 0)
+ *	-r	Seed for the error generator (default 1)
+ *	-i	Binary image (ending at $FFFF) that every device starts with in its flash (default erased)
+ *	-l	Make a symbolic link to the pseudo-terminal, for programs that want a fixed port name
+ *	-v	Report each byte that a device loses
+ * With a command, chainsim runs it with every %p in its arguments replaced by the pseudo-terminal's path,
+ * then prints each device's program CRC12 and lost-byte count and exits with the command's exit status.
+ * Without one, it prints the path and runs until killed.
+ * Example: chainsim -n 16 -e 1e-4 -- sendprog -b monolith.bin %p
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "../sendprog/crc12.h"
+
+#define PROG_START		0xC000			/* Main flash, as in sendprog.c */
+#define BSL2_START		0xFC00
+#define FLASH_SIZE		0x4000			/* PROG_START to $FFFF */
+#define IMAGE_SIZE		(BSL2_START - PROG_START)
+#define REV61_IMAGE		0x1E00			/* REV61_BSL2_ST - REV61_PROG_ST */
+#define SEG_SIZE		512
+#define PP_SEG			0xFA00			/* The segment holding ProgPresence */
+#define BLK_SOH			0x01
+#define BLK_BAUD_HI		0xFE
+#define UART_CLOCK		(3686400 / 16)	/* UCA0BR0 = UART_CLOCK / rate */
+#define BMU_MODBUS_ID	100				/* BmuModbusID and BroadcastModbusID in common/comDefinitions.s43 */
+#define BROADCAST_MODBUS_ID	(BMU_MODBUS_ID - 1)
+#define MODBUS_REGS		"vVtjpfg"		/* ModbusRegs: registers $0000 up; CMUs have only the first 5 */
+#define MODBUS_CMU_REGS	5
+#define MODBUS_MAX		(3 + 2 * (sizeof MODBUS_REGS - 1) + 2)	/* Longest response, with its LRC or CRC16 */
+#define RTU_LEN			8				/* RtuBufSz: a Modbus RTU read request */
+#define RTU_GAP_US		(35 * 1000000LL / 9600)	/* 3.5 characters of silence */
+#define SLOT_GAP_US		(20 * 1000000LL / 9600)	/* SlotGap: quiet after the answer of the device ahead */
+#define SLOT_WAIT_US	(100 * 1000000LL / 9600)	/* SlotWait: quiet in any case, */
+#define SLOT_PC_US		400000LL		/*	plus SlotPcWait for each 'Pc', */
+#define SLOT_J_US		300000LL		/*	SlotJWait for each 'J', and the count of each 'Ms' */
+
+#define MAX_DEVS		256
+#define RX_SZ			32				/* RxSz and TxSz in the main program */
+#define TX_SZ			32
+#define QUEUE_LEN		256				/* Power of 2, bigger than TX_SZ plus the longest response */
+#define TIB_SIZE		48
+
+/* CPU times in microseconds */
+#define BYTE_US			30				/* Main program: receive interrupt, echo and ACCEPT */
+#define CMD_US			1000			/* Interpreting a packet */
+#define PROG_CRC_US		300000			/* 'Pc' */
+#define ERASE_US		16000			/* One segment */
+#define BSL_BYTE_US		100				/* BSL2: read, echo and program a byte */
+#define LDR_BYTE_US		20				/* Block loader: read and echo */
+#define PROG_US			90				/* Program a byte. The CPU carries on in RAM meanwhile, but stalls
+										   when it next calls ReadByte, which is in flash. */
+#define SEG_CRC_US		14000
+#define IMAGE_CRC_US	400000
+#define MATCH_US		10				/* Copy one byte of a match, besides waiting for the flash */
+#define RESTART_US		50000			/* From a good download to the main program running */
+
+enum { MAIN, BSL, BSL_WAIT, LDR };		/* What a device is running */
+enum { FLAG_BYTE, LITERAL, MATCH_LO, MATCH_HI };	/* Items in compressed data */
+enum { EV_ARRIVE, EV_TX_DONE, EV_CPU, EV_CPU_DONE, EV_RTU, EV_SLOT };
+enum { SLOT_NONE, SLOT_LINE, SLOT_ID, SLOT_TEXT };	/* slotState in common/CmdCharInterpreter.s43 */
+
+typedef struct {
+	unsigned char b[QUEUE_LEN];
+	int head, n;
+} queue;
+
+typedef struct dev {
+	int id;								/* 1 to n, or 255 for a BMU */
+	struct dev* unit;					/* The device whose state this is: itself, or a BMU for its tail */
+	int tail;							/* 1 for a BMU's CMU port, which carries the chain's bytes back */
+	int stage;							/* Where it is in devs */
+	unsigned char flash[FLASH_SIZE];
+	int mode;
+	int dont;							/* bDontInterpret */
+	int passWordState;
+	long fake;							/* Bytes left to forward in a fake download */
+	unsigned int addr;					/* BSL2's or the loader's flash pointer, from PROG_START */
+	unsigned char sum;					/* BSL2's XOR checksum */
+	/* Block loader */
+	int ls;								/* Which byte of a frame comes next */
+	unsigned char hdr[8];
+	unsigned int seg, crc, end;
+	int len, held, z, flags, item, matchLo, ok, spoil, ack;
+	unsigned int blkCrc;				/* CRC12 of the data, as BlkPut computes it */
+	long long flashFree;				/* When the flash will have programmed the last byte */
+	long long scuBusy;					/* A BMU's ReadByte sends on the SCU port until then */
+	/* ACCEPT */
+	char tib[TIB_SIZE];
+	int tibLen;
+	unsigned int queries;
+	/* Response slots: a packet held in tib until the answers ahead of ours have passed */
+	int slot, heldLen, slotId;
+	long long slotLast;					/* When the last byte came */
+	long long slotWait;					/* slotWait, in microseconds */
+	/* UART */
+	queue rx, tx, reply;
+	/* Modbus RTU on a BMU's SCU port */
+	int rtuLen;							/* Bytes of the frame so far, or -1 in a command packet */
+	unsigned char rtuBuf[RTU_LEN];
+	long long rtuLast;					/* When the last byte came */
+	queue rtuOut;						/* The answer, until its silence has passed */
+	unsigned int rate, newRate;
+	int txBusy, cpuPending;
+	long long cpuFree;
+	long lost;
+} dev;
+
+typedef struct {
+	long long t;
+	unsigned long seq;
+	int type, d;
+	unsigned char b;
+	unsigned int rate;
+} event;
+
+static dev* devs[MAX_DEVS + 2];
+static int nStage;						/* Stages in the chain, including a BMU's two */
+static int nCmu = 8, bmu, rtu, verbose, slots = 1;
+static double errRate;
+static unsigned long rng = 1;
+static int master;
+static long long hostFree, startUs;
+static long long simNow;				/* When the event being run was due */
+static event* heap;
+static int nHeap, heapCap;
+static unsigned long evSeq;
+
+long long nowUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000 - startUs;
+}
+
+/* xorshift: quick, and the same on every machine */
+unsigned long rand32(void) {
+	rng ^= (rng << 13) & 0xFFFFFFFFUL;
+	rng ^= rng >> 17;
+	rng ^= (rng << 5) & 0xFFFFFFFFUL;
+	return rng;
+}
+
+int put(queue* q, unsigned char b) {
+	if (q->n >= QUEUE_LEN)
+		return 0;
+	q->b[(q->head + q->n++) & (QUEUE_LEN-1)] = b;
+	return 1;
+}
+
+unsigned char get(queue* q) {
+	unsigned char b = q->b[q->head];
+	q->head = (q->head + 1) & (QUEUE_LEN-1);
+	--q->n;
+	return b;
+}
+
+/* Event queue: a binary heap ordered by time, then by when the event was scheduled */
+int before(const event* a, const event* b) {
+	return a->t < b->t || (a->t == b->t && a->seq < b->seq);
+}
+
+void schedule(long long t, int type, int d, unsigned char b, unsigned int rate) {
+	event e;
+	int i;
+	if (nHeap == heapCap) {
+		heapCap = heapCap ? heapCap * 2 : 1024;
+		heap = realloc(heap, heapCap * sizeof(event));
+		if (heap == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	e.t = t; e.seq = evSeq++; e.type = type; e.d = d; e.b = b; e.rate = rate;
+	for (i = nHeap++; i > 0 && before(&e, &heap[(i-1)/2]); i = (i-1)/2)
+		heap[i] = heap[(i-1)/2];
+	heap[i] = e;
+}
+
+event unschedule(void) {
+	event top = heap[0], last = heap[--nHeap];
+	int i = 0, c;
+	while ((c = 2*i + 1) < nHeap) {
+		if (c + 1 < nHeap && before(&heap[c+1], &heap[c]))
+			++c;
+		if (!before(&heap[c], &last))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = last;
+	return top;
+}
+
+long long byteUs(unsigned int rate, int bits) {
+	return (long long)bits * 1000000 / rate;
+}
+
+/* The host's rate and framing, from the pseudo-terminal's settings */
+unsigned int hostRate(int* bits) {
+	static const struct { speed_t s; unsigned int r; } rates[] = {
+		{B1200, 1200}, {B2400, 2400}, {B4800, 4800}, {B9600, 9600}, {B19200, 19200},
+		{B38400, 38400}, {B57600, 57600}, {B115200, 115200}, {B230400, 230400}
+	};
+	struct termios t;
+	unsigned int i;
+	*bits = 10;
+	if (tcgetattr(master, &t) < 0)
+		return 9600;
+	if (t.c_cflag & CSTOPB)
+		*bits = 11;
+	for (i=0; i < sizeof rates / sizeof rates[0]; ++i)
+		if (cfgetospeed(&t) == rates[i].s)
+			return rates[i].r;
+	return 9600;
+}
+
+int rxCap(dev* d) {
+	return d->unit->mode == MAIN ? RX_SZ : 1;
+}
+
+int txCap(dev* d) {
+	return d->unit->mode == MAIN ? TX_SZ : 1;
+}
+
+/* Give stage i's CPU the next received byte, once it is free and has room to echo it */
+void kick(int i, long long now) {
+	dev* d = devs[i];
+	if (!d->cpuPending && d->rx.n && d->tx.n < txCap(d)) {
+		d->cpuPending = 1;
+		schedule(d->cpuFree > now ? d->cpuFree : now, EV_CPU, i, 0, 0);
+	}
+}
+
+/* Start sending the next byte from stage i, if its UART is free */
+void startTx(int i, long long now) {
+	dev* d = devs[i];
+	long long t;
+	if (d->txBusy || d->tx.n == 0)
+		return;
+	d->txBusy = 1;
+	t = now + byteUs(d->rate, 10);
+	schedule(t, EV_TX_DONE, i, 0, 0);
+	schedule(t, EV_ARRIVE, i + 1, get(&d->tx), d->rate);
+}
+
+/* Start a byte from the host on its way to the first device. We take the host's bytes from the
+   pseudo-terminal only as fast as its UART would send them, so that its output queue drains at the real
+   rate, and the host's idea of when its bytes have gone (see drainOutput in sendprog.c) stays true.
+   If the byte was already waiting when the last one finished, it follows that one without a gap, even
+   if we are a little late reading it. */
+void fromHost(unsigned char b, int waiting) {
+	int bits;
+	unsigned int rate = hostRate(&bits);
+	long long now = nowUs();
+	if (!waiting && hostFree < now)
+		hostFree = now;					/* The line was idle */
+	hostFree += byteUs(rate, bits);
+	schedule(hostFree, EV_ARRIVE, 0, b, rate);
+}
+
+/*
+ * Device behaviour. Each handler is given a byte its device has read, queues what it sends in d->tx (the
+ * echo) or d->reply (anything sent once the CPU time has passed), and returns the CPU time it took.
+ */
+
+void reply(dev* d, const char* text) {
+	unsigned char ck[2];
+	int n = strlen(text), i;
+	for (i=0; i < n; ++i)
+		put(&d->reply, text[i]);
+	printableCrc(crc12((const unsigned char*)text, n), ck);
+	put(&d->reply, ck[0]);
+	put(&d->reply, ck[1]);
+	put(&d->reply, '\r');
+}
+
+void respond(dev* d, const char* cmd, long value, int digits) {
+	char text[40];
+	sprintf(text, "\\%03d:%s %s%0*ld", d->unit->id, cmd, value < 0 ? "-" : "", digits,
+		value < 0 ? -value : value);
+	reply(d, text);
+}
+
+/* A made-up reading for a one-character command, the same on every run. Returns 0 if c isn't one. */
+int reading(dev* u, char c, int q, long* value) {
+	switch (c) {
+	case 'v': case 'V': *value = 3280 + (u->id * 37 + q) % 41; return 1;
+	case 't': *value = 21 + (u->id + q) % 5; return 1;
+	case 'o': *value = (3280 + (u->id * 37) % 41) * 16 + q % 16; return 1;
+	case 'f': *value = 800 - q % 10; return u->id == 255;	/* BMUs only */
+	case 'g': *value = 200 + q % 10; return u->id == 255;
+	case 'j': case 'p': *value = 0; return 1;
+	}
+	return 0;
+}
+
+/* The 'm' command's answer: v V Is o t p as 80 bits, 6 to a character, as _Snapshot sends them */
+void snapshot(dev* d, int q) {
+	dev* u = d->unit;
+	long v[4], t, p;
+	unsigned char bytes[11] = {0};
+	char text[32];
+	int n, k, b;
+	reading(u, 'v', q, &v[0]);
+	reading(u, 'V', q, &v[1]);
+	v[2] = (long)(q % 7) - 3;
+	reading(u, 'o', q, &v[3]);
+	reading(u, 't', q, &t);
+	reading(u, 'p', q, &p);
+	for (k=0; k < 4; ++k) {
+		bytes[2*k] = (unsigned char)(v[k] >> 8);
+		bytes[2*k+1] = (unsigned char)v[k];
+	}
+	bytes[8] = (unsigned char)t;
+	bytes[9] = (unsigned char)p;
+	n = sprintf(text, "\\%03d:m", u->id);
+	for (k=0; k < 14; ++k) {
+		int six = 0;
+		for (b=0; b < 6; ++b)
+			six = six << 1 | (bytes[(k*6 + b) / 8] >> (7 - (k*6 + b) % 8) & 1);
+		text[n++] = six == 63 ? '?' : 0x40 | six;
+	}
+	text[n] = 0;
+	reply(d, text);
+}
+
+/* Interpret a packet whose CRC12 was good. Returns the time it took. */
+long interpret(dev* d, const char* p, int n) {
+	dev* u = d->unit;
+	long num = 0, us = CMD_US;
+	int i, digit = 0, hex = 0, q;
+	for (i=0; i < n; ++i) {
+		char c = p[i];
+		int v = c >= '0' && c <= '9' ? c - '0' : hex && c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+		if (v >= 0) {
+			if (!digit)
+				num = 0;
+			num = num * (hex ? 16 : 10) + v;
+			digit = 1;
+			continue;
+		}
+		digit = 0;
+		q = u->queries++;
+		switch (c) {
+		case '$': hex = 1; continue;
+		case '\\': return us;			/* A response from another device */
+		case 'x':
+			u->dont = 1;
+			/* Fall through */
+		case 's':
+			if (num != u->id)
+				return us;
+			u->dont = 0;
+			break;
+		case 'S': if (num == u->id) return us; break;
+		case 'X': if (num == u->id) u->dont = 1; break;
+		case 'v': case 'V': case 't': case 'o': case 'f':
+			{
+				char cmd[2] = {c, 0};
+				long value;
+				if (reading(u, c, q, &value))
+					respond(d, cmd, value, c == 't' ? 2 : c == 'o' ? 5 : 4);
+			}
+			break;
+		case 'q':						/* The worst-stress log, if its stress is at least num */
+			{
+				char text[48];
+				int stress = (u->id * 5) % 16;
+				if (stress >= num) {
+					sprintf(text, "\\%03d:q %02d %d %04d %04d %02d %02d %04d ", u->id, stress, u->id % 5 + 1,
+						3400 + u->id % 41, 3100 + u->id % 37, 30 + u->id % 9, 15 + u->id % 7, 0);
+					reply(d, text);
+				}
+			}
+			break;
+		case 'R':						/* 'Rl': the count of resets, then up to num of their reasons */
+			if (i + 1 < n && p[i+1] == 'l') {
+				char text[16];
+				int count = u->id % 20 + 3, k;
+				++i;
+				respond(d, "Rl", count, 3);
+				for (k=0; k < num && k < count && k < 16; ++k) {
+					sprintf(text, "\\%03d:Rl $%02X", u->id, (u->id + k) % 7 * 2);
+					reply(d, text);
+				}
+			}
+			break;
+		case 'm':
+			snapshot(d, q);
+			break;
+		case 'p':						/* In hex */
+			{
+				char text[16];
+				sprintf(text, "\\%03d:p $%02X", u->id, 0);
+				reply(d, text);
+			}
+			break;
+		case 'I':
+			if (i + 1 < n && p[i+1] == 's') {
+				++i;
+				respond(d, "Is", (long)(q % 7) - 3, 4);
+			}
+			break;
+		case 'P':
+			if (i + 1 < n && p[i+1] == 'c') {
+				++i;
+				respond(d, "Pc", crc12(u->flash, IMAGE_SIZE), 4);
+				us += PROG_CRC_US;
+			}
+			break;
+		}
+		hex = 0;
+	}
+	return us;
+}
+
+int hexDigit(char c) {
+	return c >= '0' && c <= '9' ? c - '0' : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+/* The registers that _Modbus and RtuAnswer read, from req: <reg_hi> <reg_lo> <cnt_hi> <cnt_lo>. One register
+   at $0020 or above is read as the one-character command <reg_lo> with the number <reg_hi>; registers
+   below that are the block MODBUS_REGS, read several at once. Puts the byte count and the values in r,
+   from r[2], and returns 1; or returns 0 if the device wouldn't answer. */
+int modbusRead(dev* u, const unsigned char* req, unsigned char* r) {
+	unsigned int reg = req[0] << 8 | req[1], count = req[2] << 8 | req[3];
+	unsigned int regs = u->id == 255 ? sizeof MODBUS_REGS - 1 : MODBUS_CMU_REGS;
+	long value;
+	int i;
+	if (count == 0 || (reg < 0x20 ? reg + count > regs : count != 1))
+		return 0;
+	r[2] = 2 * count;
+	for (i=0; i < (int)count; ++i) {
+		if (!reading(u, reg < 0x20 ? MODBUS_REGS[reg + i] : req[1], u->queries++, &value))
+			return 0;					/* The firmware would send a broken packet; send nothing */
+		r[3 + 2*i] = value >> 8;
+		r[4 + 2*i] = value;
+	}
+	return 1;
+}
+
+/* _Modbus: ":<id><fc><reg_hi><reg_lo><cnt_hi><cnt_lo><LRC>" in hex, with a good LRC, reads the registers
+   of modbusRead. The answer is a Modbus/ASCII response
+   ":<id>03<2 * cnt><values><LRC>" with a CR and LF. IDs BMU_MODBUS_ID and BROADCAST_MODBUS_ID stand
+   for 255 and every device. Other devices' responses are never as long as a request, so they are
+   ignored. */
+long modbus(dev* d, const char* p, int n) {
+	dev* u = d->unit;
+	unsigned char b[7], r[MODBUS_MAX];
+	unsigned int sum = 0, count;
+	char text[2 * sizeof r + 2];
+	int i, id;
+	if (n != 1 + 2 * 7)
+		return 0;
+	for (i=0; i < 7; ++i) {
+		int hi = hexDigit(p[1 + 2*i]), lo = hexDigit(p[2 + 2*i]);
+		if (hi < 0 || lo < 0)
+			return 0;
+		b[i] = hi << 4 | lo;
+		sum += b[i];
+	}
+	if (sum & 0xFF)
+		return 0;
+	id = b[0] == BMU_MODBUS_ID ? 255 : b[0];
+	if (b[0] != BROADCAST_MODBUS_ID && id != u->id)
+		return CMD_US;
+	count = b[4] << 8 | b[5];
+	if (!modbusRead(u, b + 2, r))
+		return CMD_US;
+	r[0] = u->id == 255 ? BMU_MODBUS_ID : u->id;
+	r[1] = 3;
+	n = 3 + 2 * count;
+	for (sum = 0, i=0; i < n; ++i)
+		sum += r[i];
+	r[n++] = -sum;
+	text[0] = ':';
+	for (i=0; i < n; ++i)
+		sprintf(text + 1 + 2*i, "%02X", r[i]);
+	for (i=0; text[i]; ++i)
+		put(&d->reply, text[i]);
+	put(&d->reply, '\r');
+	put(&d->reply, '\n');
+	return CMD_US * count;
+}
+
+/* The Modbus CRC16 of n bytes */
+unsigned int modbusCrc16(const unsigned char* p, int n) {
+	unsigned int crc = 0xFFFF;
+	int i;
+	while (n--) {
+		crc ^= *p++;
+		for (i=0; i < 8; ++i)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+	return crc;
+}
+
+/* RtuRxByte, on a BMU built with MODBUS_RTU (-R): a byte of BMU_MODBUS_ID after 3.5 characters of silence
+   begins a Modbus RTU frame, which doesn't go on to the CMUs. A read request (function 3 or 4) with a
+   good CRC16 is answered out of the SCU port, once the silence after it has passed; here that's timed
+   from its last byte, and from when the CPU gets to each byte rather than when it came. Returns the
+   time it took, or -1 if the byte is for the CMUs. */
+long rtuByte(dev* d, unsigned char c) {
+	unsigned char r[MODBUS_MAX];
+	unsigned int crc;
+	int i, n;
+	if (simNow - d->rtuLast >= RTU_GAP_US)
+		d->rtuLen = c == BMU_MODBUS_ID ? 0 : -1;
+	d->rtuLast = simNow;
+	if (d->rtuLen < 0)
+		return -1;
+	if (d->rtuLen < RTU_LEN)
+		d->rtuBuf[d->rtuLen] = c;
+	if (++d->rtuLen != RTU_LEN)
+		return BYTE_US;
+	if (modbusCrc16(d->rtuBuf, RTU_LEN) != 0 || (d->rtuBuf[1] != 3 && d->rtuBuf[1] != 4) ||
+			!modbusRead(d, d->rtuBuf + 2, r))
+		return BYTE_US;
+	r[0] = BMU_MODBUS_ID;
+	r[1] = d->rtuBuf[1];
+	n = 3 + r[2];
+	crc = modbusCrc16(r, n);
+	r[n++] = crc;
+	r[n++] = crc >> 8;
+	for (i=0; i < n; ++i)
+		put(&d->rtuOut, r[i]);
+	schedule(simNow + RTU_GAP_US + CMD_US, EV_RTU, 0, 0, 0);
+	return BYTE_US;
+}
+
+/* SlotRelease: interpret the held packet. Returns the time it took. */
+long slotRelease(dev* d) {
+	d->slot = SLOT_NONE;
+	return interpret(d, d->tib, d->heldLen);
+}
+
+/* SlotWaitFor: SlotWait, plus what the slow commands in the packet p of n characters take the device
+   ahead */
+long long slotWaitFor(const char* p, int n) {
+	long long us = SLOT_WAIT_US;
+	long num = 0;
+	int i;
+	for (i=0; i < n; ++i) {
+		if (p[i] >= '0' && p[i] <= '9') {
+			if (num < 6553)
+				num = num * 10 + p[i] - '0';
+			continue;
+		}
+		if (p[i] == 'J')
+			us += SLOT_J_US;
+		else if (p[i] == 'P' && i + 1 < n && p[i+1] == 'c')
+			us += SLOT_PC_US;
+		else if (p[i] == 'M' && i + 1 < n && p[i+1] == 's')
+			us += (num < 16000 ? num : 16000) * 1000;
+		num = 0;
+	}
+	return us;
+}
+
+/* How long the line must be quiet before SlotQuiet answers the held packet */
+long long slotQuiet(dev* d) {
+	return d->slot == SLOT_LINE && d->slotId == ((d->unit->id - 1) & 0xFF) ? SLOT_GAP_US : d->slotWait;
+}
+
+void slotTimer(dev* d) {
+	schedule(d->slotLast + slotQuiet(d), EV_SLOT, d->stage, 0, 0);
+}
+
+/* SlotByte: while a packet is held, follow the answers going past, noting the ID of each. Returns 0 if
+   no packet is held, so the byte is for ACCEPT. */
+int slotByte(dev* d, unsigned char c) {
+	if (d->slot == SLOT_NONE)
+		return 0;
+	d->slotLast = simNow;
+	switch (d->slot) {
+	case SLOT_LINE:						/* SlotStart has seen that it's a response */
+		d->slotId = 0;
+		d->slot = SLOT_ID;
+		break;
+	case SLOT_ID:
+		if (c >= '0' && c <= '9') {
+			d->slotId = (d->slotId * 10 + c - '0') & 0xFF;
+			break;
+		}
+		d->slot = SLOT_TEXT;
+		/* Fall through */
+	case SLOT_TEXT:
+		if (c == '\r')
+			d->slot = SLOT_LINE;
+		break;
+	}
+	slotTimer(d);
+	return 1;
+}
+
+/* True if the packet p of n characters is for one device: an ID, in decimal or $hex, then 's' or 'x' */
+int oneDevice(const char* p, int n) {
+	int i, hex = n > 0 && p[0] == '$';
+	for (i = hex; i < n && ((p[i] >= '0' && p[i] <= '9') || (hex && p[i] >= 'A' && p[i] <= 'F')); ++i)
+		;
+	return i > hex && i < n && (p[i] == 's' || p[i] == 'x');
+}
+
+/* ACCEPT: collect a packet, and interpret it at the CR if its CRC12 is good. Like the firmware, it keeps
+   any password bytes that went before, so the packet after a fake download fails its check. */
+long accept(dev* d, unsigned char c) {
+	dev* u = d->unit;
+	unsigned char ck[2];
+	int n;
+	switch (c) {
+	case '\r':
+		n = d->tibLen - 2;
+		d->tibLen = 0;
+		if (n < 1 || n + 2 >= TIB_SIZE - 1)
+			return 0;					/* Empty, or the buffer filled */
+		if (d->tib[0] == ':')			/* Modbus/ASCII has an LRC instead of a CRC12 */
+			return u->dont ? 0 : modbus(d, d->tib, n + 2);
+		printableCrc(crc12((unsigned char*)d->tib, n), ck);
+		if (ck[0] != (unsigned char)d->tib[n] || ck[1] != (unsigned char)d->tib[n+1] || u->dont)
+			return 0;
+		if (slots && u->id != 1 && d->tib[0] != '\\' && !oneDevice(d->tib, n)) {
+			d->heldLen = n;				/* SlotPacket: hold it */
+			d->slot = SLOT_LINE;
+			d->slotId = 0;
+			d->slotLast = simNow;
+			d->slotWait = slotWaitFor(d->tib, n);
+			slotTimer(d);
+			return 0;
+		}
+		return interpret(d, d->tib, n);
+	case 8:
+		if (d->tibLen)
+			--d->tibLen;
+		return 0;
+	case 27:
+		u->dont = 0;
+		return 0;
+	case 0x11: case 0x13:
+	case '\n':							/* After a Modbus CR */
+		return 0;
+	}
+	if (d->tibLen < TIB_SIZE - 1)
+		d->tib[d->tibLen++] = c;
+	return 0;
+}
+
+void erase(dev* u, unsigned int seg) {
+	memset(u->flash + seg - PROG_START, 0xFF, SEG_SIZE);
+}
+
+/* DoPassword. Returns the CPU time it took, or -1 if the byte isn't part of a password. */
+long doPassword(dev* d, unsigned char c) {
+	dev* u = d->unit;
+	int i;
+	if (--u->passWordState) {
+		if (c != u->passWordState + 2)
+			u->passWordState = 4;
+		return -1;
+	}
+	u->passWordState = 4;
+	if (c == 2) {
+		u->fake = REV61_IMAGE;
+		return 0;
+	}
+	if (c == 1 && u->dont) {
+		u->fake = IMAGE_SIZE;
+		return 0;
+	}
+	if ((c & ~2) != 1)
+		return -1;
+	if (c == 3) {
+		u->mode = LDR;
+		u->ls = 0;
+		u->ok = 0;
+		erase(u, PP_SEG);
+		return ERASE_US;
+	}
+	u->mode = BSL;
+	u->addr = 0;
+	u->sum = 0;
+	for (i=0; i < IMAGE_SIZE; i += SEG_SIZE)
+		erase(u, PROG_START + i);
+	return (long)ERASE_US * (IMAGE_SIZE / SEG_SIZE);
+}
+
+long mainByte(dev* d, unsigned char c) {
+	dev* u = d->unit;
+	long us, held = 0;
+	if (rtu && u->id == 255 && !d->tail && (us = rtuByte(d, c)) >= 0)
+		return us;
+	if (d->slot == SLOT_LINE && c != '\\') {	/* SlotStart: something new, so answer the held packet first */
+		held = slotRelease(d);
+		while (d->reply.n)
+			put(&d->tx, get(&d->reply));
+	}
+	put(&d->tx, c);
+	if (d->tail)						/* A BMU's ACCEPT only sees the chain's bytes */
+		return BYTE_US + held + (slotByte(d, c) ? 0 : accept(d, c));
+	if (u->fake) {
+		--u->fake;
+		return BYTE_US + held;
+	}
+	us = doPassword(d, c);
+	if (us >= 0)
+		return BYTE_US + held + us;
+	return BYTE_US + held + (u->id == 255 || slotByte(d, c) ? 0 : accept(d, c));
+}
+
+/* After a good download, BSL2 restarts and runs the new program, at 9600 b/s once the last byte has gone.
+   A BMU's CMU port starts afresh too, without the password bytes that came back round the chain.
+   Returns the time it takes. */
+long restart(dev* d) {
+	int i;
+	d->mode = MAIN;
+	d->passWordState = 4;
+	d->dont = 0;
+	for (i=0; i < nStage; ++i)
+		if (devs[i]->unit == d) {
+			devs[i]->tibLen = 0;
+			devs[i]->slot = SLOT_NONE;
+		}
+	if (d->rate != 9600)
+		d->newRate = 9600;
+	return RESTART_US;
+}
+
+long bslByte(dev* d, unsigned char c) {
+	put(&d->tx, c);
+	d->flash[d->addr++] &= c;
+	d->sum ^= c;
+	if (d->addr < IMAGE_SIZE)
+		return BSL_BYTE_US;
+	if (d->sum == 0)
+		return BSL_BYTE_US + restart(d);
+	d->mode = BSL_WAIT;					/* Bad checksum: BSL2 waits for another download */
+	d->passWordState = 4;
+	return BSL_BYTE_US;
+}
+
+long bslWaitByte(dev* d, unsigned char c) {
+	int i;
+	put(&d->tx, c);
+	if (--d->passWordState) {
+		if (c != d->passWordState + 2)
+			d->passWordState = 4;
+		return BSL_BYTE_US;
+	}
+	d->passWordState = 4;
+	if (c != 1)
+		return BSL_BYTE_US;
+	d->mode = BSL;
+	d->addr = 0;
+	d->sum = 0;
+	for (i=0; i < IMAGE_SIZE; i += SEG_SIZE)
+		erase(d, PROG_START + i);
+	return (long)ERASE_US * (IMAGE_SIZE / SEG_SIZE);
+}
+
+/* Add a byte of segment data, as BlkPut does, with the CPU ready to write it at time at. The flash
+   programs it while the CPU carries on, so the CPU only waits if the last byte isn't finished.
+   Returns the wait. */
+long blkPut(dev* d, unsigned char b, long long at) {
+	long wait = 0;
+	int i;
+	if (d->addr >= d->end)
+		return 0;
+	d->blkCrc ^= b;
+	for (i=0; i < 8; ++i)
+		d->blkCrc = (d->blkCrc & 1) ? (d->blkCrc >> 1) ^ 0xC16 : d->blkCrc >> 1;
+	if (!d->held) {
+		if (d->flashFree > at)
+			wait = d->flashFree - at;
+		d->flashFree = at + wait + PROG_US;
+		d->flash[d->addr] &= b;
+	}
+	++d->addr;
+	return wait;
+}
+
+/* Decide what the next data byte is, from the flag bits. Plain data is all literals. */
+void nextItem(dev* d) {
+	if (d->flags == 1)
+		d->item = FLAG_BYTE;
+	else if (d->flags == -1)
+		d->item = LITERAL;
+	else {
+		d->item = d->flags & 1 ? LITERAL : MATCH_LO;
+		d->flags >>= 1;
+	}
+}
+
+/* The block loader, one byte at a time. ls counts through the frame: 0 = hunting for SOH, 1 to 7 =
+   header, 8 = data, 9 and 10 = acknowledgement pair. */
+long ldrByte(dev* d, unsigned char c) {
+	long us = LDR_BYTE_US;
+	unsigned int hi;
+	if (d->flashFree > simNow)
+		us += d->flashFree - simNow;	/* ReadByte couldn't be fetched until the last byte was programmed */
+	switch (d->ls) {
+	case 0:
+		if (d->seg == BSL2_START && d->ok) {
+			put(&d->tx, c);				/* Anything the host sends starts a verified image */
+			return us + restart(d);
+		}
+		if (c == BLK_SOH) {
+			d->ls = 1;
+			d->ok = 0;
+		}
+		break;
+	case 1: case 2: case 3: case 4: case 5: case 6:
+		d->hdr[d->ls++] = c;
+		if (d->ls == 4 && ((d->hdr[2] ^ d->hdr[3]) != 0xFF || d->hdr[2] < PROG_START >> 8))
+			d->ls = 0;
+		break;
+	case 7:
+		d->hdr[7] = c;
+		hi = d->hdr[2];
+		d->z = hi & 1;
+		d->seg = (hi & 0xFE) << 8;
+		d->crc = d->hdr[4] | d->hdr[5] << 8;
+		d->len = d->hdr[6] | d->hdr[7] << 8;
+		if (d->len > SEG_SIZE) {
+			d->ls = 0;					/* A corrupt length; hunt for the next frame */
+			break;
+		}
+		d->held = d->ok = d->spoil = 0;
+		d->ls = 9;
+		if (d->seg == BSL2_START) {
+			d->ok = crc12(d->flash, IMAGE_SIZE) == (d->crc ^ 0xFFF);
+			us += IMAGE_CRC_US;
+			if (!d->ok) {
+				erase(d, PP_SEG);
+				us += ERASE_US;
+			}
+		} else if (d->seg == BLK_BAUD_HI << 8) {
+			if (d->id == 255)
+				d->spoil = 1;
+			else
+				d->ok = 1;
+		} else {
+			d->addr = d->seg - PROG_START;
+			d->end = d->addr + SEG_SIZE;
+			d->held = crc12(d->flash + d->addr, SEG_SIZE) == (d->crc ^ 0xFFF);
+			us += SEG_CRC_US;
+			if (!d->held) {
+				erase(d, d->seg);
+				us += ERASE_US;
+			}
+			d->blkCrc = 0xFFF;
+			d->flags = d->z ? 1 : -1;
+			if (d->len > 0) {
+				d->ls = 8;
+				nextItem(d);
+			}
+		}
+		break;
+	case 8:								/* Data */
+		--d->len;
+		switch (d->item) {
+		case FLAG_BYTE:
+			d->flags = c | 0x100;
+			nextItem(d);
+			put(&d->tx, c);
+			return us;					/* A flag byte is never the last */
+		case LITERAL:
+			us += blkPut(d, c, simNow + us);
+			break;
+		case MATCH_LO:
+			d->matchLo = c;
+			d->item = MATCH_HI;
+			put(&d->tx, c);
+			return us;
+		case MATCH_HI:
+			{
+				unsigned int off = (d->matchLo | (c & 1) << 8) + 1, n = (c >> 1) + 3;
+				unsigned int src = d->addr - off;
+				while (n--) {
+					us += MATCH_US + blkPut(d, src < FLASH_SIZE ? d->flash[src] : 0xFF, simNow + us);
+					++src;
+				}
+			}
+			break;
+		}
+		if (d->len < 1) {				/* End of the data */
+			d->ok = d->held || (d->addr == d->end && d->blkCrc == d->crc);
+			d->spoil = -d->len;			/* The frame ended in the middle of an item */
+			d->ls = 9;
+		} else
+			nextItem(d);
+		break;
+	case 9:
+		c += d->ok;
+		d->ack = c;
+		d->ls = 10;
+		break;
+	case 10:
+		c = c - d->ok + d->spoil;
+		d->ls = 0;
+		if (d->seg == BLK_BAUD_HI << 8 && ((d->ack + c) & 0xFF) == 0xFF)
+			d->newRate = UART_CLOCK / (d->hdr[4] ? d->hdr[4] : 1);
+		break;
+	}
+	put(&d->tx, c);
+	return us;
+}
+
+long handle(dev* d, unsigned char c) {
+	switch (d->unit->mode) {
+	case BSL:
+		return d->tail ? (put(&d->tx, c), BYTE_US) : bslByte(d, c);
+	case BSL_WAIT:
+		return d->tail ? (put(&d->tx, c), BYTE_US) : bslWaitByte(d, c);
+	case LDR:
+		if (!d->tail)
+			return ldrByte(d, c);
+		if (d->unit->ls)
+			return 0;					/* WRT stops a BMU passing the chain's bytes on */
+		put(&d->tx, c);					/* Its ReadByte sends them with WriteScuByte */
+		if (d->unit->scuBusy < simNow)
+			d->unit->scuBusy = simNow;
+		d->unit->scuBusy += byteUs(d->rate, 10);
+		return byteUs(d->rate, 10);
+	}
+	return mainByte(d, c);
+}
+
+const char* modeName(int mode) {
+	return mode == MAIN ? "main program" : mode == LDR ? "block loader" : "BSL2";
+}
+
+/* Run one event, due at now */
+void run(event* e, long long now) {
+	dev* d;
+	if (e->d == nStage) {				/* Back at the host */
+		int bits;
+		unsigned char b = e->b;
+		if (e->rate != hostRate(&bits))
+			b = rand32();				/* Framing at the wrong rate: garbage */
+		if (write(master, &b, 1) < 0) {
+			/* The host has closed the port; the byte is lost */
+		}
+		return;
+	}
+	d = devs[e->d];
+	switch (e->type) {
+	case EV_ARRIVE:
+		{
+			unsigned char b = e->b;
+			if (errRate > 0 && rand32() / 4294967296.0 < errRate)
+				b ^= 1 << (rand32() & 7);
+			if (e->rate != d->rate)
+				b = rand32();
+			if (d->rx.n >= rxCap(d) || (d->unit->mode == LDR && d->unit->id == 255 && !d->tail &&
+					now - byteUs(e->rate, 10) < d->unit->scuBusy)) {
+				++d->unit->lost;		/* Nowhere to put it, or a BMU missed its start bit */
+				if (verbose)
+					fprintf(stderr, "%.6f s: device %d lost a byte (%s)\n", now / 1e6, d->unit->id,
+						modeName(d->unit->mode));
+			} else
+				put(&d->rx, b);
+			kick(e->d, now);
+		}
+		break;
+	case EV_TX_DONE:
+		d->txBusy = 0;
+		if (d->newRate && d->tx.n == 0) {
+			d->rate = d->newRate;
+			d->newRate = 0;
+		}
+		startTx(e->d, now);
+		kick(e->d, now);
+		break;
+	case EV_CPU:
+		d->cpuPending = 1;
+		if (d->rx.n == 0 || d->tx.n >= txCap(d)) {
+			d->cpuPending = 0;			/* TX_DONE will kick us */
+			break;
+		}
+		simNow = now;
+		d->cpuFree = now + handle(d, get(&d->rx));
+		startTx(e->d, now);
+		schedule(d->cpuFree, EV_CPU_DONE, e->d, 0, 0);
+		break;
+	case EV_CPU_DONE:
+		d->cpuPending = 0;
+		while (d->reply.n)
+			put(&d->tx, get(&d->reply));
+		startTx(e->d, now);
+		kick(e->d, now);
+		if (d->slot != SLOT_NONE && !d->cpuPending)
+			slotTimer(d);				/* In case it came due while the CPU was busy */
+		break;
+	case EV_SLOT:						/* SlotQuiet: answer a held packet once the line is quiet */
+		if (d->slot == SLOT_NONE || d->cpuPending || d->rx.n || now < d->slotLast + slotQuiet(d))
+			break;
+		simNow = now;
+		d->cpuPending = 1;
+		d->cpuFree = now + slotRelease(d);
+		schedule(d->cpuFree, EV_CPU_DONE, e->d, 0, 0);
+		break;
+	case EV_RTU:						/* A BMU's Modbus RTU answer goes out of its SCU port */
+		while (d->rtuOut.n)
+			put(&devs[nStage-1]->tx, get(&d->rtuOut));
+		startTx(nStage - 1, now);
+		break;
+	}
+}
+
+dev* newDev(int id, dev* unit) {
+	dev* d = calloc(1, sizeof(dev));
+	if (d == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	d->id = id;
+	d->unit = unit ? unit : d;
+	d->tail = unit != NULL;
+	d->rate = 9600;
+	d->passWordState = 4;
+	memset(d->flash, 0xFF, FLASH_SIZE);
+	return d;
+}
+
+void usage(void) {
+	fprintf(stderr, "Usage: chainsim [-n <CMUs>] [-m] [-R] [-a] [-e <error rate>] [-r <seed>] [-i <image>] "
+		"[-l <link>] [-v] [-- <command, with %%p for the port>]\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	const char* image = NULL;
+	const char* link = NULL;
+	char* slaveName;
+	char** cmd = NULL;
+	static unsigned char initial[FLASH_SIZE];
+	int slave, i, status = 0, waiting = 0;
+	pid_t child = 0;
+	struct termios raw;
+
+	for (i=1; i < argc; ++i) {
+		if (strcmp(argv[i], "--") == 0) {
+			cmd = argv + i + 1;
+			break;
+		} else if (strcmp(argv[i], "-m") == 0)
+			bmu = 1;
+		else if (strcmp(argv[i], "-R") == 0)
+			rtu = 1;
+		else if (strcmp(argv[i], "-a") == 0)
+			slots = 0;
+		else if (strcmp(argv[i], "-v") == 0)
+			verbose = 1;
+		else if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+			nCmu = atoi(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-e") == 0)
+			errRate = atof(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-r") == 0)
+			rng = strtoul(argv[++i], NULL, 0);
+		else if (i + 1 < argc && strcmp(argv[i], "-i") == 0)
+			image = argv[++i];
+		else if (i + 1 < argc && strcmp(argv[i], "-l") == 0)
+			link = argv[++i];
+		else
+			usage();
+	}
+	if (nCmu < 1 || nCmu > MAX_DEVS - 2) {
+		fprintf(stderr, "Number of CMUs must be 1 to %d\n", MAX_DEVS - 2);
+		exit(1);
+	}
+	if (rng == 0)
+		rng = 1;						/* xorshift would stay at 0 */
+	if (rtu && !bmu) {
+		fprintf(stderr, "-R needs a BMU (-m)\n");
+		exit(1);
+	}
+
+	memset(initial, 0xFF, FLASH_SIZE);
+	if (image) {
+		FILE* f = fopen(image, "rb");
+		long len;
+		if (f == NULL) {
+			perror(image);
+			exit(1);
+		}
+		fseek(f, 0, SEEK_END);
+		len = ftell(f);
+		if (len > FLASH_SIZE)
+			len = FLASH_SIZE;
+		fseek(f, -len, SEEK_END);
+		if (fread(initial + FLASH_SIZE - len, 1, len, f) != (size_t)len) {
+			fprintf(stderr, "Could not read %s\n", image);
+			exit(1);
+		}
+		fclose(f);
+	}
+
+	if (bmu)
+		devs[nStage++] = newDev(255, NULL);
+	for (i=1; i <= nCmu; ++i)
+		devs[nStage++] = newDev(i, NULL);
+	if (bmu)
+		devs[nStage++] = newDev(255, devs[0]);
+	for (i=0; i < nStage; ++i) {
+		devs[i]->stage = i;
+		memcpy(devs[i]->flash, initial, FLASH_SIZE);
+	}
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0 || (slaveName = ptsname(master)) == NULL) {
+		perror("Could not open a pseudo-terminal");
+		exit(1);
+	}
+	/* Keep the slave open ourselves, so the master doesn't see a hangup between the host's opens */
+	slave = open(slaveName, O_RDWR | O_NOCTTY);
+	if (slave < 0) {
+		perror(slaveName);
+		exit(1);
+	}
+	tcgetattr(slave, &raw);
+	cfmakeraw(&raw);
+	cfsetspeed(&raw, B9600);
+	tcsetattr(slave, TCSANOW, &raw);
+	if (link) {
+		unlink(link);
+		if (symlink(slaveName, link) < 0) {
+			perror(link);
+			exit(1);
+		}
+	}
+	startUs = nowUs();
+	signal(SIGPIPE, SIG_IGN);
+
+	if (cmd && *cmd) {
+		child = fork();
+		if (child == 0) {
+			/* Replace %p in the arguments with the port */
+			for (i=0; cmd[i]; ++i) {
+				char* p = strstr(cmd[i], "%p");
+				if (p) {
+					char* s = malloc(strlen(cmd[i]) + strlen(slaveName));
+					sprintf(s, "%.*s%s%s", (int)(p - cmd[i]), cmd[i], slaveName, p + 2);
+					cmd[i] = s;
+				}
+			}
+			close(master);
+			execvp(cmd[0], cmd);
+			perror(cmd[0]);
+			_exit(127);
+		}
+	} else {
+		printf("%d CMUs%s on %s\n", nCmu, bmu ? " and a BMU" : "", slaveName);
+		fflush(stdout);
+	}
+
+	for (;;) {
+		struct pollfd pfd;
+		struct timespec ts;
+		long long now = nowUs(), wait = 100000;
+		while (nHeap && heap[0].t <= now) {
+			event e = unschedule();
+			run(&e, e.t);			/* In the order, and at the times, they were due */
+		}
+		if (nHeap && heap[0].t - now < wait)
+			wait = heap[0].t - now;
+		pfd.fd = master;
+		pfd.events = 0;
+		if (hostFree <= now)
+			pfd.events = POLLIN;		/* The host's UART is free for another byte */
+		else if (hostFree - now < wait)
+			wait = hostFree - now;
+		ts.tv_sec = wait / 1000000;
+		ts.tv_nsec = wait % 1000000 * 1000;
+		if (ppoll(&pfd, 1, &ts, NULL) > 0 && (pfd.revents & POLLIN)) {
+			unsigned char b;
+			if (read(master, &b, 1) == 1)
+				fromHost(b, waiting);
+			if (ioctl(master, FIONREAD, &waiting) < 0)
+				waiting = 0;
+		}
+		if (child && waitpid(child, &status, WNOHANG) == child)
+			break;
+	}
+
+	if (link)
+		unlink(link);
+	printf("Device  Program CRC12  Lost bytes  Running\n");
+	for (i=0; i < nStage; ++i) {
+		dev* d = devs[i];
+		if (d->tail)
+			continue;
+		printf("%6d  %13u  %10ld  %s\n", d->id, crc12(d->flash, IMAGE_SIZE), d->lost,
+			modeName(d->mode));
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,302 @@
+// lfproxy.cpp : share one BMU serial port among many local programs, answering repeated reads from memory
+//
+// Written 17/Oct/2026
+//
+// lfproxy owns the serial port and listens on a Unix socket. Clients send packets just as they would on
+// the port (text, CRC12, CR) and get the answers back the same way. Several dashboards polling the same
+// readings would each cost a trip round the chain at 9600 b/s; instead:
+// - A read of one of these, alone in its packet, to every device or to one ("v" or "12sv"), is answered
+//   from memory if the same read was answered recently enough:
+//		voltages		v V		-V ms (default 1000)
+//		temperatures	t		-T ms (default 5000)
+//		state of charge	f g		-S ms (default 10000)
+//   If the same read is already on its way, the new client waits for its answers instead of sending it
+//   again. 'o' isn't cached, since it is ChargerControl in some builds.
+// - Every other packet, such as 'Th' thresholds or 'L' and 'U' to liven or unliven the contactors, goes
+//   to the chain every time and is never answered from memory. Its sender gets the answers to the
+//   commands at the end of the packet, each of them if there are several ("tv").
+// Packets go through liblytefyba's Chain, so the reads of many clients are pipelined.
+//
+// Usage: lfproxy [-p port] [-b baud] [-s socket] [-n devices] [-V ms] [-T ms] [-S ms] [-k] [-v]
+// Linux and macOS.
+
+#include "../liblytefyba/lytefyba.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <system_error>
+
+using namespace lytefyba;
+
+struct Client
+{
+	int			fd;
+	std::mutex	writing;
+
+	explicit Client(int f) : fd(f) {}
+	~Client() { close(fd); }
+};
+
+typedef std::shared_ptr<Client> ClientPtr;
+
+// A cacheable read, and what is known of it
+struct Entry
+{
+	std::chrono::steady_clock::time_point when;	// When its answers came
+	std::vector<Response> answers;
+	bool		valid = false;
+	bool		pending = false;					// Sent, and waiting for answers
+	std::vector<ClientPtr> waiting;
+};
+
+static std::unique_ptr<Chain> chain;
+static bool checksums = true, verbose;
+static int devices;
+static std::chrono::milliseconds voltageAge(1000), temperatureAge(5000), socAge(10000);
+
+static volatile sig_atomic_t stopWanted;
+
+static std::mutex caching;
+static std::map<std::string, Entry> cache;
+static unsigned long packets, hits, merged, sent;
+
+static void sendAnswers(Client& c, const std::vector<Response>& answers)
+{
+	std::string out;
+	for (auto& a : answers)
+		out += checksums ? makePacket(a.text) : a.text + '\r';
+	std::lock_guard<std::mutex> lock(c.writing);
+	std::size_t done = 0;
+	while (done < out.size()) {
+		ssize_t n = send(c.fd, out.data() + done, out.size() - done, MSG_NOSIGNAL);
+		if (n <= 0 && errno != EINTR)
+			return;						// The client has gone
+		if (n > 0)
+			done += n;
+	}
+}
+
+// How long a read's answers stay fresh, or -1 ms if the packet isn't a read that may be cached.
+// Sets id and command for it.
+static std::chrono::milliseconds freshness(const std::string& text, int& id, std::string& command)
+{
+	std::size_t i = 0;
+	id = AllDevices;
+	while (i < text.size() && isdigit(static_cast<unsigned char>(text[i])))
+		++i;
+	if (i > 0) {
+		if (i > 3 || i + 1 >= text.size() || text[i] != 's')
+			return std::chrono::milliseconds(-1);
+		id = atoi(text.c_str());
+		++i;
+	}
+	if (i + 1 != text.size())
+		return std::chrono::milliseconds(-1);
+	command = text.substr(i);
+	switch (text[i]) {
+	case 'v': case 'V':	return voltageAge;
+	case 't':			return temperatureAge;
+	case 'f': case 'g':	return socAge;
+	}
+	return std::chrono::milliseconds(-1);
+}
+
+static void handlePacket(const ClientPtr& c, const std::string& line)
+{
+	std::string text = line;
+	if (checksums) {
+		if (!checkPacket(line))
+			return;						// As a device would, ignore a packet with a bad CRC12
+		text.resize(line.size() - 2);
+	}
+	int id;
+	std::string command;
+	std::chrono::milliseconds age = freshness(text, id, command);
+	std::unique_lock<std::mutex> lock(caching);
+	++packets;
+	if (age.count() < 0) {
+		++sent;
+		lock.unlock();
+		ClientPtr client = c;
+		chain->send(AllDevices, text, [client](std::vector<Response> answers) {
+			sendAnswers(*client, answers);
+		});
+		return;
+	}
+	Entry& e = cache[text];
+	if (e.valid && std::chrono::steady_clock::now() - e.when < age) {
+		++hits;
+		std::vector<Response> answers = e.answers;
+		lock.unlock();
+		sendAnswers(*c, answers);
+		return;
+	}
+	e.waiting.push_back(c);
+	if (e.pending) {
+		++merged;
+		return;
+	}
+	e.pending = true;
+	++sent;
+	lock.unlock();
+	chain->send(id, command, [text](std::vector<Response> answers) {
+		std::vector<ClientPtr> waiting;
+		{
+			std::lock_guard<std::mutex> lock(caching);
+			Entry& e = cache[text];
+			e.pending = false;
+			e.valid = !answers.empty();	// Don't remember that nobody answered
+			e.answers = answers;
+			e.when = std::chrono::steady_clock::now();
+			waiting.swap(e.waiting);
+		}
+		for (auto& w : waiting)
+			sendAnswers(*w, answers);
+	}, id == AllDevices ? devices : 1);
+}
+
+// A client's thread: split what it sends into packets at each CR
+static void serveClient(ClientPtr c)
+{
+	std::string line;
+	char buf[256];
+	for (;;) {
+		ssize_t n = recv(c->fd, buf, sizeof buf, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		for (ssize_t i = 0; i < n; ++i) {
+			if (buf[i] == '\r') {
+				if (!line.empty()) {
+					try {
+						handlePacket(c, line);
+					} catch (const std::system_error& e) {
+						fprintf(stderr, "%s\n", e.what());	// The serial port has gone
+						exit(1);
+					}
+				}
+				line.clear();
+			} else if (buf[i] != '\n' && line.size() < 80)
+				line += buf[i];
+		}
+	}
+	shutdown(c->fd, SHUT_RDWR);			// Closed when the last answer meant for it has gone
+}
+
+static void onStop(int)
+{
+	stopWanted = 1;
+}
+
+static void report()
+{
+	std::lock_guard<std::mutex> lock(caching);
+	Chain::Stats s = chain->stats();
+	fprintf(stderr, "%lu packets: %lu reads answered from memory, %lu joined one on its way, "
+		"%lu sent; %lu bad CRC12s from the chain\n", packets, hits, merged, sent, s.badCrcs);
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: lfproxy [-p port] [-b baud] [-s socket] [-n devices] [-V ms] [-T ms] [-S ms] [-k] [-v]\n"
+		"  -p  serial port of the BMU (default /dev/ttyUSB0)\n"
+		"  -b  baud rate (default 9600)\n"
+		"  -s  Unix socket to listen on (default /tmp/lfproxy.sock)\n"
+		"  -n  devices that answer a read to every device, so it needn't wait for them to stop\n"
+		"  -V  ms that voltages (v V) stay fresh (default 1000; 0 to never answer from memory)\n"
+		"  -T  ms that temperatures (t) stay fresh (default 5000)\n"
+		"  -S  ms that state of charge (f g) stays fresh (default 10000)\n"
+		"  -k  checksums are off ('kk')\n"
+		"  -v  report the numbers of packets, reads answered from memory, and reads sent, every minute\n"
+		"      and on exit\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	std::string portName = "/dev/ttyUSB0", socketName = "/tmp/lfproxy.sock";
+	unsigned baud = 9600;
+	for (int i = 1; i < argc; ++i) {
+		if (argv[i][0] != '-')
+			usage();
+		char opt = argv[i][1];
+		if (opt == 'k' || opt == 'v') {
+			if (opt == 'k')
+				checksums = false;
+			else
+				verbose = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+			usage();
+		const char* arg = argv[++i];
+		switch (opt) {
+		case 'p': portName = arg; break;
+		case 'b': baud = atoi(arg); break;
+		case 's': socketName = arg; break;
+		case 'n': devices = atoi(arg); break;
+		case 'V': voltageAge = std::chrono::milliseconds(atoi(arg)); break;
+		case 'T': temperatureAge = std::chrono::milliseconds(atoi(arg)); break;
+		case 'S': socAge = std::chrono::milliseconds(atoi(arg)); break;
+		default: usage();
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, onStop);
+	signal(SIGINT, onStop);
+
+	std::unique_ptr<SerialPort> port;
+	try {
+		port.reset(new SerialPort(portName, baud));
+		Chain::Options options;
+		options.checksums = checksums;
+		chain.reset(new Chain(*port, options));
+	} catch (const std::system_error& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	struct sockaddr_un sa;
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	if (socketName.size() >= sizeof sa.sun_path) {
+		fprintf(stderr, "%s is too long for a socket name\n", socketName.c_str());
+		return 1;
+	}
+	strcpy(sa.sun_path, socketName.c_str());
+	unlink(sa.sun_path);				// Left by a run that was killed
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (bind(listener, reinterpret_cast<struct sockaddr*>(&sa), sizeof sa) < 0 || listen(listener, 8) < 0) {
+		perror(socketName.c_str());
+		return 1;
+	}
+
+	auto lastReport = std::chrono::steady_clock::now();
+	while (!stopWanted) {
+		struct pollfd pfd = {listener, POLLIN, 0};
+		if (poll(&pfd, 1, 1000) > 0) {
+			int fd = accept(listener, NULL, NULL);
+			if (fd >= 0)
+				std::thread(serveClient, std::make_shared<Client>(fd)).detach();
+		}
+		if (verbose && std::chrono::steady_clock::now() - lastReport >= std::chrono::minutes(1)) {
+			lastReport = std::chrono::steady_clock::now();
+			report();
+		}
+	}
+	if (verbose)
+		report();
+	unlink(sa.sun_path);
+	_exit(0);							// Without waiting for the clients' threads
+}
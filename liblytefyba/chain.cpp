@@ -0,0 +1,369 @@
+// chain.cpp : keeps several commands in flight on the chain, and matches each answer to its command
+//
+// Written 17/Oct/2026
+//
+// Each device handles packets in the order they come, and an answer goes round the rest of the chain
+// behind the packets ahead of it, so answers to one command can arrive mixed with answers to the next.
+// An answer "\012:v 3312" belongs to the oldest command in flight that asks device 12 (or every
+// device) for 'v' and doesn't have device 12's answer yet. A packet of several commands, such as "tv"
+// or "vv", gets an answer from each device to each of them.
+
+#include "lytefyba.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace lytefyba {
+
+bool parseResponse(const std::string& line, Response& r, bool checksums)
+{
+	// "\iii:cmd value", then two CRC12 characters if checksums are on
+	std::size_t n = line.size();
+	if (n < 1 || line[0] != '\\')
+		return false;
+	if (checksums) {
+		if (!checkPacket(line))
+			return false;
+		n -= 2;
+	}
+	if (n < 8 || line[4] != ':')
+		return false;
+	r.id = 0;
+	for (std::size_t i = 1; i < 4; ++i) {
+		if (!isdigit(static_cast<unsigned char>(line[i])))
+			return false;
+		r.id = r.id * 10 + line[i] - '0';
+	}
+	if (line[5] == 'm' && n == 6 + SnapshotChars) {
+		r.command = "m";				// A snapshot, which has no space or number
+		r.value = 0;
+		r.hex = false;
+		r.text = line.substr(0, n);
+		return true;
+	}
+	std::size_t i = 5;
+	while (i < n && line[i] != ' ')
+		++i;
+	if (i == 5 || i >= n)
+		return false;
+	r.command = line.substr(5, i - 5);
+	++i;
+	bool neg = false;
+	r.hex = false;
+	if (i < n && line[i] == '-') {
+		neg = true;
+		++i;
+	} else if (i < n && line[i] == '$') {
+		r.hex = true;
+		++i;
+	}
+	if (i >= n)
+		return false;
+	r.value = 0;
+	for (; i < n; ++i) {
+		char c = line[i];
+		int d = c >= '0' && c <= '9' ? c - '0' : r.hex && c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+		if (d < 0)
+			return false;
+		r.value = r.value * (r.hex ? 16 : 10) + d;
+	}
+	if (neg)
+		r.value = -r.value;
+	r.text = line.substr(0, n);
+	return true;
+}
+
+bool parseSnapshot(const std::string& line, Snapshot& s, bool checksums)
+{
+	// 80 bits, most significant first, 6 to a character as $40 plus the bits, except 63 as '?'.
+	// Then 4 zero bits to fill the last character.
+	Response r;
+	if (!parseResponse(line, r, checksums) || r.command != "m")
+		return false;
+	unsigned char bytes[11] = {0};
+	unsigned bits = 0;
+	for (std::size_t k = 0; k < SnapshotChars; ++k) {
+		unsigned char c = line[6 + k];
+		unsigned six = c == '?' ? 63u : c & 0x3F;
+		if (c != '?' && (c & 0xC0) != 0x40)
+			return false;
+		for (int b = 5; b >= 0; --b, ++bits)
+			if (six >> b & 1)
+				bytes[bits / 8] |= 0x80 >> bits % 8;
+	}
+	auto word = [&](int k) { return bytes[k] << 8 | bytes[k+1]; };
+	s.id = r.id;
+	s.cellMv = word(0);
+	s.boltPlusMv = word(2);
+	s.boltMinusMv = static_cast<int16_t>(word(4));
+	s.ocCellV16 = word(6);
+	s.temperature = static_cast<int8_t>(bytes[8]);
+	s.status = bytes[9];
+	return true;
+}
+
+// The commands in the letters at the end of a packet, as their answers name them. By the convention
+// in common/CmdCharInterpreter.s43, a two-character command is an uppercase letter then a lowercase
+// one ("Is"); any other letter is a command by itself ("tv" is 't' then 'v').
+static std::vector<std::string> tagsOf(const std::string& command)
+{
+	std::size_t i = command.size();
+	while (i > 0 && isalpha(static_cast<unsigned char>(command[i-1])))
+		--i;
+	std::vector<std::string> tags;
+	while (i < command.size()) {
+		std::size_t n = isupper(static_cast<unsigned char>(command[i])) && i + 1 < command.size()
+			&& islower(static_cast<unsigned char>(command[i+1])) ? 2 : 1;
+		tags.push_back(command.substr(i, n));
+		i += n;
+	}
+	return tags;
+}
+
+Chain::Chain(SerialPort& port) : Chain(port, Options())
+{
+}
+
+Chain::Chain(SerialPort& port, const Options& options) : m_port(port), m_options(options)
+{
+	if (m_options.window < 1)
+		m_options.window = 1;
+	m_window = m_options.window;
+	m_thread = std::thread(&Chain::reader, this);
+}
+
+Chain::~Chain()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_thread.join();
+	// Anything still waiting gets what it has, from a queue of its own, since a callback may send
+	Queue done;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		done.swap(m_queue);
+		m_inFlight = 0;
+	}
+	for (auto& p : done)
+		p->done(std::move(p->answers));
+}
+
+void Chain::send(int id, const std::string& command, Callback done, int expect)
+{
+	auto p = std::make_shared<Pending>();
+	p->id = id;
+	p->command = id == AllDevices ? command : std::to_string(id) + "s" + command;
+	p->tags = tagsOf(command);
+	p->expect = (id == AllDevices ? expect : 1) * static_cast<int>(p->tags.size());
+	p->done = std::move(done);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_error)
+		std::rethrow_exception(m_error);
+	m_queue.push_back(p);
+	pump();
+}
+
+std::future<std::vector<Response>> Chain::query(int id, const std::string& command, int expect)
+{
+	auto promise = std::make_shared<std::promise<std::vector<Response>>>();
+	auto future = promise->get_future();
+	send(id, command, [promise](std::vector<Response> answers) {
+		promise->set_value(std::move(answers));
+	}, expect);
+	return future;
+}
+
+void Chain::drain()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_idle.wait(lock, [this] { return m_queue.empty() && m_calling == 0; });
+}
+
+Chain::Stats Chain::stats() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Stats s = m_stats;
+	s.window = m_window;
+	return s;
+}
+
+void Chain::pump()
+{
+	while (!m_error && m_inFlight < m_window && m_inFlight < m_queue.size()) {
+		Pending& p = *m_queue[m_inFlight];
+		std::string packet = m_options.checksums ? makePacket(p.command) : p.command + '\r';
+		try {
+			m_port.write(packet.data(), packet.size());
+		} catch (...) {
+			m_error = std::current_exception();
+			return;						// The reader will see the port has gone too
+		}
+		p.deadline = Clock::now() + m_options.firstTimeout;
+		++m_inFlight;
+		++m_stats.sent;
+	}
+}
+
+void Chain::onLine(const std::string& text, Queue& done)
+{
+	// Skip any noise before the answer, such as the tail of a line that was cut off
+	std::size_t start = text.find('\\');
+	if (start == std::string::npos)
+		return;							// Our own commands, coming back round the chain
+	std::string line = text.substr(start);
+	Response r;
+	if (!parseResponse(line, r, m_options.checksums)) {
+		if (m_options.checksums && !checkPacket(line)) {
+			++m_stats.badCrcs;
+			shrink();
+		}
+		return;
+	}
+	for (auto it = m_queue.begin(); it != m_queue.begin() + m_inFlight; ++it) {
+		Pending& p = **it;
+		if (p.id != AllDevices && p.id != r.id)
+			continue;
+		// As many answers from the device to this command as the packet asks for it
+		int asked = static_cast<int>(std::count(p.tags.begin(), p.tags.end(), r.command)), seen = 0;
+		for (auto& a : p.answers)
+			seen += a.id == r.id && a.command == r.command;
+		if (seen >= asked)
+			continue;
+		++m_stats.answers;
+		grow();
+		p.answers.push_back(r);
+		if (p.expect > 0 && static_cast<int>(p.answers.size()) >= p.expect)
+			finish(it, done);
+		else							// More are due, however slowly (e.g. 'Pc' in response slots)
+			p.deadline = Clock::now() + (p.expect > 0 ? m_options.firstTimeout : m_options.quietTimeout);
+		return;
+	}
+	++m_stats.unmatched;
+}
+
+void Chain::expire(Queue& done)
+{
+	if (m_error) {						// A write failed: nothing more will be sent
+		m_inFlight = m_queue.size();
+		while (!m_queue.empty())
+			finish(m_queue.begin(), done);
+		return;
+	}
+	auto now = Clock::now();
+	for (std::size_t i = 0; i < m_inFlight; )
+		if (m_queue[i]->deadline <= now) {
+			// A command to every device with no count is over when its answers stop
+			if (m_queue[i]->answers.empty() || m_queue[i]->expect > 0) {
+				++m_stats.timeouts;
+				shrink();
+			}
+			finish(m_queue.begin() + i, done);
+		} else
+			++i;
+}
+
+void Chain::finish(Queue::iterator it, Queue& done)
+{
+	done.push_back(*it);
+	m_queue.erase(it);
+	--m_inFlight;
+}
+
+// Bad and missing answers are most often bytes lost in a device whose receive queue overflowed, with
+// more packets and answers passing through it than it can echo
+void Chain::shrink()
+{
+	if (m_window > 1) {
+		m_window /= 2;
+		if (m_cleanRun < MaxCleanRun)
+			m_cleanRun *= 2;			// On a chain too long for the window, widen it less often
+	}
+	m_clean = 0;
+}
+
+// After a run of good answers, whatever spoilt them has likely passed: let one more command in flight
+void Chain::grow()
+{
+	if (++m_clean >= m_cleanRun && m_window < m_options.window) {
+		++m_window;
+		m_clean = 0;
+	}
+}
+
+void Chain::fail(std::exception_ptr error)
+{
+	Queue done;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_error)
+			m_error = error;
+		done.swap(m_queue);
+		m_inFlight = 0;
+		m_calling += done.size();
+	}
+	called(done);
+}
+
+void Chain::reader()
+{
+	std::string line;
+	char buf[64];
+	for (;;) {
+		std::chrono::milliseconds wait(100);
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_stop)
+				return;
+			auto now = Clock::now();
+			for (std::size_t i = 0; i < m_inFlight; ++i) {
+				auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+					m_queue[i]->deadline - now) + std::chrono::milliseconds(1);
+				if (left < wait)
+					wait = left;
+			}
+			if (wait.count() < 0)
+				wait = std::chrono::milliseconds(0);
+		}
+		std::size_t n;
+		try {
+			n = m_port.read(buf, sizeof buf, wait);
+		} catch (...) {
+			fail(std::current_exception());
+			return;
+		}
+		Queue done;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (std::size_t i = 0; i < n; ++i) {
+				char c = buf[i];
+				if (c == '\r') {
+					onLine(line, done);
+					line.clear();
+				} else if (c != '\n' && line.size() < 256)
+					line += c;
+			}
+			expire(done);
+			if (!done.empty())
+				pump();
+			m_calling += done.size();
+		}
+		called(done);
+	}
+}
+
+// Call back without the lock, so that callbacks can send more commands
+void Chain::called(Queue& done)
+{
+	if (done.empty())
+		return;
+	for (auto& p : done)
+		p->done(std::move(p->answers));
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_calling -= done.size();
+	if (m_queue.empty() && m_calling == 0)
+		m_idle.notify_all();
+}
+
+}	// namespace lytefyba
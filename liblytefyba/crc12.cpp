@@ -0,0 +1,102 @@
+// crc12.cpp : the CRC12 that protects every packet on the chain
+//
+// Written 17/Oct/2026
+//
+// The same CRC as common/Crc12.s43: polynomial $C16 (reversed), initial value $FFF, inverted at the
+// end. MakeCrc12Printable sends it as two characters of 6 bits each, low bits first; each has bit 6
+// set, unless it is all ones ('?'), so that it can never be a CR.
+//
+// crc12Update is for checking recorded traffic in bulk, so it uses slicing by 8, about 4 KiB of
+// tables; crc12UpdateBitwise is the firmware's algorithm, kept to check it against.
+
+#include "lytefyba.h"
+
+namespace lytefyba {
+
+unsigned crc12UpdateBitwise(unsigned crc, const void* data, std::size_t n)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	while (n--) {
+		crc ^= *p++;
+		for (int i = 0; i < 8; ++i)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xC16 : crc >> 1;
+	}
+	return crc;
+}
+
+// Slicing by 8. table[0][b] is the CRC of the one-byte message b, from a CRC of zero, as
+// VirtualCrc12Lookup returns it; table[k][b] is the CRC of b followed by k zero bytes. Eight bytes
+// then take eight lookups, one for each, with no dependency between them but the final XORs.
+// Since the CRC is only 12 bits, it only ever affects the first two bytes of each 8.
+namespace {
+
+struct Crc12Tables
+{
+	std::uint16_t table[8][256];
+
+	Crc12Tables()
+	{
+		for (unsigned b = 0; b < 256; ++b) {
+			unsigned char c = static_cast<unsigned char>(b);
+			table[0][b] = static_cast<std::uint16_t>(crc12UpdateBitwise(0, &c, 1));
+		}
+		for (int k = 1; k < 8; ++k)
+			for (unsigned b = 0; b < 256; ++b) {
+				unsigned crc = table[k-1][b];
+				table[k][b] = static_cast<std::uint16_t>((crc >> 8) ^ table[0][crc & 0xFF]);
+			}
+	}
+};
+
+const Crc12Tables& tables()
+{
+	static const Crc12Tables t;			// Built on first use; thread-safe in C++11
+	return t;
+}
+
+}	// namespace
+
+unsigned crc12Update(unsigned crc, const void* data, std::size_t n)
+{
+	const std::uint16_t (*t)[256] = tables().table;
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	crc &= 0xFFF;
+	for (; n >= 8; n -= 8, p += 8)
+		crc = t[7][(crc ^ p[0]) & 0xFF] ^ t[6][(crc >> 8) ^ p[1]] ^ t[5][p[2]] ^ t[4][p[3]] ^
+			t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+	while (n--)
+		crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+	return crc;
+}
+
+unsigned crc12(const void* data, std::size_t n)
+{
+	return crc12Update(InitialCrc12, data, n) ^ 0xFFF;
+}
+
+std::string crc12Printable(unsigned crc)
+{
+	std::string s(2, '\0');
+	for (int i = 0; i < 2; ++i) {
+		unsigned char c = (crc >> (6 * i)) & 0x3F;
+		if (c != 0x3F)
+			c |= 0x40;
+		s[i] = static_cast<char>(c);
+	}
+	return s;
+}
+
+std::string makePacket(const std::string& text)
+{
+	return text + crc12Printable(crc12(text.data(), text.size())) + '\r';
+}
+
+bool checkPacket(const std::string& line)
+{
+	if (line.size() < 3)
+		return false;
+	std::size_t n = line.size() - 2;
+	return line.compare(n, 2, crc12Printable(crc12(line.data(), n))) == 0;
+}
+
+}	// namespace lytefyba
@@ -0,0 +1,112 @@
+// lfquery.cpp : send commands to a chain of BMUs and CMUs and print their answers
+//
+// Written 17/Oct/2026
+//
+// An example of liblytefyba. Each command is sent to every device, or to one device as id:command,
+// with up to -w commands in flight at once. For example
+//	lfquery -p /dev/ttyUSB0 -r 10 v Is t 3:Pc
+// reads every device's voltage, current and temperature ten times, then device 3's program CRC12.
+// "lfquery m" reads all of every device's readings at once, as snapshots.
+
+#include "lytefyba.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <system_error>
+
+using namespace lytefyba;
+
+static void usage()
+{
+	fprintf(stderr, "Usage: lfquery [-p port] [-b baud] [-w window] [-n devices] [-r repeats] [-k] [-q]"
+		" command|id:command ...\n"
+		"  -p  serial port (default /dev/ttyUSB0)\n"
+		"  -b  baud rate (default 9600)\n"
+		"  -w  most commands in flight at once, halved by each bad or missing answer and widened again\n"
+		"      after a run of good ones (default 2; 1 waits for each command's answers)\n"
+		"  -n  answers to expect from each command to every device (default: wait for them to stop)\n"
+		"  -r  send the commands this many times (default 1)\n"
+		"  -k  checksums are off ('kk')\n"
+		"  -q  don't print the answers, only the totals\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	std::string portName = "/dev/ttyUSB0";
+	unsigned baud = 9600;
+	int expect = 0, repeats = 1;
+	bool quiet = false;
+	Chain::Options options;
+	int i;
+	for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+		char opt = argv[i][1];
+		if (opt == 'k' || opt == 'q') {
+			if (opt == 'k')
+				options.checksums = false;
+			else
+				quiet = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+			usage();
+		const char* arg = argv[++i];
+		switch (opt) {
+		case 'p': portName = arg; break;
+		case 'b': baud = atoi(arg); break;
+		case 'w': options.window = atoi(arg); break;
+		case 'n': expect = atoi(arg); break;
+		case 'r': repeats = atoi(arg); break;
+		default: usage();
+		}
+	}
+	if (i >= argc)
+		usage();
+
+	try {
+		SerialPort port(portName, baud);
+		port.flushInput();
+		Chain chain(port, options);
+		std::mutex printing;
+		unsigned long answers = 0, noAnswers = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < repeats; ++r)
+			for (int j = i; j < argc; ++j) {
+				const char* colon = strchr(argv[j], ':');
+				int id = colon ? atoi(argv[j]) : AllDevices;
+				std::string command = colon ? colon + 1 : argv[j];
+				chain.send(id, command, [&, command](std::vector<Response> got) {
+					std::lock_guard<std::mutex> lock(printing);
+					if (got.empty())
+						++noAnswers;
+					answers += got.size();
+					if (quiet)
+						return;
+					if (got.empty())
+						printf("No answer to %s\n", command.c_str());
+					for (auto& a : got) {
+						Snapshot s;
+						if (a.command == "m" && parseSnapshot(a.text, s, false))
+							printf("%3d m  v %d V %d Is %d o %u t %d p $%02X\n", s.id, s.cellMv, s.boltPlusMv,
+								s.boltMinusMv, s.ocCellV16, s.temperature, s.status);
+						else
+							printf(a.hex ? "%3d %-2s $%lX\n" : "%3d %-2s %ld\n", a.id, a.command.c_str(),
+								a.value);
+					}
+				}, expect);
+			}
+		chain.drain();
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		Chain::Stats s = chain.stats();
+		fprintf(stderr, "%lu commands, %lu answers in %.2f s (%.1f answers/s); %lu with no answer, "
+			"%lu bad CRCs, %lu unmatched; window %lu\n", s.sent, answers, secs,
+			secs > 0 ? answers / secs : 0.0, noAnswers, s.badCrcs, s.unmatched,
+			static_cast<unsigned long>(s.window));
+		return noAnswers || s.badCrcs ? 2 : 0;
+	} catch (const std::system_error& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+}
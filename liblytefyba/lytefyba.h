@@ -0,0 +1,265 @@
+// lytefyba.h : host library for talking to LyteFyba BMUs and CMUs over their serial chain
+//
+// Written 17/Oct/2026
+//
+// Crc12		The CRC12 of common/Crc12.s43, and the two printable characters that carry it in a packet
+// Modbus		Modbus/ASCII packets with their LRCs, for the ':' command, and Modbus RTU frames
+// SerialPort	A serial port on Linux, macOS or Windows, with read timeouts
+// Chain		Sends commands as packets with CRC12s, keeping several in flight at once, and hands back
+//				each device's answer, matched to its command, through a future or a callback
+//
+// At 9600 b/s, waiting for each answer before sending the next command leaves the link idle for
+// most of every round trip through the chain. Chain sends up to a window of commands ahead, so the
+// link stays busy; the devices answer in order, and every answer names its device and command.
+// See lfquery.cpp for an example.
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace lytefyba {
+
+// CRC12
+
+const unsigned InitialCrc12 = 0xFFF;
+
+// Update a CRC12 with n bytes, without the final inversion. Uses tables, 8 bytes at a time.
+unsigned crc12Update(unsigned crc, const void* data, std::size_t n);
+
+// The same, a bit at a time, as UpdateCrc12 and VirtualCrc12Lookup do it. For checking crc12Update.
+unsigned crc12UpdateBitwise(unsigned crc, const void* data, std::size_t n);
+
+// The CRC12 of n bytes, inverted at the end as MakeCrc12Printable expects
+unsigned crc12(const void* data, std::size_t n);
+
+// The two characters that carry a CRC12 at the end of a packet, low 6 bits first
+std::string crc12Printable(unsigned crc);
+
+// text with its CRC12 characters and a CR added
+std::string makePacket(const std::string& text);
+
+// Check the last two characters of line (which has no CR) against the CRC12 of the rest
+bool checkPacket(const std::string& line);
+
+
+// Modbus/ASCII, as _Modbus and TxEndOfModbusPacket in common/comDefinitions.s43 handle it
+
+const unsigned BmuModbusId = 100;				// The BMU's Modbus ID; it stands for 255
+const unsigned BroadcastModbusId = BmuModbusId - 1;
+
+// The LRC of n bytes: the negation of their sum
+unsigned char modbusLrc(const unsigned char* data, std::size_t n);
+
+// A Modbus/ASCII packet: ':', frame in hex, its LRC, CR and LF
+std::string makeModbusAscii(const std::vector<unsigned char>& frame);
+
+// Decode a Modbus/ASCII packet (without its CR) into frame, without its LRC. Returns false if it isn't
+// one, or its LRC is wrong.
+bool parseModbusAscii(const std::string& line, std::vector<unsigned char>& frame);
+
+// The read-holding-registers request the firmware understands: one register at address reg_hi:reg_lo
+// ($0020 up) is read as the one-character command reg_lo with the number reg_hi, so register $0076 is
+// 'v'. Registers $0000 up are its block of readings (v V t j p, and on the BMU f g), read count at once.
+std::string makeModbusRead(unsigned id, unsigned address, unsigned count = 1);
+
+
+// Modbus RTU, as monolith/ModbusRtu.s43 handles it on a BMU's SCU port when built with MODBUS_RTU.
+// Only the BMU (BmuModbusId) answers, with the same registers as the ':' command. A frame must follow
+// 3.5 characters of silence, and is answered once another such silence ends it.
+
+// The Modbus CRC16 of n bytes
+unsigned modbusCrc16(const unsigned char* data, std::size_t n);
+
+// A Modbus RTU frame: frame, then its CRC16, low byte first
+std::string makeModbusRtu(const std::vector<unsigned char>& frame);
+
+// Decode a whole Modbus RTU frame into frame, without its CRC16. Returns false if its CRC16 is wrong.
+bool parseModbusRtu(const std::string& bytes, std::vector<unsigned char>& frame);
+
+// The length of the response to a read that begins with these n bytes, or 0 if more are needed to tell.
+// Responses can then be picked out of a byte stream without timing the silences.
+std::size_t modbusRtuResponseLength(const unsigned char* data, std::size_t n);
+
+// The read-holding-registers request of makeModbusRead, as an RTU frame
+std::string makeModbusRtuRead(unsigned id, unsigned address, unsigned count = 1);
+
+
+// Serial port
+
+class SerialPort
+{
+public:
+	// Opens the port (a path such as /dev/ttyUSB0, or a name such as COM3) at baud, 8N1, raw.
+	// Throws std::system_error if it can't.
+	explicit SerialPort(const std::string& name, unsigned baud = 9600);
+	~SerialPort();
+	SerialPort(const SerialPort&) = delete;
+	SerialPort& operator=(const SerialPort&) = delete;
+
+	void	write(const void* data, std::size_t n);
+	// Read up to n bytes, waiting at most timeout for the first. Returns 0 on timeout.
+	std::size_t read(void* data, std::size_t n, std::chrono::milliseconds timeout);
+	void	setBaud(unsigned baud);
+	void	flushInput();
+	const std::string& name() const { return m_name; }
+
+private:
+	std::string	m_name;
+#ifdef _WIN32
+	void*		m_handle;
+#else
+	int			m_fd;
+#endif
+};
+
+
+// Answers
+
+const int AllDevices = -1;		// For commands that go to every device
+const int BmuId = 255;
+
+// One answer, as _prettyPrint sends it: "\012:v 3312", then a CRC12 and a CR
+struct Response
+{
+	int			id;				// Device ID; 255 for a BMU
+	std::string	command;		// The command characters, such as "v" or "Is"
+	long		value;			// The number
+	bool		hex;			// True if it was sent in hex ('$')
+	std::string	text;			// The whole line, without its CRC12
+};
+
+// Parse an answer line (without its CR). Returns false if it isn't one, or its CRC12 is wrong.
+// A snapshot ('m') parses with value 0; give its text to parseSnapshot.
+bool parseResponse(const std::string& line, Response& r, bool checksums = true);
+
+// All of a device's readings in one answer, as the 'm' command in monolith/monoDefinitions.s43 sends
+// them: "\012:m", 14 characters of 6 bits each, then a CRC12 and a CR. A third of the characters of
+// v V Is o t p sent separately.
+struct Snapshot
+{
+	int			id;
+	int			cellMv;			// 'v'
+	int			boltPlusMv;		// 'V'
+	int			boltMinusMv;	// 'Is': bolt- voltage, or shunt voltage x20, in millivolts; 9999 if not valid
+	unsigned	ocCellV16;		// 'o': filtered open circuit cell voltage in 1/16ths of a millivolt
+	int			temperature;	// 't': degrees Celsius
+	unsigned	status;			// 'p'
+};
+
+const std::size_t SnapshotChars = 14;
+
+// Decode a snapshot line (without its CR). Returns false if it isn't one, or its CRC12 is wrong.
+bool parseSnapshot(const std::string& line, Snapshot& s, bool checksums = true);
+
+
+// The chain
+
+class Chain
+{
+public:
+	typedef std::function<void(std::vector<Response>)> Callback;
+
+	struct Options
+	{
+		std::size_t	window = 2;							// Most commands in flight at once. Too
+														//	many can overrun the devices' serial
+														//	buffers on a long chain, so each bad or
+														//	missing answer halves it, down to 1, and
+														//	each run of good answers lets one more
+														//	back in, up to this. The run starts at
+														//	32 answers, and each loss doubles it, up
+														//	to 4096.
+		std::chrono::milliseconds firstTimeout{2000};	// Longest wait for a command's first answer,
+														//	or for each of the answers it expects
+		std::chrono::milliseconds quietTimeout{300};	// A command to all devices is over when no
+														//	answer comes for this long
+		bool		checksums = true;					// False if checksums are off ('kk')
+	};
+
+	explicit Chain(SerialPort& port);
+	Chain(SerialPort& port, const Options& options);
+	~Chain();
+	Chain(const Chain&) = delete;
+	Chain& operator=(const Chain&) = delete;
+
+	// Send command (such as "v", "Is" or "Pc") to device id, or to AllDevices. done is called, on the
+	// chain's reader thread, with the answers: one for a device; for all devices, expect of them if
+	// expect > 0, else as many as come before the chain goes quiet. An empty vector means no answer.
+	// Answers are matched to it by device ID and by the commands in the letters at the end of command;
+	// with several ("tv"), each device answers each, and expect counts devices.
+	void	send(int id, const std::string& command, Callback done, int expect = 0);
+	// The same, with the answers through a future
+	std::future<std::vector<Response>> query(int id, const std::string& command, int expect = 0);
+
+	// Wait until every command sent so far has been answered or has timed out, and its callback has
+	// returned. Not from a callback.
+	void	drain();
+
+	// If the port fails, every command still waiting gets what answers it has, and send rethrows
+	// the port's std::system_error
+
+	// Counts since the chain was made
+	struct Stats
+	{
+		unsigned long sent = 0, answers = 0, badCrcs = 0, unmatched = 0, timeouts = 0;
+		std::size_t	window = 0;					// Commands allowed in flight now
+	};
+	Stats	stats() const;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Pending
+	{
+		int			id;
+		std::string	command;		// As sent, after any select prefix
+		std::vector<std::string> tags;	// The commands, by the characters their answers carry
+		int			expect;
+		Callback	done;
+		std::vector<Response> answers;
+		Clock::time_point deadline;
+	};
+
+	typedef std::deque<std::shared_ptr<Pending>> Queue;
+
+	void	reader();
+	void	pump();						// Send queued commands while the window has room. Lock held.
+	void	onLine(const std::string& line, Queue& done);
+	void	expire(Queue& done);
+	void	finish(Queue::iterator it, Queue& done);
+	void	fail(std::exception_ptr error);
+	void	shrink();					// An answer was lost or spoilt: halve the window. Lock held.
+	void	grow();						// An answer came: widen the window after a clean run. Lock held.
+
+	static const unsigned CleanRun = 32, MaxCleanRun = 4096;
+	void	called(Queue& done);
+
+	SerialPort&	m_port;
+	Options		m_options;
+	mutable std::mutex m_mutex;
+	std::condition_variable m_idle;
+	Queue		m_queue;					// Oldest first; the first m_inFlight have been sent
+	std::size_t	m_inFlight = 0;
+	std::size_t	m_window;					// Options' window, halved by each lost answer
+	unsigned	m_clean = 0;				// Good answers since the window last changed
+	unsigned	m_cleanRun = CleanRun;		// Good answers it takes to widen it
+	std::size_t	m_calling = 0;				// Finished commands whose callbacks haven't returned
+	Stats		m_stats;
+	bool		m_stop = false;
+	std::exception_ptr m_error;
+	std::thread	m_thread;
+};
+
+}	// namespace lytefyba
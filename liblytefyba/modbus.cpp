@@ -0,0 +1,119 @@
+// modbus.cpp : Modbus/ASCII packets, for the ':' command in common/comDefinitions.s43, and Modbus RTU
+// frames, for monolith/ModbusRtu.s43
+//
+// Written 17/Oct/2026
+
+#include "lytefyba.h"
+
+namespace lytefyba {
+
+static const char hexDigits[] = "0123456789ABCDEF";
+
+static int hexValue(char c)
+{
+	return c >= '0' && c <= '9' ? c - '0' : c >= 'A' && c <= 'F' ? c - 'A' + 10 :
+		c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+unsigned char modbusLrc(const unsigned char* data, std::size_t n)
+{
+	unsigned char sum = 0;
+	while (n--)
+		sum += *data++;
+	return static_cast<unsigned char>(-sum);
+}
+
+std::string makeModbusAscii(const std::vector<unsigned char>& frame)
+{
+	std::string s(1, ':');
+	std::vector<unsigned char> all(frame);
+	all.push_back(modbusLrc(frame.data(), frame.size()));
+	for (unsigned char b : all) {
+		s += hexDigits[b >> 4];
+		s += hexDigits[b & 0xF];
+	}
+	return s + "\r\n";
+}
+
+bool parseModbusAscii(const std::string& line, std::vector<unsigned char>& frame)
+{
+	// The LF after the last CR may still be at the start
+	std::size_t start = line.find(':');
+	if (start == std::string::npos || (line.size() - start) % 2 != 1 || line.size() - start < 5)
+		return false;
+	frame.clear();
+	for (std::size_t i = start + 1; i < line.size(); i += 2) {
+		int hi = hexValue(line[i]), lo = hexValue(line[i+1]);
+		if (hi < 0 || lo < 0)
+			return false;
+		frame.push_back(static_cast<unsigned char>(hi << 4 | lo));
+	}
+	if (modbusLrc(frame.data(), frame.size()) != 0)
+		return false;					// The sum, with the LRC, should be zero
+	frame.pop_back();
+	return true;
+}
+
+static std::vector<unsigned char> readFrame(unsigned id, unsigned address, unsigned count)
+{
+	std::vector<unsigned char> frame;
+	frame.push_back(static_cast<unsigned char>(id));
+	frame.push_back(3);					// Read holding registers
+	frame.push_back(static_cast<unsigned char>(address >> 8));
+	frame.push_back(static_cast<unsigned char>(address));
+	frame.push_back(static_cast<unsigned char>(count >> 8));
+	frame.push_back(static_cast<unsigned char>(count));
+	return frame;
+}
+
+std::string makeModbusRead(unsigned id, unsigned address, unsigned count)
+{
+	return makeModbusAscii(readFrame(id, address, count));
+}
+
+unsigned modbusCrc16(const unsigned char* data, std::size_t n)
+{
+	unsigned crc = 0xFFFF;
+	while (n--) {
+		crc ^= *data++;
+		for (int i = 0; i < 8; ++i)
+			crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+	return crc;
+}
+
+std::string makeModbusRtu(const std::vector<unsigned char>& frame)
+{
+	std::string s(frame.begin(), frame.end());
+	unsigned crc = modbusCrc16(frame.data(), frame.size());
+	s += static_cast<char>(crc & 0xFF);
+	s += static_cast<char>(crc >> 8);
+	return s;
+}
+
+bool parseModbusRtu(const std::string& bytes, std::vector<unsigned char>& frame)
+{
+	if (bytes.size() < 4)
+		return false;
+	frame.assign(bytes.begin(), bytes.end());
+	if (modbusCrc16(frame.data(), frame.size()) != 0)
+		return false;					// The CRC16 of a frame with its CRC16 is zero
+	frame.resize(frame.size() - 2);
+	return true;
+}
+
+std::size_t modbusRtuResponseLength(const unsigned char* data, std::size_t n)
+{
+	if (n >= 2 && data[1] & 0x80)
+		return 5;						// <id> <function | $80> <exception code> <CRC16>
+	if (n < 3)
+		return 0;
+	return 5 + data[2];					// <id> <function> <byte count> <data> <CRC16>
+}
+
+std::string makeModbusRtuRead(unsigned id, unsigned address, unsigned count)
+{
+	return makeModbusRtu(readFrame(id, address, count));
+}
+
+}	// namespace lytefyba
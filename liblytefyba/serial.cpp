@@ -0,0 +1,226 @@
+// serial.cpp : a serial port with read timeouts, for Windows and for Linux and macOS
+//
+// Written 17/Oct/2026
+
+#include "lytefyba.h"
+
+#include <system_error>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+namespace lytefyba {
+
+#ifdef _WIN32
+
+static void fail(const std::string& what)
+{
+	throw std::system_error(static_cast<int>(GetLastError()), std::system_category(), what);
+}
+
+SerialPort::SerialPort(const std::string& name, unsigned baud) : m_name(name)
+{
+	// COM10 and above can only be opened by their device names
+	std::string path = name.compare(0, 4, "\\\\.\\") == 0 ? name : "\\\\.\\" + name;
+	m_handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if (m_handle == INVALID_HANDLE_VALUE)
+		fail("Can't open " + name);
+	DCB dcb = {0};
+	dcb.DCBlength = sizeof dcb;
+	if (!GetCommState(m_handle, &dcb)) {
+		CloseHandle(m_handle);
+		fail("Can't get the settings of " + name);
+	}
+	dcb.fBinary = TRUE;
+	dcb.fParity = FALSE;
+	dcb.fOutxCtsFlow = FALSE;
+	dcb.fOutxDsrFlow = FALSE;
+	dcb.fDtrControl = DTR_CONTROL_ENABLE;
+	dcb.fDsrSensitivity = FALSE;
+	dcb.fOutX = FALSE;					// XON and XOFF pass through, as data
+	dcb.fInX = FALSE;
+	dcb.fNull = FALSE;
+	dcb.fRtsControl = RTS_CONTROL_ENABLE;
+	dcb.fAbortOnError = FALSE;
+	dcb.ByteSize = 8;
+	dcb.Parity = NOPARITY;
+	dcb.StopBits = ONESTOPBIT;
+	dcb.BaudRate = baud;
+	if (!SetCommState(m_handle, &dcb)) {
+		CloseHandle(m_handle);
+		fail("Can't set up " + name);
+	}
+	PurgeComm(m_handle, PURGE_RXCLEAR | PURGE_TXCLEAR);
+}
+
+SerialPort::~SerialPort()
+{
+	CloseHandle(m_handle);
+}
+
+void SerialPort::write(const void* data, std::size_t n)
+{
+	const char* p = static_cast<const char*>(data);
+	while (n) {
+		DWORD done;
+		if (!WriteFile(m_handle, p, static_cast<DWORD>(n), &done, NULL))
+			fail("Can't write to " + m_name);
+		p += done;
+		n -= done;
+	}
+}
+
+std::size_t SerialPort::read(void* data, std::size_t n, std::chrono::milliseconds timeout)
+{
+	// Return as soon as there is a byte, or after timeout if none comes
+	COMMTIMEOUTS t = {0};
+	t.ReadIntervalTimeout = MAXDWORD;
+	t.ReadTotalTimeoutMultiplier = MAXDWORD;
+	t.ReadTotalTimeoutConstant = timeout.count() > 0 ? static_cast<DWORD>(timeout.count()) : 1;
+	if (!SetCommTimeouts(m_handle, &t))
+		fail("Can't set the timeouts of " + m_name);
+	DWORD done;
+	if (!ReadFile(m_handle, data, static_cast<DWORD>(n), &done, NULL))
+		fail("Can't read from " + m_name);
+	return done;
+}
+
+void SerialPort::setBaud(unsigned baud)
+{
+	DCB dcb = {0};
+	dcb.DCBlength = sizeof dcb;
+	if (!GetCommState(m_handle, &dcb))
+		fail("Can't get the settings of " + m_name);
+	dcb.BaudRate = baud;
+	if (!SetCommState(m_handle, &dcb))
+		fail("Can't set the baud rate of " + m_name);
+}
+
+void SerialPort::flushInput()
+{
+	PurgeComm(m_handle, PURGE_RXCLEAR);
+}
+
+#else
+
+static void fail(const std::string& what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+static speed_t speedOf(unsigned baud)
+{
+	switch (baud) {
+	case 1200:		return B1200;
+	case 2400:		return B2400;
+	case 4800:		return B4800;
+	case 9600:		return B9600;
+	case 19200:		return B19200;
+	case 38400:		return B38400;
+	case 57600:		return B57600;
+	case 115200:	return B115200;
+	case 230400:	return B230400;
+	}
+	errno = EINVAL;
+	fail("Can't use " + std::to_string(baud) + " b/s");
+	return B0;
+}
+
+SerialPort::SerialPort(const std::string& name, unsigned baud) : m_name(name)
+{
+	m_fd = open(name.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (m_fd < 0)
+		fail("Can't open " + name);
+	struct termios config;
+	if (tcgetattr(m_fd, &config) < 0) {
+		int e = errno;
+		close(m_fd);
+		errno = e;
+		fail(name + " is not a serial port");
+	}
+	cfmakeraw(&config);					// 8 bits, no parity, no processing; XON and XOFF pass through
+	config.c_cflag &= ~CSTOPB;
+	config.c_cflag |= CLOCAL | CREAD;
+	config.c_cc[VMIN] = 1;
+	config.c_cc[VTIME] = 0;
+	if (tcsetattr(m_fd, TCSAFLUSH, &config) < 0) {
+		int e = errno;
+		close(m_fd);
+		errno = e;
+		fail("Can't set up " + name);
+	}
+	try {
+		setBaud(baud);
+	} catch (...) {
+		close(m_fd);
+		throw;
+	}
+}
+
+SerialPort::~SerialPort()
+{
+	close(m_fd);
+}
+
+void SerialPort::write(const void* data, std::size_t n)
+{
+	const char* p = static_cast<const char*>(data);
+	while (n) {
+		ssize_t r = ::write(m_fd, p, n);
+		if (r > 0) {
+			p += r;
+			n -= r;
+		} else if (r < 0 && errno != EAGAIN && errno != EINTR)
+			fail("Can't write to " + m_name);
+		else {
+			struct pollfd pfd = {m_fd, POLLOUT, 0};
+			poll(&pfd, 1, 1000);
+		}
+	}
+}
+
+std::size_t SerialPort::read(void* data, std::size_t n, std::chrono::milliseconds timeout)
+{
+	struct pollfd pfd = {m_fd, POLLIN, 0};
+	int r = poll(&pfd, 1, static_cast<int>(timeout.count()));
+	if (r < 0 && errno != EINTR)
+		fail("Can't wait for " + m_name);
+	if (r <= 0)
+		return 0;
+	ssize_t got = ::read(m_fd, data, n);
+	if (got < 0 && errno != EAGAIN && errno != EINTR)
+		fail("Can't read from " + m_name);
+	if (got == 0 && (pfd.revents & (POLLHUP | POLLERR))) {
+		errno = EIO;					// A USB adapter unplugged, say
+		fail(m_name + " went away");
+	}
+	return got > 0 ? static_cast<std::size_t>(got) : 0;
+}
+
+void SerialPort::setBaud(unsigned baud)
+{
+	struct termios config;
+	speed_t speed = speedOf(baud);
+	if (tcgetattr(m_fd, &config) < 0)
+		fail("Can't get the settings of " + m_name);
+	cfsetispeed(&config, speed);
+	cfsetospeed(&config, speed);
+	if (tcsetattr(m_fd, TCSADRAIN, &config) < 0)
+		fail("Can't set the baud rate of " + m_name);
+}
+
+void SerialPort::flushInput()
+{
+	tcflush(m_fd, TCIFLUSH);
+}
+
+#endif
+
+}	// namespace lytefyba
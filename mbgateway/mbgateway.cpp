@@ -0,0 +1,443 @@
+// mbgateway.cpp : a Modbus TCP gateway to the BMU's Modbus/ASCII ':' command
+//
+// Written 17/Oct/2026
+//
+// Listens on a TCP port for Modbus TCP clients such as SCADA systems, and turns their read-register
+// requests (function 3 or 4) into Modbus/ASCII packets on the serial port; see _Modbus in
+// common/comDefinitions.s43. From $0020 up, the register address is a command character in its low
+// byte and that command's number in its high byte, so register $0076 is 'v'. Those are read one at a
+// time, as RtuAnswer in monolith/ModbusRtu.s43 insists, and only for commands that just answer (see
+// ReadOnly); a read of any other would run the command, e.g. $0055 'U' unlivens the device. Registers
+// $0000 to $0004 are the firmware's block of readings (v V t j p, and on the BMU f g at $0005 and
+// $0006), which one packet reads several of. Anything else gets exception 2. The unit ID is the
+// device's Modbus ID: its own ID for a CMU, 100 for the BMU.
+//
+// Any number of clients can connect, and each can have several requests outstanding. The serial link
+// serves them in turn, one packet each, so a client reading many registers can't hold up the others.
+// A packet that gets no answer gives exception 11 (gateway target failed to respond).
+//
+// With -r, reads from the BMU go as Modbus RTU frames, which take half the time of Modbus/ASCII
+// packets; the BMU must be built with MODBUS_RTU (see monolith/ModbusRtu.s43). CMUs can only be read
+// with Modbus/ASCII, through the chain.
+//
+// Usage: mbgateway [-p port] [-b baud] [-l TCP port] [-a address] [-t timeout ms] [-q queue] [-r] [-v]
+// Linux and macOS.
+
+#include "../liblytefyba/lytefyba.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <system_error>
+
+using namespace lytefyba;
+
+enum
+{
+	ILLEGAL_FUNCTION = 1,
+	ILLEGAL_DATA_ADDRESS = 2,
+	ILLEGAL_DATA_VALUE = 3,
+	SERVER_BUSY = 6,
+	TARGET_FAILED = 11
+};
+
+const unsigned MaxRegisters = 125;		// The most one Modbus read may ask for
+const unsigned BlockEnd = 0x20;			// Registers below this are the block of readings
+const unsigned CmuRegs = 5, BmuRegs = 7;	// ModbusCmuRegs and ModbusBmuRegs in comDefinitions.s43
+// The commands above the block that only answer: readings, calibration, worst stress, capacity and
+// revisions
+const char ReadOnly[] = "vVtjpfgHOWrq@#";
+
+struct Request
+{
+	unsigned	transaction;
+	unsigned	unit;
+	unsigned	function;
+	unsigned	address;
+	unsigned	count;
+	std::vector<unsigned> values;		// Registers read so far
+};
+
+struct Client
+{
+	int			fd;
+	std::string	name;
+	std::mutex	writing;				// The reader answers errors; the serial thread answers reads
+	std::deque<Request> requests;		// Guarded by the scheduler's lock
+	bool		gone = false;
+
+	~Client() { close(fd); }			// Not before the serial thread has finished answering it
+};
+
+static unsigned timeoutMs = 1000;
+static std::size_t maxQueue = 16;
+static bool verbose;
+static bool rtu;
+
+// The scheduler: every client with requests waiting, served in turn
+static std::mutex scheduling;
+static std::condition_variable work;
+static std::list<std::shared_ptr<Client>> clients;
+static std::list<std::shared_ptr<Client>>::iterator nextClient = clients.end();
+
+static void logMsg(const char* format, ...)
+{
+	va_list args;
+	if (!verbose)
+		return;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+// Send a Modbus TCP response: the MBAP header, then pdu
+static void respond(Client& c, const Request& r, const std::vector<unsigned char>& pdu)
+{
+	std::vector<unsigned char> adu;
+	adu.push_back(static_cast<unsigned char>(r.transaction >> 8));
+	adu.push_back(static_cast<unsigned char>(r.transaction));
+	adu.push_back(0);					// Protocol ID
+	adu.push_back(0);
+	adu.push_back(static_cast<unsigned char>((pdu.size() + 1) >> 8));
+	adu.push_back(static_cast<unsigned char>(pdu.size() + 1));
+	adu.push_back(static_cast<unsigned char>(r.unit));
+	adu.insert(adu.end(), pdu.begin(), pdu.end());
+	std::lock_guard<std::mutex> lock(c.writing);
+	std::size_t done = 0;
+	while (done < adu.size()) {
+		ssize_t n = send(c.fd, adu.data() + done, adu.size() - done, MSG_NOSIGNAL);
+		if (n <= 0 && errno != EINTR)
+			return;						// The client has gone; its reader will notice
+		if (n > 0)
+			done += n;
+	}
+}
+
+static void exception(Client& c, const Request& r, unsigned code)
+{
+	std::vector<unsigned char> pdu;
+	pdu.push_back(static_cast<unsigned char>(r.function | 0x80));
+	pdu.push_back(static_cast<unsigned char>(code));
+	respond(c, r, pdu);
+}
+
+// Read count registers from the BMU with one Modbus RTU frame, appending them to values. Returns false
+// if it doesn't answer in time.
+static bool readRtu(SerialPort& port, unsigned address, unsigned count, std::vector<unsigned>& values)
+{
+	// The BMU only takes a frame that follows 3.5 characters of silence
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	port.flushInput();
+	std::string packet = makeModbusRtuRead(BmuModbusId, address, count);
+	port.write(packet.data(), packet.size());
+	auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+	std::string got;
+	char buf[64];
+	for (;;) {
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(until -
+			std::chrono::steady_clock::now());
+		if (left.count() <= 0)
+			return false;
+		std::size_t n = port.read(buf, sizeof buf, left);
+		for (std::size_t i = 0; i < n; ++i) {
+			if (got.empty() && static_cast<unsigned char>(buf[i]) != BmuModbusId)
+				continue;				// Not the start of the response; perhaps a CMU's status byte
+			got += buf[i];
+			std::size_t length = modbusRtuResponseLength(
+				reinterpret_cast<const unsigned char*>(got.data()), got.size());
+			if (length == 0 || got.size() < length)
+				continue;
+			std::vector<unsigned char> f;
+			if (parseModbusRtu(got, f) && f.size() == 3 + 2 * count && f[2] == 2 * count) {
+				for (unsigned k = 0; k < count; ++k)
+					values.push_back(f[3 + 2*k] << 8 | f[4 + 2*k]);
+				return true;
+			}
+			got.erase(0, 1);			// Look for the start again, one byte on
+			while (!got.empty() && static_cast<unsigned char>(got[0]) != BmuModbusId)
+				got.erase(0, 1);
+		}
+	}
+}
+
+// Read count registers over the serial link with one packet, appending them to values. Returns false
+// if no device answers in time.
+static bool readRegisters(SerialPort& port, unsigned unit, unsigned address, unsigned count,
+	std::vector<unsigned>& values)
+{
+	if (rtu && unit == BmuModbusId)
+		return readRtu(port, address, count, values);
+	port.flushInput();					// Drop anything late from a read that timed out
+	std::string packet = makeModbusRead(unit, address, count);
+	port.write(packet.data(), packet.size());
+	auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+	std::string line;
+	char buf[64];
+	for (;;) {
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(until -
+			std::chrono::steady_clock::now());
+		if (left.count() <= 0)
+			return false;
+		std::size_t n = port.read(buf, sizeof buf, left);
+		for (std::size_t i = 0; i < n; ++i) {
+			if (buf[i] != '\r') {
+				if (buf[i] != '\n' && line.size() < 80)
+					line += buf[i];
+				continue;
+			}
+			// ":<id><fc><2 * count><values>", after its LRC is checked and removed. Our own packet
+			// may come back round the chain too, but it is 6 bytes, and a response is always odd.
+			std::vector<unsigned char> f;
+			if (parseModbusAscii(line, f) && f.size() == 3 + 2 * count && f[0] == unit &&
+					f[2] == 2 * count) {
+				for (unsigned k = 0; k < count; ++k)
+					values.push_back(f[3 + 2*k] << 8 | f[4 + 2*k]);
+				return true;
+			}
+			line.clear();
+		}
+	}
+}
+
+// The serial thread: take one packet's worth of registers from each client with requests waiting, in
+// turn
+static void serveSerial(SerialPort& port)
+{
+	for (;;) {
+		std::shared_ptr<Client> c;
+		Request r;
+		{
+			std::unique_lock<std::mutex> lock(scheduling);
+			for (;;) {
+				// Round robin from the client after the one served last
+				for (std::size_t k = 0; k < clients.size() && !c; ++k) {
+					if (nextClient == clients.end())
+						nextClient = clients.begin();
+					auto it = nextClient++;
+					if (!(*it)->requests.empty())
+						c = *it;
+				}
+				if (c)
+					break;
+				work.wait(lock);
+			}
+			r = c->requests.front();
+		}
+		unsigned address = r.address + r.values.size(), count = 1;
+		if (address < BlockEnd)			// The rest of the request in the block, in one packet
+			count = r.count - static_cast<unsigned>(r.values.size());
+		std::vector<unsigned> values;
+		bool ok = readRegisters(port, r.unit, address, count, values);
+		std::unique_lock<std::mutex> lock(scheduling);
+		if (c->gone || c->requests.empty())
+			continue;
+		Request& q = c->requests.front();
+		if (!ok) {
+			Request done = q;
+			c->requests.pop_front();
+			lock.unlock();
+			logMsg("No answer from unit %u for register $%04X\n", r.unit, address);
+			exception(*c, done, TARGET_FAILED);
+			continue;
+		}
+		q.values.insert(q.values.end(), values.begin(), values.end());
+		if (q.values.size() < q.count)
+			continue;
+		Request done = q;
+		c->requests.pop_front();
+		lock.unlock();
+		std::vector<unsigned char> pdu;
+		pdu.push_back(static_cast<unsigned char>(done.function));
+		pdu.push_back(static_cast<unsigned char>(2 * done.count));
+		for (unsigned v : done.values) {
+			pdu.push_back(static_cast<unsigned char>(v >> 8));
+			pdu.push_back(static_cast<unsigned char>(v));
+		}
+		respond(*c, done, pdu);
+	}
+}
+
+static bool readAll(int fd, unsigned char* p, std::size_t n)
+{
+	while (n) {
+		ssize_t r = recv(fd, p, n, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		p += r;
+		n -= r;
+	}
+	return true;
+}
+
+// A client's thread: read its requests and queue them for the serial thread
+static void serveClient(std::shared_ptr<Client> c)
+{
+	unsigned char hdr[7], pdu[260];
+	while (readAll(c->fd, hdr, sizeof hdr)) {
+		unsigned length = hdr[4] << 8 | hdr[5];
+		if (hdr[2] != 0 || hdr[3] != 0 || length < 2 || length - 1 > sizeof pdu)
+			break;						// Not Modbus TCP
+		if (!readAll(c->fd, pdu, length - 1))
+			break;
+		Request r;
+		r.transaction = hdr[0] << 8 | hdr[1];
+		r.unit = hdr[6];
+		r.function = pdu[0];
+		if (r.function != 3 && r.function != 4) {
+			exception(*c, r, ILLEGAL_FUNCTION);
+			continue;
+		}
+		if (length - 1 != 5) {
+			exception(*c, r, ILLEGAL_DATA_VALUE);
+			continue;
+		}
+		r.address = pdu[1] << 8 | pdu[2];
+		r.count = pdu[3] << 8 | pdu[4];
+		if (r.count < 1 || r.count > MaxRegisters) {
+			exception(*c, r, ILLEGAL_DATA_VALUE);
+			continue;
+		}
+		if (r.address < BlockEnd ? r.address + r.count > (r.unit == BmuModbusId ? BmuRegs : CmuRegs) :
+				r.count != 1 || !(r.address & 0xFF) || !strchr(ReadOnly, r.address & 0xFF)) {
+			exception(*c, r, ILLEGAL_DATA_ADDRESS);
+			continue;
+		}
+		if (r.unit == BroadcastModbusId || r.unit == 0) {
+			exception(*c, r, ILLEGAL_DATA_VALUE);	// A read can't have more than one answer
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(scheduling);
+		if (c->requests.size() >= maxQueue) {
+			lock.unlock();
+			exception(*c, r, SERVER_BUSY);
+			continue;
+		}
+		c->requests.push_back(r);
+		work.notify_one();
+	}
+	logMsg("%s disconnected\n", c->name.c_str());
+	std::lock_guard<std::mutex> lock(scheduling);
+	c->gone = true;
+	c->requests.clear();
+	for (auto it = clients.begin(); it != clients.end(); ++it)
+		if (*it == c) {
+			if (nextClient == it)
+				++nextClient;
+			clients.erase(it);
+			break;
+		}
+	shutdown(c->fd, SHUT_RDWR);			// Closed when the serial thread lets go of it
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: mbgateway [-p port] [-b baud] [-l TCP port] [-a address] [-t timeout] [-q queue] [-r] [-v]\n"
+		"  -p  serial port of the BMU (default /dev/ttyUSB0)\n"
+		"  -b  baud rate (default 9600)\n"
+		"  -l  TCP port to listen on (default 502)\n"
+		"  -a  address to listen on (default 127.0.0.1; 0.0.0.0 for every interface)\n"
+		"  -t  ms to wait for each register (default 1000)\n"
+		"  -q  most requests waiting from one client before it gets exception 6, busy (default 16)\n"
+		"  -r  read the BMU with Modbus RTU frames (it needs MODBUS_RTU)\n"
+		"  -v  report connections and registers with no answer\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	std::string portName = "/dev/ttyUSB0", address = "127.0.0.1";
+	unsigned baud = 9600, tcpPort = 502;
+	for (int i = 1; i < argc; ++i) {
+		if (argv[i][0] != '-')
+			usage();
+		if (argv[i][1] == 'v') {
+			verbose = true;
+			continue;
+		}
+		if (argv[i][1] == 'r') {
+			rtu = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+			usage();
+		const char* arg = argv[++i];
+		switch (argv[i-1][1]) {
+		case 'p': portName = arg; break;
+		case 'b': baud = atoi(arg); break;
+		case 'l': tcpPort = atoi(arg); break;
+		case 'a': address = arg; break;
+		case 't': timeoutMs = atoi(arg); break;
+		case 'q': maxQueue = atoi(arg); break;
+		default: usage();
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	std::unique_ptr<SerialPort> port;
+	try {
+		port.reset(new SerialPort(portName, baud));
+	} catch (const std::system_error& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof sa);
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(tcpPort);
+	if (inet_pton(AF_INET, address.c_str(), &sa.sin_addr) != 1) {
+		fprintf(stderr, "Can't listen on %s\n", address.c_str());
+		return 1;
+	}
+	if (bind(listener, reinterpret_cast<struct sockaddr*>(&sa), sizeof sa) < 0 || listen(listener, 8) < 0) {
+		perror("Can't listen");
+		return 1;
+	}
+
+	std::thread([&port] {
+		try {
+			serveSerial(*port);
+		} catch (const std::system_error& e) {
+			fprintf(stderr, "%s\n", e.what());
+			exit(1);
+		}
+	}).detach();
+
+	for (;;) {
+		struct sockaddr_in from;
+		socklen_t len = sizeof from;
+		int fd = accept(listener, reinterpret_cast<struct sockaddr*>(&from), &len);
+		if (fd < 0) {
+			if (errno != EINTR)
+				perror("accept");
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+		auto c = std::make_shared<Client>();
+		c->fd = fd;
+		char name[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &from.sin_addr, name, sizeof name);
+		c->name = std::string(name) + ":" + std::to_string(ntohs(from.sin_port));
+		logMsg("%s connected\n", c->name.c_str());
+		{
+			std::lock_guard<std::mutex> lock(scheduling);
+			clients.push_back(c);
+		}
+		std::thread(serveClient, c).detach();
+	}
+}
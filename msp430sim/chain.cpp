@@ -0,0 +1,264 @@
+// chain.cpp : a string of simulated devices wired as our packs are, run in lockstep on several host threads
+//
+// Written 17/Oct/2026
+
+#include "chain.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace msp430 {
+
+// A number in [-1, 1) from the seed and the device, the same on every host (splitmix64)
+static double spread(uint32_t seed, size_t i)
+{
+	uint64_t z = seed + (i + 1) * 0x9E3779B97F4A7C15ull;
+	z = (z ^ z >> 30) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ z >> 27) * 0x94D049BB133111EBull;
+	z ^= z >> 31;
+	return static_cast<double>(z >> 11) / (1ull << 52) - 1;
+}
+
+Chain::Chain(const Config& config, const uint8_t* memory)
+	: m_config(config), m_generation(0), m_running(0)
+{
+	size_t n = config.cmus + (config.bmu ? 1 : 0);
+	for (size_t i = 0; i < n; ++i) {
+		m_nodes.emplace_back(new Mcu);
+		memcpy(m_nodes.back()->memory(), memory, 0x10000);
+		m_ppm.push_back(config.ppm + config.tolerance * spread(config.seed, i));
+		m_nodes.back()->setCrystalPpm(m_ppm.back());
+	}
+
+	// The CMU ports, in a ring through the BMU or a string from the host back to it
+	m_links.reserve(n + 1);
+	for (size_t i = 0; i < n; ++i)
+		link(i, 1, 2, false, i + 1 < n ? static_cast<int>(i + 1) : config.bmu ? 0 : -1, 1, 1);
+	if (config.bmu)
+		link(0, 3, 5, true, -1, 0, 0);
+	m_hostPort = config.bmu ? 3 : 1;
+	m_hostBit = config.bmu ? 0 : 1;
+	for (size_t i = 0; i < n; ++i) {
+		bool scu = i == 0 && config.bmu;
+		m_nodes[i]->resetOnLow(scu ? 3 : 1, scu ? 0 : 1);
+	}
+
+	unsigned threads = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(config.threads, n)));
+	for (unsigned share = 1; share < threads; ++share)
+		m_threads.emplace_back(&Chain::worker, this, share);
+}
+
+Chain::~Chain()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+		++m_generation;
+	}
+	m_wake.notify_all();
+	for (std::thread& t : m_threads)
+		t.join();
+}
+
+// Collect the edges on a transmit pin, inverted back to the line's levels, for the exchange to pass on
+void Chain::link(size_t from, int fromPort, int fromBit, bool inverted, int to, int toPort, int toBit)
+{
+	size_t l = m_links.size();
+	m_links.push_back(Link());
+	Link& k = m_links.back();
+	k.from = from;
+	k.to = to;
+	k.toPort = toPort;
+	k.toBit = toBit;
+	k.monitor.bitTime = Second / m_config.baud;
+	Mcu* mcu = m_nodes[from].get();
+	k.monitor.level = mcu->pin(fromPort, fromBit) != inverted;
+	mcu->watchPin(fromPort, fromBit, [this, l, mcu, inverted](bool level) {
+		m_links[l].outbox.push_back(Edge{mcu->now(), level != inverted});
+	});
+}
+
+void Chain::powerOn()
+{
+	for (auto& n : m_nodes)
+		n->powerOn();
+}
+
+void Chain::fastForward(const FastForward::Symbols& symbols)
+{
+	m_fastForward.clear();
+	for (auto& node : m_nodes)
+		m_fastForward.emplace_back(new FastForward(*node, symbols));
+}
+
+void Chain::run(Time t)
+{
+	while (m_now < t) {
+		if (!m_fastForward.empty()) {
+			// As far as every device can go, when that's longer than a quantum. Nothing crosses the
+			// links meanwhile, as none of them is sending.
+			Time to = t;
+			for (auto& f : m_fastForward)
+				if ((to = std::min(to, f->until(to))) < m_now + m_config.linkDelay)
+					break;
+			if (to >= m_now + m_config.linkDelay) {
+				for (size_t i = 0; i < m_nodes.size(); ++i)
+					if (m_nodes[i]->now() < to)
+						m_fastForward[i]->leap(to);
+				++m_leaps;
+				exchange(to);
+				m_now = to;
+				continue;
+			}
+		}
+		Time end = std::min(t, m_now + m_config.linkDelay);
+		if (m_threads.empty())
+			runShare(0, end);
+		else {
+			m_target = end;
+			m_running = static_cast<unsigned>(m_threads.size());
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				++m_generation;
+			}
+			m_wake.notify_all();
+			runShare(0, end);
+			// Quanta are short, so spin a while before sleeping
+			for (int spin = 0; m_running != 0 && spin < 1000; ++spin)
+				std::this_thread::yield();
+			if (m_running != 0) {
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_done.wait(lock, [this] { return m_running == 0; });
+			}
+		}
+		exchange(end);
+		m_now = end;
+	}
+}
+
+void Chain::runShare(unsigned share, Time t)
+{
+	size_t n = m_nodes.size(), shares = m_threads.size() + 1;
+	for (size_t i = share * n / shares; i < (share + 1) * n / shares; ++i)
+		m_nodes[i]->run(t);
+}
+
+void Chain::worker(unsigned share)
+{
+	uint64_t seen = 0;
+	for (;;) {
+		for (int spin = 0; m_generation == seen && spin < 1000; ++spin)
+			std::this_thread::yield();
+		if (m_generation == seen) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [this, seen] { return m_generation != seen; });
+		}
+		seen = m_generation;
+		if (m_stopping)
+			return;
+		runShare(share, m_target);
+		if (--m_running == 0) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_done.notify_one();
+		}
+	}
+}
+
+// Decode frames as SerialPin does, sampling mid-bit, as far as now
+template <typename F> void Chain::Monitor::advance(Time now, F byte)
+{
+	for (;;) {
+		if (!receiving) {
+			if (pending.empty())
+				return;
+			Edge e = pending.front();
+			pending.pop_front();
+			if (level && !e.level) {
+				receiving = true;				// A start bit, perhaps
+				start = e.t;
+				bit = 0;
+				data = 0;
+			}
+			level = e.level;
+			continue;
+		}
+		Time sample = start + bitTime / 2 + bit * bitTime;
+		if (sample > now)
+			return;
+		while (!pending.empty() && pending.front().t <= sample) {
+			level = pending.front().level;
+			pending.pop_front();
+		}
+		if (bit == 0 && level) {
+			receiving = false;					// A glitch
+			continue;
+		}
+		if (bit >= 1 && bit <= 8)
+			data |= (level ? 1u : 0u) << (bit - 1);
+		if (bit == 9) {
+			receiving = false;
+			byte(start, level ? static_cast<int>(data) : -1);
+			continue;
+		}
+		++bit;
+	}
+}
+
+// Between quanta, with every device stopped: deliver each link's edges a link delay after they were made,
+// link by link so the order is always the same, and decode its bytes
+void Chain::exchange(Time t)
+{
+	for (size_t l = 0; l < m_links.size(); ++l) {
+		Link& k = m_links[l];
+		for (const Edge& e : k.outbox) {
+			if (k.to >= 0) {
+				Mcu* mcu = m_nodes[k.to].get();
+				int port = k.toPort, bit = k.toBit;
+				bool level = e.level;
+				mcu->at(e.t + m_config.linkDelay, [mcu, port, bit, level] { mcu->setInput(port, bit, level); });
+			}
+			k.monitor.pending.push_back(e);
+		}
+		k.outbox.clear();
+		k.monitor.advance(t, [this, l, &k](Time start, int byte) {
+			if (byte < 0)
+				++k.stats.framingErrors;
+			else
+				++k.stats.bytes;
+			if (l < links() && onLinkByte)
+				onLinkByte(l, start, byte);
+			if (k.to < 0 && onHostByte)
+				onHostByte(start, byte);
+		});
+	}
+}
+
+void Chain::send(uint8_t byte)
+{
+	Mcu* head = m_nodes[0].get();
+	int port = m_hostPort, pin = m_hostBit;
+	Time bitTime = Second / m_config.baud;
+	Time t = std::max(m_sendEnd, m_now);
+	unsigned frame = (byte | 0x100u) << 1;		// Start bit, 8 data bits LSB first, stop bit
+	bool level = true;
+	for (int bit = 0; bit < 10; ++bit) {
+		bool b = frame >> bit & 1;
+		if (b != level) {
+			level = b;
+			head->at(t + bit * bitTime, [head, port, pin, b] { head->setInput(port, pin, b); });
+		}
+	}
+	m_sendEnd = t + 10 * bitTime;
+}
+
+void Chain::sendBreak(Time length)
+{
+	Mcu* head = m_nodes[0].get();
+	int port = m_hostPort, pin = m_hostBit;
+	Time t = std::max(m_sendEnd, m_now);
+	head->at(t, [head, port, pin] { head->setInput(port, pin, false); });
+	head->at(t + length, [head, port, pin] { head->setInput(port, pin, true); });
+	m_sendEnd = t + length + Second / m_config.baud;
+}
+
+}	// namespace msp430
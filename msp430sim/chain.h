@@ -0,0 +1,135 @@
+// chain.h : a string of simulated devices wired as our packs are, run in lockstep on several host threads
+//
+// Written 17/Oct/2026
+//
+// Chain	An optional BMU at the head, then CMUs, each an Mcu with its own copy of the images and its own
+//			crystal error. Each device's CMU port transmit (P1.2) drives the next one's receive (P1.1)
+//			through a link with the delay of its opto-isolators; the last CMU's drives the BMU's receive,
+//			or the host's. The host has the BMU's SCU port (P3.0, and P3.5 inverted), or with no BMU the
+//			first CMU's receive and the last CMU's transmit.
+//
+// The devices run in quanta no longer than the link delay, each thread taking a fixed share of them, and
+// between quanta one thread passes the edges each link carried on to the device at its far end. An edge
+// can't reach another device in the quantum it was made in, so what every device does depends only on
+// the edges and the images, not on the threads or how the host schedules them: a run with one thread is
+// the same, to the picosecond, as a run with sixteen. Fast-forwarded, the chain leaps between quanta
+// while every device is waiting for its next tick, to the earliest time any of them stops waiting.
+
+#pragma once
+
+#include "fastforward.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace msp430 {
+
+class Chain
+{
+public:
+	struct Config
+	{
+		unsigned	cmus = 1;						// CMUs after the BMU, or alone
+		bool		bmu = false;					// A BMU at the head, device 0
+		double		ppm = 0;						// The crystals' error in parts per million,
+		double		tolerance = 0;					// give or take up to this at random
+		uint32_t	seed = 1;						// For those
+		Time		linkDelay = 10 * Microsecond;	// Through each link; also the lockstep quantum
+		unsigned	threads = 1;
+		unsigned	baud = 9600;					// For the host's port and the link monitors
+	};
+
+	// Each device starts with a copy of memory, a 64 KiB address space with the images loaded
+	Chain(const Config& config, const uint8_t* memory);
+	~Chain();
+	Chain(const Chain&) = delete;
+	Chain& operator=(const Chain&) = delete;
+
+	size_t	size() const { return m_nodes.size(); }
+	Mcu&	node(size_t i) { return *m_nodes[i]; }
+	double	crystalPpm(size_t i) const { return m_ppm[i]; }
+
+	void	powerOn();
+	// Run every device until time t
+	void	run(Time t);
+	Time	now() const { return m_now; }
+	// Have the devices leap over time they all spend idle, with the labels of the monolith image they
+	// run (see fastforward.h)
+	void	fastForward(const FastForward::Symbols& symbols);
+	uint64_t leaps() const { return m_leaps; }
+
+	// The host's port: bytes to the head of the chain, after any still being sent, and a break
+	void	send(uint8_t byte);
+	void	sendBreak(Time length);
+	// Called with each byte the host receives, at the time its start bit began, and -1 for a framing error
+	std::function<void(Time t, int byte)> onHostByte;
+
+	// Link i carries device i's CMU port transmit to device i+1, or from the last device back to the BMU
+	// or the host. With a BMU there's one more link than CMUs.
+	size_t	links() const { return m_links.size() - (m_config.bmu ? 1 : 0); }
+	// Called with each byte decoded on each link, at the time its start bit began
+	std::function<void(size_t link, Time t, int byte)> onLinkByte;
+	struct LinkStats
+	{
+		uint64_t	bytes = 0, framingErrors = 0;
+	};
+	const LinkStats& linkStats(size_t link) const { return m_links[link].stats; }
+
+private:
+	struct Edge
+	{
+		Time		t;
+		bool		level;
+	};
+	// Decodes a link's bytes from its edges, once everything up to a time is known
+	struct Monitor
+	{
+		Time		bitTime;
+		bool		level = true;
+		bool		receiving = false;
+		Time		start = 0;
+		int			bit = 0;
+		unsigned	data = 0;
+		std::deque<Edge> pending;
+		template <typename F> void advance(Time now, F byte);
+	};
+	struct Link
+	{
+		size_t		from;
+		int			to;							// A device, or -1 for the host
+		int			toPort, toBit;
+		std::vector<Edge> outbox;				// Filled by the sender's thread in a quantum
+		Monitor		monitor;
+		LinkStats	stats;
+	};
+
+	void	link(size_t from, int fromPort, int fromBit, bool inverted, int to, int toPort, int toBit);
+	void	runShare(unsigned share, Time t);
+	void	exchange(Time t);
+	void	worker(unsigned share);
+
+	Config		m_config;
+	std::vector<std::unique_ptr<Mcu>> m_nodes;
+	std::vector<double> m_ppm;
+	std::vector<Link> m_links;				// With a BMU, the last is its SCU port to the host
+	std::vector<std::unique_ptr<FastForward>> m_fastForward;	// One for each device, or none
+	uint64_t	m_leaps = 0;
+	Time		m_now = 0;
+	int			m_hostPort, m_hostBit;		// The head's input from the host
+	Time		m_sendEnd = 0;
+
+	// The workers, each running its share of the devices to m_target when m_generation changes
+	std::vector<std::thread> m_threads;
+	std::mutex	m_mutex;
+	std::condition_variable m_wake, m_done;
+	std::atomic<uint64_t> m_generation;
+	std::atomic<unsigned> m_running;
+	Time		m_target = 0;
+	bool		m_stopping = false;
+};
+
+}	// namespace msp430
@@ -0,0 +1,596 @@
+// cpu.cpp : the MSP430 CPU: instructions, their cycle counts, interrupts and resets
+//
+// Written 17/Oct/2026
+//
+// Cycle counts are those of the tables in section 3.4.4 of SLAU144. A constant from the constant
+// generator (R2 and R3) counts as a register. Each instruction's memory accesses happen in its last
+// cycle, after the peripherals have been clocked through the others, so a read of TAR in a 3-cycle
+// instruction sees the count two cycles after the instruction began.
+
+#include "msp430.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace msp430 {
+
+Mcu::Mcu()
+{
+	memset(m_mem, 0xFF, sizeof m_mem);
+	memset(m_mem, 0, 0x400);
+	memset(m_r, 0, sizeof m_r);
+	memset(m_port, 0, sizeof m_port);
+	for (auto& p : m_port)
+		p.ext = 0xFF;
+	analog = [](int) { return 512u; };
+}
+
+void Mcu::powerOn()
+{
+	memset(m_mem + 0x200, 0, 0x200);
+	m_powered = true;
+	m_rstHeld = false;
+	m_ifg1 = PORIFG;
+	puc(0);
+}
+
+void Mcu::reset()
+{
+	m_ifg1 = RSTIFG;
+	puc(0);
+}
+
+// A power-up clear: the registers and peripherals to their initial states, and run from the reset vector
+void Mcu::puc(uint8_t why)
+{
+	m_ifg1 |= why;
+	memset(m_r, 0, sizeof m_r);
+	resetPeripherals(why == 0);
+	m_r[0] = readWord(RESET_VECTOR);
+	m_gieBefore = false;
+	m_stall = 0;
+	m_pucPending = false;
+	++m_stats.resets;
+	if (why & WDTIFG)
+		++m_stats.watchdogResets;
+	m_requested = 0;
+	if (m_observer)
+		m_observer->reset();
+}
+
+void Mcu::run(Time t)
+{
+	while (m_now < t)
+		step();
+}
+
+void Mcu::at(Time t, std::function<void()> f)
+{
+	if (t < m_now)
+		t = m_now;
+	m_events.push(Event{t, m_eventSeq++, std::move(f)});
+	m_nextEvent = m_events.top().t;
+}
+
+void Mcu::runEvents()
+{
+	while (!m_events.empty() && m_events.top().t <= m_now) {
+		std::function<void()> f = std::move(const_cast<Event&>(m_events.top()).f);
+		m_events.pop();
+		f();
+	}
+	m_nextEvent = m_events.empty() ? ~Time(0) : m_events.top().t;
+}
+
+
+// Memory
+
+uint8_t Mcu::readByte(uint16_t a)
+{
+	if (a < 0x200)
+		return static_cast<uint8_t>(readPeripheral(a, false));
+	return m_mem[a];
+}
+
+uint16_t Mcu::readWord(uint16_t a)
+{
+	a &= 0xFFFE;
+	if (a < 0x200)
+		return readPeripheral(a, true);
+	return m_mem[a] | m_mem[a+1] << 8;
+}
+
+static bool isFlash(uint16_t a)
+{
+	return a >= 0xC000 || (a >= 0x1000 && a < 0x1100);
+}
+
+void Mcu::writeByte(uint16_t a, uint8_t v)
+{
+	if (a < 0x200)
+		writePeripheral(a, v, false);
+	else if (a < 0x400)
+		m_mem[a] = v;
+	else if (isFlash(a))
+		writeFlash(a, v, false);
+}
+
+void Mcu::writeWord(uint16_t a, uint16_t v)
+{
+	a &= 0xFFFE;
+	if (a < 0x200)
+		writePeripheral(a, v, true);
+	else if (a < 0x400) {
+		m_mem[a] = static_cast<uint8_t>(v);
+		m_mem[a+1] = static_cast<uint8_t>(v >> 8);
+	} else if (isFlash(a))
+		writeFlash(a, v, true);
+}
+
+uint16_t Mcu::fetch()
+{
+	uint16_t w = readWord(m_r[0]);
+	m_r[0] += 2;
+	return w;
+}
+
+
+// Cycles
+
+// Format I, by source (register or constant, @Rn, @Rn+, #N, indexed/symbolic/absolute) and destination
+// (register, PC, memory)
+static const unsigned FormatICycles[5][3] = {{1, 2, 4}, {2, 2, 5}, {2, 3, 5}, {2, 3, 5}, {3, 3, 6}};
+// Format II, by operand as above, for RRA/RRC/SWPB/SXT, PUSH and CALL
+static const unsigned FormatIICycles[3][5] = {{1, 3, 3, 3, 4}, {3, 4, 5, 4, 5}, {4, 4, 5, 5, 5}};
+
+// The column of the tables above for a source operand
+static unsigned sourceClass(unsigned as, unsigned r)
+{
+	if (r == 3 || (r == 2 && as >= 2) || as == 0)
+		return 0;
+	if (as == 1)
+		return 4;
+	if (as == 3 && r == 0)
+		return 3;
+	return as == 2 ? 1 : 2;
+}
+
+unsigned Mcu::cyclesOf(uint16_t op) const
+{
+	if ((op & 0xE000) == 0x2000)
+		return 2;							// Jumps
+	if ((op & 0xFC00) == 0x1000) {
+		unsigned sub = op >> 7 & 7;
+		if (sub == 6)
+			return 5;						// RETI
+		if (sub == 7)
+			return 1;
+		unsigned c = sourceClass(op >> 4 & 3, op & 15);
+		return FormatIICycles[sub == 4 ? 1 : sub == 5 ? 2 : 0][c];
+	}
+	if (op >= 0x4000) {
+		unsigned d = op & 0x80 ? 2 : (op & 15) == 0 ? 1 : 0;
+		return FormatICycles[sourceClass(op >> 4 & 3, op >> 8 & 15)][d];
+	}
+	return 1;
+}
+
+
+// Instructions
+
+namespace {
+
+// An operand: a register, a memory address, or a constant
+struct Operand
+{
+	enum Kind { Reg, Mem, Const } kind;
+	unsigned	r;
+	uint16_t	a;
+};
+
+}
+
+// Set N, Z, C and V for an arithmetic result. s is the operand as added, after any inversion.
+static uint16_t arith(uint16_t& sr, uint32_t d, uint32_t s, uint32_t carry, bool byte)
+{
+	uint32_t mask = byte ? 0xFF : 0xFFFF, msb = byte ? 0x80 : 0x8000;
+	d &= mask;
+	s &= mask;
+	uint32_t sum = d + s + carry, r = sum & mask;
+	sr &= ~(C | Z | N | V);
+	if (sum > mask)
+		sr |= C;
+	if (r == 0)
+		sr |= Z;
+	if (r & msb)
+		sr |= N;
+	if (~(d ^ s) & (d ^ r) & msb)
+		sr |= V;
+	return static_cast<uint16_t>(r);
+}
+
+// Set N and Z for a logical result, C to not Z, and V as given
+static void logic(uint16_t& sr, uint16_t r, bool byte, bool v)
+{
+	sr &= ~(C | Z | N | V);
+	if ((byte ? r & 0xFF : r) == 0)
+		sr |= Z;
+	else
+		sr |= C;
+	if (r & (byte ? 0x80 : 0x8000))
+		sr |= N;
+	if (v)
+		sr |= V;
+}
+
+void Mcu::step()
+{
+	if (m_pucPending) {
+		puc(m_pucWhy);
+		return;
+	}
+	if (m_rstHeld) {
+		m_now = std::min(m_nextEvent, m_now + Microsecond);	// Nothing runs until /RST goes high
+		runEvents();
+		return;
+	}
+
+	// Interrupts are taken between instructions, when GIE was set at the start of the last one, so
+	// the instruction after an EINT always runs first
+	uint16_t& sr = m_r[2];
+	if (m_gieBefore) {
+		uint16_t vector = pendingVector();
+		if (vector) {
+			interrupt(vector);
+			return;
+		}
+	}
+	if (sr & CPUOFF) {
+		m_gieBefore = (sr & GIE) != 0;
+		++m_stats.sleepCycles;
+		clocks(1);
+		if (m_observer)
+			m_observer->asleep();
+		return;
+	}
+
+	uint16_t pc0 = m_r[0];
+	if (pc0 < 0x200) {
+		puc(0);								// Fetching from the peripherals resets the chip
+		return;
+	}
+	if (pc0 == m_hookPc && m_hook)
+		m_hook();
+	uint16_t op = readWord(pc0);
+	uint64_t start = m_stats.cycles;
+	m_gieBefore = (sr & GIE) != 0;
+	clocks(cyclesOf(op) - 1);
+	if (m_pucPending)
+		return;								// The watchdog went off during the instruction
+	m_r[0] += 2;
+	++m_stats.instructions;
+	execute(op, pc0);
+
+	if (m_observer) {
+		m_observer->instruction(pc0, static_cast<unsigned>(m_stats.cycles - start));
+		if ((op & 0xFF80) == 0x1280)
+			m_observer->call(pc0, m_r[0], m_r[1]);
+		else if (op == 0x4130 || op == 0x1300)	// RET (MOV @SP+,PC) and RETI
+			m_observer->ret(pc0, m_r[1]);
+	}
+}
+
+void Mcu::execute(uint16_t op, uint16_t pc0)
+{
+	uint16_t& sr = m_r[2];
+	if ((op & 0xE000) == 0x2000) {
+		// Jumps
+		bool take;
+		switch (op >> 10 & 7) {
+		case 0: take = !(sr & Z); break;
+		case 1: take = (sr & Z) != 0; break;
+		case 2: take = !(sr & C); break;
+		case 3: take = (sr & C) != 0; break;
+		case 4: take = (sr & N) != 0; break;
+		case 5: take = !(sr & N) == !(sr & V); break;
+		case 6: take = !(sr & N) != !(sr & V); break;
+		default: take = true;
+		}
+		if (take)
+			m_r[0] += static_cast<uint16_t>(static_cast<int16_t>(op << 6) >> 5);
+		clocks(1);
+		return;
+	}
+
+	bool byte = (op & 0x40) != 0;
+	auto source = [&](unsigned as, unsigned r) -> Operand {
+		if (r == 3)
+			return Operand{Operand::Const, 0, static_cast<uint16_t>(as == 3 ? 0xFFFF : as)};
+		if (r == 2 && as >= 2)
+			return Operand{Operand::Const, 0, static_cast<uint16_t>(as == 2 ? 4 : 8)};
+		switch (as) {
+		case 0:
+			return Operand{Operand::Reg, r, 0};
+		case 1: {
+			uint16_t x = fetch();
+			uint16_t base = r == 0 ? m_r[0] - 2 : r == 2 ? 0 : m_r[r];
+			return Operand{Operand::Mem, 0, static_cast<uint16_t>(base + x)};
+		}
+		case 2:
+			return Operand{Operand::Mem, 0, m_r[r]};
+		default:
+			if (r == 0)
+				return Operand{Operand::Const, 0, fetch()};
+			Operand o{Operand::Mem, 0, m_r[r]};
+			m_r[r] += byte && r != 1 ? 1 : 2;
+			return o;
+		}
+	};
+	auto read = [&](const Operand& o) -> uint16_t {
+		switch (o.kind) {
+		case Operand::Reg: return byte ? m_r[o.r] & 0xFF : m_r[o.r];
+		case Operand::Mem: return byte ? readByte(o.a) : readWord(o.a);
+		default: return byte ? o.a & 0xFF : o.a;
+		}
+	};
+	auto write = [&](const Operand& o, uint16_t v) {
+		if (o.kind == Operand::Mem) {
+			if (byte)
+				writeByte(o.a, static_cast<uint8_t>(v));
+			else
+				writeWord(o.a, v);
+		} else if (o.kind == Operand::Reg) {
+			if (byte)
+				v &= 0xFF;
+			switch (o.r) {
+			case 0: case 1: m_r[o.r] = v & 0xFFFE; break;
+			case 3: break;
+			default: m_r[o.r] = v;
+			}
+		}
+	};
+	auto push = [&](uint16_t v) {
+		m_r[1] -= 2;
+		writeWord(m_r[1], v);
+	};
+
+	if ((op & 0xFC00) == 0x1000) {
+		// Format II: one operand
+		unsigned sub = op >> 7 & 7;
+		if (sub == 6) {
+			// RETI
+			sr = readWord(m_r[1]);
+			m_r[1] += 2;
+			m_r[0] = readWord(m_r[1]);
+			m_r[1] += 2;
+			clocks(1);
+			return;
+		}
+		if (sub == 7) {
+			++m_stats.illegal;
+			m_stats.lastIllegal = pc0;
+			clocks(1);
+			return;
+		}
+		if (sub == 1 || sub == 3 || sub == 5)
+			byte = false;
+		Operand o = source(op >> 4 & 3, op & 15);
+		uint16_t v = read(o), r, msb = byte ? 0x80 : 0x8000;
+		switch (sub) {
+		case 0:								// RRC
+			r = static_cast<uint16_t>((v >> 1) | (sr & C ? msb : 0));
+			logic(sr, r, byte, false);
+			sr = (sr & ~C) | (v & 1);
+			write(o, r);
+			break;
+		case 1:								// SWPB
+			write(o, static_cast<uint16_t>(v << 8 | v >> 8));
+			break;
+		case 2:								// RRA
+			r = static_cast<uint16_t>((v >> 1) | (v & msb));
+			logic(sr, r, byte, false);
+			sr = (sr & ~C) | (v & 1);
+			write(o, r);
+			break;
+		case 3:								// SXT
+			r = static_cast<uint16_t>(static_cast<int8_t>(v & 0xFF));
+			logic(sr, r, false, false);
+			write(o, r);
+			break;
+		case 4:								// PUSH
+			m_r[1] -= 2;
+			if (byte)
+				writeByte(m_r[1], static_cast<uint8_t>(v));
+			else
+				writeWord(m_r[1], v);
+			break;
+		case 5:								// CALL
+			push(m_r[0]);
+			m_r[0] = v & 0xFFFE;
+			break;
+		}
+		clocks(1);
+		return;
+	}
+
+	if (op < 0x4000) {
+		++m_stats.illegal;
+		m_stats.lastIllegal = pc0;
+		clocks(1);
+		return;
+	}
+
+	// Format I: two operands
+	unsigned opcode = op >> 12;
+	Operand s = source(op >> 4 & 3, op >> 8 & 15);
+	uint16_t src = read(s);
+	Operand d;
+	unsigned rd = op & 15;
+	if (op & 0x80) {
+		uint16_t x = fetch();
+		uint16_t base = rd == 0 ? m_r[0] - 2 : rd == 2 || rd == 3 ? 0 : m_r[rd];
+		d = Operand{Operand::Mem, 0, static_cast<uint16_t>(base + x)};
+	} else
+		d = Operand{Operand::Reg, rd, 0};
+	uint16_t dst = opcode == 4 ? 0 : read(d);
+	if ((opcode == 9 || opcode == 11) && d.kind == Operand::Mem)
+		read(d);							// CMP and BIT read their destination twice, so a read of
+											//	TAIV that way clears two flags, as on the chip
+	uint16_t mask = byte ? 0xFF : 0xFFFF;
+	uint16_t r;
+	switch (opcode) {
+	case 4:									// MOV
+		write(d, src);
+		break;
+	case 5:									// ADD
+		r = arith(sr, dst, src, 0, byte);
+		write(d, r);
+		break;
+	case 6:									// ADDC
+		r = arith(sr, dst, src, sr & C, byte);
+		write(d, r);
+		break;
+	case 7:									// SUBC
+		r = arith(sr, dst, ~src & mask, sr & C, byte);
+		write(d, r);
+		break;
+	case 8:									// SUB
+		r = arith(sr, dst, ~src & mask, 1, byte);
+		write(d, r);
+		break;
+	case 9:									// CMP
+		arith(sr, dst, ~src & mask, 1, byte);
+		break;
+	case 10: {								// DADD
+		unsigned carry = sr & C, res = 0, digits = byte ? 2 : 4;
+		for (unsigned i = 0; i < digits; ++i) {
+			unsigned n = (dst >> 4*i & 15) + (src >> 4*i & 15) + carry;
+			carry = n > 9;
+			if (carry)
+				n -= 10;
+			res |= (n & 15) << 4*i;
+		}
+		r = static_cast<uint16_t>(res);
+		sr &= ~(C | Z | N | V);
+		if (carry)
+			sr |= C;
+		if (r == 0)
+			sr |= Z;
+		if (r & (byte ? 0x80 : 0x8000))
+			sr |= N;
+		write(d, r);
+		break;
+	}
+	case 11:								// BIT
+		logic(sr, dst & src, byte, false);
+		break;
+	case 12:								// BIC
+		write(d, dst & ~src);
+		break;
+	case 13:								// BIS
+		write(d, dst | src);
+		break;
+	case 14:								// XOR
+		r = dst ^ src;
+		logic(sr, r, byte, (dst & src & (byte ? 0x80 : 0x8000)) != 0);
+		write(d, r);
+		break;
+	case 15:								// AND
+		r = dst & src;
+		logic(sr, r, byte, false);
+		write(d, r);
+		break;
+	}
+	clocks(1);
+	if (m_stall) {
+		unsigned n = m_stall;				// The flash controller holds the CPU
+		m_stall = 0;
+		clocks(n);
+	}
+}
+
+
+// Interrupts
+
+// The vectors asking for an interrupt, whether or not GIE lets them, a bit each from $FFE0 up so the
+// highest has priority
+unsigned Mcu::requests()
+{
+	auto bit = [](Vector v) { return 1u << ((v - 0xFFE0) / 2); };
+	unsigned r = 0;
+	const Timer& t1 = m_ta[1];
+	if (t1.cctl[0] & t1.cctl[0] << 4 & 0x10)
+		r |= bit(TIMER1_A0_VECTOR);
+	if (timerCcrPending(t1))
+		r |= bit(TIMER1_A1_VECTOR);
+	if ((m_wdtctl & 0x10) && (m_ifg1 & m_ie1 & WDTIFG))
+		r |= bit(WDT_VECTOR);
+	const Timer& t0 = m_ta[0];
+	if (t0.cctl[0] & t0.cctl[0] << 4 & 0x10)
+		r |= bit(TIMER0_A0_VECTOR);
+	if (timerCcrPending(t0))
+		r |= bit(TIMER0_A1_VECTOR);
+	if (m_ifg2 & m_ie2 & 0x01)
+		r |= bit(USCIAB0RX_VECTOR);
+	if (m_ifg2 & m_ie2 & 0x02)
+		r |= bit(USCIAB0TX_VECTOR);
+	if (m_adc.ctl0 & m_adc.ctl0 << 1 & 0x08)
+		r |= bit(ADC10_VECTOR);
+	if (m_port[1].ifg & m_port[1].ie)
+		r |= bit(PORT2_VECTOR);
+	if (m_port[0].ifg & m_port[0].ie)
+		r |= bit(PORT1_VECTOR);
+	return r;
+}
+
+uint16_t Mcu::pendingVector()
+{
+	unsigned r = requests();
+	if (!r)
+		return 0;
+	int n = 15;
+	while (!(r >> n & 1))
+		--n;
+	return static_cast<uint16_t>(0xFFE0 + 2 * n);
+}
+
+// Note when each vector begins asking, for its latency. Called each cycle while observed.
+void Mcu::trackRequests()
+{
+	unsigned r = requests(), started = r & ~m_requested;
+	for (int n = 0; started; ++n, started >>= 1)
+		if (started & 1)
+			m_requestedAt[n] = m_stats.cycles;
+	m_requested = r;
+}
+
+void Mcu::interrupt(uint16_t vector)
+{
+	// Single-source flags are cleared as the interrupt is accepted
+	switch (vector) {
+	case TIMER1_A0_VECTOR: m_ta[1].cctl[0] &= ~1; break;
+	case TIMER0_A0_VECTOR: m_ta[0].cctl[0] &= ~1; break;
+	case WDT_VECTOR: m_ifg1 &= ~WDTIFG; break;
+	case ADC10_VECTOR: m_adc.ctl0 &= ~0x04; break;
+	}
+	clocks(5);
+	uint16_t sr = m_r[2];
+	m_r[1] -= 2;
+	writeWord(m_r[1], m_r[0]);
+	m_r[1] -= 2;
+	writeWord(m_r[1], sr);
+	m_r[2] = sr & SCG0;
+	m_r[0] = readWord(vector) & 0xFFFE;
+	m_gieBefore = false;
+	++m_stats.interrupts;
+	++m_stats.vectorInterrupts[(vector - 0xFFE0) / 2];
+	clocks(1);
+	if (m_observer) {
+		// The vector asks afresh from now, if it has another source still waiting
+		unsigned n = (vector - 0xFFE0) / 2;
+		m_requested &= ~(1u << n);
+		m_observer->interrupt(vector, m_r[0], m_r[1], 6, m_stats.cycles - m_requestedAt[n]);
+	}
+}
+
+}	// namespace msp430
@@ -0,0 +1,229 @@
+// fastforward.cpp : run monolith faster than its own clock, by leaping over the time it spends waiting
+//
+// Written 17/Oct/2026
+
+#include "fastforward.h"
+#include "reference.h"
+
+#include <algorithm>
+
+namespace msp430 {
+
+namespace {
+
+// Registers and bits, named as in msp430g2553.h
+const uint16_t IE1_IE2 = 0x0000, UCA0MCTL_STAT = 0x0064, WDTCTL = 0x0120, ADC10CTL0 = 0x01B0,
+	ADC10CTL1 = 0x01B2, ADC10MEM = 0x01B4, TA0CCR0 = 0x0172;
+const uint16_t TAIE = 0x0002, CCIE = 0x0010, CAP = 0x0100, CCIS = 0x3000, CCIS_1 = 0x1000;
+const uint16_t ADC10SC = 0x0001, ENC = 0x0002, ADC10IE = 0x0008, ADC10BUSY = 0x0001, ADC10DF = 0x0200;
+const uint16_t WDTTMSEL = 0x0010, WDTIE = 0x0001, UCA0TXIE = 0x0200, UCBUSY = 0x0100;
+
+uint16_t timerBase(int n) { return n ? 0x0180 : 0x0160; }
+
+// The measurement interrupt's period in timer clocks, (TAfreq+800)/1600 with common.h's 3686400 Hz
+const unsigned MeasurePeriod = (3686400 + 800) / 1600;
+// Leaps end this many FLL interrupts before the main loop is due to measure, so it gets there itself
+const int Margin = 2;
+// And not within this of the next measurement interrupt, so the conversion the last one started has
+// finished by then
+const Time AdcGuard = 200 * Microsecond;
+
+const char* const Required[] = {"UpdateRtc", "measureCount", "oldMeasureCount", "oldFllTime", "sampIndex",
+	"chanIndex", "chanList", "partialSum", "boltVPlRaw", "rxWr", "rxRd", "txWr", "txRd"};
+// The SCU and charger queues are a BMU's
+const char* const Queues[][2] = {{"rxWr", "rxRd"}, {"txWr", "txRd"}, {"scuRxWr", "scuRxRd"},
+	{"scuTxWr", "scuTxRd"}, {"chgRxWr", "chgRxRd"}, {"chgTxWr", "chgTxRd"}};
+
+}	// namespace
+
+bool FastForward::check(const Symbols& symbols, std::string& missing)
+{
+	for (const char* name : Required)
+		if (!symbols.count(name)) {
+			missing = name;
+			return false;
+		}
+	return true;
+}
+
+FastForward::FastForward(Mcu& mcu, const Symbols& symbols)
+	: m_mcu(mcu), m_mem(mcu.memory())
+{
+	auto at = [&symbols](const char* name) {
+		auto i = symbols.find(name);
+		return i == symbols.end() ? uint16_t(0) : i->second;
+	};
+	m_bmu = m_mem[0x1016] == 255;			// infoID
+	m_timer = m_bmu ? 1 : 0;
+	m_ccr = m_bmu ? 0 : 2;
+	m_updateRtc = at("UpdateRtc");
+	m_measureCount = at("measureCount");
+	m_oldMeasureCount = at("oldMeasureCount");
+	m_oldFllTime = at("oldFllTime");
+	m_sampIndex = at("sampIndex");
+	m_chanIndex = at("chanIndex");
+	m_chanList = at("chanList");
+	m_partialSum = at("partialSum");
+	m_rawMeasures = at("boltVPlRaw");		// The first of rawMeasures
+	m_slotState = at("slotState");
+	for (const auto& q : Queues)
+		if (at(q[0]) && at(q[1]))
+			m_queues.emplace_back(at(q[0]), at(q[1]));
+	m_mcu.onPc(m_updateRtc, [this] { arrive(); });
+}
+
+FastForward::~FastForward()
+{
+	m_mcu.onPc(0, nullptr);
+}
+
+void FastForward::setWord(uint16_t a, uint16_t v)
+{
+	m_mem[a] = static_cast<uint8_t>(v);
+	m_mem[a+1] = static_cast<uint8_t>(v >> 8);
+}
+
+// Interrupts taken other than the FLL's and the measurement one
+uint64_t FastForward::otherInterrupts() const
+{
+	const Mcu::Stats& s = m_mcu.stats();
+	uint16_t measure = m_bmu ? TIMER1_A0_VECTOR : TIMER0_A1_VECTOR;
+	return s.interrupts - s.vectorInterrupts[(TIMER0_A0_VECTOR - 0xFFE0) / 2]
+		- s.vectorInterrupts[(measure - 0xFFE0) / 2];
+}
+
+// The main loop is about to update the RTC, so it has no byte to handle
+void FastForward::arrive()
+{
+	m_idle = quiet();
+	m_others = otherInterrupts();
+	m_measured = word(m_oldMeasureCount);
+}
+
+// Whether nothing but the FLL and measurement interrupts can happen until something arrives
+bool FastForward::quiet()
+{
+	if (!(m_mcu.reg(2) & GIE) || m_mcu.interruptRequested())
+		return false;
+	for (const auto& q : m_queues)
+		if (m_mem[q.first] != m_mem[q.second])
+			return false;
+	if (m_slotState && m_mem[m_slotState])
+		return false;
+	if ((m_mcu.read16(UCA0MCTL_STAT) & UCBUSY) || (m_mcu.read16(IE1_IE2) & UCA0TXIE))
+		return false;
+	if ((m_mcu.read16(ADC10CTL0) & ADC10IE) || (m_mcu.read16(ADC10CTL1) & ADC10BUSY))
+		return false;
+	if ((m_mcu.read16(WDTCTL) & WDTTMSEL) && (m_mcu.read16(IE1_IE2) & WDTIE))
+		return false;
+	for (int n = 0; n < 2; ++n) {
+		uint16_t base = timerBase(n), ctl = m_mcu.read16(base);
+		if (ctl & TAIE)
+			return false;
+		for (int x = 0; x < 3; ++x) {
+			uint16_t cctl = m_mcu.read16(static_cast<uint16_t>(base + 2 + 2 * x));
+			bool measure = n == m_timer && x == m_ccr, fll = n == 0 && x == 0;
+			if (measure && (cctl & (CAP | CCIE)) != CCIE)
+				return false;
+			if (measure && (ctl & 0x0330) != 0x0220)
+				return false;				// It must be SMCLK, continuous
+			if (fll && (cctl & (CAP | CCIS | CCIE)) != (CAP | CCIS_1 | CCIE))
+				return false;				// Capturing ACLK
+			if (!measure && !fll && (cctl & (CAP | CCIE)) == CCIE)
+				return false;				// A software UART sending, perhaps
+		}
+	}
+	return true;
+}
+
+Time FastForward::until(Time limit)
+{
+	Time now = m_mcu.now();
+	if (!m_idle)
+		return now;
+	if (otherInterrupts() != m_others || word(m_oldMeasureCount) != m_measured) {
+		m_idle = false;
+		return now;
+	}
+	if (!quiet())
+		return now;
+
+	// FLL interrupts until the main loop measures, as it works it out
+	int16_t left = static_cast<int16_t>(m_measured + 4096 / monolith::StatusFreq - word(m_measureCount));
+	if (left <= Margin)
+		return now;
+	Time t = std::min(limit, m_mcu.aclkRise(static_cast<uint64_t>(left - Margin)));
+	Time next = m_mcu.nextEvent();
+	if (next <= now + Microsecond)
+		return now;
+	t = std::min(t, next - Microsecond);
+
+	uint16_t base = timerBase(m_timer);
+	uint16_t r = m_mcu.read16(base + 0x10), ccr = m_mcu.read16(static_cast<uint16_t>(base + 0x12 + 2 * m_ccr));
+	uint64_t first = static_cast<uint16_t>(ccr - r), counts = m_mcu.timerCounts(m_timer, t);
+	if (!first)
+		first = 0x10000;
+	if (counts >= first) {
+		uint64_t interrupts = 1 + (counts - first) / MeasurePeriod;
+		if (m_mcu.timerCountTime(m_timer, first + interrupts * MeasurePeriod) < t + AdcGuard)
+			t = m_mcu.timerCountTime(m_timer, first + (interrupts - 1) * MeasurePeriod);
+	}
+	return std::max(t, now);
+}
+
+void FastForward::leap(Time t)
+{
+	uint16_t base = timerBase(m_timer), ccrAddress = static_cast<uint16_t>(base + 0x12 + 2 * m_ccr);
+	uint16_t ccr = m_mcu.read16(ccrAddress);
+	uint64_t first = static_cast<uint16_t>(ccr - m_mcu.read16(base + 0x10));
+	if (!first)
+		first = 0x10000;
+	uint64_t counts = m_mcu.timerCounts(m_timer, t);
+	uint64_t interrupts = counts >= first ? 1 + (counts - first) / MeasurePeriod : 0;
+
+	Mcu::Leap l = m_mcu.leap(t);
+	++m_leaps;
+
+	// TA0FllIsr's, with the DCO as it was
+	if (l.aclkRises) {
+		setWord(m_measureCount, static_cast<uint16_t>(word(m_measureCount) + l.aclkRises));
+		m_mcu.write16(TA0CCR0, l.atAclkRise[0]);
+		setWord(m_oldFllTime, l.atAclkRise[0]);
+	}
+	if (!interrupts)
+		return;
+
+	// MeasureCmuIsr's or MeasureBmuIsr's, each adding the conversion the one before started
+	m_mcu.write16(ccrAddress, static_cast<uint16_t>(ccr + interrupts * MeasurePeriod));
+	uint16_t ctl1 = m_mcu.read16(ADC10CTL1) & ~ADC10BUSY, mem = m_mcu.read16(ADC10MEM);
+	uint16_t sum = word(m_partialSum);
+	uint8_t samp = m_mem[m_sampIndex], chan = m_mem[m_chanIndex];
+	bool switched = false;
+	for (uint64_t i = 0; i < interrupts; ++i) {
+		if (i) {
+			unsigned code = m_mcu.analog(ctl1 >> 12) & 0x3FF;
+			mem = static_cast<uint16_t>(ctl1 & ADC10DF ? (code ^ 0x200) << 6 : code);
+		}
+		sum = static_cast<uint16_t>(sum + mem);
+		samp = (samp + 1) & (monolith::NumSamples - 1);
+		if (!samp) {
+			setWord(static_cast<uint16_t>(m_rawMeasures + chan), sum);
+			sum = 0;
+			chan = (chan + 2) & 7;
+			ctl1 = word(static_cast<uint16_t>(m_chanList + chan));
+			switched = true;
+		}
+	}
+	setWord(m_partialSum, sum);
+	m_mem[m_sampIndex] = samp;
+	m_mem[m_chanIndex] = chan;
+	// The last one starts a real conversion
+	uint16_t ctl0 = m_mcu.read16(ADC10CTL0);
+	if (switched) {
+		m_mcu.write16(ADC10CTL0, ctl0 & ~ENC);
+		m_mcu.write16(ADC10CTL1, ctl1);
+	}
+	m_mcu.write16(ADC10CTL0, ctl0 | ENC | ADC10SC);
+}
+
+}	// namespace msp430
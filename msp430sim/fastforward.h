@@ -0,0 +1,73 @@
+// fastforward.h : run monolith faster than its own clock, by leaping over the time it spends waiting
+//
+// Written 17/Oct/2026
+//
+// FastForward	Watches a device running monolith for its main loop polling with nothing to do, and
+//			has the device leap from there to just before its next measurement. The firmware
+//			never sleeps (the LPM in the main loop is commented out), so between ticks it goes round
+//			the loop, taking the FLL interrupt 4096 times a second and the measurement interrupt 1600
+//			times, and nothing else changes. A leap moves the crystal and timers on in one go (see
+//			Mcu::leap) and does those interrupts' work all at once: measureCount and oldFllTime as the
+//			FLL's would leave them, and the ADC10 sums, channel and compare register as the
+//			measurement ISR's would. The RTC (UpdateRtc) and the ticks follow measureCount when the
+//			device runs on, so a simulated day takes seconds.
+//
+// A device is idle when it has reached UpdateRtc with its queues empty, no packet held (slotState),
+// nothing sending or converting, no interrupt asked for or enabled but those two, and GIE set, and it
+// stays idle until it takes any other interrupt or measures. Leaps stop short of anything scheduled
+// with Mcu::at(), so bytes arriving and steps in the inputs end them. Through a leap the DCO stays at
+// its present setting, which a locked FLL keeps within a step of 900 cycles to each ACLK period.
+//
+// The addresses come from the IAR assembler listing or XLINK map of the image (see profile.h).
+
+#pragma once
+
+#include "msp430.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace msp430 {
+
+class FastForward
+{
+public:
+	// Labels by name. Returns false, naming the first one missing, if it lacks any it needs.
+	typedef std::map<std::string, uint16_t> Symbols;
+	static bool check(const Symbols& symbols, std::string& missing);
+
+	FastForward(Mcu& mcu, const Symbols& symbols);
+	~FastForward();
+	FastForward(const FastForward&) = delete;
+	FastForward& operator=(const FastForward&) = delete;
+
+	// How far the device can leap from now, no further than limit. Now, if it's busy.
+	Time	until(Time limit);
+	// Leap to t, which until() allowed
+	void	leap(Time t);
+	uint64_t leaps() const { return m_leaps; }
+
+private:
+	void	arrive();
+	bool	quiet();
+	uint16_t word(uint16_t a) const { return static_cast<uint16_t>(m_mem[a] | m_mem[a+1] << 8); }
+	void	setWord(uint16_t a, uint16_t v);
+	uint64_t otherInterrupts() const;
+
+	Mcu&		m_mcu;
+	uint8_t*	m_mem;
+	bool		m_bmu;					// Whose measurement interrupt is TA1CCR0's, not TA0CCR2's
+	int			m_timer, m_ccr;			// That compare register
+	uint16_t	m_updateRtc, m_measureCount, m_oldMeasureCount, m_oldFllTime;
+	uint16_t	m_sampIndex, m_chanIndex, m_chanList, m_partialSum, m_rawMeasures;
+	uint16_t	m_slotState;			// 0 without RESP_SLOTS
+	std::vector<std::pair<uint16_t, uint16_t>> m_queues;	// Write and read indices
+
+	bool		m_idle = false;
+	uint64_t	m_others = 0;			// Other interrupts when it became idle
+	uint16_t	m_measured = 0;			// oldMeasureCount then
+	uint64_t	m_leaps = 0;
+};
+
+}	// namespace msp430
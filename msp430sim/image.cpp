@@ -0,0 +1,192 @@
+// image.cpp : loading firmware images into the simulator's address space
+//
+// Written 17/Oct/2026
+//
+// The same formats, and the same rules for telling them apart, as loadImage in sendprog/sendprog.c
+
+#include "msp430.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+namespace msp430 {
+
+namespace {
+
+class Loader
+{
+public:
+	Loader(const std::string& text, uint8_t* memory) : m_text(text), m_mem(memory) {}
+
+	bool	hex();
+	bool	txt();
+
+	std::string	error;
+
+private:
+	bool	fail(const char* what);
+	int		nibble();
+	int		byte();
+	bool	put(int b);
+
+	const std::string& m_text;
+	uint8_t*	m_mem;
+	size_t		m_pos = 0;
+	unsigned	m_line = 1;
+	unsigned	m_address = 0;
+	unsigned	m_sum = 0;
+};
+
+bool Loader::fail(const char* what)
+{
+	std::ostringstream s;
+	s << "line " << m_line << ": " << what << ", address = " << std::hex << std::uppercase << m_address;
+	error = s.str();
+	return false;
+}
+
+int Loader::nibble()
+{
+	if (m_pos >= m_text.size())
+		return -1;
+	int c = static_cast<unsigned char>(m_text[m_pos++]);
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+int Loader::byte()
+{
+	int hi = nibble(), lo = nibble();
+	if (hi < 0 || lo < 0)
+		return -1;
+	m_sum += hi << 4 | lo;
+	return hi << 4 | lo;
+}
+
+bool Loader::put(int b)
+{
+	if (m_address > 0xFFFF)
+		return fail("data beyond the 64 KiB address space");
+	m_mem[m_address++] = static_cast<uint8_t>(b);
+	return true;
+}
+
+// Intel HEX records, checking each record's checksum, until the end-of-file record
+bool Loader::hex()
+{
+	unsigned base = 0;
+	for (;;) {
+		while (m_pos < m_text.size() && m_text[m_pos] != ':')
+			if (m_text[m_pos++] == '\n')
+				++m_line;
+		if (m_pos++ >= m_text.size())
+			return fail("no end-of-file record");
+		m_sum = 0;
+		int n = byte(), hi = byte(), lo = byte(), typ = byte();
+		if (n < 0 || hi < 0 || lo < 0 || typ < 0)
+			return fail("unexpected character when reading hex");
+		m_address = base + (hi << 8 | lo);
+		uint8_t data[256];
+		for (int u = 0; u < n; ++u) {
+			int b = byte();
+			if (b < 0)
+				return fail("unexpected character when reading hex");
+			data[u] = static_cast<uint8_t>(b);
+		}
+		if (byte() < 0)
+			return fail("unexpected character when reading hex");
+		if (m_sum & 0xFF)
+			return fail("bad record checksum");
+		switch (typ) {
+		case 0:								// Data
+			for (int u = 0; u < n; ++u)
+				if (!put(data[u]))
+					return false;
+			break;
+		case 1:								// End of file
+			return true;
+		case 2:								// Extended segment address
+			base = (data[0] << 8 | data[1]) << 4;
+			break;
+		case 4:								// Extended linear address
+			base = (data[0] << 8 | data[1]) << 16;
+			break;
+		case 3: case 5:						// Start address; the reset vector decides that
+			break;
+		default:
+			return fail("unknown record type");
+		}
+	}
+}
+
+// TI-TXT: "@xxxx" sets the address, then bytes in hex, until "q"
+bool Loader::txt()
+{
+	while (m_pos < m_text.size()) {
+		int c = static_cast<unsigned char>(m_text[m_pos]);
+		if (c == 'q' || c == 'Q')
+			break;
+		if (c == '\n')
+			++m_line;
+		if (c == '@') {
+			++m_pos;
+			m_address = 0;
+			while (m_pos < m_text.size() && isxdigit(static_cast<unsigned char>(m_text[m_pos])))
+				m_address = m_address << 4 | nibble();
+		} else if (isxdigit(c)) {
+			int b = byte();
+			if (b < 0)
+				return fail("unexpected character when reading hex");
+			if (!put(b))
+				return false;
+		} else if (isspace(c))
+			++m_pos;
+		else
+			return fail("unexpected character");
+	}
+	return true;
+}
+
+}	// namespace
+
+bool loadImage(const std::string& name, uint8_t* memory, std::string& error)
+{
+	std::ifstream f(name, std::ios::binary);
+	if (!f) {
+		error = "could not open " + name;
+		return false;
+	}
+	std::string text((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+
+	size_t dot = name.rfind('.');
+	std::string ext = dot == std::string::npos ? "" : name.substr(dot);
+	size_t first = text.find_first_not_of(" \t\r\n");
+	Loader loader(text, memory);
+	bool ok;
+	if (ext == ".txt")
+		ok = loader.txt();
+	else if (ext != ".bin" && first != std::string::npos && text[first] == ':')
+		ok = loader.hex();						// Intel HEX starts with a colon; anything else is a binary
+	else {
+		if (text.size() > 0x10000) {
+			error = name + ": binary is bigger than 64 KiB";
+			return false;
+		}
+		memcpy(memory + 0x10000 - text.size(), text.data(), text.size());
+		return true;
+	}
+	if (!ok)
+		error = name + " " + loader.error;
+	return ok;
+}
+
+}	// namespace msp430
@@ -0,0 +1,342 @@
+// msp430.h : an instruction-set simulator of the MSP430G2553, for running our firmware images on a host
+//
+// Written 17/Oct/2026
+//
+// Mcu		The CPU, with the cycle counts of the MSP430x2xx Family User's Guide (SLAU144), and the
+//			peripherals that BSL2, monitor, monolith, wmonolith and TestICal use: the basic clock module
+//			(a DCO whose frequency follows DCOCTL and RSEL, so the FLL in BSL2 has something to lock,
+//			and a 32768 Hz watch crystal), the watchdog, the flash controller, Timer0_A3 and Timer1_A3
+//			with their capture inputs and output units, USCI_A0 as a UART, ADC10 with its DTC, and
+//			ports 1 to 3 with their interrupts.
+// SerialPin	Bytes sent to a UART input pin at a baud rate, and those on an output pin decoded again,
+//			for wiring a simulated device to a host program or to another device
+//
+// Everything happens at its own time, in picoseconds since power-on. The peripherals are stepped a
+// DCO cycle at a time while the CPU runs an instruction, and its memory accesses land in the
+// instruction's last cycle. Things outside the chip (a serial line, a test) are scheduled with at().
+// See msp430sim.cpp for an example. A program that knows when the firmware is only waiting can have
+// it leap over the wait in one go (see fastforward.h).
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <string>
+#include <vector>
+
+namespace msp430 {
+
+typedef uint64_t Time;					// Picoseconds since power-on
+
+const Time Microsecond = 1000000;
+const Time Millisecond = 1000 * Microsecond;
+const Time Second = 1000 * Millisecond;
+
+// Status register bits
+const uint16_t C = 0x0001, Z = 0x0002, N = 0x0004, GIE = 0x0008, CPUOFF = 0x0010, OSCOFF = 0x0020,
+	SCG0 = 0x0040, SCG1 = 0x0080, V = 0x0100;
+
+// Interrupt vectors, highest priority last
+enum Vector
+{
+	PORT1_VECTOR = 0xFFE4, PORT2_VECTOR = 0xFFE6, ADC10_VECTOR = 0xFFEA, USCIAB0TX_VECTOR = 0xFFEC,
+	USCIAB0RX_VECTOR = 0xFFEE, TIMER0_A1_VECTOR = 0xFFF0, TIMER0_A0_VECTOR = 0xFFF2, WDT_VECTOR = 0xFFF4,
+	TIMER1_A1_VECTOR = 0xFFF8, TIMER1_A0_VECTOR = 0xFFFA, RESET_VECTOR = 0xFFFE
+};
+
+// Why the chip was last reset, as IFG1 shows it
+const uint8_t WDTIFG = 0x01, PORIFG = 0x04, RSTIFG = 0x08;
+
+// Told what the CPU does, for profilers and tracers. Cycles are MCLK cycles, as in Mcu::Stats.
+class Observer
+{
+public:
+	virtual ~Observer() {}
+	// An instruction at pc took this many cycles, including any flash stall
+	virtual void instruction(uint16_t pc, unsigned cycles) = 0;
+	// A cycle with CPUOFF set
+	virtual void asleep() {}
+	// After a CALL from pc has pushed its return address to sp
+	virtual void call(uint16_t pc, uint16_t target, uint16_t sp) = 0;
+	// After a RET or RETI at pc, with sp as it left it
+	virtual void ret(uint16_t pc, uint16_t sp) = 0;
+	// After the entry cycles of an interrupt, which had been asked for latency cycles earlier by its
+	// peripheral. sp has the pushed PC and SR.
+	virtual void interrupt(uint16_t vector, uint16_t isr, uint16_t sp, unsigned entryCycles,
+		uint64_t latency) = 0;
+	// After a reset, at the reset vector
+	virtual void reset() = 0;
+};
+
+class Mcu
+{
+public:
+	Mcu();
+	Mcu(const Mcu&) = delete;
+	Mcu& operator=(const Mcu&) = delete;
+
+	// The 64 KiB address space as loaded from images. Load before powerOn; after that, flash only
+	// changes through the flash controller, as on the chip.
+	uint8_t*	memory() { return m_mem; }
+
+	// Power on (PORIFG), or pulse /RST (RSTIFG). RAM is kept by a reset, and is zero at power-on.
+	void	powerOn();
+	void	reset();
+
+	// Run until time t. May be called again to go on.
+	void	run(Time t);
+	// Call f at time t, which may be now. Several at the same time are called in the order given.
+	void	at(Time t, std::function<void()> f);
+	Time	now() const { return m_now; }
+
+	// Pins: port 1 to 3, bit 0 to 7. An input that nothing drives reads high.
+	void	setInput(int port, int bit, bool level);
+	bool	pin(int port, int bit) const { return m_level[port-1] >> bit & 1; }
+	// Call f with the new level whenever the pin changes, whichever way it is driven
+	void	watchPin(int port, int bit, std::function<void(bool)> f);
+	// Wire /RST to an input pin, as our boards do through an RC filter: holding the pin low for longer
+	// than low resets the chip when it goes high again.
+	void	resetOnLow(int port, int bit, Time low = 10 * Millisecond);
+
+	// The 10-bit code that ADC10 converts on channel n (0 to 15). Unset, every channel reads 512.
+	std::function<unsigned(int channel)> analog;
+
+	// The watch crystal's frequency error in parts per million, for skew between devices
+	void	setCrystalPpm(double ppm);
+
+	// Tell o what the CPU does from now on, or no one if null. Slows it down a little.
+	void	setObserver(Observer* o) { m_observer = o; m_requested = 0; }
+
+	// Registers, for tests and for tools that trace the program
+	uint16_t reg(int n) const { return m_r[n]; }
+	uint16_t pc() const { return m_r[0]; }
+	uint16_t read16(uint16_t address) { return readWord(address); }	// As the CPU would; may have side effects
+	void	write16(uint16_t address, uint16_t v) { writeWord(address, v); }
+	double	dcoHz() const { return m_dcoHz; }
+
+	// For leaping over time the firmware spends waiting (see fastforward.h)
+	// Call f just before each instruction at pc runs, or at none if f is empty. One address at a time.
+	void	onPc(uint16_t pc, std::function<void()> f) { m_hookPc = pc; m_hook = std::move(f); }
+	// Whether a peripheral is asking for an interrupt, whether or not GIE lets it
+	bool	interruptRequested() { return requests() != 0; }
+	// When the next thing given to at(), or scheduled by a peripheral, is due
+	Time	nextEvent() const { return m_nextEvent; }
+	// When ACLK will next rise for the nth time (n from 1)
+	Time	aclkRise(uint64_t n) const;
+	// How many times Timer_A n, clocked from SMCLK, will have counted by time t, and when it will count
+	// for the cth time (c from 1), with the DCO as it is now
+	uint64_t timerCounts(int n, Time t) const;
+	Time	timerCountTime(int n, uint64_t c) const;
+	// Go on to time t as if the CPU spent it in a loop that clears the watchdog, with no interrupt
+	// taken. The DCO stays as it is; the crystal, ACLK and the timers move on, but the timers set no
+	// flag except TAIFG, make no capture and don't change their outputs. Anything due with at() by t
+	// still happens. Returns how many times ACLK rose, and each timer's count at the last of them.
+	struct Leap
+	{
+		uint64_t	aclkRises = 0;
+		uint16_t	atAclkRise[2] = {};
+	};
+	Leap	leap(Time t);
+
+	struct Stats
+	{
+		uint64_t instructions = 0, cycles = 0;	// MCLK cycles, including interrupt entry and flash stalls
+		uint64_t sleepCycles = 0;				// Those with CPUOFF set
+		uint64_t leapCycles = 0;				// Those leapt over
+		uint64_t interrupts = 0, resets = 0, watchdogResets = 0, keyViolations = 0;
+		uint64_t vectorInterrupts[16] = {};		// By vector, from $FFE0 up
+		uint64_t illegal = 0;					// Undefined instructions, run as NOPs
+		uint16_t lastIllegal = 0;
+	};
+	const Stats& stats() const { return m_stats; }
+
+private:
+	// The peripherals' registers and state. Register addresses and bits are those of msp430g2553.h.
+	struct Timer
+	{
+		int			n;					// 0 or 1
+		uint16_t	ctl, r, cctl[3], ccr[3];
+		unsigned	divCount;
+		bool		down;				// Counting down in up/down mode
+		bool		out[3];				// The output units
+		bool		inA[3], inB[3];		// Capture inputs CCIxA and CCIxB
+		bool		capPending[3];		// A synchronised capture waiting for the next timer clock
+	};
+	struct Usci
+	{
+		uint8_t		ctl0, ctl1, br0, br1, mctl, stat, rxbuf, txbuf;
+		bool		txFull;				// TXBUF has a byte for the shift register
+		int			txBit;				// The bit being sent (0 the start bit, 9 the stop bit), or -1
+		uint16_t	txShift;
+		unsigned	txCount;			// BRCLKs left of this bit
+		bool		txd;				// The level of UCA0TXD
+		int			rxBit;				// The bit to be sampled next, or -1 while the line is idle
+		unsigned	rxCount;
+		uint16_t	rxShift;
+		bool		rxd, rxWaitHigh;	// The level of UCA0RXD, and whether a frame must end first
+		unsigned	bitFrac;			// Modulation remainder, in eighths of a BRCLK
+	};
+	struct Adc
+	{
+		uint16_t	ctl0, ctl1, mem, sa;
+		uint8_t		dtc0, dtc1, ae0;
+		bool		busy;
+		unsigned	channel;			// Being converted
+		unsigned	transfers;			// By the DTC into this block
+		uint64_t	generation;			// So a conversion stopped early doesn't complete
+	};
+	struct Port
+	{
+		uint8_t		out, dir, sel, sel2, ren, ifg, ies, ie;
+		uint8_t		ext;				// Driven from outside
+	};
+	struct Event
+	{
+		Time		t;
+		uint64_t	seq;
+		std::function<void()> f;
+		bool operator<(const Event& e) const { return t != e.t ? t > e.t : seq > e.seq; }
+	};
+
+	// cpu.cpp
+	void	step();
+	void	execute(uint16_t op, uint16_t pc);
+	unsigned cyclesOf(uint16_t op) const;
+	uint16_t fetch();
+	uint16_t readWord(uint16_t a);
+	uint8_t	readByte(uint16_t a);
+	void	writeWord(uint16_t a, uint16_t v);
+	void	writeByte(uint16_t a, uint8_t v);
+	void	interrupt(uint16_t vector);
+	uint16_t pendingVector();
+	unsigned requests();
+	void	trackRequests();
+	void	puc(uint8_t why);
+
+	// peripherals.cpp
+	void	resetPeripherals(bool por);
+	uint16_t readPeripheral(uint16_t a, bool word);
+	void	writePeripheral(uint16_t a, uint16_t v, bool word);
+	void	writeFlash(uint16_t a, uint16_t v, bool word);
+	void	clocks(unsigned mclkCycles);
+	void	setDco();
+	void	crystalTick();
+	Time	cycleTime(uint64_t cycles) const;
+	uint64_t cyclesUntil(Time t) const;
+	Time	crystalPeriod() const { return static_cast<Time>(Second / (2 * m_xtalHz)); }
+	void	timerClock(Timer& t);
+	uint64_t timerAdvance(Timer& t, uint64_t clocks);
+	void	timerEqu(Timer& t, int x);
+	void	timerCapture(Timer& t, int x);
+	void	timerInput(Timer& t, int x, bool a, bool level);
+	void	timerWriteCctl(Timer& t, int x, uint16_t v);
+	uint16_t timerIv(Timer& t);
+	bool	timerCcrPending(const Timer& t) const;
+	void	usciClock();
+	void	usciWriteTx(uint8_t v);
+	void	usciLoad();
+	void	usciRxEdge(bool level);
+	unsigned usciBitLength();
+	void	adcStart();
+	void	adcDone(uint64_t generation);
+	void	watchdogClock();
+	void	updatePins();
+	void	runEvents();
+
+	uint8_t		m_mem[0x10000];
+	uint16_t	m_r[16];
+	bool		m_gieBefore = false;	// GIE at the start of the last instruction, as it gates interrupts
+	bool		m_pucPending = false;	// A reset asked for by a peripheral, taken before the next instruction
+	uint8_t		m_pucWhy = 0;			// The IFG1 flag it sets
+
+	// Time
+	Time		m_now = 0;
+	uint64_t	m_frac = 0;				// Fractions of a picosecond, in 2^-16 ps, carried between cycles
+	uint64_t	m_periodFx = 0;			// DCO period in 2^-16 ps
+	double		m_dcoHz = 0;
+	double		m_xtalHz = 32768;
+	uint64_t	m_xtalTicks = 0;		// Crystal half-cycles so far
+	Time		m_nextXtal = 0;			// When the next one ends
+	unsigned	m_smclkDiv = 0;
+	unsigned	m_stall = 0;			// MCLK cycles the flash controller holds the CPU for
+	std::priority_queue<Event> m_events;
+	uint64_t	m_eventSeq = 0;
+	Time		m_nextEvent = ~Time(0);
+
+	// Special function registers and the basic clock module
+	uint8_t		m_ie1 = 0, m_ie2 = 0, m_ifg1 = 0, m_ifg2 = 0;
+	uint8_t		m_dcoctl = 0, m_bcsctl1 = 0, m_bcsctl2 = 0, m_bcsctl3 = 0;
+	unsigned	m_aclkDiv = 0;
+	bool		m_aclk = false;
+
+	// Watchdog and flash controller
+	uint16_t	m_wdtctl = 0;
+	unsigned	m_wdtCount = 0;
+	uint16_t	m_fctl1 = 0, m_fctl2 = 0, m_fctl3 = 0;
+	Time		m_flashBusyUntil = 0;
+
+	Timer		m_ta[2];
+	Usci		m_uca;
+	Adc			m_adc;
+	Port		m_port[3];
+	uint8_t		m_level[3] = {0xFF, 0xFF, 0xFF};	// What each pin is at
+
+	struct Watch { int port, bit; std::function<void(bool)> f; };
+	std::vector<Watch> m_watches;
+	int			m_rstPort = 0, m_rstBit = 0;
+	Time		m_rstLow = 0, m_rstFell = 0;
+	bool		m_rstHeld = false;		// /RST has been low long enough, and the chip is held in reset
+	bool		m_powered = false;
+
+	Stats		m_stats;
+	Observer*	m_observer = nullptr;
+	unsigned	m_requested = 0;		// Vectors asking for an interrupt, a bit each from $FFE0 up
+	uint64_t	m_requestedAt[16];		// The cycle each began asking
+	uint16_t	m_hookPc = 0;
+	std::function<void()> m_hook;
+};
+
+// Drives a UART input pin with bytes at a baud rate, and decodes bytes from an output pin. Inverted
+// pins idle low, as our opto-isolated TxMi outputs do.
+class SerialPin
+{
+public:
+	SerialPin(Mcu& mcu, int rxPort, int rxBit, int txPort, int txBit, unsigned baud = 9600,
+		bool txInverted = false);
+
+	// Send a byte to the input pin after any still being sent, with one stop bit
+	void	send(uint8_t byte);
+	// Hold the input pin at the space level for a time, as a break
+	void	sendBreak(Time length);
+	bool	idle() const { return m_sendEnd <= m_mcu.now(); }
+
+	// Called with each byte decoded from the output pin, and with -1 for a framing error
+	std::function<void(int)> onByte;
+
+	// The baud rate as the other end sees it, for skew: 1.0 is exact
+	void	setSkew(double factor) { m_bitTime = static_cast<Time>(Second / (m_baud * factor)); }
+
+private:
+	void	edge(bool level);
+	void	sample(int bit, uint64_t frame);
+
+	Mcu&		m_mcu;
+	int			m_rxPort, m_rxBit;		// The device's input
+	unsigned	m_baud;
+	Time		m_bitTime;
+	bool		m_txInverted;
+	Time		m_sendEnd = 0;
+	bool		m_receiving = false;
+	uint64_t	m_frame = 0;
+	unsigned	m_data = 0;
+	bool		m_level = true;			// The device's output, as the line has it
+};
+
+// Load an image into a 64 KiB address space, as sendprog does: Intel HEX, TI-TXT (.txt), or binary
+// (.bin, ending at $FFFF). Bytes it doesn't have are left alone, so several images can be laid over
+// each other. Returns false with a reason if it can't.
+bool loadImage(const std::string& name, uint8_t* memory, std::string& error);
+
+}	// namespace msp430
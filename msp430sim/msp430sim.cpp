@@ -0,0 +1,545 @@
+// msp430sim.cpp : run a firmware image on a simulated MSP430G2553, behind a pseudo-terminal
+//
+// Written 17/Oct/2026
+//
+// Usage: msp430sim [-n <id> | -c <CMUs> [-m]] [-a [<id>:]<channel>=<code>] [-s <id>:<channel>=<code>@<seconds>]
+//						[-p <ppm>] [-k <ppm>] [-r <seed>] [-d <us>] [-j <threads>] [-l <link>] [-t <seconds>] [-f]
+//						[-b <Ah> [-o <SoC %>] [-i <amps>]] [-P <listing or map> | -F <listing or map>] <image>...
+//						[-- <command>]
+//	-n	Make the device's info flash that of a calibrated device with this ID, where it's erased: infoID,
+//		infoDataVers, unity voltage calibrations, and the temperature sensor's slope and TLV calibration.
+//		ID 255 is a BMU.
+//	-c	Run a chain of this many CMUs, with IDs 1 up whatever the images say, and calibrated as for -n
+//	-m	With a BMU (ID 255) at the head of the chain. A BMU and 254 CMUs is the longest there can be.
+//	-a	The ADC10 code that a channel converts (default 512; the temperature sensor, channel 10, 673,
+//		about 30 C), on every device or on the one with this ID. May be given more than once.
+//	-s	A step: from this many seconds on, the device with this ID converts this code on this channel.
+//		At the end msp430sim says how long the status bytes reaching the head of the chain took to change.
+//	-p	The watch crystals' error in parts per million
+//	-k	Give each device's crystal a further error of up to this many ppm either way, at random
+//	-r	The seed for those (default 1), so a run can be repeated
+//	-d	The delay through each link between devices, in microseconds (default 10)
+//	-j	The host threads to run a chain on (default one per core)
+//	-l	Make a symbolic link to the pseudo-terminal, for programs that want a fixed port name
+//	-t	Stop after this many seconds of simulated time
+//	-f	Run as fast as the host can, instead of in step with real time
+//	-b	Have the devices measure a pack of cells of this capacity (see pack.h), a cell for each CMU (or 16
+//		for a BMU alone), instead of fixed codes on the cell, bolt and temperature channels; -a and -s still
+//		override them. The CMUs' bypass outputs (P2.5) load the cells, and a BMU's contactors (P3) let the
+//		current through, charge only while the source contactor is closed.
+//	-o	The cells' state of charge at the start, in percent (default 50)
+//	-i	The current into the pack in amps, charging positive (default 0)
+//	-P	Profile the run of the head device, with labels from the IAR assembler listing or XLINK map (see
+//		profile.h), and print a flat profile, a call graph and each vector's interrupt latencies at the end
+//	-F	Fast-forward monolith, with labels from its listing or map: leap over the time the devices spend
+//		waiting for their next tick (see fastforward.h). Implies -f.
+// Images are Intel HEX, TI-TXT or binary (ending at $FFFF), laid over each other in the order given over
+// an erased chip, e.g. monolith.bin and a TI-TXT dump of info flash. The pseudo-terminal is the CMU port
+// (P1.1 and P1.2) of a CMU, or the SCU port (P3.0 and P3.5) of a BMU, whose CMU port is looped back as
+// an empty chain would be. Either way, holding Rx low for 10 ms resets the device, as on the board.
+// In a chain (see chain.h) the pseudo-terminal is the BMU's SCU port, or without one, the first CMU's
+// receive and the last CMU's transmit, and the devices run in lockstep on several threads, the same
+// whatever the number.
+// With a command, msp430sim runs it with every %p in its arguments replaced by the pseudo-terminal's
+// path, and stops when it exits. At the end it prints what the CPUs did, and the traffic on the links.
+// Example: msp430sim -n 1 wmonolith.bin -- lfquery -p %p v
+// Example: msp430sim -c 64 -m -k 50 -f -t 20 -s 40:7=1000@10 monolith.bin
+// Example: msp430sim -n 255 -b 100 -i 20 -t 86400 -F monolith.lst monolith.bin
+
+#include "chain.h"
+#include "pack.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace msp430;
+
+static void usage()
+{
+	fprintf(stderr, "Usage: msp430sim [-n id | -c CMUs [-m]] [-a [id:]channel=code] [-s id:channel=code@seconds] "
+		"[-p ppm] [-k ppm] [-r seed] [-d us] [-j threads] [-l link] [-t seconds] [-f] [-b Ah [-o SoC%%] "
+		"[-i amps]] [-P symbols | -F symbols] image... [-- command]\n");
+	exit(1);
+}
+
+// Fill in a calibrated device's info flash (see common/common.h), where it's erased
+static void calibrate(uint8_t* mem, unsigned id)
+{
+	auto word = [mem](unsigned a, unsigned v) {
+		if (mem[a] == 0xFF && mem[a+1] == 0xFF) {
+			mem[a] = static_cast<uint8_t>(v);
+			mem[a+1] = static_cast<uint8_t>(v >> 8);
+		}
+	};
+	if (mem[0x1016] == 0xFF)
+		mem[0x1016] = static_cast<uint8_t>(id);		// infoID
+	if (mem[0x1017] == 0xFF)
+		mem[0x1017] = 7;								// infoDataVers: DATAVERS
+	word(0x1004, 0x8000);								// infoBoltMiCal
+	word(0x100E, 0x8000);								// infoBoltPlCal
+	word(0x1010, 0x8000);								// infoCellCal
+	word(0x1006, 27101);								// infoTempSlope
+	word(0x10E2, 673);									// CALADC_15T30
+}
+
+// A change to one device's ADC input part way through a run, and what the head of the chain saw of it
+struct Step
+{
+	unsigned	id;
+	int			channel;
+	unsigned	code;
+	Time		t;
+	bool		based = false;		// Whether the status before it is known
+	int			before = -1, after = -1;
+	Time		seen = 0;			// When the status byte that changed began
+};
+
+// What a device measures of the pack: the sums its channels are to make, and how many conversions each
+// has done
+struct PackInput
+{
+	monolith::Info			info;
+	monolith::Device::Sums	sums;
+	unsigned				conversions[16] = {};
+	size_t					cell = 0;
+};
+
+int main(int argc, char* argv[])
+{
+	int id = -1;
+	Chain::Config config;
+	config.cmus = 0;
+	config.threads = std::max(1u, std::thread::hardware_concurrency());
+	double seconds = 0;
+	bool fast = false;
+	const char* link = nullptr;
+	const char* symbols = nullptr;
+	const char* fastSymbols = nullptr;
+	std::map<unsigned, std::map<int, unsigned>> codes;	// By ID, with 0 for every device
+	std::vector<Step> steps;
+	std::vector<std::string> images;
+	char** cmd = nullptr;
+	Pack::Config packConfig;
+	packConfig.capacity = 0;
+	double packAmps = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string a = argv[i];
+		if (a == "--") {
+			cmd = argv + i + 1;
+			break;
+		}
+		if (a[0] != '-') {
+			images.push_back(a);
+			continue;
+		}
+		if (a == "-f") {
+			fast = true;
+			continue;
+		}
+		if (a == "-m") {
+			config.bmu = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+			usage();
+		const char* v = argv[++i];
+		if (a == "-n")
+			id = atoi(v);
+		else if (a == "-c")
+			config.cmus = static_cast<unsigned>(atoi(v));
+		else if (a == "-a") {
+			unsigned dev = 0, code;
+			int chan;
+			if (!(sscanf(v, "%u:%d=%u", &dev, &chan, &code) == 3 || (dev = 0, sscanf(v, "%d=%u", &chan, &code) == 2))
+					|| chan < 0 || chan > 15 || code > 1023)
+				usage();
+			codes[dev][chan] = code;
+		} else if (a == "-s") {
+			Step step;
+			double at;
+			if (sscanf(v, "%u:%d=%u@%lf", &step.id, &step.channel, &step.code, &at) != 4 || step.channel < 0
+					|| step.channel > 15 || step.code > 1023 || at < 0)
+				usage();
+			step.t = static_cast<Time>(at * Second);
+			steps.push_back(step);
+		} else if (a == "-p")
+			config.ppm = atof(v);
+		else if (a == "-k")
+			config.tolerance = atof(v);
+		else if (a == "-r")
+			config.seed = static_cast<uint32_t>(strtoul(v, nullptr, 0));
+		else if (a == "-d")
+			config.linkDelay = static_cast<Time>(atof(v) * Microsecond);
+		else if (a == "-j")
+			config.threads = static_cast<unsigned>(atoi(v));
+		else if (a == "-l")
+			link = v;
+		else if (a == "-t")
+			seconds = atof(v);
+		else if (a == "-P")
+			symbols = v;
+		else if (a == "-F") {
+			fastSymbols = v;
+			fast = true;
+		}
+		else if (a == "-b")
+			packConfig.capacity = atof(v);
+		else if (a == "-o")
+			packConfig.soc = atof(v) / 100;
+		else if (a == "-i")
+			packAmps = atof(v);
+		else
+			usage();
+	}
+	bool chained = config.cmus > 0 || config.bmu;
+	if (images.empty() || config.linkDelay == 0 || config.cmus > 254 || (chained && id >= 0)
+			|| packConfig.capacity < 0 || (symbols && fastSymbols))
+		usage();
+
+	std::unique_ptr<Mcu> loaded(new Mcu);			// An erased chip to lay the images over
+	uint8_t* mem = loaded->memory();
+	for (const std::string& image : images) {
+		std::string error;
+		if (!loadImage(image, mem, error)) {
+			fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+	}
+	// Alone, a device is a BMU or a CMU as its ID says
+	std::vector<unsigned> ids;
+	if (!chained) {
+		if (id >= 0)
+			calibrate(mem, id);
+		config.bmu = mem[0x1016] == 255;
+		config.cmus = config.bmu ? 0 : 1;
+		ids.push_back(mem[0x1016]);
+	} else {
+		if (config.bmu)
+			ids.push_back(255);
+		for (unsigned c = 1; c <= config.cmus; ++c)
+			ids.push_back(c);
+	}
+
+	Chain chain(config, mem);
+	std::unique_ptr<Pack> pack;
+	if (packConfig.capacity > 0) {
+		packConfig.cells = config.cmus ? config.cmus : 16;
+		pack.reset(new Pack(packConfig));
+	}
+	std::vector<std::map<int, unsigned>> deviceCodes(chain.size());
+	std::vector<PackInput> packInputs(chain.size());
+	for (size_t i = 0; i < chain.size(); ++i) {
+		Mcu& mcu = chain.node(i);
+		if (chained) {
+			mcu.memory()[0x1016] = 0xFF;
+			calibrate(mcu.memory(), ids[i]);
+		}
+		std::map<int, unsigned>& c = deviceCodes[i];
+		if (!pack)
+			c[10] = 673;
+		for (const auto& e : codes[0])
+			c[e.first] = e.second;
+		for (const auto& e : codes[ids[i]])
+			c[e.first] = e.second;
+		if (!pack) {
+			mcu.analog = [&c](int channel) { return c.count(channel) ? c[channel] : 512u; };
+			continue;
+		}
+		PackInput& in = packInputs[i];
+		in.info = monolith::Info(mcu.memory());
+		in.cell = chained && ids[i] != 255 ? ids[i] - 1 : 0;
+		mcu.analog = [&c, &in](int channel) {
+			if (c.count(channel))
+				return c[channel];
+			uint16_t sum;
+			switch (channel) {
+			case monolith::CellVChan:	sum = in.sums.cellV; break;
+			case monolith::BoltVPlChan:	sum = in.sums.boltPlV; break;
+			case monolith::BoltVMiChan:	sum = in.sums.boltMiV; break;
+			case monolith::TempChan:	sum = in.sums.temperature; break;
+			default:					return 512u;
+			}
+			return Pack::code(sum, in.conversions[channel]++);
+		};
+	}
+	// The pack runs between slices, while the devices' threads wait, so they read their sums unlocked
+	const Time packStep = 10 * Millisecond;
+	Time packTime = 0;
+	auto measurePack = [&]() {
+		for (size_t i = 0; i < chain.size(); ++i) {
+			PackInput& in = packInputs[i];
+			in.sums = ids[i] == 255 ? pack->bmuSums(in.info) : pack->cmuSums(in.cell, in.info);
+		}
+	};
+	if (pack)
+		measurePack();
+	// Each step is made in its device's own thread, at its time
+	for (const Step& step : steps) {
+		size_t i = std::find(ids.begin(), ids.end(), step.id) - ids.begin();
+		if (i == ids.size()) {
+			fprintf(stderr, "There is no device with ID %u\n", step.id);
+			return 1;
+		}
+		std::map<int, unsigned>& c = deviceCodes[i];
+		int channel = step.channel;
+		unsigned code = step.code;
+		chain.node(i).at(step.t, [&c, channel, code] { c[channel] = code; });
+	}
+
+	Profiler profiler;
+	if (symbols) {
+		if (profiler.loadSymbols(symbols) < 0) {
+			fprintf(stderr, "Could not read %s\n", symbols);
+			return 1;
+		}
+		chain.node(0).setObserver(&profiler);
+	}
+	if (fastSymbols) {
+		FastForward::Symbols labels;
+		std::string missing;
+		if (readSymbols(fastSymbols, [&labels](uint16_t a, const std::string& l) { labels.emplace(l, a); }) < 0) {
+			fprintf(stderr, "Could not read %s\n", fastSymbols);
+			return 1;
+		}
+		if (!FastForward::check(labels, missing)) {
+			fprintf(stderr, "%s has no %s\n", fastSymbols, missing.c_str());
+			return 1;
+		}
+		chain.fastForward(labels);
+	}
+
+	// Status bytes (with bit 7 set; everything else is a command or a response) on the last link, which
+	// goes into the BMU or the host
+	uint64_t statusBytes = 0;
+	int lastStatus = -1;
+	size_t headLink = chain.links() - 1;
+	chain.onLinkByte = [&](size_t l, Time t, int b) {
+		if (l != headLink || b < 0x80)
+			return;
+		++statusBytes;
+		for (Step& step : steps) {
+			if (step.t > t || step.after >= 0)
+				continue;
+			if (!step.based) {
+				step.based = true;
+				step.before = lastStatus;
+			}
+			if (b != step.before) {
+				step.after = b;
+				step.seen = t;
+			}
+		}
+		lastStatus = b;
+	};
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	const char* slaveName;
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0 || (slaveName = ptsname(master)) == nullptr) {
+		perror("Could not open a pseudo-terminal");
+		return 1;
+	}
+	std::string portName = slaveName;
+	// Keep the slave open ourselves, so the master doesn't see a hangup between the host's opens
+	int slave = open(portName.c_str(), O_RDWR | O_NOCTTY);
+	if (slave < 0) {
+		perror(portName.c_str());
+		return 1;
+	}
+	struct termios raw;
+	tcgetattr(slave, &raw);
+	cfmakeraw(&raw);
+	cfsetspeed(&raw, B9600);
+	tcsetattr(slave, TCSANOW, &raw);
+	if (link) {
+		unlink(link);
+		if (symlink(portName.c_str(), link) < 0) {
+			perror(link);
+			return 1;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	pid_t child = 0;
+	int status = 0;
+	if (cmd && *cmd) {
+		child = fork();
+		if (child == 0) {
+			// Replace %p in the arguments with the port
+			for (int i = 0; cmd[i]; ++i) {
+				std::string s = cmd[i];
+				size_t p = s.find("%p");
+				if (p != std::string::npos)
+					cmd[i] = strdup(s.replace(p, 2, portName).c_str());
+			}
+			close(master);
+			execvp(cmd[0], cmd);
+			perror(cmd[0]);
+			_exit(127);
+		}
+	} else {
+		if (!chained)
+			printf("%s on %s\n", config.bmu ? "BMU" : "CMU", portName.c_str());
+		else
+			printf("%s%u CMUs on %s\n", config.bmu ? "A BMU and " : "", config.cmus, portName.c_str());
+		fflush(stdout);
+	}
+
+	chain.onHostByte = [master](Time, int b) {
+		if (b >= 0) {
+			uint8_t c = static_cast<uint8_t>(b);
+			ssize_t n = write(master, &c, 1);	// With no reader yet, the byte is lost, as on a real line
+			(void)n;
+		}
+	};
+
+	chain.powerOn();
+	// Leaps go no further than a slice, so fast-forwarded they're longer; the pack steps once a slice then
+	const Time slice = fastSymbols ? 100 * Millisecond : Millisecond;
+	Time end = seconds > 0 ? static_cast<Time>(seconds * Second) : ~Time(0);
+	auto start = std::chrono::steady_clock::now();
+	for (Time t = slice; chain.now() < end; t += slice) {
+		chain.run(std::min(t, end));
+		if (pack && chain.now() - packTime >= packStep) {
+			// The BMU's positive contactor carries the current, and its source contactor any charge
+			double amps = packAmps;
+			if (config.bmu) {
+				const Mcu& bmu = chain.node(0);
+				if (!bmu.pin(3, 2) || (amps > 0 && !bmu.pin(3, 4)))
+					amps = 0;
+			}
+			for (size_t i = 0; i < chain.size(); ++i)
+				if (ids[i] != 255)
+					pack->setBypass(packInputs[i].cell, chain.node(i).pin(2, 5));
+			pack->step(static_cast<double>(chain.now() - packTime) / Second, amps);
+			packTime = chain.now();
+			measurePack();
+		}
+
+		// Bytes from the host, each sent after those before it
+		struct pollfd pfd = {master, POLLIN, 0};
+		while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+			uint8_t buf[64];
+			ssize_t n = read(master, buf, sizeof buf);
+			if (n <= 0)
+				break;
+			for (ssize_t i = 0; i < n; ++i)
+				chain.send(buf[i]);
+		}
+
+		if (!fast)
+			std::this_thread::sleep_until(start + std::chrono::nanoseconds(chain.now() / 1000));
+		if (child && waitpid(child, &status, WNOHANG) == child) {
+			child = 0;
+			break;
+		}
+	}
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (link)
+		unlink(link);
+	auto ull = [](uint64_t n) { return static_cast<unsigned long long>(n); };
+	Mcu::Stats s;
+	double dcoLo = 1e9, dcoHi = 0;
+	unsigned lastIllegalId = 0;
+	for (size_t i = 0; i < chain.size(); ++i) {
+		const Mcu::Stats& n = chain.node(i).stats();
+		s.instructions += n.instructions;
+		s.cycles += n.cycles;
+		s.sleepCycles += n.sleepCycles;
+		s.leapCycles += n.leapCycles;
+		s.interrupts += n.interrupts;
+		s.resets += n.resets;
+		s.watchdogResets += n.watchdogResets;
+		s.keyViolations += n.keyViolations;
+		s.illegal += n.illegal;
+		if (n.illegal) {
+			s.lastIllegal = n.lastIllegal;
+			lastIllegalId = ids[i];
+		}
+		dcoLo = std::min(dcoLo, chain.node(i).dcoHz());
+		dcoHi = std::max(dcoHi, chain.node(i).dcoHz());
+	}
+	double simSeconds = static_cast<double>(chain.now()) / Second;
+	printf("Simulated %.3f s", simSeconds);
+	if (chained)
+		printf(" of %u devices on %u threads", static_cast<unsigned>(chain.size()),
+			std::min(config.threads, static_cast<unsigned>(chain.size())));
+	printf(" in %.3f s (%.1f times real time), DCO %.0f Hz", wall, wall > 0 ? simSeconds / wall : 0, dcoLo);
+	if (dcoHi > dcoLo)
+		printf(" to %.0f Hz", dcoHi);
+	printf("\nInstructions %llu, cycles %llu (%.1f%% asleep", ull(s.instructions), ull(s.cycles),
+		s.cycles ? 100.0 * s.sleepCycles / s.cycles : 0);
+	if (fastSymbols)
+		printf(", %.1f%% leapt over in %llu leaps", s.cycles ? 100.0 * s.leapCycles / s.cycles : 0,
+			ull(chain.leaps()));
+	printf("), interrupts %llu\n", ull(s.interrupts));
+	printf("Resets %llu (watchdog %llu), flash key violations %llu, illegal instructions %llu",
+		ull(s.resets), ull(s.watchdogResets), ull(s.keyViolations), ull(s.illegal));
+	if (s.illegal)
+		printf(chained ? " (last at $%04X on ID %u)" : " (last at $%04X)", s.lastIllegal, lastIllegalId);
+	printf("\n");
+
+	if (chained) {
+		uint64_t bytes = 0, errors = 0, busiest = 0;
+		size_t busiestLink = 0;
+		for (size_t l = 0; l < chain.links(); ++l) {
+			const Chain::LinkStats& ls = chain.linkStats(l);
+			bytes += ls.bytes;
+			errors += ls.framingErrors;
+			if (ls.bytes > busiest) {
+				busiest = ls.bytes;
+				busiestLink = l;
+			}
+		}
+		double capacity = simSeconds * config.baud / 10;
+		printf("Links: %llu bytes, %llu framing errors; the busiest, from ID %u, %.1f bytes/s (%.1f%% of the "
+			"line)\n", ull(bytes), ull(errors), ids[busiestLink], simSeconds > 0 ? busiest / simSeconds : 0,
+			capacity > 0 ? 100 * busiest / capacity : 0);
+		printf("Status bytes reaching the head: %llu (%.2f/s), the last $%02X\n", ull(statusBytes),
+			simSeconds > 0 ? statusBytes / simSeconds : 0, lastStatus < 0 ? 0 : lastStatus);
+		for (const Step& step : steps) {
+			printf("Step at %.3f s, ID %u channel %d to %u: ", static_cast<double>(step.t) / Second, step.id,
+				step.channel, step.code);
+			double ms = static_cast<double>(step.seen - step.t) / Millisecond;
+			if (step.after < 0)
+				printf("no change in the status bytes\n");
+			else if (step.before < 0)
+				printf("the first status, $%02X, after %.3f ms\n", step.after, ms);
+			else
+				printf("status $%02X to $%02X after %.3f ms\n", step.before, step.after, ms);
+		}
+	}
+	if (pack) {
+		double vLo = 1e9, vHi = 0, socLo = 1e9, socHi = -1e9;
+		for (size_t c = 0; c < pack->cells(); ++c) {
+			vLo = std::min(vLo, pack->volts(c));
+			vHi = std::max(vHi, pack->volts(c));
+			socLo = std::min(socLo, pack->soc(c));
+			socHi = std::max(socHi, pack->soc(c));
+		}
+		printf("Pack: %u cells at %.1f A, %.3f to %.3f V, SoC %.1f%% to %.1f%%\n",
+			static_cast<unsigned>(pack->cells()), pack->current(), vLo, vHi, socLo * 100, socHi * 100);
+	}
+	if (symbols) {
+		printf("\n");
+		profiler.report(stdout);
+	}
+	if (child)
+		kill(child, SIGTERM);
+	return cmd && *cmd ? (WIFEXITED(status) ? WEXITSTATUS(status) : 1) : 0;
+}
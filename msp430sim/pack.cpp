@@ -0,0 +1,212 @@
+// pack.cpp : a battery of cells in series for simulated BMUs and CMUs to measure
+//
+// Written 17/Oct/2026
+
+#include "pack.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace msp430 {
+
+using namespace monolith;
+
+static const int OcvSteps = 1000;
+static const uint16_t MaxSum = 1023 * NumSamples;
+
+// A number in [-1, 1) from the seed, the cell and what it's for, the same on every host (splitmix64)
+static double spread(uint32_t seed, size_t i, unsigned what)
+{
+	uint64_t z = seed + (i * 8 + what + 1) * 0x9E3779B97F4A7C15ull;
+	z = (z ^ z >> 30) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ z >> 27) * 0x94D049BB133111EBull;
+	z ^= z >> 31;
+	return static_cast<double>(z >> 11) / (1ull << 52) - 1;
+}
+
+// A LiFePO4 cell at rest at 25 C, steep at both ends
+static const std::pair<double, double> LiFePO4[] = {{0, 2.50}, {0.01, 2.80}, {0.03, 3.05}, {0.05, 3.15},
+	{0.10, 3.21}, {0.20, 3.25}, {0.30, 3.275}, {0.40, 3.29}, {0.50, 3.295}, {0.60, 3.30}, {0.70, 3.315},
+	{0.80, 3.33}, {0.90, 3.335}, {0.95, 3.34}, {0.97, 3.35}, {0.98, 3.37}, {0.99, 3.42}, {1, 3.55}};
+
+Pack::Pack(const Config& config)
+	: m_config(config)
+{
+	std::vector<std::pair<double, double>> curve = config.ocv;
+	if (curve.size() < 2)
+		curve.assign(std::begin(LiFePO4), std::end(LiFePO4));
+	size_t k = 0;
+	for (int i = 0; i <= OcvSteps; ++i) {
+		double s = static_cast<double>(i) / OcvSteps;
+		while (k + 2 < curve.size() && curve[k+1].first <= s)
+			++k;
+		const std::pair<double, double>& a = curve[k];
+		const std::pair<double, double>& b = curve[k+1];
+		m_ocvTable.push_back(a.second + (b.second - a.second) * (s - a.first) / (b.first - a.first));
+	}
+	const std::pair<double, double>& first = curve[0];
+	const std::pair<double, double>& second = curve[1];
+	const std::pair<double, double>& last = curve[curve.size() - 1];
+	const std::pair<double, double>& penultimate = curve[curve.size() - 2];
+	m_ocvLowSlope = (second.second - first.second) / (second.first - first.first);
+	m_ocvHighSlope = (last.second - penultimate.second) / (last.first - penultimate.first);
+
+	size_t n = config.cells;
+	for (size_t i = 0; i < n; ++i) {
+		m_capacity.push_back(config.capacity * 3600 * (1 + config.capacitySpread * spread(config.seed, i, 0)));
+		m_soc.push_back(config.soc + config.socSpread * spread(config.seed, i, 1));
+		m_r25.push_back(config.resistance * (1 + config.resistanceSpread * spread(config.seed, i, 2)));
+		m_ocvOffset.push_back(config.ocvSpread * spread(config.seed, i, 3));
+	}
+	m_cellT.assign(n, config.ambient);
+	m_boardT.assign(n, config.ambient);
+	m_bypass.assign(n, 0);
+	m_r.resize(n);
+	m_v.resize(n);
+	update();
+}
+
+// The open-circuit voltage, carried on straight beyond an empty or full cell
+double Pack::ocv(double soc) const
+{
+	if (soc <= 0)
+		return m_ocvTable.front() + soc * m_ocvLowSlope;
+	if (soc >= 1)
+		return m_ocvTable.back() + (soc - 1) * m_ocvHighSlope;
+	double x = soc * OcvSteps;
+	int i = std::min(static_cast<int>(x), OcvSteps - 1);
+	return m_ocvTable[i] + (m_ocvTable[i+1] - m_ocvTable[i]) * (x - i);
+}
+
+// Each cell's resistance at its temperature, R25/7.76 * (1 + 1.046875^(67 - T)) as DoMeasurement has it,
+// and its strap voltage with the bypass resistor (if on) across it: V = E + (I - bV/Rb) R
+void Pack::update()
+{
+	size_t n = cells();
+	double rb = m_config.bypassResistance, amps = m_current;
+	const double lnK = std::log(1.046875);
+	for (size_t i = 0; i < n; ++i)
+		m_r[i] = m_r25[i] / 7.76 * (1 + std::exp(lnK * (67 - m_cellT[i])));
+	for (size_t i = 0; i < n; ++i) {
+		double e = ocv(m_soc[i]) + m_ocvOffset[i];
+		m_v[i] = (e + amps * m_r[i]) / (1 + m_bypass[i] * m_r[i] / rb);
+	}
+}
+
+void Pack::step(double dt, double amps)
+{
+	m_current = amps;
+	update();
+	size_t n = cells();
+	const Config& c = m_config;
+	// Explicit steps, short enough for the board's time constant
+	double tau = c.boardHeatCapacity / (c.boardToCell + c.boardToAmbient);
+	int parts = std::max(1, static_cast<int>(std::ceil(dt / (tau / 4))));
+	double h = dt / parts;
+	for (int p = 0; p < parts; ++p) {
+		for (size_t i = 0; i < n; ++i) {
+			double bypass = m_bypass[i] * m_v[i] / c.bypassResistance;
+			double cell = amps - bypass;
+			m_soc[i] += h * cell / m_capacity[i];
+			double toBoard = c.boardToCell * (m_boardT[i] - m_cellT[i]);
+			double cellHeat = cell * cell * m_r[i] + toBoard - c.cellToAmbient * (m_cellT[i] - c.ambient);
+			double boardHeat = bypass * bypass * c.bypassResistance - toBoard
+				- c.boardToAmbient * (m_boardT[i] - c.ambient);
+			m_cellT[i] += h * cellHeat / c.cellHeatCapacity;
+			m_boardT[i] += h * boardHeat / c.boardHeatCapacity;
+		}
+		update();
+	}
+}
+
+double Pack::packVolts() const
+{
+	double v = 0;
+	for (size_t i = 0; i < cells(); ++i)
+		v += m_v[i];
+	return v + 2 * m_config.terminal * m_current * cells();
+}
+
+// The sum whose reading is nearest target, from a guess, for a reading that never falls as the sum rises
+template <typename F> static uint16_t invert(F reading, int target, double guess)
+{
+	int s = static_cast<int>(std::lround(std::min(std::max(guess, 0.0), static_cast<double>(MaxSum))));
+	while (s < MaxSum && reading(s) < target)
+		++s;
+	while (s > 0 && reading(s - 1) >= target)
+		--s;
+	if (s > 0 && std::abs(reading(s - 1) - target) <= std::abs(reading(s) - target))
+		--s;
+	return static_cast<uint16_t>(s);
+}
+
+// The sum that the temperature sensor would give at t C, and the whole degrees GetTemp makes of it
+static uint16_t temperatureSum(double t, const Info& info, int8_t& cmuTemperature)
+{
+	int half = static_cast<int>(std::lround(t * 2));
+	double quarter = 2.0 * half - 120 - 2 * info.tempOff;
+	double guess = (quarter * 65536 / std::max<unsigned>(info.tempSlope, 1) + 4.0 * info.cal30) * 4;
+	auto reading = [&info](int s) {
+		int16_t h;
+		temperature(static_cast<uint16_t>(s), info, &h);
+		return static_cast<int>(h);
+	};
+	uint16_t sum = invert(reading, half, guess);
+	cmuTemperature = static_cast<int8_t>(temperature(sum, info));
+	return sum;
+}
+
+// What a voltage reading of mv needs, from the calibration, before ApplyTempCo and Mul17Div16Cmu
+static double voltageGuess(double mv, uint16_t cal, int8_t offset, int8_t cmuTemperature, bool cmu)
+{
+	double sum = (mv - offset + (cmuTemperature - 25) / 4.0) * 2 * 65536 / std::max<unsigned>(cal, 1);
+	return cmu ? sum * 16 / 17 : sum;
+}
+
+// The bolt- channel's sum for a reading of mv, a CMU's drop or a BMU's shunt in fifths of an amp. The
+// corrected reading is 2046 and 1.364 for each of those.
+static uint16_t boltMiSum(int mv, const Info& info)
+{
+	uint16_t cal = info.boltMiCal == 0xFFFF ? info.cellCal : info.boltMiCal;
+	double guess = voltageGuess(2046 + mv * 1.364, cal, info.boltMiOff, 25, false);
+	if (info.boltMiOff == -128)
+		return static_cast<uint16_t>(std::lround(std::min(std::max(guess, 0.0), static_cast<double>(MaxSum))));
+	return invert([&](int x) { return static_cast<int>(boltMiV(static_cast<uint16_t>(x), info)); }, mv, guess);
+}
+
+Device::Sums Pack::cmuSums(size_t cell, const Info& info) const
+{
+	Device::Sums s;
+	int8_t t;
+	s.temperature = temperatureSum(m_boardT[cell], info, t);
+	bool cmu = info.id != 255;
+	int v = static_cast<int>(std::lround(m_v[cell] * 1000));
+	s.cellV = invert([&](int x) { return static_cast<int>(cellV(static_cast<uint16_t>(x), info, t)); }, v,
+		voltageGuess(v, info.cellCal, info.cellOff, t, cmu));
+	double drop = m_current * m_config.terminal * 1000;
+	int pl = static_cast<int>(std::lround(m_v[cell] * 1000 + drop));
+	uint16_t plCal = info.boltPlCal == 0xFFFF ? info.cellCal : info.boltPlCal;
+	s.boltPlV = invert([&](int x) { return static_cast<int>(boltPlV(static_cast<uint16_t>(x), info, t)); }, pl,
+		voltageGuess(pl, plCal, info.boltPlOff, t, cmu));
+	s.boltMiV = boltMiSum(static_cast<int>(std::lround(-drop)), info);
+	return s;
+}
+
+Device::Sums Pack::bmuSums(const Info& info) const
+{
+	Device::Sums s;
+	int8_t t;
+	s.temperature = temperatureSum(m_config.ambient + 8, info, t);
+	// Scaled to 16 cells: the firmware's x6.25 makes the reading a 16-cell pack's average cell voltage
+	int v = static_cast<int>(std::lround(packVolts() * 10 * 16 / cells()));
+	s.cellV = invert([&](int x) { return static_cast<int>(cellV(static_cast<uint16_t>(x), info, t)); }, v,
+		voltageGuess(v, info.cellCal, info.cellOff, t, false));
+	int array = static_cast<int>(std::lround(m_config.arrayVoltage * 10));
+	uint16_t plCal = info.boltPlCal == 0xFFFF ? info.cellCal : info.boltPlCal;
+	s.boltPlV = invert([&](int x) { return static_cast<int>(boltPlV(static_cast<uint16_t>(x), info, t)); },
+		array, voltageGuess(array, plCal, info.boltPlOff, t, false));
+	s.boltMiV = boltMiSum(static_cast<int>(std::lround(m_current * 5)), info);	// Fifths of an amp
+	return s;
+}
+
+}	// namespace msp430
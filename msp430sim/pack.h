@@ -0,0 +1,93 @@
+// pack.h : a battery of cells in series for simulated BMUs and CMUs to measure
+//
+// Written 17/Oct/2026
+//
+// Pack	Each cell has its own capacity, open-circuit voltage curve, resistance (which rises in the cold
+//		as DoMeasurement assumes it does, so a CMU given the same infoCellRes estimates its OCV exactly),
+//		terminal resistances and thermal mass, and carries a CMU board whose bypass resistor, when on,
+//		draws current from the cell and heats the board, the cell, and the temperature sensor in the
+//		MSP430 on the board. The state is held as arrays with an element per cell, so a step of a
+//		pack of 255 cells is a few loops that the compiler vectorises.
+//
+// The pack gives each device the sums of NumSamples ADC10 codes on each channel that make its firmware,
+// with its calibration, measure what the model has: a CMU its cell's strap voltage, its bolt drops and its
+// board's temperature; a BMU the pack's voltage in tenths of a volt (as if of 16 cells, as the firmware
+// assumes), the PV array's, the current through its 200 A, 50 mV shunt, and its own temperature, 8 C above
+// ambient as the firmware also assumes. code() spreads a sum over the conversions that make it up.
+
+#pragma once
+
+#include "reference.h"
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace msp430 {
+
+class Pack
+{
+public:
+	struct Config
+	{
+		unsigned	cells = 16;
+		double		capacity = 100;				// Amp-hours
+		double		soc = 0.5;					// At the start, 0 to 1
+		double		resistance = 0.5e-3;		// Ohms at 25 C, as for infoCellRes
+		double		terminal = 20e-6;			// Ohms between each bolt and its strap
+		std::vector<std::pair<double, double>> ocv;	// (SoC, volts), in order of SoC; LiFePO4 if empty
+		// Each cell's differs from those by up to this either way, at random
+		double		capacitySpread = 0.02;		// A fraction
+		double		socSpread = 0.01;
+		double		resistanceSpread = 0.1;		// A fraction
+		double		ocvSpread = 0.002;			// Volts
+		uint32_t	seed = 1;
+		// Heat, in joules per kelvin and watts per kelvin
+		double		cellHeatCapacity = 3000;
+		double		cellToAmbient = 0.5;
+		double		bypassResistance = 3.3;		// Ohms
+		double		boardHeatCapacity = 10;
+		double		boardToCell = 0.2;
+		double		boardToAmbient = 0.03;
+		double		ambient = 25;				// C
+		double		arrayVoltage = 0;			// What the BMU's PV array input sees
+	};
+
+	explicit Pack(const Config& config);
+
+	size_t	cells() const { return m_soc.size(); }
+	// Advance dt seconds with this current through the pack, charging positive
+	void	step(double dt, double amps);
+	void	setBypass(size_t cell, bool on) { m_bypass[cell] = on ? 1.0 : 0.0; }
+	void	setAmbient(double c) { m_config.ambient = c; }
+
+	double	current() const { return m_current; }
+	double	soc(size_t cell) const { return m_soc[cell]; }
+	double	volts(size_t cell) const { return m_v[cell]; }	// Between the cell's straps
+	double	openCircuit(size_t cell) const { return ocv(m_soc[cell]) + m_ocvOffset[cell]; }
+	double	packVolts() const;								// Between the end bolts
+	double	cellTemperature(size_t cell) const { return m_cellT[cell]; }
+	double	boardTemperature(size_t cell) const { return m_boardT[cell]; }
+	double	resistance(size_t cell) const { return m_r[cell]; }	// Now, at its temperature
+
+	// The sums a device with this calibration would have in rawMeasures
+	monolith::Device::Sums cmuSums(size_t cell, const monolith::Info& info) const;
+	monolith::Device::Sums bmuSums(const monolith::Info& info) const;
+	// The code for the nth conversion on a channel, so that any NumSamples in a row add up to sum
+	static unsigned code(uint16_t sum, unsigned n) { return (sum + n % monolith::NumSamples) / monolith::NumSamples; }
+
+private:
+	double	ocv(double soc) const;
+	void	update();
+
+	Config		m_config;
+	double		m_current = 0;
+	std::vector<double> m_ocvTable;			// ocv, at SoCs 0 to 1 in OcvSteps
+	double		m_ocvLowSlope, m_ocvHighSlope;	// Volts per unit SoC, beyond the ends
+	// By cell
+	std::vector<double> m_soc, m_capacity, m_r25, m_ocvOffset;	// Capacity in amp-seconds
+	std::vector<double> m_cellT, m_boardT, m_bypass;
+	std::vector<double> m_r, m_v;			// Resistance and strap voltage now
+};
+
+}	// namespace msp430
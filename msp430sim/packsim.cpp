@@ -0,0 +1,263 @@
+// packsim.cpp : run a BMU and its CMUs' stress, fuel gauge and charge control against a model of their pack
+//
+// Written 17/Oct/2026
+//
+// Usage: packsim [-c <cells>] [-a <Ah>] [-o <SoC %>] [-R <uohm>] [-C <uohm>] [-r <seed>] [-e <C>] [-E <C>]
+//					[-i <amps> | [-s <amps>] [-l <amps>]] [-g pi|chg] [-t <hours>] [-v <seconds>]
+//	-c	Cells, each with a CMU (default 16, at most 254)
+//	-a	Their capacity in amp-hours (default 100), which is also the BMU's infoCapacity
+//	-o	Their state of charge at the start, in percent (default 50)
+//	-R	Their resistance at 25 C in micro-ohms (default 500)
+//	-C	The infoCellRes the devices are given (default what -R says), to see what a wrong one does
+//	-r	The seed for the spread in the cells' capacity, SoC, resistance and curves (default 1)
+//	-e	The ambient temperature (default 25 C),
+//	-E	give or take this much each day, coldest at 5 am
+//	-i	A steady current into the pack in amps, charging positive. Otherwise
+//	-s	the peak of a solar array's charge current, from 6 am to 6 pm (default 40 A),
+//	-l	less a steady load (default 4 A)
+//	-g	Try the charger controller that ControlContactors would call if it weren't #if 0: pi limits the
+//		charge current to PiController's output; chg makes the charger hold the pack at ChgController's
+//		bulk voltage (for 16 cells, scaled to the pack). Otherwise only the source contactors stop it.
+//	-t	Hours to run (default 24)
+//	-v	Print a line of CSV every so many seconds
+// The devices run the firmware's DoMeasurement, DoStatus and ControlContactors from reference.h, ticking
+// together StatusFreq times a second; each status byte passes up the chain within the tick, and each 'i'
+// command reaches every CMU before the next. The pack (see pack.h) runs between ticks, its bypass resistors
+// following the CMUs.
+// Example: packsim -c 254 -s 60 -l 5 -E 10 -t 240 -v 600
+
+#include "pack.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace msp430;
+using namespace monolith;
+
+static void usage()
+{
+	fprintf(stderr, "Usage: packsim [-c cells] [-a Ah] [-o SoC%%] [-R uohm] [-C uohm] [-r seed] [-e C] [-E C] "
+		"[-i amps | [-s amps] [-l amps]] [-g pi|chg] [-t hours] [-v seconds]\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	Pack::Config config;
+	double infoRes = -1, swing = 0, steady = NAN, solar = 40, load = 4, hours = 24, every = 0;
+	std::string controller;
+	for (int i = 1; i < argc; ++i) {
+		std::string a = argv[i];
+		if (a[0] != '-' || i + 1 >= argc)
+			usage();
+		const char* v = argv[++i];
+		if (a == "-c")
+			config.cells = static_cast<unsigned>(atoi(v));
+		else if (a == "-a")
+			config.capacity = atof(v);
+		else if (a == "-o")
+			config.soc = atof(v) / 100;
+		else if (a == "-R")
+			config.resistance = atof(v) * 1e-6;
+		else if (a == "-C")
+			infoRes = atof(v);
+		else if (a == "-r")
+			config.seed = static_cast<uint32_t>(strtoul(v, nullptr, 0));
+		else if (a == "-e")
+			config.ambient = atof(v);
+		else if (a == "-E")
+			swing = atof(v);
+		else if (a == "-i")
+			steady = atof(v);
+		else if (a == "-s")
+			solar = atof(v);
+		else if (a == "-l")
+			load = atof(v);
+		else if (a == "-g")
+			controller = v;
+		else if (a == "-t")
+			hours = atof(v);
+		else if (a == "-v")
+			every = atof(v);
+		else
+			usage();
+	}
+	if (config.cells < 1 || config.cells > 254 || config.capacity <= 0 || config.capacity > 6553
+			|| (!controller.empty() && controller != "pi" && controller != "chg"))
+		usage();
+	if (infoRes < 0)
+		infoRes = config.resistance * 1e6;
+
+	Pack pack(config);
+	Info bmuInfo;
+	bmuInfo.calibrate(255);
+	bmuInfo.capacity = static_cast<uint16_t>(std::lround(config.capacity * 10));
+	bmuInfo.cellRes = static_cast<uint16_t>(std::lround(infoRes));
+	Device bmu(bmuInfo);
+	// Its fuel gauge starting where a rest at the model's mean SoC would have set it
+	bmu.discharge = socToDischarge(static_cast<uint16_t>(std::lround(config.soc * 1000)), bmuInfo.capacity);
+	std::vector<Info> infos;
+	std::vector<Device> cmus;
+	for (unsigned c = 0; c < config.cells; ++c) {
+		Info info;
+		info.calibrate(static_cast<uint8_t>(c + 1));
+		info.cellRes = bmuInfo.cellRes;
+		infos.push_back(info);
+		cmus.push_back(Device(info));
+	}
+
+	const double tick = 1.0 / StatusFreq;
+	const uint64_t ticks = static_cast<uint64_t>(hours * 3600 * StatusFreq);
+	uint64_t stressTicks[16] = {}, allFull = 0, comErrors = 0, sourceDrops = 0, bypassTicks = 0, statusTicks = 0;
+	double ocvErrMax = 0, ocvErrSq = 0, maxBoard = -1e9, minCell = 1e9, maxCell = 0;
+	uint64_t ocvSamples = 0;
+	int16_t chargeLimit = chargerCurrMax;
+	if (every > 0)
+		printf("seconds,amps,pack V,min cell V,max cell V,min SoC %%,max SoC %%,status,DoD %%,true DoD %%,"
+			"bypassing,max board C,contactors,charge stress,charger\n");
+
+	auto start = std::chrono::steady_clock::now();
+	uint64_t t;
+	for (t = 0; t < ticks && !bmu.halted; ++t) {
+		double seconds = static_cast<double>(t) * tick, day = fmod(seconds / 3600, 24);
+		pack.setAmbient(config.ambient - swing * cos((day - 5) / 24 * 2 * M_PI));
+
+		// The current through the pack until the next tick
+		double amps;
+		if (!std::isnan(steady))
+			amps = steady;
+		else {
+			double charge = day > 6 && day < 18 ? solar * sin((day - 6) / 12 * M_PI) : 0;
+			if (!(bmu.contactors & AcLfPvCtor))
+				charge = 0;
+			else if (controller == "pi")
+				charge = std::min<double>(charge, chargeLimit);
+			else if (controller == "chg") {
+				// A charger holding the bulk voltage, for 16 cells, across the pack's resistance
+				double r = 0, e = 0;
+				for (size_t c = 0; c < pack.cells(); ++c) {
+					r += pack.resistance(c);
+					e += pack.openCircuit(c);
+				}
+				double bulk = bmu.chg.prevBulk / 10.0 * pack.cells() / 16;
+				charge = std::max(0.0, std::min(charge, (bulk - e) / r));
+			}
+			amps = charge - load;
+		}
+		if (!(bmu.contactors & BatPosCtor))
+			amps = 0;
+		pack.step(tick, amps);
+
+		// A tick: everyone measures, the status byte goes up the chain to the BMU, and the BMU's 'i' reaches
+		// the CMUs
+		bmu.measure(pack.bmuSums(bmuInfo));
+		int status = -1;
+		for (size_t c = 0; c < cmus.size(); ++c) {
+			int sent = cmus[c].measure(pack.cmuSums(c, infos[c]));
+			if (status >= 0)
+				status = cmus[c].relay(static_cast<uint8_t>(status));
+			else if (sent >= 0)
+				status = sent;
+		}
+		uint8_t before = bmu.contactors;
+		if (status >= 0) {
+			bmu.receive(static_cast<uint8_t>(status));
+			++statusTicks;
+			++stressTicks[status & STRESS];
+			if (status & COM_ERR)
+				++comErrors;
+			else if ((status & S_TYPE) == ALL_FULL)
+				++allFull;
+		}
+		if ((before & AcLfPvCtor) && !(bmu.contactors & AcLfPvCtor))
+			++sourceDrops;
+		for (size_t c = 0; c < cmus.size(); ++c) {
+			cmus[c].currentCommand(bmu.current);
+			pack.setBypass(c, cmus[c].bypass);
+			bypassTicks += cmus[c].bypass;
+		}
+		if (bmu.chargeStress >= 0) {
+			if (controller == "pi")
+				chargeLimit = piController(bmu.pi, bmu.chargeStress);
+			else if (controller == "chg")
+				chgController(bmu.chg, bmu.chargeStress, bmu.chargerTxTimer);
+		}
+
+		// How well the CMUs estimate their cells' open-circuit voltage, once they know the current
+		for (size_t c = 0; c < cmus.size() && t >= ZeroCurrentTicks; ++c) {
+			double err = std::fabs(cmus[c].ocCellVolt - pack.openCircuit(c) * 1000);
+			ocvErrMax = std::max(ocvErrMax, err);
+			ocvErrSq += err * err;
+			++ocvSamples;
+		}
+		double lo = 1e9, hi = 0, loSoc = 1e9, hiSoc = -1e9, board = -1e9, soc = 0;
+		unsigned bypassing = 0;
+		for (size_t c = 0; c < pack.cells(); ++c) {
+			lo = std::min(lo, pack.volts(c));
+			hi = std::max(hi, pack.volts(c));
+			loSoc = std::min(loSoc, pack.soc(c));
+			hiSoc = std::max(hiSoc, pack.soc(c));
+			board = std::max(board, pack.boardTemperature(c));
+			soc += pack.soc(c);
+			bypassing += cmus[c].bypass;
+		}
+		minCell = std::min(minCell, lo);
+		maxCell = std::max(maxCell, hi);
+		maxBoard = std::max(maxBoard, board);
+		if (every > 0 && fmod(seconds + tick, every) < tick / 2) {
+			printf("%.0f,%.1f,%.2f,%.3f,%.3f,%.1f,%.1f,$%02X,%.1f,%.1f,%u,%.1f,$%02X,%d,", seconds + tick, amps,
+				pack.packVolts(), lo, hi, loSoc * 100, hiSoc * 100, bmu.globalStatus,
+				depthOfDischarge(bmu.discharge, bmuInfo.capacity) / 10.0, 100 - soc / pack.cells() * 100,
+				bypassing, board, bmu.contactors, bmu.chargeStress);
+			if (controller == "pi")
+				printf("%d A\n", chargeLimit);
+			else if (controller == "chg")
+				printf("%.1f V\n", bmu.chg.prevBulk / 10.0);
+			else
+				printf("\n");
+		}
+	}
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	double simSeconds = static_cast<double>(t) * tick;
+	printf("Simulated %.2f h of %u cells in %.3f s (%.0f times real time)\n", simSeconds / 3600, config.cells,
+		wall, wall > 0 ? simSeconds / wall : 0);
+	printf("Status bytes reaching the BMU: %llu, %llu with a comms error, %llu all considered full\n",
+		static_cast<unsigned long long>(statusTicks), static_cast<unsigned long long>(comErrors),
+		static_cast<unsigned long long>(allFull));
+	printf("Stress:");
+	for (int s = 0; s < 16; ++s)
+		if (stressTicks[s])
+			printf(" %d: %.1f%%", s, 100.0 * stressTicks[s] / statusTicks);
+	printf("\n");
+	static const char* Types[] = {"", "OV", "UV", "OT", "UT", "AL"};
+	uint8_t worst = 0, worstType = 0;
+	unsigned worstId = 0;
+	for (const Device& d : cmus)
+		if (d.worstStress > worst) {
+			worst = d.worstStress;
+			worstType = d.worstStressType;
+			worstId = d.id;
+		}
+	printf("Worst stress %u", worst);
+	if (worst)
+		printf(" (%s) at CMU %u", worstType <= 5 ? Types[worstType] : "?", worstId);
+	printf("; cells %.3f to %.3f V; boards up to %.1f C; bypassing %.1f cell-hours\n", minCell, maxCell, maxBoard,
+		static_cast<double>(bypassTicks) * tick / 3600);
+	printf("Source contactors dropped %llu times%s\n", static_cast<unsigned long long>(sourceDrops),
+		bmu.halted ? "; the BMU shut the pack down" : "");
+	double soc = 0;
+	for (size_t c = 0; c < pack.cells(); ++c)
+		soc += pack.soc(c);
+	printf("Fuel gauge: DoD %.1f%% (the cells' mean %.1f%%)\n",
+		depthOfDischarge(bmu.discharge, bmuInfo.capacity) / 10.0, 100 - soc / pack.cells() * 100);
+	printf("OCV estimates with infoCellRes %u uohm: error %.1f mV RMS, %.1f mV worst\n", bmuInfo.cellRes,
+		ocvSamples ? std::sqrt(ocvErrSq / ocvSamples) : 0, ocvErrMax);
+	return 0;
+}
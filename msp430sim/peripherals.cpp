@@ -0,0 +1,1028 @@
+// peripherals.cpp : the MSP430G2553's clocks, watchdog, flash controller, timers, USCI_A0, ADC10 and ports
+//
+// Written 17/Oct/2026
+//
+// Each is modelled as far as our firmware uses it, and as SLAU144 describes it:
+// - MCLK and SMCLK are the DCO (DIVM, DIVS and SELM are ignored; all our code runs them at 1:1). The DCO's
+//   frequency is a table of the datasheet's typical RSEL frequencies at DCO = 3, 8% a DCO step, with MOD
+//   mixing in the next step, so a loop that adjusts DCOCTL behaves as on the chip. ACLK is the watch
+//   crystal divided by DIVA.
+// - The watchdog, in watchdog or interval mode, from SMCLK or ACLK. A wrong password resets the chip.
+// - The flash controller's erase, mass erase and write, which stall the CPU for their datasheet times
+//   in flash timing generator cycles when run from flash. Programming can only clear bits. LOCK and
+//   LOCKA are honoured, and a wrong password resets the chip.
+// - Timer0_A3 and Timer1_A3 in all three counting modes, with capture (synchronised or not) on either
+//   input or on a software toggle of CCIS, compare with the SCCI latch, and the output units.
+// - USCI_A0 as a UART with 8 data bits and 1 stop bit, oversampled or not, with break and framing
+//   error detection.
+// - ADC10, with all four sequence modes and the data transfer controller.
+
+#include "msp430.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace msp430 {
+
+// Register bits, named as in msp430g2553.h
+namespace {
+
+const uint16_t TAIFG = 0x0001, TAIE = 0x0002, TACLR = 0x0004;
+const uint16_t CCIFG = 0x0001, COV = 0x0002, OUT = 0x0004, CCI = 0x0008, CCIE = 0x0010, CAP = 0x0100,
+	SCCI = 0x0400, SCS = 0x0800;
+const uint8_t UCA0RXIFG = 0x01, UCA0TXIFG = 0x02, UCA0RXIE = 0x01, UCA0TXIE = 0x02;
+const uint8_t UCSWRST = 0x01, UCBRKIE = 0x10, UCRXEIE = 0x20;
+const uint8_t UCRXERR = 0x04, UCBRK = 0x08, UCOE = 0x20, UCFE = 0x40, UCBUSY = 0x01;
+const uint8_t UCOS16 = 0x01;
+const uint16_t ADC10SC = 0x0001, ENC = 0x0002, ADC10IFG = 0x0004, ADC10ON = 0x0010, MSC = 0x0080;
+const uint16_t ADC10BUSY = 0x0001, ADC10DF = 0x0200;
+const uint8_t ADC10CT = 0x04;
+const uint16_t WDTIS = 0x0003, WDTSSEL = 0x0004, WDTCNTCL = 0x0008, WDTTMSEL = 0x0010, WDTHOLD = 0x0080;
+const uint16_t ERASE = 0x0002, MERAS = 0x0004, WRT = 0x0040, BLKWRT = 0x0080;
+const uint16_t BUSY = 0x0001, KEYV = 0x0002, ACCVIFG = 0x0004, LOCK = 0x0010, LOCKA = 0x0040;
+const uint8_t WDTIE = 0x01;
+
+// Typical DCO frequencies in kHz at DCO = 3, by RSEL, from the MSP430G2x53 datasheet
+const double RselKHz[16] = {100, 150, 210, 300, 410, 580, 800, 1100, 1600, 2300, 3400, 4250, 5800, 7800,
+	11200, 15300};
+const double DcoStep = 1.08;				// Frequency ratio between DCO steps
+const double Adc10OscHz = 5e6;
+
+// Flash timing generator cycles, from the datasheet
+const unsigned FlashProgram = 30, FlashErase = 4819, FlashMassErase = 10593;
+
+// Pins with timer functions. An output is driven when SEL is set, SEL2 clear and DIR set.
+struct TimerPin { int port, bit, timer, x; };
+const TimerPin TimerOutputs[] = {
+	{1, 1, 0, 0}, {1, 5, 0, 0}, {3, 4, 0, 0}, {1, 2, 0, 1}, {1, 6, 0, 1}, {3, 5, 0, 1}, {3, 0, 0, 2},
+	{3, 6, 0, 2}, {2, 0, 1, 0}, {2, 3, 1, 0}, {3, 1, 1, 0}, {2, 1, 1, 1}, {2, 2, 1, 1}, {3, 2, 1, 1},
+	{2, 4, 1, 2}, {2, 5, 1, 2}, {3, 3, 1, 2}};
+// Capture inputs from pins: CCIxA, and CCIxB when b is set. TA0's CCI0B is ACLK.
+struct TimerInputPin { int port, bit, timer, x; bool b; };
+const TimerInputPin TimerInputs[] = {
+	{1, 1, 0, 0, false}, {1, 2, 0, 1, false}, {3, 0, 0, 2, false}, {2, 0, 1, 0, false}, {2, 3, 1, 0, true},
+	{2, 1, 1, 1, false}, {2, 2, 1, 1, true}, {2, 4, 1, 2, false}, {2, 5, 1, 2, true}};
+// USCI_A0 pins on port 1, when SEL and SEL2 are both set
+const uint8_t UcaRxd = 0x02, UcaTxd = 0x04;
+
+}	// namespace
+
+
+// Reset
+
+void Mcu::resetPeripherals(bool por)
+{
+	m_ie1 = m_ie2 = 0;
+	m_ifg2 = UCA0TXIFG | 0x08;				// And UCB0TXIFG
+	m_dcoctl = 0x60;
+	m_bcsctl1 = 0x87;
+	m_bcsctl2 = 0;
+	m_bcsctl3 = 0x05;
+	setDco();
+	m_aclkDiv = m_smclkDiv = 0;
+	if (por)
+		m_nextXtal = m_now + static_cast<Time>(Second / (2 * m_xtalHz));
+
+	m_wdtctl = 0;
+	m_wdtCount = 0;
+	m_fctl1 = 0;
+	m_fctl2 = 0x42;
+	m_fctl3 = LOCK | LOCKA | 0x08;			// And WAIT
+	m_flashBusyUntil = 0;
+
+	for (int n = 0; n < 2; ++n) {
+		Timer& t = m_ta[n];
+		bool inA[3], inB[3];
+		std::copy(t.inA, t.inA + 3, inA);	// The inputs are outside the timer
+		std::copy(t.inB, t.inB + 3, inB);
+		t = Timer();
+		t.n = n;
+		std::copy(inA, inA + 3, t.inA);
+		std::copy(inB, inB + 3, t.inB);
+	}
+
+	bool rxd = m_uca.rxd;
+	m_uca = Usci();
+	m_uca.ctl1 = UCSWRST;
+	m_uca.txBit = m_uca.rxBit = -1;
+	m_uca.txd = true;
+	m_uca.rxd = rxd;
+
+	uint64_t generation = m_adc.generation;
+	m_adc = Adc();
+	m_adc.generation = generation + 1;
+
+	for (int p = 0; p < 3; ++p) {
+		uint8_t ext = m_port[p].ext, out = m_port[p].out;
+		m_port[p] = Port();
+		m_port[p].ext = ext;
+		m_port[p].out = out;				// Undefined after a reset; left as it was
+	}
+	m_port[1].sel = 0xC0;					// XIN and XOUT
+	updatePins();
+}
+
+
+// Register access
+
+uint16_t Mcu::readPeripheral(uint16_t a, bool word)
+{
+	if (a < 0x100) {
+		auto byteReg = [this](uint16_t a) -> uint8_t {
+			switch (a) {
+			case 0x00: return m_ie1;
+			case 0x01: return m_ie2;
+			case 0x02: return m_ifg1;
+			case 0x03: return m_ifg2;
+			case 0x10: return m_port[2].ren;
+			case 0x18: return m_level[2];
+			case 0x19: return m_port[2].out;
+			case 0x1A: return m_port[2].dir;
+			case 0x1B: return m_port[2].sel;
+			case 0x20: case 0x28: return m_level[(a - 0x20) >> 3];
+			case 0x21: case 0x29: return m_port[(a - 0x20) >> 3].out;
+			case 0x22: case 0x2A: return m_port[(a - 0x20) >> 3].dir;
+			case 0x23: case 0x2B: return m_port[(a - 0x20) >> 3].ifg;
+			case 0x24: case 0x2C: return m_port[(a - 0x20) >> 3].ies;
+			case 0x25: case 0x2D: return m_port[(a - 0x20) >> 3].ie;
+			case 0x26: case 0x2E: return m_port[(a - 0x20) >> 3].sel;
+			case 0x27: case 0x2F: return m_port[(a - 0x20) >> 3].ren;
+			case 0x41: case 0x42: case 0x43: return m_port[a - 0x41].sel2;
+			case 0x48: return m_adc.dtc0;
+			case 0x49: return m_adc.dtc1;
+			case 0x4A: return m_adc.ae0;
+			case 0x53: return m_bcsctl3;
+			case 0x56: return m_dcoctl;
+			case 0x57: return m_bcsctl1;
+			case 0x58: return m_bcsctl2;
+			case 0x60: return m_uca.ctl0;
+			case 0x61: return m_uca.ctl1;
+			case 0x62: return m_uca.br0;
+			case 0x63: return m_uca.br1;
+			case 0x64: return m_uca.mctl;
+			case 0x65: return static_cast<uint8_t>(m_uca.stat | (m_uca.txBit >= 0 || m_uca.rxBit >= 0 ? UCBUSY : 0));
+			case 0x66: {
+				uint8_t v = m_uca.rxbuf;
+				m_ifg2 &= ~UCA0RXIFG;
+				m_uca.stat &= ~(UCFE | UCOE | UCBRK | UCRXERR | 0x10);
+				return v;
+			}
+			case 0x67: return m_uca.txbuf;
+			default: return 0;
+			}
+		};
+		if (word)
+			return byteReg(a) | byteReg(a + 1) << 8;
+		return byteReg(a);
+	}
+
+	uint16_t v;
+	uint16_t w = a & 0xFFFE;
+	if (w >= 0x160 && w < 0x1A0) {
+		Timer& t = m_ta[w >= 0x180];
+		unsigned off = w & 0x1F;
+		if (off == 0)
+			v = t.ctl;
+		else if (off <= 6) {
+			int x = off / 2 - 1;
+			unsigned ccis = t.cctl[x] >> 12 & 3;
+			bool cci = ccis == 0 ? t.inA[x] : ccis == 1 ? t.inB[x] : ccis == 3;
+			v = static_cast<uint16_t>((t.cctl[x] & ~CCI) | (cci ? CCI : 0));
+		} else if (off == 0x10)
+			v = t.r;
+		else if (off >= 0x12 && off <= 0x16)
+			v = t.ccr[off / 2 - 9];
+		else
+			v = 0;
+	} else switch (w) {
+	case 0x11E: v = timerIv(m_ta[1]); break;
+	case 0x12E: v = timerIv(m_ta[0]); break;
+	case 0x120: v = 0x6900 | (m_wdtctl & 0xFF); break;
+	case 0x128: v = 0x9600 | m_fctl1; break;
+	case 0x12A: v = 0x9600 | m_fctl2; break;
+	case 0x12C: v = 0x9600 | m_fctl3 | (m_now < m_flashBusyUntil ? BUSY : 0); break;
+	case 0x1B0: v = m_adc.ctl0; break;
+	case 0x1B2: v = static_cast<uint16_t>(m_adc.ctl1 | (m_adc.busy ? ADC10BUSY : 0)); break;
+	case 0x1B4: v = m_adc.mem; break;
+	case 0x1BC: v = m_adc.sa; break;
+	default: v = 0;
+	}
+	if (!word && (a & 1))
+		return v >> 8;
+	return word ? v : v & 0xFF;
+}
+
+void Mcu::writePeripheral(uint16_t a, uint16_t v, bool word)
+{
+	if (a < 0x100) {
+		auto byteReg = [this](uint16_t a, uint8_t v) {
+			switch (a) {
+			case 0x00: m_ie1 = v; break;
+			case 0x01: m_ie2 = v; break;
+			case 0x02: m_ifg1 = v; break;
+			case 0x03: m_ifg2 = v; break;
+			case 0x10: m_port[2].ren = v; break;
+			case 0x19: m_port[2].out = v; updatePins(); break;
+			case 0x1A: m_port[2].dir = v; updatePins(); break;
+			case 0x1B: m_port[2].sel = v; updatePins(); break;
+			case 0x21: case 0x29: m_port[(a - 0x20) >> 3].out = v; updatePins(); break;
+			case 0x22: case 0x2A: m_port[(a - 0x20) >> 3].dir = v; updatePins(); break;
+			case 0x23: case 0x2B: m_port[(a - 0x20) >> 3].ifg = v; break;
+			case 0x24: case 0x2C: m_port[(a - 0x20) >> 3].ies = v; break;
+			case 0x25: case 0x2D: m_port[(a - 0x20) >> 3].ie = v; break;
+			case 0x26: case 0x2E: m_port[(a - 0x20) >> 3].sel = v; updatePins(); break;
+			case 0x27: case 0x2F: m_port[(a - 0x20) >> 3].ren = v; break;
+			case 0x41: case 0x42: case 0x43: m_port[a - 0x41].sel2 = v; updatePins(); break;
+			case 0x48: m_adc.dtc0 = v & 0x0F; break;
+			case 0x49: m_adc.dtc1 = v; m_adc.transfers = 0; break;
+			case 0x4A: m_adc.ae0 = v; break;
+			case 0x53: m_bcsctl3 = v; break;
+			case 0x56: m_dcoctl = v; setDco(); break;
+			case 0x57: m_bcsctl1 = v; setDco(); break;
+			case 0x58: m_bcsctl2 = v; setDco(); break;
+			case 0x60: m_uca.ctl0 = v; break;
+			case 0x61:
+				if (v & UCSWRST) {
+					// Held in reset: the interrupt enables, RXIFG and the errors are cleared, and TXIFG set
+					m_ie2 &= ~(UCA0RXIE | UCA0TXIE);
+					m_ifg2 = static_cast<uint8_t>((m_ifg2 & ~UCA0RXIFG) | UCA0TXIFG);
+					m_uca.stat &= ~(UCFE | UCOE | UCBRK | UCRXERR | 0x10);
+					m_uca.txBit = m_uca.rxBit = -1;
+					m_uca.txFull = m_uca.rxWaitHigh = false;
+					if (!m_uca.txd) {
+						m_uca.txd = true;
+						updatePins();
+					}
+				}
+				m_uca.ctl1 = v;
+				break;
+			case 0x62: m_uca.br0 = v; break;
+			case 0x63: m_uca.br1 = v; break;
+			case 0x64: m_uca.mctl = v; break;
+			case 0x65: m_uca.stat = static_cast<uint8_t>((m_uca.stat & 0x7F) | (v & 0x80)); break;
+			case 0x67: usciWriteTx(v); break;
+			}
+		};
+		if (word) {
+			byteReg(a, static_cast<uint8_t>(v));
+			byteReg(a + 1, static_cast<uint8_t>(v >> 8));
+		} else
+			byteReg(a, static_cast<uint8_t>(v));
+		return;
+	}
+
+	uint16_t w = a & 0xFFFE;
+	if (!word)
+		v &= 0xFF;							// A byte written to a word register clears its high byte
+	if (w >= 0x160 && w < 0x1A0) {
+		Timer& t = m_ta[w >= 0x180];
+		unsigned off = w & 0x1F;
+		if (off == 0) {
+			if (v & TACLR) {
+				t.r = 0;
+				t.divCount = 0;
+				t.down = false;
+			}
+			t.ctl = v & ~TACLR;
+		} else if (off <= 6)
+			timerWriteCctl(t, off / 2 - 1, v);
+		else if (off == 0x10)
+			t.r = v;
+		else if (off >= 0x12 && off <= 0x16)
+			t.ccr[off / 2 - 9] = v;
+		return;
+	}
+	switch (w) {
+	case 0x120:
+		if (v >> 8 != 0x5A) {
+			m_pucPending = true;			// Wrong password
+			m_pucWhy = WDTIFG;
+			return;
+		}
+		if (v & WDTCNTCL)
+			m_wdtCount = 0;
+		m_wdtctl = v & 0xFF & ~WDTCNTCL;
+		break;
+	case 0x128: case 0x12A: case 0x12C:
+		if (v >> 8 != 0xA5) {
+			m_fctl3 |= KEYV;
+			++m_stats.keyViolations;
+			m_pucPending = true;
+			m_pucWhy = 0;
+			return;
+		}
+		v &= 0xFF;
+		if (w == 0x128)
+			m_fctl1 = v & (BLKWRT | WRT | MERAS | ERASE);
+		else if (w == 0x12A)
+			m_fctl2 = v;
+		else {
+			// LOCKA toggles when written with a 1; KEYV and ACCVIFG are cleared by writing 0
+			uint16_t locka = (m_fctl3 ^ v) & LOCKA;
+			m_fctl3 = static_cast<uint16_t>((m_fctl3 & ~(LOCKA | LOCK | KEYV | ACCVIFG | 0x20))
+				| locka | (v & (LOCK | KEYV | ACCVIFG | 0x20)) | 0x08);
+		}
+		break;
+	case 0x1B0: {
+		uint16_t old = m_adc.ctl0;
+		m_adc.ctl0 = v & ~ADC10SC;
+		if ((old & ENC) && !(v & ENC) && (m_adc.ctl1 >> 1 & 3) == 0 && m_adc.busy) {
+			m_adc.busy = false;				// Clearing ENC stops a single conversion
+			++m_adc.generation;
+		}
+		if ((v & (ENC | ADC10SC | ADC10ON)) == (ENC | ADC10SC | ADC10ON))
+			adcStart();
+		break;
+	}
+	case 0x1B2:
+		if (!(m_adc.ctl0 & ENC))
+			m_adc.ctl1 = v & ~ADC10BUSY;	// Only changes while ENC is clear
+		break;
+	case 0x1BC:
+		m_adc.sa = v & 0xFFFE;
+		m_adc.transfers = 0;
+		break;
+	}
+}
+
+
+// Flash
+
+void Mcu::writeFlash(uint16_t a, uint16_t v, bool word)
+{
+	bool infoA = a >= 0x10C0 && a < 0x1100;
+	if ((m_fctl3 & LOCK) || (infoA && (m_fctl3 & LOCKA)) || m_now < m_flashBusyUntil
+			|| !(m_fctl1 & (WRT | BLKWRT | ERASE | MERAS))) {
+		m_fctl3 |= ACCVIFG;
+		return;
+	}
+
+	// The flash timing generator's period in MCLK cycles
+	double ftg = (m_fctl2 & 0x3F) + 1;
+	if ((m_fctl2 >> 6) == 0)
+		ftg *= m_dcoHz / (m_xtalHz / (1 << (m_bcsctl1 >> 4 & 3)));
+	unsigned ftgCycles;
+	if (m_fctl1 & MERAS) {
+		for (unsigned i = 0xC000; i < 0x10000; ++i)
+			m_mem[i] = 0xFF;
+		ftgCycles = FlashMassErase;
+		m_fctl1 &= ~(MERAS | ERASE);
+	} else if (m_fctl1 & ERASE) {
+		unsigned size = a >= 0xC000 ? 512 : 64;
+		unsigned start = a & ~(size - 1);
+		for (unsigned i = start; i < start + size; ++i)
+			m_mem[i] = 0xFF;
+		ftgCycles = FlashErase;
+		m_fctl1 &= ~ERASE;
+	} else {
+		m_mem[a] &= static_cast<uint8_t>(v);
+		if (word)
+			m_mem[a+1] &= static_cast<uint8_t>(v >> 8);
+		ftgCycles = FlashProgram;
+	}
+
+	// Running from flash, the CPU waits; from RAM, it goes on and can poll BUSY
+	unsigned cycles = static_cast<unsigned>(ftgCycles * ftg);
+	m_flashBusyUntil = m_now + static_cast<Time>(cycles * (m_periodFx >> 16));
+	if (m_r[0] >= 0x400)
+		m_stall = cycles;
+}
+
+
+// Clocks
+
+void Mcu::setDco()
+{
+	unsigned rsel = m_bcsctl1 & 15, dco = m_dcoctl >> 5, mod = m_dcoctl & 31;
+	double f = RselKHz[rsel] * 1e3 * std::pow(DcoStep, static_cast<int>(dco) - 3);
+	double period = 1e12 / f;
+	if (dco < 7 && mod)
+		period = ((32 - mod) * period + mod * period / DcoStep) / 32;
+	m_dcoHz = 1e12 / period;
+	m_periodFx = static_cast<uint64_t>(period * 65536);
+}
+
+void Mcu::setCrystalPpm(double ppm)
+{
+	m_xtalHz = 32768 * (1 + ppm * 1e-6);
+}
+
+void Mcu::clocks(unsigned mclkCycles)
+{
+	bool smclk = !((m_r[2] & SCG1) && (m_r[2] & CPUOFF));
+	for (unsigned i = 0; i < mclkCycles && !m_pucPending; ++i) {
+		uint64_t t = m_frac + m_periodFx;
+		m_now += t >> 16;
+		m_frac = t & 0xFFFF;
+		++m_stats.cycles;
+		while (m_now >= m_nextXtal)
+			crystalTick();
+		if (smclk) {
+			for (Timer& t : m_ta)
+				if ((t.ctl >> 8 & 3) == 2)
+					timerClock(t);
+			if ((m_uca.ctl1 >> 6) >= 2)
+				usciClock();
+			if (!(m_wdtctl & WDTSSEL))
+				watchdogClock();
+		}
+		if (m_now >= m_nextEvent)
+			runEvents();
+		if (m_observer)
+			trackRequests();
+	}
+}
+
+// Half a cycle of the watch crystal
+void Mcu::crystalTick()
+{
+	++m_xtalTicks;
+	m_nextXtal += crystalPeriod();
+	if (++m_aclkDiv < (1u << (m_bcsctl1 >> 4 & 3)))
+		return;
+	m_aclkDiv = 0;
+	m_aclk = !m_aclk;
+	timerInput(m_ta[0], 0, true, m_aclk);	// CCI0B
+	if (!m_aclk)
+		return;
+	for (Timer& t : m_ta)
+		if ((t.ctl >> 8 & 3) == 1)
+			timerClock(t);
+	if ((m_uca.ctl1 >> 6) == 1)
+		usciClock();
+	if (m_wdtctl & WDTSSEL)
+		watchdogClock();
+}
+
+
+// The end of the nth MCLK cycle from now, with the DCO as it is. clocks() adds up the same fractions.
+Time Mcu::cycleTime(uint64_t n) const
+{
+	return m_now + n * (m_periodFx >> 16) + ((m_frac + n * (m_periodFx & 0xFFFF)) >> 16);
+}
+
+// How many MCLK cycles it takes to reach time t
+uint64_t Mcu::cyclesUntil(Time t) const
+{
+	if (t <= m_now)
+		return 0;
+	uint64_t n = static_cast<uint64_t>(static_cast<double>(t - m_now) * 65536 / m_periodFx);
+	while (n && cycleTime(n - 1) >= t)
+		--n;
+	while (cycleTime(n) < t)
+		++n;
+	return n;
+}
+
+Time Mcu::aclkRise(uint64_t n) const
+{
+	// ACLK toggles on the DIVAth crystal half-cycle, and the rises are every other toggle
+	uint64_t diva = 1u << (m_bcsctl1 >> 4 & 3);
+	uint64_t toggle = m_aclk ? 2 * n : 2 * n - 1;
+	uint64_t half = diva - m_aclkDiv + (toggle - 1) * diva;
+	return m_nextXtal + (half - 1) * crystalPeriod();
+}
+
+uint64_t Mcu::timerCounts(int n, Time t) const
+{
+	const Timer& tm = m_ta[n];
+	if ((tm.ctl >> 4 & 3) == 0)
+		return 0;
+	return (tm.divCount + cyclesUntil(t)) >> (tm.ctl >> 6 & 3);
+}
+
+Time Mcu::timerCountTime(int n, uint64_t c) const
+{
+	const Timer& tm = m_ta[n];
+	return cycleTime((c << (tm.ctl >> 6 & 3)) - tm.divCount);
+}
+
+Mcu::Leap Mcu::leap(Time t)
+{
+	Leap l;
+	uint64_t cycles = cyclesUntil(t);
+	if (!cycles)
+		return l;
+	Time end = cycleTime(cycles);
+
+	// The crystal half-cycles that end by then, and the ACLK edges they make
+	Time period = crystalPeriod();
+	uint64_t halves = m_nextXtal <= end ? (end - m_nextXtal) / period + 1 : 0;
+	uint64_t diva = 1u << (m_bcsctl1 >> 4 & 3), first = diva - m_aclkDiv;
+	uint64_t toggles = halves >= first ? 1 + (halves - first) / diva : 0;
+	l.aclkRises = m_aclk ? toggles / 2 : (toggles + 1) / 2;
+	uint64_t lastRise = 0;						// In MCLK cycles from now
+	if (l.aclkRises)
+		lastRise = cyclesUntil(aclkRise(l.aclkRises));
+	for (int n = 0; n < 2; ++n) {
+		Timer& tm = m_ta[n];
+		unsigned tassel = tm.ctl >> 8 & 3;
+		uint64_t clocks = tassel == 2 ? cycles : tassel == 1 ? l.aclkRises : 0;
+		if (l.aclkRises) {
+			// The count a capture at the last rise would have got, before that cycle's timer clock
+			Timer at = tm;
+			timerAdvance(at, tassel == 2 ? lastRise - 1 : tassel == 1 ? l.aclkRises - 1 : 0);
+			l.atAclkRise[n] = at.r;
+		}
+		timerAdvance(tm, clocks);
+	}
+	m_xtalTicks += halves;
+	m_nextXtal += halves * period;
+	m_aclkDiv = static_cast<unsigned>((m_aclkDiv + halves) % diva);
+	if (toggles & 1)
+		m_aclk = !m_aclk;
+	m_ta[0].inB[0] = m_aclk;
+	m_wdtCount = 0;
+
+	m_now = end;
+	m_frac = (m_frac + cycles * (m_periodFx & 0xFFFF)) & 0xFFFF;
+	m_stats.cycles += cycles;
+	m_stats.leapCycles += cycles;
+	if (m_now >= m_nextEvent)
+		runEvents();
+	return l;
+}
+
+
+// Watchdog
+
+void Mcu::watchdogClock()
+{
+	static const unsigned Interval[4] = {32768, 8192, 512, 64};
+	if (m_wdtctl & WDTHOLD)
+		return;
+	if (++m_wdtCount < Interval[m_wdtctl & WDTIS])
+		return;
+	m_wdtCount = 0;
+	if (m_wdtctl & WDTTMSEL)
+		m_ifg1 |= WDTIFG;
+	else {
+		m_pucPending = true;
+		m_pucWhy = WDTIFG;
+	}
+}
+
+
+// Timers
+
+void Mcu::timerClock(Timer& t)
+{
+	unsigned mc = t.ctl >> 4 & 3;
+	if (mc == 0)
+		return;
+	if (++t.divCount < (1u << (t.ctl >> 6 & 3)))
+		return;
+	t.divCount = 0;
+
+	// Synchronised captures happen on the timer clock after their input's edge
+	for (int x = 0; x < 3; ++x)
+		if (t.capPending[x]) {
+			t.capPending[x] = false;
+			timerCapture(t, x);
+		}
+
+	switch (mc) {
+	case 1:									// Up to CCR0
+		if (t.r >= t.ccr[0]) {
+			if (t.ccr[0] == 0)
+				return;						// Stopped
+			t.r = 0;
+			t.ctl |= TAIFG;
+		} else
+			++t.r;
+		break;
+	case 2:									// Continuous
+		if (++t.r == 0)
+			t.ctl |= TAIFG;
+		break;
+	case 3:									// Up to CCR0 and down to 0
+		if (t.down) {
+			if (t.r == 0 || --t.r == 0) {
+				t.down = false;
+				t.ctl |= TAIFG;
+			}
+		} else if (t.r >= t.ccr[0]) {
+			t.down = true;
+			if (t.r)
+				--t.r;
+		} else
+			++t.r;
+		break;
+	}
+
+	for (int x = 0; x < 3; ++x)
+		if (!(t.cctl[x] & CAP) && t.r == t.ccr[x])
+			timerEqu(t, x);
+}
+
+// As timerClock() that many times, but with no compare or capture but those already pending. Returns
+// how many times it counted.
+uint64_t Mcu::timerAdvance(Timer& t, uint64_t clocks)
+{
+	unsigned mc = t.ctl >> 4 & 3;
+	if (mc == 0 || clocks == 0)
+		return 0;
+	uint64_t total = t.divCount + clocks, n = total >> (t.ctl >> 6 & 3);
+	t.divCount = static_cast<unsigned>(total - (n << (t.ctl >> 6 & 3)));
+	if (n == 0)
+		return 0;
+	for (int x = 0; x < 3; ++x)
+		if (t.capPending[x]) {
+			t.capPending[x] = false;
+			timerCapture(t, x);
+		}
+
+	uint64_t ccr0 = t.ccr[0], left = n;
+	switch (mc) {
+	case 1:
+		if (ccr0 == 0)
+			break;							// Stopped
+		if (t.r > ccr0) {
+			t.r = 0;
+			t.ctl |= TAIFG;
+			--left;
+		}
+		if (t.r + left > ccr0)
+			t.ctl |= TAIFG;
+		t.r = static_cast<uint16_t>((t.r + left) % (ccr0 + 1));
+		break;
+	case 2:
+		if (t.r + left > 0xFFFF)
+			t.ctl |= TAIFG;
+		t.r = static_cast<uint16_t>(t.r + left);
+		break;
+	case 3: {
+		if (ccr0 == 0) {
+			t.r = 0;
+			t.down = false;
+			t.ctl |= TAIFG;
+			break;
+		}
+		// A position around the cycle of 2 * CCR0 counts, up from 0 and down again
+		if (t.r > ccr0 && !t.down) {
+			t.down = true;
+			--t.r;
+			--left;
+		}
+		uint64_t cycle = 2 * ccr0, pos = t.down ? cycle - t.r : t.r;
+		if (pos + left >= cycle)
+			t.ctl |= TAIFG;
+		pos = (pos + left) % cycle;
+		t.down = pos > ccr0;
+		t.r = static_cast<uint16_t>(t.down ? cycle - pos : pos);
+		break;
+	}
+	}
+	return n;
+}
+
+// The timer has reached CCRx
+void Mcu::timerEqu(Timer& t, int x)
+{
+	unsigned ccis = t.cctl[x] >> 12 & 3;
+	bool cci = ccis == 0 ? t.inA[x] : ccis == 1 ? t.inB[x] : ccis == 3;
+	t.cctl[x] = static_cast<uint16_t>((t.cctl[x] & ~SCCI) | (cci ? SCCI : 0) | CCIFG);
+
+	bool changed = false;
+	auto apply = [&](int unit, bool equ0) {
+		bool old = t.out[unit];
+		switch (t.cctl[unit] >> 5 & 7) {
+		case 1: if (!equ0) t.out[unit] = true; break;
+		case 2: t.out[unit] = equ0 ? false : !t.out[unit]; break;
+		case 3: t.out[unit] = !equ0; break;
+		case 4: if (!equ0) t.out[unit] = !t.out[unit]; break;
+		case 5: if (!equ0) t.out[unit] = false; break;
+		case 6: t.out[unit] = equ0 ? true : !t.out[unit]; break;
+		case 7: t.out[unit] = equ0; break;
+		}
+		changed |= t.out[unit] != old;
+	};
+	apply(x, false);
+	if (x == 0)
+		for (int unit = 1; unit < 3; ++unit) {
+			unsigned mode = t.cctl[unit] >> 5 & 7;
+			if (mode == 2 || mode == 3 || mode == 6 || mode == 7)
+				apply(unit, true);
+		}
+	if (changed)
+		updatePins();
+}
+
+void Mcu::timerCapture(Timer& t, int x)
+{
+	if (t.cctl[x] & CCIFG)
+		t.cctl[x] |= COV;
+	t.ccr[x] = t.r;
+	t.cctl[x] |= CCIFG;
+}
+
+// An input of capture/compare block x has changed: CCIxA, or CCIxB if b is set
+void Mcu::timerInput(Timer& t, int x, bool b, bool level)
+{
+	bool& in = b ? t.inB[x] : t.inA[x];
+	if (in == level)
+		return;
+	in = level;
+	uint16_t cctl = t.cctl[x];
+	if (!(cctl & CAP) || (cctl >> 12 & 3) != (b ? 1u : 0u))
+		return;
+	unsigned cm = cctl >> 14;
+	if ((level && (cm & 1)) || (!level && (cm & 2))) {
+		if (cctl & SCS)
+			t.capPending[x] = true;
+		else
+			timerCapture(t, x);
+	}
+}
+
+void Mcu::timerWriteCctl(Timer& t, int x, uint16_t v)
+{
+	// Switching CCIS between GND and VCC is an edge too, for a capture by software
+	uint16_t old = t.cctl[x];
+	auto input = [&](uint16_t cctl) {
+		unsigned ccis = cctl >> 12 & 3;
+		return ccis == 0 ? t.inA[x] : ccis == 1 ? t.inB[x] : ccis == 3;
+	};
+	bool before = input(old);
+	t.cctl[x] = v & ~CCI;
+	bool after = input(v);
+	if ((v & CAP) && before != after && (old >> 12 & 3) >= 2 && (v >> 12 & 3) >= 2) {
+		unsigned cm = v >> 14;
+		if ((after && (cm & 1)) || (!after && (cm & 2)))
+			timerCapture(t, x);
+	}
+	if ((v >> 5 & 7) == 0 && t.out[x] != ((v & OUT) != 0)) {
+		t.out[x] = (v & OUT) != 0;
+		updatePins();
+	}
+}
+
+// Reading TAIV returns the highest pending interrupt, and clears its flag
+uint16_t Mcu::timerIv(Timer& t)
+{
+	for (int x = 1; x < 3; ++x)
+		if ((t.cctl[x] & (CCIE | CCIFG)) == (CCIE | CCIFG)) {
+			t.cctl[x] &= ~CCIFG;
+			return static_cast<uint16_t>(2 * x);
+		}
+	if ((t.ctl & (TAIE | TAIFG)) == (TAIE | TAIFG)) {
+		t.ctl &= ~TAIFG;
+		return 10;
+	}
+	return 0;
+}
+
+bool Mcu::timerCcrPending(const Timer& t) const
+{
+	return (t.cctl[1] & (CCIE | CCIFG)) == (CCIE | CCIFG) || (t.cctl[2] & (CCIE | CCIFG)) == (CCIE | CCIFG)
+		|| (t.ctl & (TAIE | TAIFG)) == (TAIE | TAIFG);
+}
+
+
+// USCI_A0
+
+// The length of the next bit in BRCLKs, with the modulation spread over the bits
+unsigned Mcu::usciBitLength()
+{
+	unsigned br = m_uca.br0 | m_uca.br1 << 8;
+	unsigned eighths = m_uca.mctl & UCOS16 ? (16 * br + (m_uca.mctl >> 4)) * 8 : br * 8 + (m_uca.mctl >> 1 & 7);
+	m_uca.bitFrac += eighths;
+	unsigned n = m_uca.bitFrac >> 3;
+	m_uca.bitFrac &= 7;
+	return n ? n : 1;
+}
+
+void Mcu::usciWriteTx(uint8_t v)
+{
+	m_uca.txbuf = v;
+	m_uca.txFull = true;
+	m_ifg2 &= ~UCA0TXIFG;
+}
+
+// Move TXBUF to the shift register and begin its start bit
+void Mcu::usciLoad()
+{
+	m_uca.txShift = m_uca.txbuf;
+	m_uca.txFull = false;
+	m_ifg2 |= UCA0TXIFG;
+	m_uca.txBit = 0;
+	m_uca.txCount = usciBitLength();
+	m_uca.txd = false;
+	updatePins();
+}
+
+void Mcu::usciClock()
+{
+	Usci& u = m_uca;
+	if (u.ctl1 & UCSWRST)
+		return;
+
+	if (u.txBit < 0) {
+		if (u.txFull)
+			usciLoad();
+	} else if (--u.txCount == 0) {
+		bool old = u.txd;
+		if (++u.txBit <= 8)
+			u.txd = u.txShift >> (u.txBit - 1) & 1;
+		else if (u.txBit == 9)
+			u.txd = true;					// Stop bit
+		else {
+			u.txBit = -1;
+			if (u.txFull)
+				usciLoad();
+		}
+		if (u.txBit > 0)
+			u.txCount = usciBitLength();
+		if (u.txd != old)
+			updatePins();
+	}
+
+	if (u.rxBit >= 0 && --u.rxCount == 0) {
+		if (u.rxBit == 0) {
+			if (u.rxd) {
+				u.rxBit = -1;				// A glitch, not a start bit
+				return;
+			}
+		} else if (u.rxBit <= 8)
+			u.rxShift = static_cast<uint16_t>(u.rxShift | (u.rxd ? 1 : 0) << (u.rxBit - 1));
+		else {
+			u.rxBit = -1;
+			if (!u.rxd) {
+				// Framing error, and a break if the data was all zeros
+				u.stat |= UCFE | UCRXERR;
+				u.rxWaitHigh = true;
+				bool brk = u.rxShift == 0;
+				if (brk)
+					u.stat |= UCBRK;
+				if (!(u.ctl1 & UCRXEIE) && !(brk && (u.ctl1 & UCBRKIE)))
+					return;
+			}
+			if (m_ifg2 & UCA0RXIFG)
+				u.stat |= UCOE;
+			u.rxbuf = static_cast<uint8_t>(u.rxShift);
+			m_ifg2 |= UCA0RXIFG;
+			return;
+		}
+		++u.rxBit;
+		u.rxCount = usciBitLength();
+	}
+}
+
+void Mcu::usciRxEdge(bool level)
+{
+	Usci& u = m_uca;
+	u.rxd = level;
+	if (level) {
+		u.rxWaitHigh = false;
+		return;
+	}
+	if (u.rxBit < 0 && !u.rxWaitHigh && !(u.ctl1 & UCSWRST)) {
+		u.rxBit = 0;
+		u.rxShift = 0;
+		u.rxCount = (usciBitLength() + 1) / 2;	// Sample the middle of each bit
+	}
+}
+
+
+// ADC10
+
+void Mcu::adcStart()
+{
+	Adc& a = m_adc;
+	if (a.busy)
+		return;
+	unsigned conseq = a.ctl1 >> 1 & 3, inch = a.ctl1 >> 12;
+	bool midSequence = (conseq & 1) && a.channel != inch && a.channel != 0 && a.channel <= inch;
+	if (!midSequence)
+		a.channel = inch;
+	a.busy = true;
+
+	// (Sample-and-hold + 13) ADC10CLKs
+	static const unsigned Sht[4] = {4, 8, 16, 64};
+	double hz;
+	switch (a.ctl1 >> 3 & 3) {
+	case 0: hz = Adc10OscHz; break;
+	case 1: hz = m_xtalHz / (1 << (m_bcsctl1 >> 4 & 3)); break;
+	default: hz = m_dcoHz;
+	}
+	hz /= (a.ctl1 >> 5 & 7) + 1;
+	Time length = static_cast<Time>((Sht[a.ctl0 >> 11 & 3] + 13) * 1e12 / hz);
+	uint64_t generation = a.generation;
+	at(m_now + length, [this, generation] { adcDone(generation); });
+}
+
+void Mcu::adcDone(uint64_t generation)
+{
+	Adc& a = m_adc;
+	if (generation != a.generation || !a.busy)
+		return;
+	unsigned code = analog(a.channel) & 0x3FF;
+	a.mem = static_cast<uint16_t>(a.ctl1 & ADC10DF ? (code ^ 0x200) << 6 : code);
+
+	if (a.dtc1 == 0)
+		a.ctl0 |= ADC10IFG;
+	else if (a.transfers < a.dtc1) {
+		writeWord(static_cast<uint16_t>(a.sa + 2 * a.transfers), a.mem);
+		if (++a.transfers == a.dtc1) {
+			a.ctl0 |= ADC10IFG;
+			if (a.dtc0 & ADC10CT)
+				a.transfers = 0;			// Continuous transfers start the block again
+		}
+	}
+
+	a.busy = false;
+	unsigned conseq = a.ctl1 >> 1 & 3, inch = a.ctl1 >> 12;
+	bool sequence = conseq & 1, endOfSequence = !sequence || a.channel == 0;
+	if (sequence)
+		a.channel = endOfSequence ? inch : a.channel - 1;
+	if (!(a.ctl0 & ENC) || (conseq == 1 && endOfSequence) || conseq == 0)
+		return;
+	// More conversions follow at once with MSC; without, each waits for ADC10SC
+	if (a.ctl0 & MSC)
+		adcStart();
+}
+
+
+// Ports
+
+void Mcu::setInput(int port, int bit, bool level)
+{
+	uint8_t& ext = m_port[port-1].ext;
+	ext = static_cast<uint8_t>((ext & ~(1 << bit)) | (level ? 1 << bit : 0));
+	updatePins();
+}
+
+void Mcu::watchPin(int port, int bit, std::function<void(bool)> f)
+{
+	m_watches.push_back(Watch{port, bit, std::move(f)});
+}
+
+void Mcu::resetOnLow(int port, int bit, Time low)
+{
+	m_rstPort = port;
+	m_rstBit = bit;
+	m_rstLow = low;
+}
+
+// Work out every pin's level from the ports and the peripherals driving them, and act on any that change
+void Mcu::updatePins()
+{
+	uint8_t level[3];
+	for (int p = 0; p < 3; ++p) {
+		const Port& port = m_port[p];
+		level[p] = static_cast<uint8_t>((port.dir & port.out) | (~port.dir & port.ext));
+	}
+	for (const TimerPin& tp : TimerOutputs) {
+		const Port& port = m_port[tp.port-1];
+		uint8_t mask = static_cast<uint8_t>(1 << tp.bit);
+		if ((port.sel & mask) && !(port.sel2 & mask) && (port.dir & mask))
+			level[tp.port-1] = static_cast<uint8_t>((level[tp.port-1] & ~mask) | (m_ta[tp.timer].out[tp.x] ? mask : 0));
+	}
+	const Port& p1 = m_port[0];
+	if (p1.sel & p1.sel2 & UcaTxd)
+		level[0] = static_cast<uint8_t>((level[0] & ~UcaTxd) | (m_uca.txd ? UcaTxd : 0));
+	if (p1.sel & p1.sel2 & UcaRxd)
+		level[0] = static_cast<uint8_t>((level[0] & ~UcaRxd) | (p1.ext & UcaRxd));
+
+	for (int p = 0; p < 3; ++p) {
+		uint8_t changed = level[p] ^ m_level[p];
+		if (!changed)
+			continue;
+		m_level[p] = level[p];
+		for (int bit = 0; bit < 8; ++bit) {
+			uint8_t mask = static_cast<uint8_t>(1 << bit);
+			if (!(changed & mask))
+				continue;
+			bool high = (level[p] & mask) != 0;
+			if (p < 2 && high != ((m_port[p].ies & mask) != 0))
+				m_port[p].ifg |= mask;		// Port 1 and 2 interrupt flags: IES clear for a rising edge
+			for (const TimerInputPin& tp : TimerInputs)
+				if (tp.port == p+1 && tp.bit == bit)
+					timerInput(m_ta[tp.timer], tp.x, tp.b, high);
+			if (p == 0 && (mask & UcaRxd) && (p1.sel & p1.sel2 & UcaRxd))
+				usciRxEdge(high);
+			if (p+1 == m_rstPort && bit == m_rstBit) {
+				if (!high) {
+					// Held low for long enough, /RST follows through the RC filter
+					Time fell = m_rstFell = m_now;
+					at(m_now + m_rstLow, [this, fell] {
+						if (m_rstFell == fell)
+							m_rstHeld = true;
+					});
+				} else {
+					m_rstFell = ~Time(0);
+					if (m_rstHeld) {
+						m_rstHeld = false;
+						m_pucPending = true;
+						m_pucWhy = RSTIFG;
+					}
+				}
+			}
+			for (const Watch& w : m_watches)
+				if (w.port == p+1 && w.bit == bit)
+					w.f(high);
+		}
+	}
+}
+
+}	// namespace msp430
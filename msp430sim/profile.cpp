@@ -0,0 +1,264 @@
+// profile.cpp : where a firmware image spends its cycles, and how long its interrupts wait
+//
+// Written 17/Oct/2026
+
+#include "profile.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <regex>
+#include <set>
+#include <sstream>
+
+namespace msp430 {
+
+// Labels apply only within the RAM, info flash or main flash that they're in
+static int region(uint32_t a)
+{
+	return a < 0x400 ? 0 : a < 0x1100 ? 1 : 2;
+}
+
+static bool isHex(const std::string& s)
+{
+	return !s.empty()
+		&& std::all_of(s.begin(), s.end(), [](char c) { return isxdigit(static_cast<unsigned char>(c)) != 0; });
+}
+
+// Read labels from either of:
+// - an IAR assembler listing, where each line has its line number, address, code and source: a label
+//   is a word ending in a colon, or a word followed by an instruction or data directive
+// - an XLINK map listing symbols: a name then its hex address, e.g. "DoMeasurement  C2A4"
+int readSymbols(const std::string& name, std::function<void(uint16_t address, const std::string& label)> f)
+{
+	std::ifstream in(name);
+	if (!in)
+		return -1;
+	static const std::set<std::string> Mnemonics = {"mov", "add", "addc", "sub", "subc", "cmp", "dadd",
+		"bit", "bic", "bis", "xor", "and", "rrc", "rra", "swpb", "sxt", "push", "call", "reti", "jmp",
+		"jne", "jnz", "jeq", "jz", "jnc", "jc", "jn", "jge", "jl", "jlo", "jhs", "br", "ret", "nop", "clr",
+		"clrc", "clrn", "clrz", "setc", "setn", "setz", "inc", "incd", "dec", "decd", "tst", "inv", "rla",
+		"rlc", "adc", "sbc", "dadc", "pop", "eint", "dint", "db", "dw", "ds", "dc8", "dc16", "ds8", "ds16"};
+	std::regex listing("^\\s*\\d+(?:\\.\\d+)?\\s+([0-9A-Fa-f]{4,6})\\s+(.*)$");
+	std::regex map("^\\s*([A-Za-z_?][\\w?]*)\\s+(?:\\$|0x)?([0-9A-Fa-f]{4,6})(?:\\s.*)?$");
+	std::regex colonLabel("^([A-Za-z_?][\\w?]*):");
+	int n = 0;
+	std::string line;
+	while (std::getline(in, line)) {
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		std::smatch m;
+		if (std::regex_match(line, m, listing)) {
+			unsigned long address = std::stoul(m[1].str(), nullptr, 16);
+			std::string source = m[2].str();
+			source = source.substr(0, source.find(';'));
+			std::istringstream words(source);
+			std::vector<std::string> w;
+			for (std::string s; words >> s; )
+				w.push_back(s);
+			size_t i = 0;
+			while (i < w.size() && isHex(w[i]) && w[i].size() % 2 == 0)
+				++i;						// The code bytes
+			if (i >= w.size() || address > 0xFFFF)
+				continue;
+			std::smatch label;
+			if (std::regex_search(w[i], label, colonLabel))
+				f(static_cast<uint16_t>(address), label[1].str());
+			else if (i + 1 < w.size()) {
+				auto mnemonic = [](std::string s) {
+					std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+					return Mnemonics.count(s.substr(0, s.find('.'))) != 0;
+				};
+				if (mnemonic(w[i+1]) && !mnemonic(w[i]))
+					f(static_cast<uint16_t>(address), w[i]);
+				else
+					continue;
+			} else
+				continue;
+			++n;
+		} else if (std::regex_match(line, m, map)) {
+			unsigned long address = std::stoul(m[2].str(), nullptr, 16);
+			if (address > 0xFFFF)
+				continue;
+			f(static_cast<uint16_t>(address), m[1].str());
+			++n;
+		}
+	}
+	return n;
+}
+
+int Profiler::loadSymbols(const std::string& name)
+{
+	return readSymbols(name, [this](uint16_t address, const std::string& label) { addSymbol(address, label); });
+}
+
+void Profiler::addSymbol(uint16_t address, const std::string& name)
+{
+	m_symbols.emplace(address, name);		// The first label at an address names it
+	m_cacheLo = 1;
+	m_cacheHi = 0;
+}
+
+// The address of the label that pc is under, or pc itself if none
+uint32_t Profiler::label(uint16_t pc) const
+{
+	if (pc >= m_cacheLo && pc <= m_cacheHi)
+		return m_cacheLabel;
+	auto next = m_symbols.upper_bound(pc);
+	uint32_t lo = pc, hi = pc, l = pc;
+	if (next != m_symbols.begin()) {
+		auto it = std::prev(next);
+		if (region(it->first) == region(pc)) {
+			l = lo = it->first;
+			hi = next == m_symbols.end() ? 0xFFFF : next->first - 1;
+		}
+	}
+	m_cacheLo = static_cast<uint16_t>(lo);
+	m_cacheHi = static_cast<uint16_t>(hi);
+	m_cacheLabel = l;
+	return l;
+}
+
+std::string Profiler::name(uint32_t address) const
+{
+	if (address == Interrupted)
+		return "<interrupt>";
+	if (address == Reset)
+		return "<reset>";
+	char s[16];
+	auto it = m_symbols.find(static_cast<uint16_t>(address));
+	if (it != m_symbols.end())
+		return it->second;
+	auto next = m_symbols.upper_bound(static_cast<uint16_t>(address));
+	if (next != m_symbols.begin() && region(std::prev(next)->first) == region(address)) {
+		--next;
+		snprintf(s, sizeof s, "+$%X", address - next->first);
+		return next->second + s;
+	}
+	snprintf(s, sizeof s, "$%04X", address);
+	return s;
+}
+
+void Profiler::instruction(uint16_t pc, unsigned cycles)
+{
+	m_routines[label(pc)].self += cycles;
+	m_total += cycles;
+}
+
+void Profiler::call(uint16_t, uint16_t target, uint16_t sp)
+{
+	uint32_t caller = m_stack.empty() ? Reset : m_stack.back().entry;
+	++m_routines[target].calls;
+	++m_arcs[std::make_pair(caller, uint32_t(target))].count;
+	m_stack.push_back(Frame{target, sp, m_total});
+}
+
+// A return pops every frame whose return address is now off the stack, so code that discards a return
+// address, or returns from several levels at once, doesn't leave frames behind
+void Profiler::ret(uint16_t, uint16_t sp)
+{
+	while (!m_stack.empty() && m_stack.back().sp < sp) {
+		Frame f = m_stack.back();
+		m_stack.pop_back();
+		pop(f);
+	}
+}
+
+void Profiler::pop(const Frame& f)
+{
+	uint64_t cycles = m_total - f.start;
+	Routine& r = m_routines[f.entry];
+	r.inclusive += cycles;
+	r.worst = std::max(r.worst, cycles);
+	uint32_t caller = f.sp & 1 ? Interrupted : m_stack.empty() ? Reset : m_stack.back().entry;
+	m_arcs[std::make_pair(caller, uint32_t(f.entry))].cycles += cycles;
+}
+
+void Profiler::interrupt(uint16_t vector, uint16_t isr, uint16_t sp, unsigned entryCycles, uint64_t latency)
+{
+	m_routines[label(isr)].self += entryCycles;
+	m_total += entryCycles;
+	++m_routines[isr].calls;
+	++m_arcs[std::make_pair(uint32_t(Interrupted), uint32_t(isr))].count;
+	// An interrupt's frame is marked by an odd SP, which the CPU never has
+	m_stack.push_back(Frame{isr, static_cast<uint16_t>(sp | 1), m_total - entryCycles});
+
+	Latency& l = m_latency[vector];
+	++l.count;
+	l.sum += latency;
+	l.min = std::min(l.min, latency);
+	l.max = std::max(l.max, latency);
+	int b = 0;
+	while (b < 23 && latency >> (b + 1))
+		++b;
+	++l.buckets[b];
+}
+
+void Profiler::reset()
+{
+	m_stack.clear();
+}
+
+void Profiler::report(FILE* f) const
+{
+	auto pct = [this](uint64_t n) { return m_total ? 100.0 * n / m_total : 0.0; };
+	auto ull = [](uint64_t n) { return static_cast<unsigned long long>(n); };
+
+	// Flat profile, by self cycles
+	std::vector<std::pair<uint32_t, Routine>> flat(m_routines.begin(), m_routines.end());
+	std::sort(flat.begin(), flat.end(), [](const std::pair<uint32_t, Routine>& a,
+		const std::pair<uint32_t, Routine>& b) { return a.second.self > b.second.self; });
+	fprintf(f, "Flat profile: %llu cycles, %.1f%% asleep\n", ull(m_total), pct(m_asleep));
+	fprintf(f, " %%cycles        self      calls    inclusive   per call      worst  name\n");
+	for (const auto& e : flat) {
+		const Routine& r = e.second;
+		if (!r.self && !r.calls)
+			continue;
+		fprintf(f, "%7.2f %11llu %10llu %12llu %10llu %10llu  %s\n", pct(r.self), ull(r.self), ull(r.calls),
+			ull(r.inclusive), ull(r.calls ? r.inclusive / r.calls : 0), ull(r.worst), name(e.first).c_str());
+	}
+
+	// Call graph, by inclusive cycles
+	std::sort(flat.begin(), flat.end(), [](const std::pair<uint32_t, Routine>& a,
+		const std::pair<uint32_t, Routine>& b) { return a.second.inclusive > b.second.inclusive; });
+	fprintf(f, "\nCall graph: callers above each routine, callees below, with calls and inclusive cycles\n");
+	for (const auto& e : flat) {
+		if (!e.second.calls)
+			continue;
+		for (const auto& a : m_arcs)
+			if (a.first.second == e.first)
+				fprintf(f, "    %10llu %12llu      %s\n", ull(a.second.count), ull(a.second.cycles),
+					name(a.first.first).c_str());
+		fprintf(f, "  %12llu %12llu  %s (%.1f%%)\n", ull(e.second.calls), ull(e.second.inclusive),
+			name(e.first).c_str(), pct(e.second.inclusive));
+		for (const auto& a : m_arcs)
+			if (a.first.first == e.first)
+				fprintf(f, "    %10llu %12llu      %s\n", ull(a.second.count), ull(a.second.cycles),
+					name(a.first.second).c_str());
+		fprintf(f, "\n");
+	}
+
+	// Latencies
+	static const std::map<uint16_t, const char*> Vectors = {{PORT1_VECTOR, "PORT1"}, {PORT2_VECTOR, "PORT2"},
+		{ADC10_VECTOR, "ADC10"}, {USCIAB0TX_VECTOR, "USCIAB0TX"}, {USCIAB0RX_VECTOR, "USCIAB0RX"},
+		{TIMER0_A1_VECTOR, "TIMER0_A1"}, {TIMER0_A0_VECTOR, "TIMER0_A0"}, {WDT_VECTOR, "WDT"},
+		{TIMER1_A1_VECTOR, "TIMER1_A1"}, {TIMER1_A0_VECTOR, "TIMER1_A0"}};
+	fprintf(f, "Interrupt latency: cycles from the flag being set to the ISR's first instruction\n");
+	for (auto v = m_latency.rbegin(); v != m_latency.rend(); ++v) {
+		const Latency& l = v->second;
+		auto it = Vectors.find(v->first);
+		fprintf(f, "%s ($%04X): %llu interrupts, min %llu, mean %.1f, max %llu\n",
+			it == Vectors.end() ? "?" : it->second, v->first, ull(l.count), ull(l.min),
+			static_cast<double>(l.sum) / l.count, ull(l.max));
+		uint64_t most = *std::max_element(l.buckets, l.buckets + 24);
+		for (int b = 0; b < 24; ++b) {
+			if (!l.buckets[b])
+				continue;
+			int bar = static_cast<int>((40 * l.buckets[b] + most - 1) / most);
+			fprintf(f, "  %6llu-%-6llu %10llu  %.*s\n", ull(b ? 1ull << b : 0), ull((2ull << b) - 1),
+				ull(l.buckets[b]), bar, "########################################");
+		}
+	}
+}
+
+}	// namespace msp430
@@ -0,0 +1,87 @@
+// profile.h : where a firmware image spends its cycles, and how long its interrupts wait
+//
+// Written 17/Oct/2026
+//
+// Profiler	An Observer that attributes each instruction's cycles to the label it's under, follows CALLs,
+//			returns and interrupts on a shadow stack for each routine's inclusive cycles and its callers
+//			and callees, and keeps a histogram for each vector of the cycles from its flag being set to
+//			the first instruction of its ISR.
+//
+// Labels come from the IAR assembler listing (AList, e.g. Debug/List/monolith.lst) or the XLINK map.
+
+#pragma once
+
+#include "msp430.h"
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace msp430 {
+
+// Read labels from a listing or map, calling f with each. Returns the number found, or -1 if it can't be
+// read.
+int readSymbols(const std::string& name, std::function<void(uint16_t address, const std::string& label)> f);
+
+class Profiler : public Observer
+{
+public:
+	// Read labels from a listing or map. Returns the number found, or -1 if it can't be read.
+	int		loadSymbols(const std::string& name);
+	// Or give one directly
+	void	addSymbol(uint16_t address, const std::string& name);
+
+	// The flat profile, the call graph and the latency histograms
+	void	report(FILE* f) const;
+
+	void	instruction(uint16_t pc, unsigned cycles) override;
+	void	asleep() override { ++m_asleep; ++m_total; }
+	void	call(uint16_t pc, uint16_t target, uint16_t sp) override;
+	void	ret(uint16_t pc, uint16_t sp) override;
+	void	interrupt(uint16_t vector, uint16_t isr, uint16_t sp, unsigned entryCycles,
+				uint64_t latency) override;
+	void	reset() override;
+
+private:
+	struct Routine
+	{
+		uint64_t	self = 0;			// Cycles under its label
+		uint64_t	calls = 0;			// Times called or interrupted into
+		uint64_t	inclusive = 0;		// Cycles from entry to return, including what it called
+		uint64_t	worst = 0;			// The most of those in one call
+	};
+	struct Arc
+	{
+		uint64_t	count = 0, cycles = 0;
+	};
+	struct Frame
+	{
+		uint16_t	entry;
+		uint16_t	sp;					// With the return address (and SR) pushed
+		uint64_t	start;				// m_total at entry
+	};
+	struct Latency
+	{
+		uint64_t	count = 0, sum = 0, min = ~uint64_t(0), max = 0;
+		uint64_t	buckets[24] = {};	// By log2 of the latency in cycles
+	};
+
+	// Entry addresses for the routines, and the callers' entries for the interrupts
+	static const uint32_t Interrupted = 0x10000, Reset = 0x10001;
+
+	uint32_t label(uint16_t pc) const;
+	std::string name(uint32_t address) const;
+	void	pop(const Frame& f);
+
+	std::map<uint16_t, std::string> m_symbols;
+	std::map<uint32_t, Routine> m_routines;			// By label address
+	std::map<std::pair<uint32_t, uint32_t>, Arc> m_arcs;	// By caller and callee entries
+	std::vector<Frame> m_stack;
+	std::map<uint16_t, Latency> m_latency;				// By vector
+	uint64_t	m_total = 0, m_asleep = 0;
+	mutable uint16_t m_cacheLo = 1, m_cacheHi = 0;	// The range the last label lookup covered
+	mutable uint32_t m_cacheLabel = 0;
+};
+
+}	// namespace msp430
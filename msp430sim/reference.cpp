@@ -0,0 +1,506 @@
+// reference.cpp : the monolith firmware's measurement, stress and charge-control arithmetic, bit for bit, in C++
+//
+// Written 17/Oct/2026
+//
+// The comments name the instructions that decide each subtle step. rra is an arithmetic shift, rrc after
+// clrc a logical one, and a comparison is signed where the firmware branches on GE or L, and unsigned on
+// HS or LO.
+
+#include "reference.h"
+
+namespace monolith {
+
+static uint16_t word(const uint8_t* m, unsigned a)
+{
+	return static_cast<uint16_t>(m[a] | m[a+1] << 8);
+}
+
+Info::Info(const uint8_t* m)
+{
+	adcTimIdx = m[0x1003];
+	boltMiCal = word(m, 0x1004);
+	tempSlope = word(m, 0x1006);
+	boltPlOff = static_cast<int8_t>(m[0x1008]);
+	cellOff = static_cast<int8_t>(m[0x1009]);
+	capacity = word(m, 0x100A);
+	cellRes = word(m, 0x100C);
+	boltPlCal = word(m, 0x100E);
+	cellCal = word(m, 0x1010);
+	tempOff = static_cast<int8_t>(m[0x1012]);
+	boltMiOff = static_cast<int8_t>(m[0x1013]);
+	id = m[0x1016];
+	dataVers = m[0x1017];
+	cal30 = word(m, 0x10E2);
+}
+
+void Info::calibrate(uint8_t newId)
+{
+	if (id == 0xFF)
+		id = newId;
+	if (dataVers == 0xFF)
+		dataVers = 7;
+	if (boltMiCal == 0xFFFF)
+		boltMiCal = 0x8000;
+	if (boltPlCal == 0xFFFF)
+		boltPlCal = 0x8000;
+	if (cellCal == 0xFFFF)
+		cellCal = 0x8000;
+	if (tempSlope == 0xFFFF)
+		tempSlope = 27101;
+	if (cal30 == 0xFFFF)
+		cal30 = 673;
+}
+
+uint32_t umStar(uint16_t a, uint16_t b)
+{
+	return static_cast<uint32_t>(a) * b;
+}
+
+// Negate, multiply, and negate the 32-bit product back
+uint32_t mmStar(int16_t a, uint16_t b)
+{
+	if (a >= 0)
+		return umStar(static_cast<uint16_t>(a), b);
+	return 0u - umStar(static_cast<uint16_t>(-static_cast<uint16_t>(a)), b);
+}
+
+uint16_t umSlashMod(uint32_t dividend, uint16_t divisor)
+{
+	if ((dividend >> 16) >= divisor)
+		return 0xFFFF;
+	return static_cast<uint16_t>(dividend / divisor);
+}
+
+static int16_t s16(int v)
+{
+	return static_cast<int16_t>(static_cast<uint16_t>(v));
+}
+
+// abs: cmp #0 then inv and inc, so -32768 stays as it is
+static int16_t abs16(int16_t v)
+{
+	return v < 0 ? s16(-v) : v;
+}
+
+// rra then adc: an arithmetic shift, rounded by the last bit shifted out
+static int16_t rraRound(int16_t v, int n)
+{
+	return s16((v >> n) + (v >> (n - 1) & 1));
+}
+
+// Mul17Div16Cmu
+static uint16_t mul17Div16(uint16_t sum, const Info& info)
+{
+	if (info.id == 255)
+		return sum;
+	return static_cast<uint16_t>(sum + (s16(sum + 8) >> 4));
+}
+
+// The common part of the MeasAndCorr routines: the product's high word, rounded and halved, plus the offset
+static int16_t correct(uint16_t sum, uint16_t cal, int8_t offset)
+{
+	uint16_t hi = static_cast<uint16_t>(umStar(sum, cal) >> 16);
+	return s16((s16(hi + 1) >> 1) + offset);
+}
+
+// ApplyTempCo
+static int16_t tempCo(int16_t v, int8_t cmuTemperature)
+{
+	return s16(v - rraRound(s16(cmuTemperature - 25), 2));
+}
+
+int16_t cellV(uint16_t sum, const Info& info, int8_t cmuTemperature)
+{
+	return tempCo(correct(mul17Div16(sum, info), info.cellCal, info.cellOff), cmuTemperature);
+}
+
+int16_t boltPlV(uint16_t sum, const Info& info, int8_t cmuTemperature)
+{
+	uint16_t cal = info.boltPlCal == 0xFFFF ? info.cellCal : info.boltPlCal;
+	return tempCo(correct(mul17Div16(sum, info), cal, info.boltPlOff), cmuTemperature);
+}
+
+// GetBoltMiV: (R - 2046) / 1.364, by multiplying by 48047 and rounding the high word
+int16_t boltMiV(uint16_t sum, const Info& info)
+{
+	if (info.boltMiOff == -128)
+		return 9999;
+	uint16_t cal = info.boltMiCal == 0xFFFF ? info.cellCal : info.boltMiCal;
+	int16_t r = s16(correct(sum, cal, info.boltMiOff) - 2046);
+	return s16((mmStar(r, 48047) + 0x8000) >> 16);
+}
+
+// GetTemp: (meas - CAL30) * slope + 30 C, in quarter degrees, then rounded to whole and half degrees
+int16_t temperature(uint16_t sum, const Info& info, int16_t* halfDegrees)
+{
+	int16_t r8 = s16(sum + 2) >> 2;
+	r8 = s16(r8 - (info.cal30 << 2));
+	int16_t r10 = s16(mmStar(r8, info.tempSlope) >> 16);
+	r10 = s16(r10 + (30 << 2) + info.tempOff * 2);
+	if (halfDegrees)
+		*halfDegrees = s16(r10 + 1) >> 1;
+	return s16(r10 + 2) >> 2;
+}
+
+// GetLinkV: a BMU's is its shunt, a CMU's the larger of its terminals' drops, compared unsigned
+int16_t linkV(uint16_t cellSum, uint16_t boltPlSum, uint16_t boltMiSum, const Info& info, int8_t cmuTemperature)
+{
+	int16_t mi = boltMiV(boltMiSum, info);
+	if (info.id == 255)
+		return mi;
+	uint16_t neg = static_cast<uint16_t>(abs16(mi));
+	int16_t drop = s16(boltPlV(boltPlSum, info, cmuTemperature) - cellV(cellSum, info, cmuTemperature));
+	uint16_t pos = static_cast<uint16_t>(abs16(drop));
+	return s16(neg < pos ? pos : neg);
+}
+
+int16_t ocv(int16_t v, int16_t current, int8_t cellTemperature, uint16_t cellRes)
+{
+	// The resistance in 1/819.2 milliohms: cellRes << 13 (rra3_l of it as a high word), / 10000, rounded
+	uint32_t scaled = static_cast<uint32_t>(static_cast<int32_t>(static_cast<uint32_t>(cellRes) << 16) >> 3);
+	uint16_t r9 = umSlashMod(scaled + 5000, 10000);
+
+	// Divided by 7.76, as 1/8 + 1/512: rra3 and adc, and swpb.b, rra and adc
+	uint16_t r8 = static_cast<uint16_t>(rraRound(static_cast<int16_t>(r9 >> 8), 1));
+	r9 = static_cast<uint16_t>(rraRound(static_cast<int16_t>(r9), 3) + r8);
+
+	// Times 1.046875 for each degree from 66 down to the cell's, compared as signed bytes. With a cell
+	// at -128 C the firmware would go round until the watchdog bit; here it stops when the count wraps.
+	uint16_t fixed = r9;
+	for (int r11 = 66; r11 >= cellTemperature; --r11) {
+		uint16_t half = r9 >> 1;
+		uint16_t t = static_cast<uint16_t>(rraRound(static_cast<int16_t>(half), 1) + half);
+		r9 = static_cast<uint16_t>(r9 + rraRound(static_cast<int16_t>(t), 4));
+	}
+	uint16_t resistance = static_cast<uint16_t>(fixed + r9);
+
+	// Times the current in 1/80 amps, keeping the high word: millivolts
+	uint16_t amps = static_cast<uint16_t>(abs16(current) << 3);
+	uint16_t drop = static_cast<uint16_t>(umStar(resistance, amps) >> 16);
+	return current >= 0 ? s16(v - drop) : s16(v + drop);
+}
+
+// DepthOfDischarge: discharge in units of 28.44 mAh, times 569, divided by twice the capacity, rounded
+uint16_t depthOfDischarge(uint32_t discharge, uint16_t capacity)
+{
+	if (static_cast<int32_t>(discharge) < 0)
+		discharge = 0;
+	uint32_t v = discharge << 5;
+	uint16_t hi = static_cast<uint16_t>((v >> 16) + (v >> 15 & 1));
+	uint32_t p = umStar(569, hi) + capacity;
+	return umSlashMod(p, static_cast<uint16_t>(capacity << 1));
+}
+
+// SocToDischarge: (1000 - SoC) * 1843/256, rounded, times the capacity
+uint32_t socToDischarge(uint16_t soc, uint16_t capacity)
+{
+	uint16_t dod = static_cast<uint16_t>(1000 - soc);
+	uint16_t r9 = static_cast<uint16_t>((umStar(dod, 1843) + 128) >> 8);
+	return umStar(capacity, r9);
+}
+
+// PiController, the current version: Kp 4 and Ki 1 on an output held four times larger
+int16_t piController(PiState& s, int16_t stress)
+{
+	int16_t error = s16(7 - stress);
+	int16_t deriv = s16(error - s.prevError);
+	int16_t out = s16(s.prevOutput + (deriv << 3) + error);
+	if (out < 0)
+		out = 0;
+	else if (out >= chargerCurrMax * 4)
+		out = chargerCurrMax * 4;
+	s.prevError = error;
+	s.prevOutput = out;
+	return out >> 2;
+}
+
+// ChgController: down a tenth of a volt each call while stressed, back up one every 128 calls while calm
+void chgController(ChgState& s, int16_t stress, uint8_t chargerTxTimer)
+{
+	s.lastChgChanged = false;
+	if (stress >= 11) {
+		if (s.prevBulk >= CHG_BULK_MIN) {
+			--s.prevBulk;
+			s.lastChgChanged = true;
+		}
+		if (s.prevFloat >= CHG_FLT_MIN) {
+			--s.prevFloat;
+			s.lastChgChanged = true;
+		}
+	} else if ((chargerTxTimer & 0x7F) == 0 && stress < 7 + 1) {
+		if (s.prevBulk < CHG_BULK_STD) {
+			++s.prevBulk;
+			s.lastChgChanged = true;
+		}
+		if (s.prevFloat < CHG_FLT_STD) {
+			++s.prevFloat;
+			s.lastChgChanged = true;
+		}
+	}
+}
+
+Device::Device(const Info& i)
+	: info(i), id(i.id)
+{
+	if (bmu())
+		updateSoC();
+	else
+		charging = false;
+}
+
+// DoStress
+void Device::doStress(int16_t meas, int16_t step, int16_t zero, uint16_t type)
+{
+	int16_t r9;
+	uint16_t divisor;
+	bool below;
+	if (step >= 0) {
+		if (meas >= worst[type])
+			worst[type] = meas;
+		below = meas < zero;
+		r9 = s16(meas - zero);
+		divisor = static_cast<uint16_t>(step);
+	} else {
+		if (meas < worst[type])
+			worst[type] = meas;
+		divisor = static_cast<uint16_t>(-step);
+		int16_t x = s16(zero - meas + step);
+		below = x < 1;
+		r9 = s16(x - 1);
+	}
+	if (below)
+		r9 = 0;
+	uint16_t q = umSlashMod(static_cast<uint16_t>(r9), divisor);
+	if (stress < q) {
+		stress = q;
+		stressMeas = static_cast<uint16_t>(meas);
+		stressType = type;
+	}
+}
+
+// UpdateSoC
+void Device::updateSoC()
+{
+	uint16_t dod = depthOfDischarge(discharge, info.capacity);
+	if (dod < MinAdvance)
+		dod = MinAdvance;
+	if (dod >= 1000 - MinAdvance)
+		dod = 1000 - MinAdvance;
+	socPwmAdv = dod;
+}
+
+void Device::currentCommand(int16_t tenthsOfAmps)
+{
+	if (!bmu())
+		current = tenthsOfAmps;
+	ticksSinceLastI = 0;
+}
+
+// DoMeasurement
+int Device::measure(const Sums& sums)
+{
+	if (halted)
+		return -1;
+	m_sums = sums;
+	++ticks;
+	if (!donePipInit) {
+		if (pipInitCtr != PipWait)
+			++pipInitCtr;
+		else if (!bmu())
+			donePipInit = true;
+		else if (pipCmdCtr != PipCmdWait)
+			++pipCmdCtr;
+		else {
+			pipCmdCtr = 0;
+			if (++pipStringsSent == PipInitStrings)		// InitPip
+				donePipInit = true;
+		}
+	}
+
+	stress = stressMeas = stressType = 0;
+	if (ticksSinceLastRx != 0xFF)
+		++ticksSinceLastRx;
+	if (ticksSinceLastI != 0xFF)
+		++ticksSinceLastI;
+	if (!bmu() && ticksSinceLastI >= ZeroCurrentTicks)
+		current = 0;
+
+	// A BMU's battery voltage in tenths of a volt, times 6.25 as the average of 16 cells in millivolts
+	int16_t v = cellV(sums.cellV, info, cmuTemperature);
+	if (bmu()) {
+		int16_t x25 = s16(v * 25);
+		v = s16((x25 >> 2) + (x25 & 2 ? 1 : 0));
+	}
+	v = ocv(v, current, cellTemperature, info.cellRes);
+	ocCellVolt = v;
+	ocCellVoltX256 -= static_cast<uint16_t>(ocCellVoltX256 >> 8);
+	ocCellVoltX256 += static_cast<uint16_t>(v);
+
+	if (bmu()) {
+		// Resting at a low voltage for 10 minutes sets the SoC from it
+		int16_t smoothed = static_cast<int16_t>(ocCellVoltX256 >> 8);
+		if (current < 20 && current >= -(s16(info.capacity + 8) >> 4) && smoothed < 3251) {
+			if (++restedCounter >= 10 * 60 * StatusFreq) {
+				restedCounter = 0;
+				discharge = socToDischarge(static_cast<uint16_t>((smoothed - 3150) * 3), info.capacity);
+			}
+		} else
+			restedCounter = 0;
+		localStatus |= ALL_FULL;			// So that charge terminates
+	} else {
+		bypass = static_cast<uint16_t>(v) >= static_cast<uint16_t>(bypassVoltage);
+		if (bypass) {
+			ticksSinceLastBypass = 0;
+			beenBypassing = true;
+		} else if (beenBypassing && ++ticksSinceLastBypass >= 5 * 60 * StatusFreq)
+			beenBypassing = false;
+		bool full = static_cast<uint16_t>(v) >= static_cast<uint16_t>(fullVoltage);
+		localStatus = static_cast<uint8_t>((localStatus & ~ALL_FULL) | (full ? ALL_FULL : 0));
+		doStress(v, ovStep, ovZero, 1);
+		doStress(v, UV_STEP, UV_ZERO, 2);
+	}
+
+	int16_t t = temperature(sums.temperature, info);
+	cmuTemperature = static_cast<int8_t>(t);
+	if (bmu())
+		cellTemperature = static_cast<int8_t>(t - 8);		// Less its self-heating
+	else {
+		int16_t ot = t;
+		if (beenBypassing)
+			ot = s16(ot - BypTempQuota);
+		else
+			cellTemperature = static_cast<int8_t>(t);
+		doStress(ot, OT_STEP, OT_ZERO, 3);
+		doStress(t, UT_STEP, UT_ZERO, 4);
+	}
+
+	int16_t link = linkV(sums.cellV, sums.boltPlV, sums.boltMiV, info, cmuTemperature);
+	if (!bmu()) {
+		if (link != 9999)
+			doStress(abs16(link), AL_STEP, AL_ZERO, 5);
+
+		uint16_t clamp = stressType == 4 ? alarmStress : 15;
+		uint16_t s = stress >= clamp ? clamp : stress;
+		localStatus = static_cast<uint8_t>((localStatus & ~STRESS) | (s & STRESS));
+		if ((localStatus & S_TYPE) != ALL_FULL) {
+			uint8_t type = stressType == 2 ? UV_AF : stressType == 1 || stressType == 4 ? OV_UT : 0;
+			localStatus = static_cast<uint8_t>((localStatus & ~S_TYPE) | type);
+		}
+		uint8_t s8 = static_cast<uint8_t>(stress);
+		if (s8 >= worstStress && s8 != 0) {
+			worstStress = s8;
+			worstStressType = static_cast<uint8_t>(stressType);
+		}
+		errorLed = s8 >= alarmStress && sums.cellV >= 200 / 4 * 16;
+	} else {
+		// The shunt, in fifths of an amp, to tenths, and coulomb counting
+		current = s16(link << 1);
+		charging = current >= 0;
+		discharge -= static_cast<uint32_t>(static_cast<int32_t>(current));
+		if (static_cast<int32_t>(discharge) < 0)
+			discharge = 0;
+		updateSoC();
+	}
+
+	localStatus &= static_cast<uint8_t>(~COM_ERR);
+	if (ticksSinceLastRx < ComErrTicks)
+		return -1;
+	if (id != 1)
+		localStatus |= COM_ERR;
+	uint8_t status = localStatus | 0x80;
+	if (bmu()) {
+		globalStatus = status;
+		controlContactors(status);
+	}
+	return status;
+}
+
+// DoStatus on a CMU: the worse of the incoming stress and ours, undervoltage trumping an equal stress, and
+// all considered full only if everyone is
+int Device::relay(uint8_t status)
+{
+	if (halted)
+		return -1;
+	ticksSinceLastRx = 0;
+	if (localStatus & COM_ERR)
+		return -1;
+	uint8_t in = status & STRESS, ours = localStatus & STRESS;
+	uint8_t r8 = status;
+	if (in < ours) {
+		r8 = static_cast<uint8_t>((r8 & ~(STRESS | S_TYPE)) | (localStatus & (STRESS | S_TYPE)));
+		if ((status & S_TYPE) != ALL_FULL && (localStatus & S_TYPE) == ALL_FULL)
+			r8 &= static_cast<uint8_t>(~UV_AF);
+	} else {
+		if (in == ours && (localStatus & S_TYPE) == UV_AF)
+			r8 = static_cast<uint8_t>((r8 & ~S_TYPE) | UV_AF);
+		if ((r8 & S_TYPE) == ALL_FULL && (localStatus & S_TYPE) != ALL_FULL)
+			r8 &= static_cast<uint8_t>(~UV_AF);
+	}
+	return r8;
+}
+
+// DoStatus on a BMU: all considered full resets the fuel gauge
+void Device::receive(uint8_t status)
+{
+	if (halted)
+		return;
+	ticksSinceLastRx = 0;
+	if (localStatus & COM_ERR)
+		return;
+	globalStatus = status;
+	if (!(status & COM_ERR) && (status & S_TYPE) == ALL_FULL) {
+		discharge = 0;
+		updateSoC();
+	}
+	controlContactors(status);
+}
+
+// ControlContactors
+void Device::controlContactors(uint8_t status)
+{
+	bool ignore;
+	if (current >= 10 || !(contactors & AcLfPvCtor))
+		ignore = (status & S_TYPE) == UV_AF;
+	else if (current < -9)
+		ignore = (status & OV_UT) == OV_UT;
+	else
+		ignore = false;
+	int16_t s = ignore ? 6 : status & STRESS;
+	if (status & COM_ERR)
+		s = 15;
+
+	// Smoothed, with a time constant of four ticks
+	int16_t x4 = s16(s * 4 + smoothStressX4 * 3 + 2) >> 2;
+	smoothStressX4 = static_cast<uint8_t>(x4);
+	int8_t smoothed = static_cast<int8_t>(s16(x4 + 1) >> 2);
+
+	if (smoothed >= 15) {
+		if (++shutdownTimer >= ShutdownTime) {
+			contactors &= static_cast<uint8_t>(~(BatPosCtor | BatNegCtor | AcLfPvCtor | RtPvCtor));
+			halted = true;
+			return;
+		}
+	} else
+		shutdownTimer = 0;
+
+	if ((status & S_TYPE) != UV_AF && charging && smoothed >= static_cast<int8_t>(alarmStress) && donePipInit)
+		contactors &= static_cast<uint8_t>(~(RtPvCtor | AcLfPvCtor));
+	else if (static_cast<uint16_t>(boltPlV(m_sums.boltPlV, info, cmuTemperature)) >= 145 * 10)
+		contactors &= static_cast<uint8_t>(~(RtPvCtor | AcLfPvCtor));
+
+	if (smoothed < 7 && static_cast<uint16_t>(cellV(m_sums.cellV, info, cmuTemperature)) < 140 * 10)
+		contactors |= AcLfPvCtor | RtPvCtor;
+
+	// What the untested call to the charger controllers would be given every fourth tick while charging
+	chargeStress = -1;
+	if (charging && (++chargerTxTimer & 3) == 0) {
+		if (status & COM_ERR)
+			chargeStress = (status & STRESS) < 8 ? 8 : status & STRESS;
+		else if ((status & S_TYPE) == UV_AF)
+			chargeStress = 0;
+		else
+			chargeStress = status & STRESS;
+	}
+}
+
+}	// namespace monolith
@@ -0,0 +1,171 @@
+// reference.h : the monolith firmware's measurement, stress and charge-control arithmetic, bit for bit, in C++
+//
+// Written 17/Oct/2026
+//
+// Each routine here does what its namesake in monolith.s43, IntMeasure.s43, comDefinitions.s43 or math.s43
+// does, with the same 16-bit wraparound, rounding and signed or unsigned comparisons, as monolith.s43 is
+// assembled by default (StatusFreq 2, WHINGE 0, LOW_LOW_CUTOFF 0, CONFIG OFF_GRID). Given the same sums
+// of ADC10 codes, a Device here and a device running the image agree on every stress, status byte, DoD
+// and controller output, so a pack model can drive thousands of simulated hours through the firmware's
+// decisions without simulating its instructions.
+//
+// Device	The RAM of one BMU or CMU that DoMeasurement, DoStatus and ControlContactors use, with those
+//			routines. A tick is measure(), then relay() on a CMU or receive() on a BMU when a status byte
+//			arrives, then, on a CMU, currentCommand() when the BMU's 'i' command arrives.
+//
+// Where the firmware waits (DelayMs before closing the source contactors) or talks (the PIP
+// initialisation strings, TxByte), a Device just records what it would have done.
+
+#pragma once
+
+#include <cstdint>
+
+namespace monolith {
+
+// monolith.s43's assembly-time constants
+const unsigned StatusFreq = 2;				// Ticks per second
+const unsigned NumSamples = 16;				// ADC10 conversions summed for each measurement
+const int CellVChan = 7, BoltVPlChan = 5, BoltVMiChan = 6, TempChan = 0xA;
+const int16_t OV_ZERO = 3130, OV_STEP = 40, UV_ZERO = 3460, UV_STEP = -35;
+const int16_t OT_ZERO = 33, OT_STEP = 2, BypTempQuota = 15, UT_ZERO = 24, UT_STEP = -2;
+const int16_t AL_ZERO = 0, AL_STEP = 8;
+const uint8_t ComErrTicks = 9, ZeroCurrentTicks = 9, ShutdownTime = 15 * StatusFreq;
+const uint8_t PipWait = 3 * StatusFreq, PipCmdWait = 2 * StatusFreq, PipInitStrings = 16;
+const int16_t chargerCurrMax = 80;			// Amps
+const int16_t CHG_BULK_MIN = 538, CHG_BULK_STD = 552, CHG_FLT_MIN = 512, CHG_FLT_STD = 538;
+const uint16_t MinAdvance = 20;
+// Status byte bits
+const uint8_t COM_ERR = 1 << 6, UV_AF = 1 << 5, OV_UT = 1 << 4, ALL_FULL = OV_UT | UV_AF;
+const uint8_t S_TYPE = 0x30, STRESS = 0x0F;
+// Contactor outputs on P3 (BMU)
+const uint8_t PreCtor = 1 << 1, BatPosCtor = 1 << 2, BatNegCtor = 1 << 3, AcLfPvCtor = 1 << 4,
+	RtPvCtor = 1 << 6;
+
+// A device's calibration, from info flash (see common/common.h) and the TLV
+struct Info
+{
+	uint8_t		adcTimIdx = 0xFF;
+	uint16_t	boltMiCal = 0xFFFF, tempSlope = 0xFFFF;
+	int8_t		boltPlOff = -1, cellOff = -1;
+	uint16_t	capacity = 0xFFFF;			// Tenths of an amp-hour
+	uint16_t	cellRes = 0xFFFF;			// Micro-ohms at 25 C
+	uint16_t	boltPlCal = 0xFFFF, cellCal = 0xFFFF;
+	int8_t		tempOff = -1, boltMiOff = -1;
+	uint8_t		id = 0xFF, dataVers = 0xFF;
+	uint16_t	cal30 = 0xFFFF;				// CALADC_15T30
+
+	Info() {}
+	// From a 64 KiB address space
+	explicit Info(const uint8_t* memory);
+	// Where erased, what msp430sim -n fills in: unity voltage calibrations, the nominal temperature
+	// slope and TLV calibration, and this ID
+	void	calibrate(uint8_t id);
+};
+
+// math.s43
+uint32_t	umStar(uint16_t a, uint16_t b);
+uint32_t	mmStar(int16_t a, uint16_t b);
+uint16_t	umSlashMod(uint32_t dividend, uint16_t divisor);	// $FFFF on overflow or division by zero
+
+// IntMeasure.s43 and GetLinkV, from the sum of NumSamples codes on a channel. cmuTemperature is what the
+// last GetTemp left for ApplyTempCo.
+int16_t		cellV(uint16_t sum, const Info& info, int8_t cmuTemperature);
+int16_t		boltPlV(uint16_t sum, const Info& info, int8_t cmuTemperature);
+int16_t		boltMiV(uint16_t sum, const Info& info);			// 9999 when BoltMiOff is $80
+int16_t		temperature(uint16_t sum, const Info& info, int16_t* halfDegrees = nullptr);
+int16_t		linkV(uint16_t cellSum, uint16_t boltPlSum, uint16_t boltMiSum, const Info& info,
+				int8_t cmuTemperature);
+
+// DoMeasurement's estimate of open-circuit voltage: v less current (tenths of an amp) times the cell
+// resistance at cellTemperature
+int16_t		ocv(int16_t v, int16_t current, int8_t cellTemperature, uint16_t cellRes);
+
+// comDefinitions.s43
+uint16_t	depthOfDischarge(uint32_t discharge, uint16_t capacity);	// Tenths of a percent
+uint32_t	socToDischarge(uint16_t soc, uint16_t capacity);
+
+// The charger controllers, which ControlContactors would call every fourth tick while charging with the
+// pack's stress: 0 if it's undervoltage, and at least 8 with a comms error (see Device::chargeStress)
+struct PiState
+{
+	int16_t		prevOutput = 0, prevError = 0;
+};
+int16_t		piController(PiState& s, int16_t stress);				// Amps, 0 to chargerCurrMax
+struct ChgState
+{
+	int16_t		prevBulk = CHG_BULK_STD, prevFloat = CHG_FLT_STD;	// Tenths of a volt
+	bool		lastChgChanged = false;
+};
+void		chgController(ChgState& s, int16_t stress, uint8_t chargerTxTimer);
+
+class Device
+{
+public:
+	// The sums the measurement interrupt leaves in rawMeasures
+	struct Sums
+	{
+		uint16_t	cellV = 0, boltPlV = 0, boltMiV = 0, temperature = 0;
+	};
+
+	// As a power-on reset leaves it. The ID is infoID, as the BSL copies it.
+	explicit Device(const Info& info);
+
+	// DoMeasurement. Returns the status byte it sends, if it takes on master duties because no status
+	// has come for ComErrTicks ticks (as CMU 1 always does), or -1. A BMU passes that byte to
+	// ControlContactors itself.
+	int		measure(const Sums& sums);
+	// DoStatus on a CMU: merge a status byte with ours, returning what to send on, or -1 if ignored
+	int		relay(uint8_t status);
+	// DoStatus on a BMU, and then ControlContactors
+	void	receive(uint8_t status);
+	// The 'i' command
+	void	currentCommand(int16_t tenthsOfAmps);
+
+	bool	bmu() const { return id == 255; }
+
+	Info		info;
+	uint8_t		id;
+	// Thresholds, as set at power-on and by the 'Th' commands
+	int16_t		ovZero = OV_ZERO;
+	uint8_t		ovStep = OV_STEP;
+	uint8_t		alarmStress = 12;
+	int16_t		bypassVoltage = OV_ZERO + 7 * OV_STEP, fullVoltage = OV_ZERO + 8 * OV_STEP;
+
+	// DoMeasurement
+	uint8_t		ticks = 0, ticksSinceLastRx = 0, ticksSinceLastI = 0;
+	uint8_t		localStatus = 0, globalStatus = 0;
+	uint8_t		worstStress = 0, worstStressType = 0;
+	int16_t		worst[6] = {};				// worstOV to worstAL, by stress type 1 to 5
+	int16_t		current = 0;				// Tenths of an amp, charging positive
+	int8_t		cellTemperature = 0, cmuTemperature = 0;
+	int16_t		ocCellVolt = 0;
+	uint32_t	ocCellVoltX256 = 3300 * 256;
+	uint16_t	restedCounter = 0;
+	bool		beenBypassing = false;
+	uint16_t	ticksSinceLastBypass = 0;
+	bool		bypass = false;				// P2.5 on a CMU
+	bool		errorLed = false;			// P2.0 on a CMU
+	uint16_t	stress = 0, stressMeas = 0, stressType = 0;		// Rstrs, Rmeas and Rtype
+
+	// A BMU's fuel gauge and charge control
+	uint32_t	discharge = 0;				// 1/72 mAh
+	uint16_t	socPwmAdv = 0;
+	bool		charging = true;			// bCharging
+	bool		donePipInit = false;		// bDonePipInit
+	uint8_t		pipInitCtr = 0, pipCmdCtr = 0, pipStringsSent = 0;
+	uint8_t		contactors = BatPosCtor | BatNegCtor | AcLfPvCtor | RtPvCtor;	// P3OUT, after DoPrecharge
+	bool		halted = false;				// Shut down by stress 15
+	uint8_t		smoothStressX4 = 0, shutdownTimer = 0, chargerTxTimer = 0;
+	int16_t		chargeStress = -1;			// What ControlContactors gave the charger controllers this
+											// tick, or -1
+	PiState		pi;
+	ChgState	chg;
+
+private:
+	void	doStress(int16_t meas, int16_t step, int16_t zero, uint16_t type);
+	void	updateSoC();
+	void	controlContactors(uint8_t status);
+	Sums	m_sums;
+};
+
+}	// namespace monolith
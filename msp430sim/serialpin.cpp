@@ -0,0 +1,75 @@
+// serialpin.cpp : asynchronous serial bytes to and from a simulated device's pins
+//
+// Written 17/Oct/2026
+
+#include "msp430.h"
+
+#include <algorithm>
+
+namespace msp430 {
+
+SerialPin::SerialPin(Mcu& mcu, int rxPort, int rxBit, int txPort, int txBit, unsigned baud, bool txInverted)
+	: m_mcu(mcu), m_rxPort(rxPort), m_rxBit(rxBit), m_baud(baud), m_bitTime(Second / baud),
+	m_txInverted(txInverted)
+{
+	m_mcu.setInput(rxPort, rxBit, true);
+	m_level = m_mcu.pin(txPort, txBit) != txInverted;
+	m_mcu.watchPin(txPort, txBit, [this](bool level) { edge(level != m_txInverted); });
+}
+
+void SerialPin::send(uint8_t byte)
+{
+	Time t = std::max(m_sendEnd, m_mcu.now());
+	unsigned frame = (byte | 0x100u) << 1;		// Start bit, 8 data bits LSB first, stop bit
+	bool level = true;
+	for (int bit = 0; bit < 10; ++bit) {
+		bool b = frame >> bit & 1;
+		if (b != level) {
+			level = b;
+			m_mcu.at(t + bit * m_bitTime, [this, b] { m_mcu.setInput(m_rxPort, m_rxBit, b); });
+		}
+	}
+	m_sendEnd = t + 10 * m_bitTime;
+}
+
+void SerialPin::sendBreak(Time length)
+{
+	Time t = std::max(m_sendEnd, m_mcu.now());
+	m_mcu.at(t, [this] { m_mcu.setInput(m_rxPort, m_rxBit, false); });
+	m_mcu.at(t + length, [this] { m_mcu.setInput(m_rxPort, m_rxBit, true); });
+	m_sendEnd = t + length + m_bitTime;
+}
+
+// The device's output has changed. A falling edge on an idle line is a start bit.
+void SerialPin::edge(bool level)
+{
+	bool fell = m_level && !level;
+	m_level = level;
+	if (!fell || m_receiving)
+		return;
+	m_receiving = true;
+	m_data = 0;
+	uint64_t frame = ++m_frame;
+	m_mcu.at(m_mcu.now() + m_bitTime / 2, [this, frame] { sample(0, frame); });
+}
+
+void SerialPin::sample(int bit, uint64_t frame)
+{
+	if (frame != m_frame)
+		return;
+	if (bit == 0 && m_level) {
+		m_receiving = false;					// A glitch, not a start bit
+		return;
+	}
+	if (bit >= 1 && bit <= 8)
+		m_data |= (m_level ? 1u : 0u) << (bit - 1);
+	if (bit == 9) {
+		m_receiving = false;
+		if (onByte)
+			onByte(m_level ? static_cast<int>(m_data) : -1);
+		return;
+	}
+	m_mcu.at(m_mcu.now() + m_bitTime, [this, bit, frame] { sample(bit + 1, frame); });
+}
+
+}	// namespace msp430
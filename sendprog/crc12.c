@@ -0,0 +1,28 @@
+/*
+ * crc12.c: the CRC12 that protects every packet on the chain, shared by sendprog, chainsim and chainmon
+ * Written 17/Oct/2026
+ *
+ * The same CRC as common/Crc12.s43: polynomial $C16 (reversed), initial value $FFF, inverted at the end.
+ */
+
+#include "crc12.h"
+
+unsigned int crc12(const unsigned char* p, unsigned int n) {
+	unsigned int crc = 0xFFF;
+	unsigned int i;
+	while (n--) {
+		crc ^= *p++;
+		for (i=0; i < 8; ++i)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xC16 : crc >> 1;
+	}
+	return crc ^ 0xFFF;
+}
+
+void printableCrc(unsigned int crc, unsigned char* p) {
+	p[0] = crc & 0x3F;
+	p[1] = crc >> 6 & 0x3F;
+	if (p[0] != 0x3F)
+		p[0] |= 0x40;
+	if (p[1] != 0x3F)
+		p[1] |= 0x40;
+}
@@ -0,0 +1,15 @@
+/*
+ * crc12.h: the CRC12 that protects every packet on the chain, for the C tools (sendprog, chainsim,
+ * chainmon). The C++ tools have their own in liblytefyba.
+ */
+
+#ifndef CRC12_H
+#define CRC12_H
+
+/* CRC12 of n bytes as the devices compute it: see common/Crc12.s43 */
+unsigned int crc12(const unsigned char* p, unsigned int n);
+
+/* The two printable characters that carry a CRC12 in a packet: see MakeCrc12Printable in common/Crc12.s43 */
+void printableCrc(unsigned int crc, unsigned char* p);
+
+#endif
@@ -3,73 +3,440 @@
  * Sends main program only
  * Updated 8/Feb/2017 for trunk password
  * Updated 18/Apr/2017 for longer password delays
+ * Updated 17/Oct/2026 for echo pacing
+ * Updated 17/Oct/2026 for block downloads (-b)
+ * Updated 17/Oct/2026 for higher rates in block downloads (-B)
+ * Updated 17/Oct/2026 for delta block downloads (-d)
+ * Updated 17/Oct/2026 for compressed block downloads (-z)
+ * Updated 17/Oct/2026 for several ports at once
+ * Updated 17/Oct/2026 for Intel HEX and TI-TXT images
+ * Updated 17/Oct/2026 to check every device's program CRC12 after the download
+ * Updated 17/Oct/2026 for downloads to a single device (-s)
+ * Updated 17/Oct/2026 to time pauses right on ports that don't report their output queue (see chainsim)
+ * Updated 17/Oct/2026 to share crc12.c with chainsim and chainmon
  */
 
 #define LINUX 1
 
-/* Usage: sengprog path/to/binary COM16 */
+/* Usage: sengprog [-t] [-s 5 | -b [-B 38400] [-d path/to/old/image] [-z]] path/to/image COM16 [path/to/image2 COM17 ...] */
 
+#define _GNU_SOURCE		// For ppoll()
 #include <termios.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>		// For usleep()
 #include <fcntl.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/stat.h>
-#if !LINUX
+#if LINUX
+#include <poll.h>
+#include <time.h>
+#include <ucontext.h>
+#include <sys/ioctl.h>
+#else
 #include "windows.h"
 #endif
+#include "crc12.h"
+
+/*
+ * Image files
+ * The image can be IAR's Intel HEX output (":" records), TI-TXT ("@" addresses, "q" at the end), or a raw
+ * binary that ends at $FFFF. It is read a byte at a time into a 64 KiB map of the address space, so it can
+ * be sparse; anything not in the file is $FF, like erased flash. What we send is fixed by where BSL2 puts
+ * it: PROG_START up to BSL2_START-1, or REV61_PROG_ST up to REV61_BSL2_ST-1 for an old rev61 image.
+ * The BSL and the interrupt vectors, from BSL2_START up, are never sent.
+ */
+#define PROG_START		0xC000		/* These are as in common/common.h */
+#define REV61_PROG_ST	0xE000
+#define BSL2_START		0xFC00
+#define REV61_BSL2_ST	0xFE00
 
-unsigned int address = 0;
-unsigned char sum;
+unsigned int address = 0;			/* Where the next byte from the file goes */
+unsigned char sum;					/* Sum of the bytes of an Intel HEX record */
+const char* loadName;				/* File being read, and the line we're on, for error messages */
+unsigned int loadLine;
+
+void loadError(const char* what) {
+	fprintf(stderr, "%s line %u: %s, address = %X\n", loadName, loadLine, what, address);
+	exit(1);
+}
 
 unsigned int readHexNibble(FILE* f) {
-	char c = fgetc(f);
-	int r;
-	if (c >= '0') {
-		r = c - '0';
-		if (r > 9)
-			r -= 'A'-1-'9';
-		if (r <= 0xF)
-			return r;
-	}
-	fprintf(stderr, "Unexpected char '%c' when reading hex, address = %X\n", c, address);
+	int c = fgetc(f);
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	fprintf(stderr, "%s line %u: unexpected char '%c' when reading hex, address = %X\n", loadName, loadLine,
+		c, address);
 	exit(1);
 	return -1;
 }
 
 unsigned int readHexByte(FILE* f) {
-	unsigned int r = (readHexNibble(f) << 4) + readHexNibble(f);
+	unsigned int r = readHexNibble(f) << 4;
+	r += readHexNibble(f);
 	sum += r;
 	return r;
 }
 
 unsigned int readHexWord(FILE* f) {
-	return (readHexByte(f) << 8) + readHexByte(f);
+	unsigned int r = readHexByte(f) << 8;
+	return r + readHexByte(f);
 }
 
 
-void readColon(FILE *f) {
-	char c;
+/* Skip to just after the next colon. Returns 0 at the end of the file. */
+int readColon(FILE *f) {
+	int c;
 	do {
 		c = fgetc(f);
-	} while (!feof(f) && c != ':');
+		if (c == '\n')
+			++loadLine;
+	} while (c != EOF && c != ':');
+	return c == ':';
+}
 
-	if (feof(f)) {
-		fprintf(stderr, "End of file waiting for colon; address is %X\n", address);
+/* Put byte b at address in the map */
+void putByte(unsigned char* mem, unsigned char* have, unsigned char b) {
+	if (address > 0xFFFF)
+		loadError("data beyond the 64 KiB address space");
+	mem[address] = b;
+	have[address++] = 1;
+}
+
+/* Read Intel HEX records, checking each record's checksum, until the end-of-file record */
+void loadHex(FILE* f, unsigned char* mem, unsigned char* have) {
+	unsigned int n, typ, base = 0, u;
+	unsigned char data[256];
+	while (readColon(f)) {
+		sum = 0;
+		n = readHexByte(f);
+		address = base + readHexWord(f);
+		typ = readHexByte(f);
+		for (u=0; u < n; ++u)
+			data[u] = readHexByte(f);
+		readHexByte(f);						/* The checksum makes the record sum to zero */
+		if (sum != 0)
+			loadError("bad record checksum");
+		switch (typ) {
+		case 0:								/* Data */
+			for (u=0; u < n; ++u)
+				putByte(mem, have, data[u]);
+			break;
+		case 1:								/* End of file */
+			return;
+		case 2:								/* Extended segment address */
+			base = (data[0] << 8 | data[1]) << 4;
+			break;
+		case 4:								/* Extended linear address */
+			base = (data[0] << 8 | data[1]) << 16;
+			break;
+		case 3: case 5:						/* Start address; BSL2 decides that */
+			break;
+		default:
+			loadError("unknown record type");
+		}
+	}
+	loadError("no end-of-file record");
+}
+
+/* Read TI-TXT: "@xxxx" sets the address, then bytes in hex, until "q" */
+void loadTxt(FILE* f, unsigned char* mem, unsigned char* have) {
+	int c;
+	while ((c = fgetc(f)) != EOF && c != 'q' && c != 'Q') {
+		if (c == '\n')
+			++loadLine;
+		if (c == '@') {
+			address = 0;
+			while (isxdigit(c = fgetc(f))) {
+				ungetc(c, f);
+				address = address << 4 | readHexNibble(f);
+			}
+			ungetc(c, f);
+		} else if (isxdigit(c)) {
+			ungetc(c, f);
+			putByte(mem, have, readHexByte(f));
+		} else if (!isspace(c))
+			loadError("unexpected character");
 	}
 }
 
+/* Read a raw binary, which ends at $FFFF */
+void loadBin(FILE* f, unsigned char* mem, unsigned char* have) {
+	unsigned int n = fread(mem, 1, 0x10000, f);
+	if (fgetc(f) != EOF)
+		loadError("binary is bigger than 64 KiB");
+	memmove(mem + 0x10000 - n, mem, n);
+	memset(mem, 0xFF, 0x10000 - n);
+	memset(have + 0x10000 - n, 1, n);
+}
+
+/* Read the image in file name. Returns a map of the address space, with the start and length of the part
+   that BSL2 downloads in *start and *len, and 1 in *rev61 if it's an old rev61 image. */
+unsigned char* loadImage(const char* name, unsigned int* start, unsigned int* len, int* rev61) {
+	FILE* f;
+	unsigned char* mem = malloc(0x10000);
+	unsigned char* have = calloc(0x10000, 1);
+	const char* ext = strrchr(name, '.');
+	unsigned int lo, end, n, a;
+	int c;
+
+	if (mem == NULL || have == NULL) {
+		fprintf(stderr, "Could not allocate memory for %s\n", name);
+		exit(2);
+	}
+	memset(mem, 0xFF, 0x10000);
+	f = fopen(name, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "Could not open %s for reading\n", name);
+		exit(1);
+	}
+	loadName = name;
+	loadLine = 1;
+	address = 0;
+	if (ext && strcmp(ext, ".txt") == 0)
+		loadTxt(f, mem, have);
+	else if (ext && strcmp(ext, ".bin") == 0)
+		loadBin(f, mem, have);
+	else {
+		/* Intel HEX starts with a colon; anything else is taken to be a binary */
+		while ((c = fgetc(f)) != EOF && isspace(c))
+			;
+		rewind(f);
+		if (c == ':')
+			loadHex(f, mem, have);
+		else
+			loadBin(f, mem, have);
+	}
+	fclose(f);
+
+	for (lo=0; lo < 0x10000 && !have[lo]; ++lo)
+		;
+	if (lo == 0x10000) {
+		fprintf(stderr, "%s has no data\n", name);
+		exit(1);
+	}
+	if (lo < PROG_START) {
+		fprintf(stderr, "%s has data at %04X, below the program image at %04X\n", name, lo, PROG_START);
+		exit(1);
+	}
+	/* Rev61 images start at REV61_PROG_ST; ours have jump tables and code from PROG_START */
+	*rev61 = lo >= REV61_PROG_ST;
+	*start = *rev61 ? REV61_PROG_ST : PROG_START;
+	end = *rev61 ? REV61_BSL2_ST : BSL2_START;
+	for (n=0, a=*start; a < end; ++a)
+		n += have[a];
+	if (n == 0) {
+		fprintf(stderr, "%s has nothing below the BSL at %04X\n", name, end);
+		exit(1);
+	}
+	*len = end - *start;
+	free(have);
+	return mem;
+}
+
+
+#define MAX_WINDOW		1024		/* Size of the ring of bytes sent but not yet echoed */
+#define SEG_SIZE		512			/* Main-flash segment size, and frame data size */
+#define LZ_MAX_OUT		(SEG_SIZE + SEG_SIZE/8)	/* A segment of literals, and its flag bytes */
+#define MAX_PORTS		16			/* Ports that can be downloaded to at once */
+
+/*
+ * Each port downloads its own image to its own chain, with its own timing, so everything that the
+ * download changes as it goes lives in a struct port. P is the port being worked on now.
+ */
+struct port {
+	const char* name;				/* Port name or path, as given */
+	const char* binName;			/* Image file name */
+	unsigned char* pBuf;			/* Image to send, from start */
+	unsigned int start, lenToSend;
+	int rev61;						/* True for an old rev61 image */
+#if LINUX
+	int fd;
+	struct termios config;
+	ucontext_t ctx;					/* Where the download carries on when the port is ready */
+	short events;					/* What the download is waiting for: POLLIN, POLLOUT, or just time */
+	long long until;				/* When it stops waiting, in microseconds */
+	long long lineFree;				/* When everything written will have been sent, at the earliest */
+#else
+	HANDLE hComm;
+#endif
+	unsigned int byteUs;			/* Time to send one byte at the current rate */
+	unsigned int sent, toSend;		/* Progress: bytes or segments sent, out of how many */
+	int finished, result;			/* Result is 0 for success */
+	int devices;					/* Devices that answered 'Pc' before the download */
+	int bmu;						/* True if a BMU (ID 255) was one of them */
+
+	/* Echo pacing */
+	int echoMode;					/* True while pacing by echoes; cleared by -t or a missing echo */
+	unsigned int echoWindow;		/* Bytes allowed in flight; set from the password round trip */
+	unsigned char inFlight[MAX_WINDOW];	/* Bytes sent but not yet echoed, oldest at inFlight[inHead] */
+	unsigned int inHead, inCount;
+	unsigned int echoErrors;		/* Echoes that differ from what was sent */
+
+	/* Block downloads */
+	unsigned char blkSeq;			/* Sequence number for the next frame */
+	struct {						/* Parser for the frames coming back from the end of the chain */
+		int state;					/* 0 = hunting for BLK_SOH, then one state per header byte, 8 = data */
+		unsigned char seq, hi, ack;
+		unsigned int n;
+	} rx;
+	unsigned char zData[256][LZ_MAX_OUT];	/* Compressed segments */
+	unsigned int zPause[256][LZ_MAX_OUT];	/* Pause after each compressed byte, in microseconds */
+	unsigned int zLen[256];			/* Compressed length, or 0 to send the segment plain */
+	int counts[256];				/* Acknowledgement count for each segment */
+	int sends[256];					/* Number of times each segment has been sent */
+	char unchanged[256];			/* Segments the same as in the old image, not to be sent */
+	int seqSeg[256];				/* Segment for each sequence number in flight, or -1 */
+	int framesInFlight, maxCount;	/* Frames in flight; most devices that have acknowledged a frame */
+};
+
+struct port* ports[MAX_PORTS];
+int nPorts;
+struct port* P;
+
+/* Print a message about the current port. With several ports, each message gets a line of its own,
+   starting with the port's name. */
+void msg(const char* fmt, ...) {
+	va_list ap;
+	if (nPorts > 1) {
+		while (*fmt == '\n')
+			++fmt;
+		printf("%s: ", P->name);
+	}
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	fflush(stdout);
+}
+
+/* Show that one more byte or segment has been sent. With several ports, the progress of all of them
+   is shown together every few seconds instead. */
+void progress(const char* s) {
+	if (nPorts == 1) {
+		printf("%s", s);
+		fflush(stdout);
+	}
+}
 
 #if LINUX
-struct termios  config;				/* UNIX only */
-int fd;
+ucontext_t schedCtx;				/* The loop that runs all the ports */
+
+long long nowUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Let the other ports run until this port's fd has one of events, or it's time until */
+void waitPort(short events, long long until) {
+	P->events = events;
+	P->until = until;
+	swapcontext(&P->ctx, &schedCtx);
+}
+
+/* Stop working on this port, with result r */
+void giveUp(int r) {
+	P->result = r;
+	P->finished = 1;
+	setcontext(&schedCtx);
+}
+
+void pauseUs(unsigned int us) {
+	waitPort(0, nowUs() + us);
+}
+
 void writeByte(const char* p) {
-	write(fd, p, 1);
+	long long now;
+	while (write(P->fd, p, 1) != 1)
+		waitPort(POLLOUT, nowUs() + 1000000);
+	now = nowUs();
+	if (P->lineFree < now)
+		P->lineFree = now;
+	P->lineFree += P->byteUs;
+}
+
+/* Read one byte into *p, waiting at most timeout_us microseconds. Returns 1 if a byte was read. */
+int readByte(unsigned char* p, unsigned int timeout_us) {
+	long long until = nowUs() + timeout_us;
+	while (read(P->fd, p, 1) != 1) {
+		if (timeout_us == 0 || nowUs() >= until)
+			return 0;
+		waitPort(POLLIN, until);
+	}
+	return 1;
+}
+
+/* Throw away anything received but not yet read */
+void flushInput(void) {
+	tcflush(P->fd, TCIFLUSH);
+}
+
+/* Wait until everything written has been transmitted. Like tcdrain(), but lets the other ports run.
+   Some USB adapters, and pseudo-terminals, report an empty queue while they still hold bytes, so we also
+   wait for as long as the bytes we've written must take. */
+void drainOutput(void) {
+	int n;
+	while (ioctl(P->fd, TIOCOUTQ, &n) == 0 && n > 0)
+		pauseUs(n * P->byteUs);
+	if (P->lineFree > nowUs())
+		waitPort(0, P->lineFree);
+	pauseUs(P->byteUs);					/* The last byte may still be in the UART */
+}
+
+/* Change the port's bit rate, after everything written has been transmitted */
+void setBaud(unsigned int rate) {
+	speed_t speed = rate == 19200 ? B19200 : rate == 38400 ? B38400 : rate == 57600 ? B57600 : B9600;
+	drainOutput();
+	cfsetispeed(&P->config, speed);
+	cfsetospeed(&P->config, speed);
+	if (tcsetattr(P->fd, TCSANOW, &P->config) < 0) {
+		msg("Error - could not set baud rate to %u\n", rate);
+		giveUp(1);
+	}
+	P->byteUs = 11000000 / rate;
+}
+#else		// Windows: one port at a time
+void giveUp(int r) {
+	exit(r);
+}
+
+void pauseUs(unsigned int us) {
+	usleep(us);
+}
+
+int readByte(unsigned char* p, unsigned int timeout_us) {
+	COMMTIMEOUTS cto = {0};
+	DWORD dwRead;
+	cto.ReadTotalTimeoutConstant = (timeout_us + 999) / 1000;
+	SetCommTimeouts(P->hComm, &cto);
+	if (!ReadFile(P->hComm, p, 1, &dwRead, NULL))
+		return 0;
+	return dwRead == 1;
+}
+
+void flushInput(void) {
+	PurgeComm(P->hComm, PURGE_RXCLEAR);
+}
+
+void drainOutput(void) {
+	FlushFileBuffers(P->hComm);
+}
+
+void setBaud(unsigned int rate) {
+	DCB dcb;
+	FlushFileBuffers(P->hComm);
+	GetCommState(P->hComm, &dcb);
+	dcb.BaudRate = rate;
+	SetCommState(P->hComm, &dcb);
+	P->byteUs = 11000000 / rate;
 }
-#else		// Windows
-HANDLE hComm;
 
 void writeByte(const char* p) {
 	OVERLAPPED osWrite = {0};
@@ -82,7 +449,7 @@ void writeByte(const char* p) {
 	}
 
 	// Issue write.
-	if (!WriteFile(hComm, p, 1, NULL, &osWrite)) {
+	if (!WriteFile(P->hComm, p, 1, NULL, &osWrite)) {
  		if (GetLastError() != ERROR_IO_PENDING) {
         	fprintf(stderr, "WriteFile to comm port failed, but isn't delayed.\n");
 		 	exit(1);
@@ -92,27 +459,633 @@ void writeByte(const char* p) {
 }
 #endif
 
-int main(int argc, char* argv[]) {
-	FILE* f;
-	char c;
-	unsigned int len;
-	unsigned int add;
-	unsigned int typ;
-	unsigned int u;
-	unsigned char* pBuf;			/* Pointer to program buffer */ 
-	unsigned char* p = NULL;
-	unsigned int sum, checksum, total_len;
-	char lastPassChar = 1;
+/*
+ * Echo pacing
+ * When the host's receive line is connected to the end of the chain, every byte we send comes back
+ * to us after it has passed through every CMU. So rather than sleeping for a worst-case time after
+ * every byte, we send at a fixed cadence that every CMU can keep up with, but never let more than
+ * echoWindow bytes be in flight. If a CMU falls behind, its echo is late, and we wait for it.
+ * If no echo arrives within the worst-case time, we fall back to the old fixed delays.
+ */
+#define MIN_BYTE_US		1250		/* Minimum time per byte: 1.2 byte times at 9600 b/s, so each CMU
+									   has time to echo and flash-write (~0.2 ms) before the next */
+#define MAX_ECHO_US		270000		/* Time for a byte to pass through the BMU and up to 255 CMUs */
+#define FIXED_BYTE_US	3000		/* Time to transmit, echo, and flash write, when not echo pacing */
 
-	if (argc != 3) {
-		fprintf(stderr, "Usage: sendprog <binfile> <comm port name/path>\n");
-		exit(1);
+int echoMode = 1;					/* Cleared by -t: no port paces by echoes */
+
+void echoFallback(void) {
+	msg("\nNo echo from the chain; using fixed delays\n");
+	P->echoMode = 0;
+	P->inCount = 0;
+}
+
+/* Wait for the echo of the oldest byte in flight. If strict is false, ignore any bytes that don't
+   match it (status bytes or responses that may still be flowing before the erase). If strict is
+   true, the next byte received is taken to be its echo, and a mismatch is counted as an error.
+   Returns the number of microseconds waited, or falls back to fixed delays on timeout. */
+unsigned int waitEcho(int strict) {
+	unsigned char c;
+	unsigned int waited = 0;
+	while (P->echoMode && P->inCount) {
+		if (!readByte(&c, MIN_BYTE_US)) {
+			waited += MIN_BYTE_US;
+			if (waited >= MAX_ECHO_US)
+				echoFallback();
+			continue;
+		}
+		if (c != P->inFlight[P->inHead]) {
+			if (!strict)
+				continue;
+			++P->echoErrors;
+		}
+		P->inHead = (P->inHead + 1) % MAX_WINDOW;
+		--P->inCount;
+		break;
+	}
+	return waited;
+}
+
+/* Wait for the echo of password byte b, skipping status bytes and responses still in transit. Returns 1
+   when it comes back, with the microseconds waited in *waited, or 0 if nothing at all comes back. Returns
+   -1 if it was echoed wrongly: a control character that no response has came back instead, or other
+   bytes came back but it didn't. */
+int waitPasswordEcho(unsigned char b, unsigned int* waited) {
+	unsigned char c;
+	int heard = 0;
+	for (*waited = 0; *waited < MAX_ECHO_US; ) {
+		if (!readByte(&c, MIN_BYTE_US)) {
+			*waited += MIN_BYTE_US;
+			continue;
+		}
+		if (c == b)
+			return 1;
+		if (c < ' ' && c != '\r' && c != '\n')
+			return -1;
+		heard = 1;
+	}
+	return heard ? -1 : 0;
+}
+
+/* Send one byte, paced by echoes if possible, otherwise by a fixed delay of fixed_us */
+void sendPaced(const unsigned char* p, unsigned int fixed_us) {
+	if (P->echoMode) {
+		while (P->echoMode && P->inCount >= P->echoWindow)
+			waitEcho(1);
+	}
+	writeByte((const char*)p);
+	if (P->echoMode) {
+		P->inFlight[(P->inHead + P->inCount) % MAX_WINDOW] = *p;
+		++P->inCount;
+		pauseUs(MIN_BYTE_US);
+	} else
+		pauseUs(fixed_us);
+}
+
+/*
+ * Block downloads
+ * The main programs (not BSL2) understand a second password, ESC 05 04 03 03, which copies a block loader
+ * into RAM (see common/BlockLoader.s43). We then send one frame per 512-byte flash segment, each with a
+ * CRC12. Each device that holds the segment after the frame has passed increments an acknowledgement
+ * count at the end of the frame, so when the frame comes back from the end of the chain we know how
+ * many devices have it, and we resend any segment with a short count. Devices don't erase or program
+ * a segment that they already hold, so resends are cheap. Finally an end frame carries the CRC12 of the
+ * whole image, and devices that verify it start the new program when we next send them anything.
+ * Through a BMU only one frame is in flight at a time: its loader passes the chain's bytes back only
+ * while it waits for the next frame, and then it can't hear us, so we wait for the line to go quiet first.
+ * A segment can be sent compressed, with a small LZ77 variant that the devices expand straight into flash.
+ * Like echo pacing, this needs the host's receive line connected to the end of the chain. Without it,
+ * every segment is sent once, and the check afterwards (see checkDevices) hears nothing, so the download
+ * fails as unverified.
+ */
+#define BLK_SOH			0x01		/* Start of frame */
+#define BLK_WINDOW		4			/* Frames sent but not yet come back */
+#define HDR_GAP_US		40000		/* Pause after a segment header: devices CRC (14 ms) and may erase (16 ms) it */
+#define END_GAP_US		600000		/* Pause after the end frame header: devices CRC the whole image (400 ms) */
+#define SILENCE_US		1000000		/* If nothing comes back for this long, frames in flight were lost */
+#define BMU_QUIET_US	20000		/* Through a BMU, a frame has come back when nothing arrives for this long */
+#define MAX_SENDS		8			/* Give up on a segment after sending it this many times */
+#define BLK_END			0xFC		/* adrHi of the end frame: BSL2_START/256 */
+#define BLK_BAUD		0xFE		/* adrHi of a baud-rate frame */
+#define UART_CLOCK		(3686400/16) /* CMU UART clock with 16x oversampling: UCA0BR0 = UART_CLOCK/rate */
+#define BYTE_BITS		11			/* Bits per byte sent: start, 8 data, 2 stop */
+#define LZ_MIN			3			/* Shortest match */
+#define LZ_MAX			130			/* Longest match: (length-3)*2 + bit 8 of offset-1 fits in a byte */
+#define EXPAND_US		110			/* Devices take this long to expand and program each byte of a match */
+#define PAUSE_COST_US	1000		/* Guess at what each pause costs beyond its length, in draining output */
+
+int blockMode = 0;					/* True for a block download (-b) */
+unsigned int baudRate = 9600;		/* Rate for the image in a block download (-B) */
+const char* oldName = NULL;			/* Image the devices hold now, for a delta download (-d) */
+int compress = 0;					/* True to compress segments where that's quicker (-z) */
+int selected = 0;					/* ID of the only device to download to (-s), or 0 for all */
+
+/* The block loader compares CRC12s before the final inversion */
+#define FRAME_CRC(p, n)	(crc12(p, n) ^ 0xFFF)
+
+/* Feed one received byte to the parser. Returns 1 when a frame with a good acknowledgement
+   has been received, with its sequence number and acknowledgement count in *seq and *count. */
+int rxFrame(unsigned char c, int* seq, int* count) {
+	switch (P->rx.state) {
+	case 0: if (c == BLK_SOH) P->rx.state = 1; return 0;
+	case 1: P->rx.seq = c; P->rx.state = 2; return 0;
+	case 2: P->rx.hi = c; P->rx.state = 3; return 0;
+	case 3: P->rx.state = (c == (unsigned char)~P->rx.hi) ? 4 : 0; return 0;
+	case 4: P->rx.state = 5; return 0;
+	case 5: P->rx.state = 6; return 0;
+	case 6: P->rx.n = c; P->rx.state = 7; return 0;
+	case 7:
+		P->rx.n += c << 8;				/* Number of data bytes */
+		P->rx.state = P->rx.n > SEG_SIZE ? 0 : P->rx.n ? 8 : 9;	/* The devices ignore a longer frame */
+		return 0;
+	case 8: if (--P->rx.n == 0) P->rx.state = 9; return 0;
+	case 9: P->rx.ack = c; P->rx.state = 10; return 0;
+	default:
+		P->rx.state = 0;
+		if ((unsigned char)(P->rx.ack + c) != 0xFF)
+			return 0;					/* Corrupted on the way back */
+		*seq = P->rx.seq;
+		*count = P->rx.ack;
+		return 1;
+	}
+}
+
+void writeBytes(const unsigned char* p, unsigned int n) {
+	while (n--)
+		writeByte((const char*)p++);
+}
+
+/* Send one frame. hi is the high byte of the segment address. data is n bytes, or NULL for the end and
+   baud-rate frames. pause is NULL for plain data; for compressed data, it's how long to pause after each
+   byte, so the devices can expand matches. gap_us is the pause after the header. */
+void sendFrame(unsigned char seq, unsigned char hi, const unsigned char* data, unsigned int n,
+		const unsigned int* pause, unsigned int crc, unsigned int gap_us) {
+	unsigned char hdr[8];
+	static const unsigned char ack[2] = {0x00, 0xFF};
+	unsigned int i, j;
+	hdr[0] = BLK_SOH;
+	hdr[1] = seq;
+	hdr[2] = pause ? hi | 1 : hi;		/* Bit 0 set for compressed data */
+	hdr[3] = ~hdr[2];
+	hdr[4] = crc & 0xFF;
+	hdr[5] = crc >> 8;
+	hdr[6] = n & 0xFF;
+	hdr[7] = n >> 8;
+	writeBytes(hdr, 8);
+	drainOutput();						/* The pause must start when the header has gone */
+	pauseUs(gap_us);
+	for (i=j=0; i < n; ++i)
+		if (pause && pause[i]) {
+			writeBytes(data + j, i + 1 - j);
+			drainOutput();				/* Devices expand a match when its last byte arrives */
+			pauseUs(pause[i]);
+			j = i + 1;
+		}
+	writeBytes(data + j, n - j);
+	writeBytes(ack, 2);
+}
+
+/* Compress one segment for the block loader: see common/BlockLoader.s43. Matches only refer to earlier
+   bytes of the same segment. Returns the compressed length, with the pause needed after each byte. */
+unsigned int lzSegment(const unsigned char* seg, unsigned char* out, unsigned int* pause) {
+	unsigned int i = 0, n = 0, flags = 0, item = 8;
+	unsigned int off, len, bestOff = 0, bestLen;
+	while (i < SEG_SIZE) {
+		if (item == 8) {				/* Room for the next flag byte */
+			flags = n;
+			out[n] = 0;
+			pause[n++] = 0;
+			item = 0;
+		}
+		bestLen = 0;
+		for (off=1; off <= i; ++off) {
+			for (len=0; len < LZ_MAX && i + len < SEG_SIZE && seg[i+len] == seg[i+len-off]; ++len)
+				;
+			if (len > bestLen) {
+				bestLen = len;
+				bestOff = off;
+			}
+		}
+		if (bestLen >= LZ_MIN) {
+			out[n] = (bestOff - 1) & 0xFF;
+			pause[n++] = 0;
+			out[n] = (bestLen - LZ_MIN) << 1 | (bestOff - 1) >> 8;
+			pause[n++] = bestLen * EXPAND_US;
+			i += bestLen;
+		} else {
+			out[flags] |= 1 << item;	/* A literal */
+			out[n] = seg[i++];
+			pause[n++] = 0;
+		}
+		++item;
+	}
+	return n;
+}
+
+/* Through a BMU, only the tail of a frame comes back, so the acknowledgement pair is the last two bytes
+   before the line goes quiet. Waits up to timeout_us for the first byte. Returns the count, or -1 if
+   nothing came back intact. */
+int bmuAck(unsigned int timeout_us) {
+	unsigned char c, last[2] = {0, 0};
+	int n = 0;
+	while (readByte(&c, n ? BMU_QUIET_US : timeout_us)) {
+		last[0] = last[1];
+		last[1] = c;
+		++n;
+	}
+	if (n < 2 || (unsigned char)(last[0] + last[1]) != 0xFF)
+		return -1;
+	return last[0];
+}
+
+/* Read what comes back from the chain, waiting up to timeout_us for each byte, until a frame that we
+   have in flight completes. Returns 0 if nothing more arrived in time. */
+int collectAck(unsigned int timeout_us) {
+	unsigned char c;
+	int q, cnt;
+	if (P->bmu) {
+		for (q=0; q < 256 && P->seqSeg[q] < 0; ++q)
+			;							/* The one frame in flight */
+		cnt = bmuAck(timeout_us);
+		if (q == 256 || cnt < 0)
+			return 0;
+	} else
+		do {
+			if (!readByte(&c, timeout_us))
+				return 0;
+		} while (!rxFrame(c, &q, &cnt) || P->seqSeg[q] < 0);
+	P->counts[P->seqSeg[q]] = cnt;
+	if (cnt > P->maxCount)
+		P->maxCount = cnt;
+	P->seqSeg[q] = -1;
+	--P->framesInFlight;
+	return 1;
+}
+
+/* True if every device that we know about holds segment s */
+int held(int s) {
+	return P->counts[s] > 0 && P->counts[s] == P->maxCount;
+}
+
+/* Choose the next segment to send: one that not every device holds (or, when blind, that hasn't been
+   sent), that isn't in flight. The last segment, which contains ProgPresence, only goes when all the
+   others are held, so BSL2 can't run a partial program. Returns -1 if there's nothing to send now. */
+int nextSegment(int nSeg, int blind) {
+	int s, q, othersHeld = 1;
+	for (s=0; s < nSeg; ++s) {
+		if (s == nSeg-1 && !othersHeld)
+			return -1;
+		if (P->unchanged[s] || (blind ? P->sends[s] != 0 : held(s)))
+			continue;
+		othersHeld = 0;
+		if (P->sends[s] >= MAX_SENDS)
+			continue;					/* Given up on this one */
+		for (q=0; q < 256 && P->seqSeg[q] != s; ++q)
+			;
+		if (q == 256)
+			return s;					/* Not in flight */
+	}
+	return -1;
+}
+
+/* Wait for the frame with sequence number seq to come back. Returns its acknowledgement count,
+   or -1 if it didn't come back intact. */
+int waitFrame(unsigned char seq, unsigned int timeout_us) {
+	unsigned char c;
+	int q, cnt;
+	if (P->bmu)
+		return bmuAck(timeout_us);
+	while (readByte(&c, timeout_us))
+		if (rxFrame(c, &q, &cnt) && q == seq)
+			return cnt;
+	return -1;
+}
+
+/* Send a baud-rate frame asking for rate, at the rate we're at now, and wait for it to come back.
+   Returns the number of devices that changed (or are already at rate), or -1. */
+int baudFrame(unsigned int rate) {
+	flushInput();
+	P->rx.state = 0;
+	sendFrame(P->blkSeq, BLK_BAUD, NULL, 0, NULL, UART_CLOCK / rate, 0);
+	return waitFrame(P->blkSeq++, SILENCE_US);
+}
+
+/* Move the host and all n devices from rate from to rate to. Returns 1 if we did, 0 if we're all
+   still at from. Gives up on the port if the chain is split between the two rates. */
+int changeRate(unsigned int from, unsigned int to, int n) {
+	int m = baudFrame(to);
+	setBaud(to);
+	if (m == n)
+		return 1;
+	/* The acknowledgement didn't come back. Find out where the chain is. */
+	if (baudFrame(to) == n)
+		return 1;
+	setBaud(from);
+	if (baudFrame(from) == n) {
+		msg("Could not change to %u b/s\n", to);
+		return 0;
 	}
+	msg("The chain is split between %u and %u b/s. Send a break to reset it, "
+		"then download without -b\n", from, to);
+	giveUp(1);
+	return 0;
+}
+
+/* Compress the segments we'll send, and keep the ones that will be quicker to send compressed at rate.
+   Report what we saved. */
+void compressSegments(const unsigned char* img, int nSeg, unsigned int rate) {
+	double byteUs = 1e6 * BYTE_BITS / rate, plainUs = 0, zUs = 0, us;
+	unsigned int plain = 0, packed = 0, i;
+	int s;
+	for (s=0; s < nSeg; ++s) {
+		if (P->unchanged[s])
+			continue;
+		P->zLen[s] = lzSegment(img + s * SEG_SIZE, P->zData[s], P->zPause[s]);
+		us = (P->zLen[s] + 2) * byteUs;	/* Including the length field */
+		for (i=0; i < P->zLen[s]; ++i)
+			if (P->zPause[s][i])
+				us += P->zPause[s][i] + PAUSE_COST_US;
+		plain += SEG_SIZE;
+		plainUs += SEG_SIZE * byteUs;
+		if (us < SEG_SIZE * byteUs) {
+			packed += P->zLen[s];
+			zUs += us;
+		} else {
+			P->zLen[s] = 0;				/* Quicker to send it as it is */
+			packed += SEG_SIZE;
+			zUs += SEG_SIZE * byteUs;
+		}
+	}
+	if (plain)
+		msg("Compressed %u bytes to %u (%u%%); about %.1f s to send instead of %.1f s, saving %.1f s\n",
+			plain, packed, 100 * packed / plain, zUs / 1e6, plainUs / 1e6, (plainUs - zUs) / 1e6);
+}
+
+/* Send the image img of len bytes, starting at address start, in blocks. Returns 0 if every device
+   that acknowledged anything has verified the whole image. */
+int sendBlocks(const unsigned char* img, unsigned int len, unsigned int start) {
+	int nSeg = len / SEG_SIZE;
+	unsigned int rate = 9600;
+	int blind = 0, frames = 0;
+	int s, q, verified;
+
+	for (s=0; s < 256; ++s)
+		P->seqSeg[s] = -1;
+	P->toSend = 0;
+	for (s=0; s < nSeg; ++s)
+		if (!P->unchanged[s])
+			++P->toSend;
+
+	if (baudRate != 9600 && P->bmu)
+		msg("A BMU's SCU port only runs at 9600 b/s; staying at that\n");
+	else if (baudRate != 9600) {
+		/* Count the devices with a baud-rate frame that changes nothing. A BMU spoils these. */
+		P->maxCount = baudFrame(9600);
+		if (P->maxCount <= 0) {
+			msg("The chain can't change rate (is there a BMU?); staying at 9600 b/s\n");
+			P->maxCount = 0;
+		} else if (changeRate(9600, baudRate, P->maxCount)) {
+			rate = baudRate;
+			msg("%d devices changed to %u b/s\n", P->maxCount, rate);
+		}
+	}
+	if (compress)
+		compressSegments(img, nSeg, rate);
+
+	while (1) {
+		while (P->framesInFlight && collectAck(0))
+			;							/* Catch up with anything that has already come back */
+		s = nextSegment(nSeg, blind);
+		if (s >= 0 && P->framesInFlight < (P->bmu ? 1 : BLK_WINDOW)) {
+			if (P->zLen[s])
+				sendFrame(P->blkSeq, (start >> 8) + s * (SEG_SIZE >> 8), P->zData[s], P->zLen[s], P->zPause[s],
+					FRAME_CRC(img + s * SEG_SIZE, SEG_SIZE), HDR_GAP_US);
+			else
+				sendFrame(P->blkSeq, (start >> 8) + s * (SEG_SIZE >> 8), img + s * SEG_SIZE, SEG_SIZE, NULL,
+					FRAME_CRC(img + s * SEG_SIZE, SEG_SIZE), HDR_GAP_US);
+			progress(P->sends[s] ? "R" : ".");	/* R for a resend */
+			if (P->sends[s]++ == 0)
+				++P->sent;
+			++frames;
+			if (!blind) {
+				P->seqSeg[P->blkSeq] = s;
+				++P->framesInFlight;
+			}
+			++P->blkSeq;
+			continue;
+		}
+		if (P->framesInFlight == 0)
+			break;						/* All held, or given up */
+		if (!collectAck(SILENCE_US)) {
+			/* Nothing came back for a long time; assume every frame in flight was lost */
+			if (P->maxCount == 0) {
+				msg("\nNo acknowledgements from the chain; sending every segment once\n");
+				blind = 1;
+			}
+			for (q=0; q < 256; ++q)
+				P->seqSeg[q] = -1;
+			P->framesInFlight = 0;
+		}
+	}
+
+	for (s=0; s < nSeg; ++s)
+		if (!blind && !P->unchanged[s] && !held(s)) {
+			msg("\nSegment at %04X was only acknowledged by %d of %d devices after %d tries\n",
+				start + s * SEG_SIZE, P->counts[s], P->maxCount, P->sends[s]);
+			return 1;
+		}
+	msg("\nSent %d frames for %d segments\n", frames, nSeg);
+
+	/* Back to 9600 b/s, so any device that fails the end frame is left where the next try can reach it */
+	if (rate != 9600)
+		changeRate(rate, 9600, P->maxCount);
+
+	/* The end frame, with the CRC12 of the whole image */
+	flushInput();
+	P->rx.state = 0;
+	sendFrame(P->blkSeq, BLK_END, NULL, 0, NULL, FRAME_CRC(img, len), END_GAP_US);
+	verified = blind ? 0 : waitFrame(P->blkSeq++, SILENCE_US + END_GAP_US);
+	/* Devices that verified the image start it when we next send anything, so that a BMU passes the
+	   acknowledgement back first. A CR is harmless to the new program. */
+	writeBytes((const unsigned char*)"\r", 1);
+	if (blind) {
+		msg("Sent the end frame without acknowledgements; asking the devices instead\n");
+		return 0;
+	}
+	if (verified < 0)
+		verified = 0;
+	if (verified < P->maxCount) {
+		msg("Only %d of %d devices verified the whole image; run sendprog again%s\n", verified, P->maxCount,
+			oldName ? " without -d. They may not have held the old image" : "");
+		return 1;
+	}
+	msg("Image verified by %d devices\n", verified);
+	return 0;
+}
+
+/*
+ * Checking the devices
+ * After a download, every device is asked for the CRC12 of its program image with the 'Pc' command (see
+ * common/comDefinitions.s43), first all at once, then one at a time for any missing IDs below the highest
+ * that answered, and for a BMU that answered before the download. A BSL2 download is expected to reach as many devices as answered the same query before
+ * it, and a block download as many as acknowledged its frames. Any device whose CRC12 differs from that of the image we sent, or that doesn't answer,
+ * is listed as needing re-flashing. Like echo pacing, this needs the host's receive line connected to the
+ * end of the chain; with no answers at all, the download counts as failed, since nothing shows that any
+ * device has the image.
+ */
+#define START_US		3000000		/* Time for the devices to start the new program */
+#define QUIET_US		1500000		/* Answers are over when nothing arrives for this long; each device
+									   takes 300 ms to work out its CRC12 */
+#define QUERY_TRIES		3			/* Times to ask a device that didn't answer */
 
+/* Send the command text as a packet, with its CRC12 and a carriage return */
+void sendPacket(const char* text) {
+	unsigned int n = strlen(text);
+	unsigned char end[3];
+	printableCrc(crc12((const unsigned char*)text, n), end);
+	end[2] = '\r';
+	writeBytes((const unsigned char*)text, n);
+	writeBytes(end, 3);
+}
+
+/* Collect answers to 'Pc' until nothing arrives for QUIET_US. Records each good one in crcs[ID], and
+   returns the number of them. Anything else, such as the echo of the command, is ignored. */
+int collectCrcs(int* crcs) {
+	char line[40];
+	unsigned char c, ck[2];
+	unsigned int n = 0;
+	int id, found = 0;
+	char* p;
+	long v;
+	while (readByte(&c, QUIET_US)) {
+		if (c != '\r') {
+			if (c != '\n' && n < sizeof(line) - 1)
+				line[n++] = c;
+			continue;
+		}
+		line[n] = 0;
+		/* A good answer looks like \005:Pc 1234 or \005:Pc $4D2, then the CRC12 of all that */
+		if (n > 2 && line[0] == '\\') {
+			printableCrc(crc12((unsigned char*)line, n - 2), ck);
+			if (ck[0] == (unsigned char)line[n-2] && ck[1] == (unsigned char)line[n-1]) {
+				line[n-2] = 0;
+				id = strtol(line + 1, &p, 10);
+				if (strncmp(p, ":Pc ", 4) == 0) {
+					p += 4;
+					v = *p == '$' ? strtol(p + 1, &p, 16) : strtol(p, &p, 10);
+					if (*p == 0 && id >= 0 && id < 256) {
+						crcs[id] = v;
+						++found;
+					}
+				}
+			}
+		}
+		n = 0;
+	}
+	return found;
+}
+
+/* Count the devices that answer 'Pc' before a download, so the check afterwards knows how many to expect,
+   and note whether one is a BMU */
+int countDevices(void) {
+	int crcs[256];
+	int id, n = 0, tries;
+
+	for (id=0; id < 256; ++id)
+		crcs[id] = -1;
+	flushInput();
+	for (tries=0; tries < QUERY_TRIES; ++tries) {
+		sendPacket("Pc");					/* Again if it was corrupted on its way to the first device */
+		if (collectCrcs(crcs))
+			break;
+	}
+	for (id=1; id < 256; ++id)
+		n += crcs[id] >= 0;
+	P->bmu = crcs[255] >= 0;
+	return n;
+}
+
+/* Ask every device for the CRC12 of its program image, and compare it with the image of len bytes at img.
+   expected is the number of devices known to have taken part in the download, or 0 if that's not known.
+   Returns the number of devices that need re-flashing, or that should have answered but didn't. */
+int checkDevices(const unsigned char* img, unsigned int len, int expected) {
+	int crcs[256];
+	unsigned int crc = crc12(img, len);
+	int id, top = 0, bad = 0, good = 0, quiet = 0, tries;
+	char cmd[8];
+
+	for (id=0; id < 256; ++id)
+		crcs[id] = -1;
+	pauseUs(START_US);
+	/* A BMU restarts as soon as it has the last byte, so the echoes of the last few reach its ACCEPT.
+	   A CR ends that line, before the query can be appended to it. */
+	writeBytes((const unsigned char*)"\r", 1);
+	pauseUs(START_US / 10);
+	flushInput();
+	if (selected) {
+		/* Only the selected device has the new image */
+		sprintf(cmd, "%dsPc", selected);
+		for (tries=0; crcs[selected] < 0 && tries < QUERY_TRIES; ++tries) {
+			sendPacket(cmd);
+			collectCrcs(crcs);
+		}
+		if (crcs[selected] < 0) {
+			msg("Device %d didn't answer the program CRC query; it may need re-flashing\n", selected);
+			return 1;
+		}
+		if (crcs[selected] != (int)crc) {
+			msg("Device %d has program CRC12 %03X, not %03X; it needs re-flashing\n", selected,
+				crcs[selected], crc);
+			return 1;
+		}
+		msg("Device %d has the image (program CRC12 %03X)\n", selected, crc);
+		return 0;
+	}
+	sendPacket("Pc");
+	if (collectCrcs(crcs) == 0) {
+		msg("No answers to the program CRC query; the download is unverified, and the devices may need "
+			"re-flashing\n");
+		return expected ? expected : 1;
+	}
+	for (id=1; id < 255; ++id)
+		if (crcs[id] >= 0)
+			top = id;
+	for (id=1; id < 256; ++id)
+		for (tries=0; crcs[id] < 0 && (id < top || (id == 255 && P->bmu)) && tries < QUERY_TRIES; ++tries) {
+			sprintf(cmd, "%dsPc", id);
+			sendPacket(cmd);
+			collectCrcs(crcs);
+		}
+
+	for (id=1; id < 256; ++id) {
+		if (crcs[id] == (int)crc)
+			++good;
+		else if (crcs[id] >= 0) {
+			msg("Device %d has program CRC12 %03X, not %03X; it needs re-flashing\n", id, crcs[id], crc);
+			++bad;
+		} else if (id < top || (id == 255 && P->bmu)) {
+			msg("Device %d didn't answer; it may need re-flashing\n", id);
+			++quiet;
+		}
+	}
+	if (good + bad < expected && quiet < expected - good - bad) {
+		msg("Only %d of the %d devices in the download answered\n", good + bad, expected);
+		quiet = expected - good - bad;
+	}
+	bad += quiet;
+	if (bad)
+		msg("%d of %d devices need re-flashing\n", bad, good + bad);
+	else
+		msg("All %d devices have the image (program CRC12 %03X)\n", good, crc);
+	return bad;
+}
+
+/* Open and set up the port for P */
+void openPort(void) {
 #if LINUX
-	fd = open(argv[2], O_RDWR | O_NOCTTY | O_NDELAY );
-	if(!isatty(fd)) { printf("Error - not a tty!\n"); exit(1); }
-	if(tcgetattr(fd, &config) < 0) {
+	P->fd = open(P->name, O_RDWR | O_NOCTTY | O_NDELAY );
+	if(!isatty(P->fd)) { printf("Error - %s is not a tty!\n", P->name); exit(1); }
+	if(tcgetattr(P->fd, &P->config) < 0) {
 		printf("Error - getattr failed\n"); exit(1);
 	}
 	//
@@ -122,7 +1095,7 @@ int main(int argc, char* argv[]) {
 	// no input parity check, don't strip high bit off,
 	// no XON/XOFF software flow control
 	//
-	config.c_iflag &= ~(IGNBRK | BRKINT | ICRNL |
+	P->config.c_iflag &= ~(IGNBRK | BRKINT | ICRNL |
 						INLCR | PARMRK | INPCK | ISTRIP | IXON);
 	//
 	// Output flags - Turn off output processing
@@ -133,151 +1106,439 @@ int main(int argc, char* argv[]) {
 	//
 	// config.c_oflag &= ~(OCRNL | ONLCR | ONLRET |
 	//                     ONOCR | ONOEOT| OFILL | OLCUC | OPOST);
-	config.c_oflag = 0;
+	P->config.c_oflag = 0;
 	//
 	// No line processing:
 	// echo off, echo newline off, canonical mode off,
 	// extended input processing off, signal chars off
 	//
-	config.c_lflag &= ~(ECHO | ECHONL | ICANON | IEXTEN | ISIG);
+	P->config.c_lflag &= ~(ECHO | ECHONL | ICANON | IEXTEN | ISIG);
 	//
 	// Turn off character processing
 	// clear current char size mask, no parity checking,
 	// no output processing, force 8 bit input
 	//
-	config.c_cflag &= ~(CSIZE | PARENB);
-	config.c_cflag |= CS8;
+	P->config.c_cflag &= ~(CSIZE | PARENB | CSTOPB);
+	P->config.c_cflag |= CS8;
+	if (blockMode)
+		P->config.c_cflag |= CSTOPB;	/* Two stop bits: each CMU echoes with one, so it can't fall behind */
 	//
 	// One input byte is enough to return from read()
 	// Inter-character timer off
 	//
-	config.c_cc[VMIN]  = 1;
-	config.c_cc[VTIME] = 0;
+	P->config.c_cc[VMIN]  = 1;
+	P->config.c_cc[VTIME] = 0;
 	//
 	// Communication speed (simple version, using the predefined
 	// constants)
 	//
-	if(cfsetispeed(&config, B9600) < 0 || cfsetospeed(&config, B9600) < 0) {
+	if(cfsetispeed(&P->config, B9600) < 0 || cfsetospeed(&P->config, B9600) < 0) {
 		printf("Error - can't set baud rate to 9600\n");
 		exit(1);
 	}
 	//
 	// Finally, apply the configuration
 	//
-	if(tcsetattr(fd, TCSAFLUSH, &config) < 0) {
+	if(tcsetattr(P->fd, TCSAFLUSH, &P->config) < 0) {
 		printf("Error - could not set configuration\n");
 		exit(1);
 	}
+	/* Reads and writes never block; the ports take turns when they would */
+	fcntl(P->fd, F_SETFL, fcntl(P->fd, F_GETFL) | O_NONBLOCK);
 #else
 	{
 		char sName[32];
 		COMMCONFIG  lpCC;
-		sprintf(sName, "\\\\.\\%s", argv[2]);
-		hComm = CreateFile(sName,
+		sprintf(sName, "\\\\.\\%s", P->name);
+		P->hComm = CreateFile(sName,
                     GENERIC_READ | GENERIC_WRITE,
                     0,
                     0,
                     OPEN_EXISTING,
                     FILE_ATTRIBUTE_NORMAL,
                     0);
-		if (hComm == INVALID_HANDLE_VALUE) {
-  			fprintf(stderr, "Error opening port %s\n", argv[2]);
+		if (P->hComm == INVALID_HANDLE_VALUE) {
+  			fprintf(stderr, "Error opening port %s\n", P->name);
 			exit(1);
 		}
-		GetCommState( hComm, &lpCC.dcb);
+		GetCommState( P->hComm, &lpCC.dcb);
 
 		 /* Initialisation of parameters */
 		  lpCC.dcb.BaudRate = CBR_9600;
 		//lpCC.dcb.BaudRate = CBR_19200;
 		lpCC.dcb.ByteSize = 8;
-		lpCC.dcb.StopBits = ONESTOPBIT;
+		lpCC.dcb.StopBits = blockMode ? TWOSTOPBITS : ONESTOPBIT;
 		lpCC.dcb.Parity = NOPARITY;
 		lpCC.dcb.fDtrControl = DTR_CONTROL_DISABLE;
 		lpCC.dcb.fRtsControl = RTS_CONTROL_DISABLE;
-		SetCommState(hComm, &lpCC.dcb );
+		SetCommState(P->hComm, &lpCC.dcb );
 
 	}
 
 #endif
+	P->byteUs = 11000000 / 9600;
+}
+
+void closePort(void) {
+#if LINUX
+	close(P->fd);
+#else
+	CloseHandle(P->hComm);
+#endif
+}
 
+/* Read P's image, and work out what to send */
+void readImage(void) {
+	unsigned int u, len;
+	int rev61;
+	unsigned char* mem = loadImage(P->binName, &P->start, &P->lenToSend, &rev61);
 
-	f = fopen(argv[1], "r");
-	if (f == NULL) {
-		fprintf(stderr, "Could not open %s for reading\n", argv[1]);
+	P->rev61 = rev61;
+	P->pBuf = mem + P->start;
+	msg("Read %s; sending %04X-%04X\n", P->binName, P->start, P->start + P->lenToSend - 1);
+	if (rev61 && selected) {
+		fprintf(stderr, "A rev61 image can't be sent to a single device\n");
 		exit(1);
 	}
 
-	struct stat st;
-	stat(argv[1], &st);
-	total_len = st.st_size;
-	if ((pBuf = malloc(total_len)) == NULL) {
-		fprintf(stderr, "Could not allocate %d bytes for program buffer\n", total_len);
-		exit(2);
+	if (blockMode) {
+		if (rev61) {
+			fprintf(stderr, "Block downloads can't be used with a rev61 image\n");
+			exit(1);
+		}
+		if (oldName) {
+			/* Compare with the old image. The last segment, with ProgPresence, is always sent. */
+			unsigned int start, nSeg = P->lenToSend / SEG_SIZE, nSame = 0;
+			unsigned char* pOld = loadImage(oldName, &start, &len, &rev61);
+			if (start != P->start || len != P->lenToSend) {
+				fprintf(stderr, "%s is not the same kind of image as %s\n", oldName, P->binName);
+				exit(1);
+			}
+			for (u=0; u+1 < nSeg; ++u)
+				if (memcmp(P->pBuf + u * SEG_SIZE, pOld + start + u * SEG_SIZE, SEG_SIZE) == 0) {
+					P->unchanged[u] = 1;
+					++nSame;
+				}
+			free(pOld);
+			msg("%u of %u segments differ from %s\n", nSeg - nSame, nSeg, oldName);
+		}
 	}
-	fread(pBuf, 1, total_len, f);
-	printf("Read %d bytes\n", total_len);
-	fclose(f);
-
-	unsigned short uReset;
-	unsigned int lenToSend, BSLlen;
-	uReset = pBuf[total_len-1]; 
-	uReset = (uReset << 8) + pBuf[total_len-2];
-	if (uReset == 0xFC00)
-		BSLlen = 1024;
-	else
-		BSLlen = 512;
-	lenToSend = total_len - BSLlen;
+}
 
-
-	/* Now send this image */
-	{
-	int i, j, k;
+/* Send P's image down its chain. Sets P->result. */
+void sendImage(void) {
+	unsigned char* pBuf = P->pBuf;
+	unsigned int lenToSend = P->lenToSend;
+	unsigned int u, sum;
+	int result = 0;
+	int i, echo, tries = 0;
+	char cmd[8];
 
 	/* Write the prefix */
 #define PASSLEN (1+4)
+#define PASS_TRIES	3						/* Times to send a password that is echoed wrongly */
 	char pfx[6] = "\x1B\x05\x04\x03\x01";	/* ESC 05 04 03 01 */
-	if (total_len == 8192)
-		// Only Rev61 images have 8 KiB images, and use a password ending in 02
+	if (P->rev61)
+		// Rev61 images use a password ending in 02
 		pfx[4] = '\x02';
-	for (i=0; i < PASSLEN; ++i) {
-		writeByte(pfx+i);					/* Write prefix */
-//		usleep(2000+100);					/* Time to transmit byte to CMU, and for it to echo
+	if (blockMode)
+		pfx[4] = '\x03';
+	unsigned int roundTrip = 0, waited;
+	/* A BSL2 download has no acknowledgements to count the devices by. A block download needs to know
+	   whether there's a BMU, since it sends one frame at a time through one (see sendBlocks). */
+	if (!selected && !P->rev61 && (blockMode || P->echoMode)) {
+		P->devices = countDevices();
+		msg("%d devices answered before the download\n", P->devices);
+	}
+	while (1) {
+		flushInput();						/* Don't mistake old responses for echoes */
+		i = 0;
+		if (selected) {
+			/* Select the device with 'x', so the others forward its download without taking part. Then
+			   send the password without its escape, which would end the selection. */
+			sprintf(cmd, "%dx", selected);
+			sendPacket(cmd);
+			drainOutput();
+			pauseUs(MAX_ECHO_US);			/* Every device has seen it */
+			i = 1;
+		}
+		for ( ; i < PASSLEN; ++i) {
+			writeByte(pfx+i);				/* Write prefix */
+//			usleep(2000+100);				/* Time to transmit byte to CMU, and for it to echo
 //											 to next CMU */
 //											/* Plus 100 us for safety */
-		usleep(270*1000);					/* Time to transmit byte to CMU, and for it to echo 
+			if (P->echoMode) {
+				/* Wait for this byte to come back. The longest round trip tells us how many bytes the
+				   chain can hold in flight. */
+				echo = waitPasswordEcho(pfx[i], &waited);
+				if (echo < 0)
+					break;
+				if (echo == 0)
+					echoFallback();
+				else if (waited > roundTrip)
+					roundTrip = waited;
+			} else
+				pauseUs(270*1000);			/* Time to transmit byte to CMU, and for it to echo
 											  to up to 255 CMUs */
+		}
+		if (i == PASSLEN)
+			break;
+		/* A device past the corruption didn't get the password. Until its last byte no device has
+		   started erasing, so the whole password can be sent again; after it, some have. */
+		if (i == PASSLEN-1 || ++tries >= PASS_TRIES) {
+			msg("The password was echoed wrongly%s; run sendprog again\n",
+				i == PASSLEN-1 ? ", after some devices had started erasing" : "");
+			if (selected)
+				writeByte("\x1B");
+			P->result = 1;
+			return;
+		}
+		msg("The password was echoed wrongly; sending it again\n");
+		pauseUs(MAX_ECHO_US);				/* Let the rest of it pass */
 	}
 
-	// Extra 2 second delay in case it's monolith, and it is busy sending data to the PIP inverter
-	usleep(2000000);
-
-    /* Allow time for segment erases (approximately 15 ms per segment) */
-	/* Note that m_len_to_send is sometimes 2 short of the real length, because of the reset vector */
-	/* Be conservative and use 21 ms per segment erase */
-	usleep(1000 * ((((lenToSend + 2) / 512) * 21) +1));
-	
-	/* Send the lenToSend-1 bytes of the binary image */
-	sum = 0;
-	for (u=0; u < lenToSend-1; ++u) {
-		if ((u & 0x7F) == 0x7F)
-		{
-			printf(".");
+	if (P->echoMode) {
+		/* Every CMU has the last password byte, and has started erasing. Keep the chain full. */
+		P->echoWindow = roundTrip / MIN_BYTE_US + 2;
+		if (P->echoWindow > MAX_WINDOW)
+			P->echoWindow = MAX_WINDOW;
+		msg("Echo round trip %u ms; up to %u bytes in flight\n", (roundTrip + 999) / 1000, P->echoWindow);
+	} else
+		// Extra 2 second delay in case it's monolith, and it is busy sending data to the PIP inverter
+		pauseUs(2000000);
+
+	if (blockMode) {
+		/* Give the devices time to copy the loader to RAM and erase one segment */
+		pauseUs(100000);
+		flushInput();
+		/* The checksum goes in place of the very last byte, so the flash ends up as after a BSL2 download */
+		sum = 0;
+		for (u=0; u < lenToSend-1; ++u)
+			sum ^= pBuf[u];
+		pBuf[lenToSend-1] = sum;
+		result = sendBlocks(pBuf, lenToSend, P->start);
+	} else {
+	    /* Allow time for segment erases (approximately 15 ms per segment) */
+		/* Be conservative and use 21 ms per segment erase */
+		pauseUs(1000 * (((lenToSend / 512) * 21) +1));
+		flushInput();							/* Nothing but echoes from here on */
+
+		/* Send the lenToSend-1 bytes of the binary image */
+		P->toSend = lenToSend;
+		sum = 0;
+		for (u=0; u < lenToSend-1; ++u) {
+			if ((u & 0x7F) == 0x7F)
+				progress(".");
+			P->sent = u;
+			sendPaced(pBuf+u, FIXED_BYTE_US);	/* Write byte */
+			sum ^= pBuf[u];
+		}
+
+		// Finally send the checksum byte in place of the very last byte (just before the BSL)
+		pBuf[lenToSend-1] = sum;
+		sendPaced(pBuf+lenToSend-1, 0);
+		P->sent = lenToSend;
+
+		// Wait for the rest of the echoes, so we know the last device has the whole image
+		while (P->echoMode && P->inCount)
+			waitEcho(1);
+		progress("\n");
+		if (P->echoMode && P->echoErrors)
+			msg("\nWarning: %u bytes were echoed wrongly; some CMUs may have a bad image\n", P->echoErrors);
+	}
+
+	if (selected)
+		writeByte("\x1B");					/* The other devices can interpret again */
+
+	/* Rev61 programs can't be asked. Ask even when the echoes or acknowledgements stopped, as the devices
+	   restart either way; without a return line nothing is heard, and the download is unverified. */
+	if (result == 0 && !P->rev61)
+		result = checkDevices(pBuf, lenToSend, blockMode ? P->maxCount : P->devices) != 0;
+	P->result = result;
+}
+
+#if LINUX
+#define STACK_SIZE		(256*1024)	/* Stack for each port's download */
+#define REPORT_US		5000000		/* How often to show progress, with several ports */
+
+/* The download for P, which runs until it has to wait, then lets the other ports run */
+void portMain(void) {
+	sendImage();
+	P->finished = 1;
+}
+
+/* Make the context that P's download starts in. It's apart from runPorts, as the compiler takes
+   getcontext to return twice like setjmp, and would have runPorts' locals in registers clobbered. */
+void makePortContext(void) {
+	getcontext(&P->ctx);
+	P->ctx.uc_stack.ss_sp = malloc(STACK_SIZE);
+	P->ctx.uc_stack.ss_size = STACK_SIZE;
+	P->ctx.uc_link = &schedCtx;
+	if (P->ctx.uc_stack.ss_sp == NULL) {
+		fprintf(stderr, "Could not allocate a stack for %s\n", P->name);
+		exit(2);
+	}
+	makecontext(&P->ctx, portMain, 0);
+	P->events = 0;
+	P->until = 0;						/* Start straight away */
+}
+
+/* Run the downloads for all the ports at once. Each one runs until it has to wait for its port or for
+   time to pass, then the others get a turn. */
+void runPorts(void) {
+	struct pollfd pfd[MAX_PORTS];
+	int idx[MAX_PORTS];
+	struct timespec ts;
+	long long now, next, report = nowUs() + REPORT_US;
+	int i, n, running;
+
+	for (i=0; i < nPorts; ++i) {
+		P = ports[i];
+		makePortContext();
+	}
+
+	do {
+		/* Wait until some port is ready, or its time is up */
+		now = nowUs();
+		next = now + 1000000;
+		for (i=n=0; i < nPorts; ++i) {
+			idx[i] = -1;
+			if (ports[i]->finished)
+				continue;
+			if (ports[i]->until < next)
+				next = ports[i]->until;
+			if (ports[i]->events) {
+				pfd[n].fd = ports[i]->fd;
+				pfd[n].events = ports[i]->events;
+				pfd[n].revents = 0;
+				idx[i] = n++;
+			}
+		}
+		if (next < now)
+			next = now;
+		ts.tv_sec = (next - now) / 1000000;
+		ts.tv_nsec = (next - now) % 1000000 * 1000;
+		ppoll(pfd, n, &ts, NULL);
+
+		/* Give each ready port a turn */
+		now = nowUs();
+		running = 0;
+		for (i=0; i < nPorts; ++i) {
+			P = ports[i];
+			if (P->finished)
+				continue;
+			if (now >= P->until || (idx[i] >= 0 && pfd[idx[i]].revents))
+				swapcontext(&schedCtx, &P->ctx);
+			if (!P->finished)
+				running = 1;
+		}
+
+		if (nPorts > 1 && now >= report) {
+			printf("Progress:");
+			for (i=0; i < nPorts; ++i)
+				if (ports[i]->finished)
+					printf("  %s %s", ports[i]->name, ports[i]->result ? "failed" : "done");
+				else
+					printf("  %s %u%%", ports[i]->name,
+						ports[i]->toSend ? 100 * ports[i]->sent / ports[i]->toSend : 0);
+			printf("\n");
 			fflush(stdout);
+			report = now + REPORT_US;
 		}
-		writeByte(pBuf+u);					/* Write byte */
-		sum ^= pBuf[u];
-    	usleep(3000);						/* Time to transmit, echo, and flash write */
+	} while (running);
+}
+#endif
+
+int main(int argc, char* argv[]) {
+	int i, result = 0;
+
+	while (argc > 1 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-t") == 0)
+			echoMode = 0;					/* -t: fixed (timed) delays only, as before echo pacing */
+		else if (strcmp(argv[1], "-b") == 0)
+			blockMode = 1;
+		else if (strcmp(argv[1], "-B") == 0 && argc > 2) {
+			baudRate = atoi(argv[2]);
+			++argv; --argc;
+		} else if (strcmp(argv[1], "-z") == 0)
+			compress = 1;
+		else if (strcmp(argv[1], "-d") == 0 && argc > 2) {
+			oldName = argv[2];
+			++argv; --argc;
+		} else if (strcmp(argv[1], "-s") == 0 && argc > 2) {
+			selected = atoi(argv[2]);
+			++argv; --argc;
+		} else
+			break;
+		++argv; --argc;
+	}
+#if LINUX
+	if (argc < 3 || argc % 2 == 0 || argc > 1 + 2 * MAX_PORTS) {
+#else
+	if (argc != 3) {
+#endif
+		fprintf(stderr, "Usage: sendprog [-t] [-s <ID> | -b [-B <rate>] [-d <old image>] [-z]] <image> <comm port name/path>"
+#if LINUX
+			" [<image> <comm port> ...]"
+#endif
+			"\n");
+		fprintf(stderr, "  -t  Use fixed delays instead of pacing by the bytes echoed by the chain\n");
+		fprintf(stderr, "  -s  Download only to the device with this ID; the others just pass it on\n");
+		fprintf(stderr, "  -b  Block download: resend only damaged segments. Needs a main program\n");
+		fprintf(stderr, "  -B  With -b, send the image at 19200, 38400 or 57600 b/s\n");
+		fprintf(stderr, "  -d  With -b, send only the segments that differ from the old image the devices hold\n");
+		fprintf(stderr, "  -z  With -b, compress the segments that are quicker to send that way\n");
+#if LINUX
+		fprintf(stderr, "With more than one image and port, all the ports are downloaded to at once\n");
+#endif
+		fprintf(stderr, "Images are Intel HEX, TI-TXT (.txt) or binary (.bin, ending at FFFF)\n");
+		exit(1);
+	}
+	if (selected && (blockMode || selected < 1 || selected > 255)) {
+		fprintf(stderr, "-s needs an ID from 1 to 255, and can't be used with -b\n");
+		exit(1);
 	}
+	if ((oldName || compress) && !blockMode) {
+		fprintf(stderr, "-d and -z need -b\n");
+		exit(1);
+	}
+	/* Not 115200: the devices take about 140 us to program each byte (see common/BlockLoader.s43) */
+	if ((baudRate != 9600 && baudRate != 19200 && baudRate != 38400 && baudRate != 57600) ||
+			(baudRate != 9600 && !blockMode)) {
+		fprintf(stderr, "Can't use %u b/s; -B needs -b and one of 19200, 38400 or 57600\n", baudRate);
+		exit(1);
 	}
 
-	// Finally send the checksum byte in place of the very last byte (just before the BSL)
-	writeByte((char*)&sum);
+	nPorts = (argc - 1) / 2;
+	for (i=0; i < nPorts; ++i) {
+		P = ports[i] = calloc(1, sizeof(struct port));
+		if (P == NULL) {
+			fprintf(stderr, "Could not allocate memory for %s\n", argv[2 + 2*i]);
+			exit(2);
+		}
+		P->binName = argv[1 + 2*i];
+		P->name = argv[2 + 2*i];
+		P->echoMode = echoMode;
+		P->echoWindow = 1;
+		readImage();
+		openPort();
+	}
 
+	/* Now send the images */
 #if LINUX
-	close(fd);
+	runPorts();
 #else
-	CloseHandle(hComm);
+	sendImage();
 #endif
-	printf("Done\n");
-	return 0;
+
+	for (i=0; i < nPorts; ++i) {
+		P = ports[i];
+		closePort();
+		if (nPorts > 1)
+			printf("%s: %s %s\n", P->name, P->result ? "FAILED" : "done", P->binName);
+		if (P->result)
+			result = P->result;
+	}
+	printf(result ? "FAILED\n" : "Done\n");
+	return result;
 }